@@ -0,0 +1,1471 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "coffee_fs/cfs.h"
+#include "coffee_fs/cfs-coffee.h"
+#include "coffee_fs/cfs-coffee-arch.h"
+#include "coffee_fs/cfs-coffee-format.h"
+#include "coffee_fs/coffee_flash.h"
+
+#define MIB (1024L * 1024L)
+
+
+/* Monotonic time in nanoseconds */
+static uint64_t now_ns(void){
+
+    struct timespec spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+
+    return (uint64_t)spec.tv_sec * 1000000000ULL + spec.tv_nsec;
+
+}
+
+
+/* Monotonic time in milliseconds */
+static double now_ms(void){
+
+    return now_ns() / 1.0e6;
+
+}
+
+
+/*
+ * Garbage collection latency against the amount of the volume in use.
+ *
+ * The used part is filled with small files and the first half of them
+ * is removed. The rest of the volume is then filled with larger files;
+ * the reservation that finds no free space runs the garbage collector,
+ * which has to evaluate every sector and erases the obsolete ones.
+ */
+static void bench_gc(void){
+
+    const long used_sizes[] = {4 * MIB, 8 * MIB, 16 * MIB, 24 * MIB};
+    char name[16];
+    double start, elapsed, worst;
+    int files, i, j;
+
+    printf("# gc: used_mib files gc_ms\n");
+
+    for(i = 0; i < sizeof(used_sizes) / sizeof(used_sizes[0]); i++){
+
+        cfs_coffee_format();
+
+        files = used_sizes[i] / 4000;
+        for(j = 0; j < files; j++){
+            sprintf(name, "g%d", j);
+            cfs_coffee_reserve(name, 4000);
+        }
+        for(j = 0; j < files / 2; j++){
+            sprintf(name, "g%d", j);
+            cfs_remove(name);
+        }
+
+        worst = 0;
+        for(j = 0; ; j++){
+            sprintf(name, "r%d", j);
+            start = now_ms();
+            if(cfs_coffee_reserve(name, 64 * 1024) < 0){
+                break;
+            }
+            elapsed = now_ms() - start;
+            if(elapsed > worst){
+                worst = elapsed;
+            }
+        }
+
+        printf("gc %ld %d %.3f\n", used_sizes[i] / MIB, files, worst);
+
+    }
+
+}
+
+
+/*
+ * Reservation latency after garbage collection.
+ *
+ * The used part is filled with files of one page less than 4 KiB,
+ * sixteen to a sector, and the files of every eighth sector are
+ * removed. A failing reservation makes the garbage collector erase
+ * those sectors, which moves the free page hint back to the start of
+ * the volume. None of the erased sectors is large enough for the
+ * following 128 KiB reservations; the header reads per reservation
+ * show how much of the volume had to be walked to place them.
+ */
+static void bench_reserve(void){
+
+    const long used_sizes[] = {4 * MIB, 8 * MIB, 16 * MIB};
+    const int reserves = 64;
+    struct cfs_coffee_cache_stats stats;
+    char name[16];
+    double start, elapsed, worst;
+    int files, i, j;
+
+    printf("# reserve: used_mib reserves mean_us worst_us header_reads\n");
+
+    for(i = 0; i < sizeof(used_sizes) / sizeof(used_sizes[0]); i++){
+
+        cfs_coffee_format();
+
+        files = used_sizes[i] / 4096;
+        for(j = 0; j < files; j++){
+            sprintf(name, "f%d", j);
+            cfs_coffee_reserve(name, 4000);
+        }
+        for(j = 0; j < files; j++){
+            if((j / 16) % 8 == 0){
+                sprintf(name, "f%d", j);
+                cfs_remove(name);
+            }
+        }
+        cfs_coffee_reserve("gc", COFFEE_SIZE - 64 * 1024);
+
+        elapsed = worst = 0;
+        cfs_coffee_reset_cache_stats();
+        for(j = 0; j < reserves; j++){
+            sprintf(name, "r%d", j);
+            start = now_ms();
+            cfs_coffee_reserve(name, 128 * 1024 - 1024);
+            start = now_ms() - start;
+            elapsed += start;
+            if(start > worst){
+                worst = start;
+            }
+        }
+        cfs_coffee_get_cache_stats(&stats);
+
+        printf("reserve %ld %d %.3f %.3f %.1f\n", used_sizes[i] / MIB,
+               reserves, elapsed * 1.0e3 / reserves, worst * 1.0e3,
+               (double)(stats.hits + stats.misses) / reserves);
+
+    }
+
+}
+
+
+/*
+ * Random reads of a file that has been modified through its micro log.
+ *
+ * The log is configured with small records, so that many regions of
+ * the file are read from the log. Each read has to find the newest
+ * log record of its region.
+ */
+static void bench_log_read(void){
+
+    const long file_size = 64 * 1024;
+    const int reads = 200000;
+    static char buf[64 * 1024];
+    unsigned long seed = 1;
+    double start, elapsed;
+    int fd, i;
+
+    printf("# log_read: records reads reads_per_s mib_per_s\n");
+
+    cfs_coffee_format();
+    cfs_coffee_reserve("log", file_size);
+    cfs_coffee_configure_log("log", 16 * 1024, 64);
+
+    fd = cfs_open("log", CFS_READ | CFS_WRITE);
+    cfs_write(fd, buf, file_size);
+
+    /* Fill most of the 256 log records with random 64 byte regions. */
+    for(i = 0; i < 250; i++){
+        seed = seed * 1103515245UL + 12345UL;
+        cfs_seek(fd, (seed >> 8) % (file_size / 64) * 64, CFS_SEEK_SET);
+        cfs_write(fd, buf, 64);
+    }
+
+    start = now_ms();
+    for(i = 0; i < reads; i++){
+        seed = seed * 1103515245UL + 12345UL;
+        cfs_seek(fd, (seed >> 8) % (file_size - 64), CFS_SEEK_SET);
+        cfs_read(fd, buf, 64);
+    }
+    elapsed = now_ms() - start;
+
+    printf("log_read 250 %d %.0f %.2f\n", reads, reads * 1.0e3 / elapsed,
+           reads * 64.0 / MIB * 1.0e3 / elapsed);
+
+    cfs_close(fd);
+
+}
+
+
+/*
+ * Unaligned 4 KiB overwrites of a file with a micro log. Each write
+ * modifies 17 regions of the file, which are stored as log records
+ * until the log is full and merged with the file.
+ */
+static void bench_log_write(void){
+
+    const long file_size = 64 * 1024;
+    const int writes = 2000;
+    static char buf[64 * 1024];
+    unsigned long seed = 1;
+    double start, elapsed;
+    int fd, i;
+
+    printf("# log_write: write_size writes writes_per_s mib_per_s\n");
+
+    cfs_coffee_format();
+    cfs_coffee_reserve("log", file_size);
+    cfs_coffee_configure_log("log", 16 * 1024, 256);
+
+    fd = cfs_open("log", CFS_READ | CFS_WRITE);
+    cfs_write(fd, buf, file_size);
+
+    start = now_ms();
+    for(i = 0; i < writes; i++){
+        seed = seed * 1103515245UL + 12345UL;
+        cfs_seek(fd, (seed >> 8) % (file_size - 4096), CFS_SEEK_SET);
+        cfs_write(fd, buf, 4096);
+    }
+    elapsed = now_ms() - start;
+
+    printf("log_write 4096 %d %.0f %.2f\n", writes, writes * 1.0e3 / elapsed,
+           writes * 4096.0 / MIB * 1.0e3 / elapsed);
+
+    cfs_close(fd);
+
+}
+
+
+/*
+ * Appending to a growing file, e.g. a telemetry log. The file starts
+ * small and has to be grown many times; the slowest append shows what
+ * growing the file costs.
+ */
+static void bench_append(void){
+
+    const long file_size = 8 * MIB;
+    static char buf[4096];
+    double start, elapsed, worst, total;
+    long written;
+    int fd;
+
+    printf("# append: file_mib chunk mib_per_s worst_ms\n");
+
+    cfs_coffee_format();
+    memset(buf, 0x55, sizeof(buf));
+
+    fd = cfs_open("append", CFS_WRITE | CFS_APPEND);
+    total = worst = 0;
+    for(written = 0; written < file_size; written += sizeof(buf)){
+        start = now_ms();
+        if(cfs_write(fd, buf, sizeof(buf)) != sizeof(buf)){
+            break;
+        }
+        elapsed = now_ms() - start;
+        total += elapsed;
+        if(elapsed > worst){
+            worst = elapsed;
+        }
+    }
+    cfs_close(fd);
+
+    printf("append %ld %d %.2f %.3f\n", written / MIB, (int)sizeof(buf),
+           written / (double)MIB * 1.0e3 / total, worst);
+
+}
+
+
+static int compare_double(const void *a, const void *b){
+
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+
+}
+
+
+/*
+ * Reservation latency while files of one sector are replaced on a
+ * nearly full volume. Without stepping, the reservation that runs out of free
+ * space runs the garbage collector, which erases every obsolete sector.
+ * With stepping, cfs_coffee_gc_step() runs between the operations like
+ * it would in an idle task.
+ */
+static void bench_gc_step(void){
+
+    const int files = 440, replacements = 4000;
+    static double latency[4000];
+    char name[16];
+    double start;
+    int step, i;
+
+    printf("# gc_step: budget reserves p50_us p99_us max_us\n");
+
+    for(step = 0; step <= 4; step += 4){
+
+        cfs_coffee_format();
+        for(i = 0; i < files; i++){
+            sprintf(name, "s%d", i);
+            cfs_coffee_reserve(name, 64 * 1024 - 128);
+        }
+
+        for(i = 0; i < replacements; i++){
+            sprintf(name, "s%d", (i * 7) % files);
+            cfs_remove(name);
+            if(step > 0){
+                cfs_coffee_gc_step(step);
+            }
+            start = now_ms();
+            cfs_coffee_reserve(name, 64 * 1024 - 128);
+            latency[i] = (now_ms() - start) * 1.0e3;
+        }
+
+        qsort(latency, replacements, sizeof(latency[0]), compare_double);
+        printf("gc_step %d %d %.2f %.2f %.2f\n", step, replacements,
+               latency[replacements / 2], latency[replacements * 99 / 100],
+               latency[replacements - 1]);
+
+    }
+
+}
+
+
+static void bench_pool(void){
+
+    const int files = 440, replacements = 4000;
+    static double latency[4000];
+    struct cfs_coffee_pool_stats stats;
+    char name[16];
+    double start;
+    int refill, i;
+
+    printf("# pool: refill reserves foreground_gcs foreground_erases "
+           "background_erases p99_us max_us\n");
+
+    for(refill = 0; refill <= 1; refill++){
+
+        cfs_coffee_format();
+        cfs_coffee_set_pool_marks(refill ? COFFEE_POOL_LOW_WATER : 0,
+                                  refill ? COFFEE_POOL_HIGH_WATER : 0);
+        for(i = 0; i < files; i++){
+            sprintf(name, "p%d", i);
+            cfs_coffee_reserve(name, 64 * 1024 - 128);
+        }
+        cfs_coffee_reset_pool_stats();
+
+        for(i = 0; i < replacements; i++){
+            sprintf(name, "p%d", (i * 7) % files);
+            cfs_remove(name);
+            cfs_coffee_refill_pool(4);
+            start = now_ms();
+            cfs_coffee_reserve(name, 64 * 1024 - 128);
+            latency[i] = (now_ms() - start) * 1.0e3;
+        }
+
+        cfs_coffee_get_pool_stats(&stats);
+        qsort(latency, replacements, sizeof(latency[0]), compare_double);
+        printf("pool %d %d %lu %lu %lu %.2f %.2f\n", refill, replacements,
+               stats.foreground_gcs, stats.foreground_erases,
+               stats.background_erases, latency[replacements * 99 / 100],
+               latency[replacements - 1]);
+
+    }
+
+    cfs_coffee_set_pool_marks(COFFEE_POOL_LOW_WATER, COFFEE_POOL_HIGH_WATER);
+
+}
+
+
+static void bench_wear(void){
+
+    const int files = 100, replacements = 4000;
+    const int sectors = COFFEE_SIZE / COFFEE_SECTOR_SIZE;
+    static uint32_t before[COFFEE_SIZE / COFFEE_SECTOR_SIZE];
+    struct cfs_coffee_wear_stats first, last;
+    uint32_t added, total = 0, max = 0;
+    char name[16];
+    int i;
+
+    printf("# wear: reserves erases max_added mean_added "
+           "spread_before spread_after\n");
+
+    cfs_coffee_format();
+    for(i = 0; i < files; i++){
+        sprintf(name, "w%d", i);
+        cfs_coffee_reserve(name, 64 * 1024 - 128);
+    }
+    for(i = 0; i < sectors; i++){
+        before[i] = cflash_erase_count(i);
+    }
+    cfs_coffee_get_wear_stats(&first);
+
+    for(i = 0; i < replacements; i++){
+        sprintf(name, "w%d", (i * 7) % files);
+        cfs_remove(name);
+        cfs_coffee_gc_step(16);
+        cfs_coffee_reserve(name, 64 * 1024 - 128);
+    }
+
+    /* The most erased sector bounds the lifetime of the device. */
+    cfs_coffee_get_wear_stats(&last);
+    for(i = 0; i < sectors; i++){
+        added = cflash_erase_count(i) - before[i];
+        total += added;
+        if(added > max){
+            max = added;
+        }
+    }
+    printf("wear %d %lu %lu %.2f %lu %lu\n", replacements,
+           (unsigned long)total, (unsigned long)max, (double)total / sectors,
+           first.max_erases - first.min_erases,
+           last.max_erases - last.min_erases);
+
+}
+
+
+/* Virtual time of the flash timing model in milliseconds */
+static double model_ms(void){
+
+    return cflash_clock_ns() / 1.0e6;
+
+}
+
+
+static void bench_model(void){
+
+    static const struct {
+        const char * name;
+        const struct cflash_timing * timing;
+    } models[] = {
+        { "nor", &cflash_timing_nor },
+        { "nand", &cflash_timing_nand }
+    };
+    const long file_size = 4 * MIB;
+    const int files = 400, replacements = 1000;
+    const struct cflash_timing * saved = cflash_get_timing();
+    static char buf[4096];
+    static double latency[1000];
+    char name[16];
+    double start, write_ms, read_ms;
+    long done;
+    int fd, m, i;
+
+    printf("# model: device write_mib_per_s read_mib_per_s "
+           "reserve_p50_ms reserve_p99_ms reserve_max_ms\n");
+
+    for(m = 0; m < (int)(sizeof(models) / sizeof(models[0])); m++){
+
+        /* Preparation is not timed */
+        cflash_set_timing(NULL);
+        cfs_coffee_format();
+        cflash_set_timing(models[m].timing);
+
+        fd = cfs_open("model", CFS_WRITE | CFS_APPEND);
+        start = model_ms();
+        for(done = 0; done < file_size; done += sizeof(buf)){
+            cfs_write(fd, buf, sizeof(buf));
+        }
+        cfs_close(fd);
+        write_ms = model_ms() - start;
+
+        fd = cfs_open("model", CFS_READ);
+        start = model_ms();
+        for(done = 0; done < file_size; done += sizeof(buf)){
+            cfs_read(fd, buf, sizeof(buf));
+        }
+        cfs_close(fd);
+        read_ms = model_ms() - start;
+
+        /* Replacements stall when a reservation runs the collector */
+        cflash_set_timing(NULL);
+        for(i = 0; i < files; i++){
+            sprintf(name, "m%d", i);
+            cfs_coffee_reserve(name, 64 * 1024 - 128);
+        }
+        cflash_set_timing(models[m].timing);
+        for(i = 0; i < replacements; i++){
+            sprintf(name, "m%d", (i * 7) % files);
+            cfs_remove(name);
+            start = model_ms();
+            cfs_coffee_reserve(name, 64 * 1024 - 128);
+            latency[i] = model_ms() - start;
+        }
+
+        qsort(latency, replacements, sizeof(latency[0]), compare_double);
+        printf("model %s %.3f %.3f %.3f %.3f %.1f\n", models[m].name,
+               file_size / (double)MIB * 1.0e3 / write_ms,
+               file_size / (double)MIB * 1.0e3 / read_ms,
+               latency[replacements / 2], latency[replacements * 99 / 100],
+               latency[replacements - 1]);
+
+    }
+
+    cflash_set_timing(saved);
+
+}
+
+
+/*
+ * Standard workloads for tracking regressions. Each workload prints one
+ * line with its throughput and the latency distribution of a single
+ * operation:
+ *   suite <workload> <ops> <ops_per_s> <mib_per_s> <p50_us> <p90_us>
+ *         <p99_us> <max_us>
+ */
+
+#define SUITE_MAX_OPS 20000
+
+static uint64_t suite_latency[SUITE_MAX_OPS];
+static uint64_t suite_start, suite_total;
+static int suite_ops;
+
+
+static int compare_u64(const void *a, const void *b){
+
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+
+}
+
+
+static void suite_begin(void){
+
+    suite_ops = 0;
+    suite_total = 0;
+
+}
+
+
+static void suite_op_start(void){
+
+    suite_start = now_ns();
+
+}
+
+
+static void suite_op_end(void){
+
+    uint64_t elapsed = now_ns() - suite_start;
+
+    suite_total += elapsed;
+    if(suite_ops < SUITE_MAX_OPS){
+        suite_latency[suite_ops++] = elapsed;
+    }
+
+}
+
+
+static void suite_report(const char * const workload, long bytes){
+
+    double seconds = suite_total / 1.0e9;
+
+    if(suite_ops == 0 || seconds <= 0){
+        return;
+    }
+
+    qsort(suite_latency, suite_ops, sizeof(suite_latency[0]), compare_u64);
+    printf("suite %s %d %.0f %.2f %.2f %.2f %.2f %.2f\n", workload,
+           suite_ops, suite_ops / seconds, bytes / (double)MIB / seconds,
+           suite_latency[suite_ops / 2] / 1.0e3,
+           suite_latency[suite_ops * 9 / 10] / 1.0e3,
+           suite_latency[suite_ops * 99 / 100] / 1.0e3,
+           suite_latency[suite_ops - 1] / 1.0e3);
+
+}
+
+
+/* Deterministic pseudo-random numbers, so every run does the same work */
+static uint32_t suite_random(void){
+
+    static uint32_t state = 1;
+
+    state = state * 1103515245UL + 12345UL;
+    return state >> 8;
+
+}
+
+
+static void suite_sequential_write(void){
+
+    const long file_size = 8 * MIB;
+    static char buf[4096];
+    long done;
+    int fd;
+
+    cfs_coffee_format();
+    cfs_coffee_reserve("seq", file_size);
+    memset(buf, 0x5a, sizeof(buf));
+
+    suite_begin();
+    fd = cfs_open("seq", CFS_WRITE);
+    for(done = 0; done < file_size; done += sizeof(buf)){
+        suite_op_start();
+        cfs_write(fd, buf, sizeof(buf));
+        suite_op_end();
+    }
+    cfs_close(fd);
+    suite_report("sequential_write", file_size);
+
+}
+
+
+static void suite_append(void){
+
+    const long file_size = 8 * MIB;
+    static char buf[1024];
+    long done;
+    int fd;
+
+    cfs_coffee_format();
+    memset(buf, 0xa5, sizeof(buf));
+
+    suite_begin();
+    fd = cfs_open("append", CFS_WRITE | CFS_APPEND);
+    for(done = 0; done < file_size; done += sizeof(buf)){
+        suite_op_start();
+        cfs_write(fd, buf, sizeof(buf));
+        suite_op_end();
+    }
+    cfs_close(fd);
+    suite_report("append", file_size);
+
+}
+
+
+static void suite_random_overwrite(void){
+
+    const long file_size = 1 * MIB;
+    const int writes = 4000;
+    static char buf[4096];
+    long done;
+    int fd, i;
+
+    cfs_coffee_format();
+    memset(buf, 0x11, sizeof(buf));
+    fd = cfs_open("random", CFS_WRITE);
+    for(done = 0; done < file_size; done += sizeof(buf)){
+        cfs_write(fd, buf, sizeof(buf));
+    }
+    cfs_close(fd);
+
+    /* Overwrites go to the micro-log of the file */
+    suite_begin();
+    fd = cfs_open("random", CFS_READ | CFS_WRITE);
+    for(i = 0; i < writes; i++){
+        suite_op_start();
+        cfs_seek(fd, suite_random() % (file_size - 256), CFS_SEEK_SET);
+        cfs_write(fd, buf, 256);
+        suite_op_end();
+    }
+    cfs_close(fd);
+    suite_report("random_overwrite", writes * 256L);
+
+}
+
+
+static void suite_open_close(void){
+
+    const int files = 100, opens = 20000;
+    char name[16];
+    int fd, i;
+
+    cfs_coffee_format();
+    for(i = 0; i < files; i++){
+        sprintf(name, "oc%d", i);
+        cfs_coffee_reserve(name, 1024);
+    }
+
+    suite_begin();
+    for(i = 0; i < opens; i++){
+        sprintf(name, "oc%d", (int)(suite_random() % files));
+        suite_op_start();
+        fd = cfs_open(name, CFS_READ);
+        cfs_close(fd);
+        suite_op_end();
+    }
+    suite_report("open_close", 0);
+
+}
+
+
+static void suite_readdir(void){
+
+    const int files = 300, listings = 200;
+    struct cfs_dir dir;
+    struct cfs_dirent dirent;
+    char name[16];
+    int i;
+
+    cfs_coffee_format();
+    for(i = 0; i < files; i++){
+        sprintf(name, "dir%d", i);
+        cfs_coffee_reserve(name, 1024);
+    }
+
+    /* One operation lists the whole directory */
+    suite_begin();
+    for(i = 0; i < listings; i++){
+        suite_op_start();
+        if(cfs_opendir(&dir, "/") == 0){
+            while(cfs_readdir(&dir, &dirent) == 0);
+            cfs_closedir(&dir);
+        }
+        suite_op_end();
+    }
+    suite_report("readdir", 0);
+
+}
+
+
+static void suite_gc_churn(void){
+
+    const int files = 440, replacements = 4000;
+    char name[16];
+    int i;
+
+    cfs_coffee_format();
+    for(i = 0; i < files; i++){
+        sprintf(name, "gc%d", i);
+        cfs_coffee_reserve(name, 64 * 1024 - 128);
+    }
+
+    /* Replacing files on a nearly full volume runs the collector */
+    suite_begin();
+    for(i = 0; i < replacements; i++){
+        sprintf(name, "gc%d", (int)(suite_random() % files));
+        suite_op_start();
+        cfs_remove(name);
+        cfs_coffee_reserve(name, 64 * 1024 - 128);
+        suite_op_end();
+    }
+    suite_report("gc_churn", 0);
+
+}
+
+
+static void bench_suite(void){
+
+    printf("# suite: workload ops ops_per_s mib_per_s "
+           "p50_us p90_us p99_us max_us\n");
+
+    suite_sequential_write();
+    suite_append();
+    suite_random_overwrite();
+    suite_open_close();
+    suite_readdir();
+    suite_gc_churn();
+
+}
+
+
+/* Print where the flash I/O of a workload went, per operation */
+static void io_report(const char * const workload){
+
+    static const char * const names[CFS_COFFEE_OPS] = {
+        "open", "read", "write", "remove", "gc", "merge", "other"
+    };
+    struct cfs_coffee_stats stats;
+    unsigned long programmed = 0;
+    int i;
+
+    cfs_coffee_get_stats(&stats);
+    for(i = 0; i < CFS_COFFEE_OPS; i++){
+        programmed += stats.ops[i].program_bytes;
+        printf("io %s %s %lu %lu %lu %lu %lu %lu\n", workload, names[i],
+               stats.ops[i].calls, stats.ops[i].reads,
+               stats.ops[i].read_bytes, stats.ops[i].programs,
+               stats.ops[i].program_bytes, stats.ops[i].erases);
+    }
+    printf("io %s amplification %.2f\n", workload,
+           stats.user_write_bytes == 0 ? 0.0 :
+           (double)programmed / stats.user_write_bytes);
+
+}
+
+
+static void bench_io(void){
+
+    const long file_size = 1 * MIB;
+    const int files = 200, writes = 4000, replacements = 1000;
+    static char buf[4096];
+    char name[16];
+    long done;
+    int fd, i;
+
+    printf("# io: workload op calls reads read_bytes programs "
+           "program_bytes erases\n");
+
+    /* Small overwrites go through the micro-log and its merges */
+    cfs_coffee_format();
+    memset(buf, 0x11, sizeof(buf));
+    fd = cfs_open("random", CFS_WRITE);
+    for(done = 0; done < file_size; done += sizeof(buf)){
+        cfs_write(fd, buf, sizeof(buf));
+    }
+    cfs_close(fd);
+    cfs_coffee_reset_stats();
+    fd = cfs_open("random", CFS_READ | CFS_WRITE);
+    for(i = 0; i < writes; i++){
+        cfs_seek(fd, suite_random() % (file_size - 256), CFS_SEEK_SET);
+        cfs_write(fd, buf, 256);
+    }
+    cfs_close(fd);
+    io_report("random_overwrite");
+
+    /* Replacing files on a full volume runs the collector */
+    cfs_coffee_format();
+    for(i = 0; i < files; i++){
+        sprintf(name, "r%d", i);
+        fd = cfs_open(name, CFS_WRITE);
+        cfs_write(fd, buf, sizeof(buf));
+        cfs_close(fd);
+    }
+    cfs_coffee_reset_stats();
+    for(i = 0; i < replacements; i++){
+        sprintf(name, "r%d", (i * 7) % files);
+        cfs_remove(name);
+        cfs_coffee_reserve(name, 128 * 1024);
+        fd = cfs_open(name, CFS_WRITE);
+        cfs_write(fd, buf, sizeof(buf));
+        cfs_close(fd);
+    }
+    io_report("replace");
+
+}
+
+
+
+/*
+ * Independent volumes in parallel threads. Each thread replaces files
+ * on its own volume in a RAM device, so the threads share no state and
+ * the throughput should scale with the number of cores.
+ */
+#define VOLUME_THREADS 4
+#define VOLUME_SIZE (4 * MIB)
+#define VOLUME_REPLACEMENTS 400
+#define VOLUME_FILE_SIZE (32 * 1024)
+
+static unsigned char volume_ram[VOLUME_THREADS][VOLUME_SIZE];
+
+
+static void ram_read(void *arg, void *buf, cfs_offset_t size,
+                     cfs_offset_t offset){
+
+    memcpy(buf, (unsigned char *)arg + offset, size);
+
+}
+
+
+static void ram_write(void *arg, const void *buf, cfs_offset_t size,
+                      cfs_offset_t offset){
+
+    memcpy((unsigned char *)arg + offset, buf, size);
+
+}
+
+
+// Sectors are numbered in the sector size of the volume
+static long ram_sector_size = COFFEE_SECTOR_SIZE;
+
+
+static void ram_erase(void *arg, unsigned sector){
+
+    memset((unsigned char *)arg + (long)sector * ram_sector_size, 0,
+           ram_sector_size);
+
+}
+
+
+static void *volume_worker(void *arg){
+
+    const int files = 16;
+    struct cfs_coffee_volume *vol = arg;
+    char buf[4096];
+    char name[16];
+    int fd, i, j;
+
+    memset(buf, 0x3c, sizeof(buf));
+    for(i = 0; i < VOLUME_REPLACEMENTS; i++){
+        sprintf(name, "v%d", i % files);
+        cfs_coffee_vol_remove(vol, name);
+        fd = cfs_coffee_vol_open(vol, name, CFS_WRITE);
+        for(j = 0; j < VOLUME_FILE_SIZE / (int)sizeof(buf); j++){
+            cfs_coffee_vol_write(vol, fd, buf, sizeof(buf));
+        }
+        cfs_coffee_vol_close(vol, fd);
+    }
+
+    return NULL;
+
+}
+
+
+static void bench_volumes(void){
+
+    const struct cfs_coffee_geometry geometry = { 0, VOLUME_SIZE, 0, 0 };
+    struct cfs_coffee_flash flash = { ram_read, ram_write, ram_erase, NULL };
+    struct cfs_coffee_volume *vols[VOLUME_THREADS];
+    pthread_t threads[VOLUME_THREADS];
+    double start, elapsed, single = 0;
+    int count, i;
+
+    printf("# volumes: threads mib_per_s speedup\n");
+
+    for(i = 0; i < VOLUME_THREADS; i++){
+        flash.arg = volume_ram[i];
+        vols[i] = cfs_coffee_attach(&flash, &geometry);
+        if(vols[i] == NULL){
+            printf("# volumes: COFFEE_VOLUMES is too small\n");
+            return;
+        }
+    }
+
+    for(count = 1; count <= VOLUME_THREADS; count *= 2){
+        for(i = 0; i < count; i++){
+            cfs_coffee_vol_format(vols[i]);
+        }
+
+        start = now_ms();
+        for(i = 0; i < count; i++){
+            pthread_create(&threads[i], NULL, volume_worker, vols[i]);
+        }
+        for(i = 0; i < count; i++){
+            pthread_join(threads[i], NULL);
+        }
+        elapsed = now_ms() - start;
+
+        if(count == 1){
+            single = elapsed;
+        }
+        printf("volumes %d %.2f %.2f\n", count,
+               (double)count * VOLUME_REPLACEMENTS * VOLUME_FILE_SIZE / MIB *
+               1.0e3 / elapsed,
+               count * single / elapsed);
+    }
+
+    for(i = 0; i < VOLUME_THREADS; i++){
+        cfs_coffee_detach(vols[i]);
+    }
+
+}
+
+
+/*
+ * The same workloads on volumes of different page and sector sizes,
+ * read back from the superblock as when an image is mounted. Layouts
+ * other than the default one need COFFEE_RUNTIME_GEOMETRY.
+ */
+#define GEOMETRY_FILES 16
+#define GEOMETRY_FILE_SIZE (128 * 1024)
+#define GEOMETRY_OVERWRITES 2000
+#define GEOMETRY_REPLACEMENTS 200
+
+static void bench_geometry(void){
+
+    static const long layouts[][2] = {
+        { 256, 4096 }, { 256, 65536 }, { 512, 4096 }, { 512, 65536 },
+        { 4096, 65536 }
+    };
+    struct cfs_coffee_flash flash = {
+        ram_read, ram_write, ram_erase, NULL, volume_ram[0]
+    };
+    struct cfs_coffee_geometry geometry = { 0, VOLUME_SIZE, 0, 0 };
+    struct cfs_coffee_volume *vol;
+    struct cfs_coffee_stats stats;
+    unsigned long programmed, erases;
+    double start, write_ms, overwrite_ms, replace_ms;
+    char buf[4096];
+    char name[16];
+    int fd, i, j, k;
+
+    printf("# geometry: page_size sector_size write_mib_per_s "
+           "overwrite_ops_per_s replace_mib_per_s amplification erases\n");
+
+    memset(buf, 0x5a, sizeof(buf));
+    for(i = 0; i < (int)(sizeof(layouts) / sizeof(layouts[0])); i++){
+        geometry.page_size = layouts[i][0];
+        geometry.sector_size = layouts[i][1];
+        ram_sector_size = layouts[i][1];
+        vol = cfs_coffee_attach(&flash, &geometry);
+        if(vol == NULL){
+            printf("# geometry: %ld %ld not supported\n",
+                   layouts[i][0], layouts[i][1]);
+            continue;
+        }
+        cfs_coffee_vol_format(vol);
+
+        // Mount the image as it would be found on the device
+        cfs_coffee_detach(vol);
+        geometry.page_size = geometry.sector_size = 0;
+        vol = cfs_coffee_attach(&flash, &geometry);
+        cfs_coffee_vol_reset_stats(vol);
+
+        start = now_ms();
+        for(j = 0; j < GEOMETRY_FILES; j++){
+            sprintf(name, "g%d", j);
+            fd = cfs_coffee_vol_open(vol, name, CFS_WRITE);
+            for(k = 0; k < GEOMETRY_FILE_SIZE / (int)sizeof(buf); k++){
+                cfs_coffee_vol_write(vol, fd, buf, sizeof(buf));
+            }
+            cfs_coffee_vol_close(vol, fd);
+        }
+        write_ms = now_ms() - start;
+
+        start = now_ms();
+        fd = cfs_coffee_vol_open(vol, "g0", CFS_READ | CFS_WRITE);
+        for(j = 0; j < GEOMETRY_OVERWRITES; j++){
+            cfs_coffee_vol_seek(vol, fd,
+                                suite_random() % (GEOMETRY_FILE_SIZE - 64),
+                                CFS_SEEK_SET);
+            cfs_coffee_vol_write(vol, fd, buf, 64);
+        }
+        cfs_coffee_vol_close(vol, fd);
+        overwrite_ms = now_ms() - start;
+
+        start = now_ms();
+        for(j = 0; j < GEOMETRY_REPLACEMENTS; j++){
+            sprintf(name, "g%d", 1 + j % (GEOMETRY_FILES - 1));
+            cfs_coffee_vol_remove(vol, name);
+            fd = cfs_coffee_vol_open(vol, name, CFS_WRITE);
+            for(k = 0; k < GEOMETRY_FILE_SIZE / (int)sizeof(buf); k++){
+                cfs_coffee_vol_write(vol, fd, buf, sizeof(buf));
+            }
+            cfs_coffee_vol_close(vol, fd);
+        }
+        replace_ms = now_ms() - start;
+
+        cfs_coffee_vol_get_stats(vol, &stats);
+        programmed = erases = 0;
+        for(j = 0; j < CFS_COFFEE_OPS; j++){
+            programmed += stats.ops[j].program_bytes;
+            erases += stats.ops[j].erases;
+        }
+        printf("geometry %ld %ld %.2f %.0f %.2f %.2f %lu\n",
+               layouts[i][0], layouts[i][1],
+               (double)GEOMETRY_FILES * GEOMETRY_FILE_SIZE / MIB *
+               1.0e3 / write_ms,
+               GEOMETRY_OVERWRITES * 1.0e3 / overwrite_ms,
+               (double)GEOMETRY_REPLACEMENTS * GEOMETRY_FILE_SIZE / MIB *
+               1.0e3 / replace_ms,
+               stats.user_write_bytes == 0 ? 0.0 :
+               (double)programmed / stats.user_write_bytes,
+               erases);
+
+        cfs_coffee_detach(vol);
+    }
+
+    ram_sector_size = COFFEE_SECTOR_SIZE;
+
+}
+
+
+
+/*
+ * Bounded telemetry logs. A ring file keeps the latest RING_SIZE bytes
+ * of records; the alternative is an appended file that is removed and
+ * created again once it reaches that size. Records are appended one at
+ * a time, and the slowest append shows the cost of making room.
+ */
+#define RING_SIZE (4 * MIB)
+#define RING_WRITTEN (64 * MIB)
+
+static void ring_report(const char * const method, int record,
+                        double total, double worst){
+
+    struct cfs_coffee_stats stats;
+    unsigned long programs = 0, program_bytes = 0, erases = 0;
+    int i;
+
+    cfs_coffee_get_stats(&stats);
+    for(i = 0; i < CFS_COFFEE_OPS; i++){
+        programs += stats.ops[i].programs;
+        program_bytes += stats.ops[i].program_bytes;
+        erases += stats.ops[i].erases;
+    }
+    printf("ring %s %d %.2f %.2f %.2f %lu %.3f\n", method, record,
+           RING_WRITTEN / (double)MIB * 1.0e3 / total,
+           programs / ((double)program_bytes / COFFEE_PAGE_SIZE),
+           (double)program_bytes / RING_WRITTEN, erases, worst);
+
+}
+
+
+static void bench_ring(void){
+
+    static const int records[] = { 16, 64, 256 };
+    static char buf[256];
+    double start, elapsed, total, worst;
+    long written, logged;
+    int fd, i;
+
+    printf("# ring: method record mib_per_s programs_per_page "
+           "amplification erases worst_ms\n");
+
+#if COFFEE_RING_FILES
+    memset(buf, 0x3c, sizeof(buf));
+    for(i = 0; i < (int)(sizeof(records) / sizeof(records[0])); i++){
+        cfs_coffee_format();
+        cfs_coffee_ring_create("ring", RING_SIZE);
+        fd = cfs_open("ring", CFS_WRITE);
+        cfs_coffee_reset_stats();
+        total = worst = 0;
+        for(written = 0; written < RING_WRITTEN; written += records[i]){
+            start = now_ms();
+            cfs_coffee_ring_append(fd, buf, records[i]);
+            elapsed = now_ms() - start;
+            total += elapsed;
+            if(elapsed > worst){
+                worst = elapsed;
+            }
+        }
+        cfs_close(fd);
+        ring_report("ring", records[i], total, worst);
+
+        cfs_coffee_format();
+        cfs_coffee_reserve("log", RING_SIZE);
+        fd = cfs_open("log", CFS_WRITE | CFS_APPEND);
+        cfs_coffee_reset_stats();
+        total = worst = 0;
+        logged = 0;
+        for(written = 0; written < RING_WRITTEN; written += records[i]){
+            start = now_ms();
+            if(logged + records[i] > RING_SIZE){
+                cfs_close(fd);
+                cfs_remove("log");
+                cfs_coffee_reserve("log", RING_SIZE);
+                fd = cfs_open("log", CFS_WRITE | CFS_APPEND);
+                logged = 0;
+            }
+            logged += records[i];
+            cfs_write(fd, buf, records[i]);
+            elapsed = now_ms() - start;
+            total += elapsed;
+            if(elapsed > worst){
+                worst = elapsed;
+            }
+        }
+        cfs_close(fd);
+        ring_report("recreate", records[i], total, worst);
+    }
+#else
+    printf("# ring: needs COFFEE_RING_FILES\n");
+#endif
+
+}
+
+
+/*
+ * Merging a file with a full micro log. The log is filled with records
+ * of random regions, and the next overwrite merges it; the merge should
+ * read the file and the log about once and program the file once, in
+ * few large writes.
+ */
+#define MERGE_RECORDS 256
+#define MERGE_RECORD_SIZE 256
+
+static void bench_merge(void){
+
+    static const long file_sizes[] = { 256 * 1024, 1 * MIB, 4 * MIB };
+    static char buf[64 * 1024];
+    struct cfs_coffee_stats stats;
+    unsigned long seed = 1;
+    double start, elapsed, log_size;
+    long done;
+    int fd, i, j;
+
+    printf("# merge: file_kib records merge_ms reads read_ratio programs "
+           "program_ratio\n");
+
+    log_size = MERGE_RECORDS * (MERGE_RECORD_SIZE + 2.0);
+    memset(buf, 0x5a, sizeof(buf));
+    for(i = 0; i < (int)(sizeof(file_sizes) / sizeof(file_sizes[0])); i++){
+        cfs_coffee_format();
+        cfs_coffee_reserve("merge", file_sizes[i]);
+        cfs_coffee_configure_log("merge", MERGE_RECORDS * MERGE_RECORD_SIZE,
+                                 MERGE_RECORD_SIZE);
+        fd = cfs_open("merge", CFS_READ | CFS_WRITE);
+        for(done = 0; done < file_sizes[i]; done += sizeof(buf)){
+            cfs_write(fd, buf, sizeof(buf));
+        }
+
+        for(j = 0; j < MERGE_RECORDS; j++){
+            seed = seed * 1103515245UL + 12345UL;
+            cfs_seek(fd, (seed >> 8) % (file_sizes[i] / MERGE_RECORD_SIZE) *
+                     MERGE_RECORD_SIZE, CFS_SEEK_SET);
+            cfs_write(fd, buf, 16);
+        }
+
+        cfs_coffee_reset_stats();
+        start = now_ms();
+        cfs_seek(fd, 0, CFS_SEEK_SET);
+        cfs_write(fd, buf, 16);
+        elapsed = now_ms() - start;
+        cfs_close(fd);
+
+        cfs_coffee_get_stats(&stats);
+        printf("merge %ld %d %.3f %lu %.2f %lu %.2f\n", file_sizes[i] / 1024,
+               MERGE_RECORDS, elapsed, stats.ops[CFS_COFFEE_OP_MERGE].reads,
+               stats.ops[CFS_COFFEE_OP_MERGE].read_bytes /
+               (file_sizes[i] + log_size),
+               stats.ops[CFS_COFFEE_OP_MERGE].programs,
+               (double)stats.ops[CFS_COFFEE_OP_MERGE].program_bytes /
+               file_sizes[i]);
+    }
+
+}
+
+
+/*
+ * Time from a restart to the first write on a full image. The image is
+ * filled through the default volume and attached again as a new volume,
+ * which knows nothing about it, like the file system after a restart.
+ * The volume either builds its tables when the first write needs them,
+ * or is mounted first. The reads are those that reached the image, and
+ * the times are those of the NOR flash timing model.
+ */
+#define MOUNT_FILE_SIZE (6 * 1024)
+
+static void image_read(void *arg, void *buf, cfs_offset_t size,
+                       cfs_offset_t offset){
+
+    cflash_read(buf, size, offset);
+
+}
+
+
+static void image_write(void *arg, const void *buf, cfs_offset_t size,
+                        cfs_offset_t offset){
+
+    cflash_write(buf, size, offset);
+
+}
+
+
+static void image_erase(void *arg, unsigned sector){
+
+    cflash_erase(sector);
+
+}
+
+
+static void mount_first_write(const char * const method, int mount){
+
+    const struct cfs_coffee_geometry geometry = { 0, COFFEE_SIZE, 0, 0 };
+    const struct cfs_coffee_flash flash = {
+        image_read, image_write, image_erase, NULL
+    };
+    const struct cflash_timing * saved = cflash_get_timing();
+    struct cfs_coffee_mount_stats stats;
+    struct cflash_stats io;
+    struct cfs_coffee_volume *vol;
+    double start, mounted, written;
+    int fd;
+
+    memset(&stats, 0, sizeof(stats));
+    cflash_set_timing(&cflash_timing_nor);
+    cflash_reset_stats();
+    start = model_ms();
+    vol = cfs_coffee_attach(&flash, &geometry);
+    if(mount){
+        cfs_coffee_vol_mount(vol, &stats);
+    }
+    mounted = model_ms();
+    fd = cfs_coffee_vol_open(vol, method, CFS_WRITE);
+    cfs_coffee_vol_write(vol, fd, method, strlen(method));
+    cfs_coffee_vol_close(vol, fd);
+    written = model_ms();
+    cflash_get_stats(&io);
+    cfs_coffee_detach(vol);
+    cflash_set_timing(saved);
+
+    printf("mount %s %lu %llu %.0f %.3f %.3f\n", method, stats.headers,
+           (unsigned long long)io.reads, io.read_bytes / 1024.0,
+           mounted - start, written - start);
+
+}
+
+
+static void bench_mount(void){
+
+    static char buf[MOUNT_FILE_SIZE];
+    char name[16];
+    int fd, files, i;
+
+    printf("# mount: method headers reads read_kib mount_ms "
+           "first_write_ms\n");
+
+    /* Fill nine tenths of the image and remove every fourth file. */
+    cfs_coffee_format();
+    for(files = 0; files < COFFEE_SIZE / 10 * 9 / MOUNT_FILE_SIZE; files++){
+        sprintf(name, "m%d", files);
+        cfs_coffee_reserve(name, MOUNT_FILE_SIZE);
+        fd = cfs_open(name, CFS_WRITE);
+        cfs_write(fd, buf, sizeof(buf));
+        cfs_close(fd);
+    }
+    for(i = 0; i < files; i += 4){
+        sprintf(name, "m%d", i);
+        cfs_remove(name);
+    }
+    cflash_flush();
+
+    mount_first_write("lazy", 0);
+    mount_first_write("mount", 1);
+
+    // The default volume does not know what the other volumes wrote
+    cfs_coffee_format();
+
+}
+
+/*
+ * Compressed telemetry. Lines of sample telemetry are appended one at a
+ * time to a compressed file with blocks of each size, and to a plain
+ * file. The throughput is that of the host, which includes compressing,
+ * and that of the NOR flash timing model, which only counts the flash;
+ * the saved bytes are the bytes programmed less than for the plain file.
+ */
+#define COMPRESS_WRITTEN (4 * MIB)
+#define COMPRESS_READS 1000
+
+/* Write a line of telemetry; its fields repeat and change slowly */
+static int telemetry_line(char *buf, unsigned long t){
+
+    return sprintf(buf, "t=%lu temp=%d.%d volt=%lu state=%s\n",
+                   1000 + t * 10, 21 + (int)(t / 97 % 5), (int)(t * 7 % 10),
+                   3300 - t / 50 % 40, t % 64 < 60 ? "idle" : "tx");
+
+}
+
+
+static unsigned long programmed_bytes(void){
+
+    struct cfs_coffee_stats stats;
+    unsigned long program_bytes = 0;
+    int i;
+
+    cfs_coffee_get_stats(&stats);
+    for(i = 0; i < CFS_COFFEE_OPS; i++){
+        program_bytes += stats.ops[i].program_bytes;
+    }
+    return program_bytes;
+
+}
+
+
+static void bench_compress(void){
+
+    static const unsigned blocks[] = { 0, 256, 512, 1024, 2048, 4096 };
+    const struct cflash_timing * saved = cflash_get_timing();
+    static char buf[4096];
+    unsigned long t, seed = 1, plain = 0, programmed;
+    double start, host_ms, model_write_ms, read_ms, random_us;
+    long written;
+    int fd, i, j, n;
+
+    printf("# compress: block write_mib_per_s nor_write_mib_per_s "
+           "read_mib_per_s random_read_us programmed_bytes saved_bytes "
+           "ratio\n");
+
+#if COFFEE_COMPRESSED_FILES
+    for(i = 0; i < (int)(sizeof(blocks) / sizeof(blocks[0])); i++){
+        cflash_set_timing(NULL);
+        cfs_coffee_format();
+        // Blocks larger than COFFEE_COMPRESS_BLOCK_SIZE are skipped
+        if(blocks[i] != 0 &&
+           (cfs_coffee_reserve("telemetry", COMPRESS_WRITTEN / blocks[i] *
+                               sizeof(struct compressed_block)) < 0 ||
+            cfs_coffee_configure_compression("telemetry", COMPRESS_WRITTEN,
+                                             blocks[i]) < 0)){
+            continue;
+        }
+        cflash_set_timing(&cflash_timing_nor);
+
+        fd = cfs_open("telemetry", CFS_WRITE | CFS_APPEND);
+        cfs_coffee_reset_stats();
+        start = now_ms();
+        model_write_ms = model_ms();
+        for(written = t = 0; ; written += n, t++){
+            n = telemetry_line(buf, t);
+            if(written + n > COMPRESS_WRITTEN){
+                break;
+            }
+            cfs_write(fd, buf, n);
+        }
+        cfs_close(fd);
+        host_ms = now_ms() - start;
+        model_write_ms = model_ms() - model_write_ms;
+        programmed = programmed_bytes();
+        if(blocks[i] == 0){
+            plain = programmed;
+        }
+
+        fd = cfs_open("telemetry", CFS_READ);
+        start = now_ms();
+        while(cfs_read(fd, buf, sizeof(buf)) > 0);
+        read_ms = now_ms() - start;
+
+        start = now_ms();
+        for(j = 0; j < COMPRESS_READS; j++){
+            seed = seed * 1103515245UL + 12345UL;
+            cfs_seek(fd, (seed >> 8) % (written - 64), CFS_SEEK_SET);
+            cfs_read(fd, buf, 64);
+        }
+        random_us = (now_ms() - start) * 1.0e3 / COMPRESS_READS;
+        cfs_close(fd);
+
+        printf("compress %u %.2f %.2f %.2f %.2f %lu %ld %.2f\n", blocks[i],
+               written / (double)MIB * 1.0e3 / host_ms,
+               written / (double)MIB * 1.0e3 / model_write_ms,
+               written / (double)MIB * 1.0e3 / read_ms, random_us,
+               programmed, (long)(plain - programmed),
+               (double)written / programmed);
+    }
+    cflash_set_timing(saved);
+    cfs_coffee_format();
+#else
+    printf("# compress: needs COFFEE_COMPRESSED_FILES\n");
+#endif
+
+}
+
+
+static const struct {
+    const char * name;
+    void (*run)(void);
+} benchmarks[] = {
+    { "gc", bench_gc },
+    { "reserve", bench_reserve },
+    { "log_read", bench_log_read },
+    { "log_write", bench_log_write },
+    { "append", bench_append },
+    { "gc_step", bench_gc_step },
+    { "pool", bench_pool },
+    { "wear", bench_wear },
+    { "model", bench_model },
+    { "suite", bench_suite },
+    { "io", bench_io },
+    { "volumes", bench_volumes },
+    { "geometry", bench_geometry },
+    { "ring", bench_ring },
+    { "merge", bench_merge },
+    { "mount", bench_mount },
+    { "compress", bench_compress }
+};
+
+
+/* Run the benchmarks named on the command line, or all of them */
+int main(int argc, char *argv[]){
+
+    const int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    int i, j;
+
+    for(i = 0; i < count; i++){
+        for(j = 1; j < argc && strcmp(argv[j], benchmarks[i].name) != 0; j++);
+        if(argc == 1 || j < argc){
+            benchmarks[i].run();
+        }
+    }
+
+    cflash_flush();
+
+    return 0;
+}
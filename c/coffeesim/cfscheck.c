@@ -0,0 +1,854 @@
+/*
+ * cfscheck.c
+ *
+ *  Offline checker of Coffee images. The image is mapped read-only and
+ *  its sectors are split into ranges that threads check side by side:
+ *
+ *  1. Each thread walks the headers of its range as if the range began
+ *     with a header. This is true unless an extent reaches into the
+ *     range from the previous one.
+ *  2. The ranges are stitched in order: the walk of a range really
+ *     starts where the walk of the previous range left it. From there
+ *     the walk is repeated until it meets the path of step 1, which it
+ *     then follows to the end of the range.
+ *  3. Each thread validates the headers of its range, the extent
+ *     chains, micro logs and block indices of the files, and the runs
+ *     of isolated pages, and counts the pages.
+ *
+ *  The checker must be built with the configuration of the file system
+ *  that wrote the image, since that decides the layout of the headers.
+ *
+ *  Usage: cfscheck [-j threads] [-q] [image]
+ *  -j: number of threads, one per online processor by default
+ *  -q: print only the problems and the summary, not the files
+ *
+ *  The exit status is 0 for a consistent image, 1 if problems were
+ *  found and 2 if the image could not be checked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "coffee_fs/cfs-coffee-format.h"
+
+#define MAX_THREADS 256
+
+/* Marks of a page */
+#define MARK_WALKED 0x1     /* Reached by the walk of step 1 */
+#define MARK_HEADER 0x2     /* Holds a header of the stitched walk */
+
+/* Use of a page */
+#define USE_FREE     0
+#define USE_ACTIVE   1
+#define USE_OBSOLETE 2
+
+
+/* Image that is checked */
+static const uint8_t *image;
+static uint32_t page_size;
+static uint32_t sector_size;
+static coffee_page_t page_count;
+static coffee_page_t pages_per_sector;
+
+/* Per page state, each byte written by the thread of its range */
+static uint8_t *marks;
+static uint8_t *use;
+
+/* References to logs and continuation extents, counted atomically */
+static uint8_t *references;
+
+
+/* A problem found at a page */
+struct problem {
+    coffee_page_t page;
+    const char *what;
+};
+
+/* A file found in a range */
+struct file_row {
+    coffee_page_t page;
+    char name[COFFEE_NAME_LENGTH];
+    unsigned long pages;
+    unsigned extents;
+    uint8_t kind;
+    unsigned log_used;
+    unsigned log_records;
+};
+
+/* Counts of a range */
+struct check_stats {
+    unsigned long headers;
+    unsigned long files;
+    unsigned long rings;
+    unsigned long compressed_files;
+    unsigned long raw_bytes;
+    unsigned long stored_bytes;
+    unsigned long chained_files;
+    unsigned long extents;
+    unsigned long logs;
+    unsigned long modified_files;
+    unsigned long log_records;
+    unsigned long log_used;
+    unsigned long isolated_runs;
+    unsigned long active_pages;
+    unsigned long obsolete_pages;
+    unsigned long free_pages;
+    unsigned long problems;
+};
+
+/* Sectors checked by one thread */
+struct range {
+    pthread_t thread;
+    coffee_page_t start;
+    coffee_page_t end;
+    coffee_page_t exit;             /* First page after the walk of step 1 */
+    struct check_stats stats;
+    struct problem *problems;
+    unsigned long problem_space;
+    struct file_row *files;
+    unsigned long file_space;
+};
+
+
+static void read_header(coffee_page_t page, struct file_header *hdr){
+
+    memcpy(hdr, image + (size_t)page * page_size, sizeof(*hdr));
+
+}
+
+
+/*
+ * Page of the header that follows a header, as in the quick-skip of
+ * next_file() in cfs-coffee.c. Broken extent sizes advance by one page,
+ * so that every walk ends.
+ */
+static coffee_page_t next_header(coffee_page_t page,
+                                 const struct file_header *hdr){
+
+    if(HDR_FREE(*hdr)){
+        return (page / pages_per_sector + 1) * pages_per_sector;
+    }
+    if(HDR_ISOLATED(*hdr) || hdr->max_pages < 1){
+        return page + 1;
+    }
+    if(hdr->max_pages > page_count - page){
+        return page_count;
+    }
+
+    return page + hdr->max_pages;
+
+}
+
+
+static void report(struct range *range, coffee_page_t page,
+                   const char *what){
+
+    struct problem *problems;
+
+    range->stats.problems++;
+    if(range->stats.problems > range->problem_space){
+        range->problem_space = range->problem_space * 2 + 16;
+        problems = realloc(range->problems,
+                           range->problem_space * sizeof(*problems));
+        if(problems == NULL){
+            /* The problem is still counted. */
+            range->problem_space = 0;
+            return;
+        }
+        range->problems = problems;
+    }
+    range->problems[range->stats.problems - 1].page = page;
+    range->problems[range->stats.problems - 1].what = what;
+
+}
+
+
+static struct file_row * add_file(struct range *range){
+
+    struct file_row *files;
+    unsigned long count;
+
+    count = range->stats.files + range->stats.rings;
+    if(count >= range->file_space){
+        range->file_space = range->file_space * 2 + 16;
+        files = realloc(range->files, range->file_space * sizeof(*files));
+        if(files == NULL){
+            range->file_space = 0;
+            return NULL;
+        }
+        range->files = files;
+    }
+
+    return &range->files[count];
+
+}
+
+
+/* Step 1: walk the range as if it began with a header */
+static void * walk_range(void *arg){
+
+    struct range *range = arg;
+    struct file_header hdr;
+    coffee_page_t page;
+
+    for(page = range->start; page < range->end;
+        page = next_header(page, &hdr)){
+        read_header(page, &hdr);
+        marks[page] |= MARK_WALKED;
+    }
+    range->exit = page;
+
+    return NULL;
+
+}
+
+
+/*
+ * Step 2: find the true headers of the ranges. Once the walk from the
+ * real start of a range reaches a page of step 1, both walks continue
+ * alike, so the rest of the path of step 1 is taken as it is.
+ */
+static void stitch_ranges(struct range *ranges, int count){
+
+    struct file_header hdr;
+    coffee_page_t page;
+    int i;
+
+    page = 0;
+    for(i = 0; i < count; i++){
+        while(page < ranges[i].end && !(marks[page] & MARK_WALKED)){
+            read_header(page, &hdr);
+            marks[page] |= MARK_HEADER;
+            page = next_header(page, &hdr);
+        }
+        if(page < ranges[i].end){
+            for(; page < ranges[i].end; page++){
+                if(marks[page] & MARK_WALKED){
+                    marks[page] |= MARK_HEADER;
+                }
+            }
+            page = ranges[i].exit;
+        }
+    }
+
+}
+
+
+static int is_header(coffee_page_t page){
+
+    return page >= 0 && page < page_count && (marks[page] & MARK_HEADER);
+
+}
+
+
+/*
+ * Claim the log or continuation extent at a page for one file. Return
+ * the reason why it cannot belong to the file, or NULL.
+ */
+static const char * claim_part(coffee_page_t page, uint8_t flag,
+                               struct file_header *hdr){
+
+    if(!is_header(page)){
+        return "reference to a page without a header";
+    }
+    read_header(page, hdr);
+    if(!HDR_ACTIVE(*hdr) || !CHECK_FLAG(*hdr, flag)){
+        return flag == HDR_FLAG_LOG ?
+            "log page is not an active log" :
+            "next extent is not an active continuation extent";
+    }
+    if(__atomic_fetch_add(&references[page], 1, __ATOMIC_RELAXED) != 0){
+        return "extent is referenced by several files";
+    }
+
+    return NULL;
+
+}
+
+
+/* Follow the continuation extents of a file and return its capacity */
+static cfs_offset_t check_chain(struct range *range, coffee_page_t page,
+                                const struct file_header *hdr,
+                                struct file_row *row){
+
+    cfs_offset_t capacity;
+#if COFFEE_EXTENT_CHAINS
+    struct file_header extent;
+    const char *what;
+    coffee_page_t next;
+#endif
+
+    capacity = (cfs_offset_t)hdr->max_pages * page_size - sizeof(*hdr);
+    row->pages = hdr->max_pages;
+    row->extents = 1;
+
+#if COFFEE_EXTENT_CHAINS
+    extent = *hdr;
+    while(extent.next_extent != 0){
+        next = extent.next_extent - 1;
+        what = claim_part(next, HDR_FLAG_EXTENT, &extent);
+        if(what != NULL){
+            report(range, page, what);
+            break;
+        }
+        capacity += (cfs_offset_t)extent.max_pages * page_size -
+            sizeof(extent);
+        row->pages += extent.max_pages;
+        row->extents++;
+    }
+#endif
+
+    return capacity;
+
+}
+
+
+/* Check the micro log of a modified file and count its used records */
+static void check_log(struct range *range, coffee_page_t page,
+                      const struct file_header *hdr, cfs_offset_t capacity,
+                      struct file_row *row){
+
+    struct file_header log;
+    const uint8_t *index;
+    uint16_t record_size, records, entry, i;
+    unsigned long regions;
+    const char *what;
+
+    what = claim_part(hdr->log_page, HDR_FLAG_LOG, &log);
+    if(what != NULL){
+        report(range, page, what);
+        return;
+    }
+
+    record_size = hdr->log_record_size == 0 ?
+        page_size : hdr->log_record_size;
+    records = hdr->log_records == 0 ?
+        COFFEE_LOG_SIZE / COFFEE_PAGE_SIZE * page_size / record_size :
+        hdr->log_records;
+    if((unsigned long)log.max_pages * page_size <
+       sizeof(log) + (unsigned long)records * (sizeof(entry) + record_size)){
+        report(range, page, "log is too small for its records");
+        return;
+    }
+
+    regions = (capacity + record_size - 1) / record_size;
+    index = image + (size_t)hdr->log_page * page_size + sizeof(log);
+    row->log_records = records;
+    for(i = 0; i < records; i++){
+        memcpy(&entry, index + i * sizeof(entry), sizeof(entry));
+        if(entry == 0){
+            continue;
+        }
+        if(i > row->log_used){
+            report(range, page, "log index has an unused record before a "
+                   "used one");
+        }
+        if(entry > regions){
+            report(range, page, "log record of a region beyond the file");
+        }
+        row->log_used = i + 1;
+    }
+    range->stats.modified_files++;
+    range->stats.log_records += records;
+    range->stats.log_used += row->log_used;
+
+}
+
+
+/*
+ * Check the block index of a compressed file, which is at the start of
+ * its first extent. The used entries come first, and describe adjacent
+ * parts of the file whose stored blocks follow each other in order.
+ */
+static void check_index(struct range *range, coffee_page_t page,
+                        const struct file_header *hdr, cfs_offset_t capacity,
+                        struct file_row *row){
+
+    struct compressed_block entry;
+    const uint8_t *index;
+    unsigned long raw_end, stored_end;
+    uint16_t i;
+
+    range->stats.compressed_files++;
+    stored_end = (unsigned long)hdr->log_records * sizeof(entry);
+    if(stored_end > (unsigned long)hdr->max_pages * page_size -
+       sizeof(*hdr)){
+        report(range, page, "block index is larger than the first extent");
+        return;
+    }
+
+    index = image + (size_t)page * page_size + sizeof(*hdr);
+    raw_end = 0;
+    row->log_records = hdr->log_records;
+    for(i = 0; i < hdr->log_records; i++){
+        memcpy(&entry, index + i * sizeof(entry), sizeof(entry));
+        if(entry.raw_size == 0){
+            continue;
+        }
+        if(i > row->log_used){
+            report(range, page, "block index has an unused entry before a "
+                   "used one");
+        }
+        if(entry.raw_size > hdr->log_record_size ||
+           entry.stored_size > entry.raw_size ||
+           entry.raw_end != raw_end + entry.raw_size){
+            report(range, page, "block of a wrong size");
+        }
+        if(entry.stored_start < stored_end ||
+           entry.stored_start + entry.stored_size > (unsigned long)capacity){
+            report(range, page, "stored block overlaps or is beyond the file");
+        }
+        raw_end = entry.raw_end;
+        stored_end = entry.stored_start + entry.stored_size;
+        range->stats.raw_bytes += entry.raw_size;
+        range->stats.stored_bytes += entry.stored_size;
+        row->log_used = i + 1;
+    }
+
+}
+
+
+/* Check an active file or ring file with its extents and log */
+static void check_file(struct range *range, coffee_page_t page,
+                       const struct file_header *hdr){
+
+    struct file_row row;
+    struct file_row *slot;
+    cfs_offset_t capacity;
+#if COFFEE_EOF_RECORDS
+    int i;
+#endif
+
+    memset(&row, 0, sizeof(row));
+    row.page = page;
+    memcpy(row.name, hdr->name, sizeof(row.name));
+    row.name[sizeof(row.name) - 1] = '\0';
+    row.kind = hdr->kind;
+
+    if(hdr->name[0] == '\0' || hdr->name[sizeof(hdr->name) - 1] != '\0'){
+        report(range, page, "file name is empty or not terminated");
+    }
+    if(hdr->kind != HDR_KIND_FILE && hdr->kind != HDR_KIND_RING &&
+       hdr->kind != HDR_KIND_COMPRESSED){
+        report(range, page, "unknown file kind");
+    }
+
+    capacity = check_chain(range, page, hdr, &row);
+    if(HDR_MODIFIED(*hdr)){
+        if(hdr->kind != HDR_KIND_FILE){
+            report(range, page, "ring or compressed file has a log");
+        } else {
+            check_log(range, page, hdr, capacity, &row);
+        }
+    } else if(HDR_COMPRESSED(*hdr)){
+        check_index(range, page, hdr, capacity, &row);
+    }
+#if COFFEE_EOF_RECORDS
+    for(i = 0; i < COFFEE_EOF_RECORDS; i++){
+        if(hdr->eof_records[i] == 0){
+            continue;
+        }
+        if((hdr->eof_records[i] & ~(EOF_RECORD_END | EOF_RECORD_DIRTY |
+                                    (EOF_RECORD_DIRTY - 1))) != 0 ||
+           !(hdr->eof_records[i] & EOF_RECORD_END)){
+            report(range, page, "invalid file end record");
+        } else if(EOF_RECORD_OFFSET(hdr->eof_records[i]) > capacity){
+            report(range, page, "file end beyond the file");
+        }
+    }
+#endif
+
+    if(row.extents > 1){
+        range->stats.chained_files++;
+    }
+    slot = add_file(range);
+    if(slot != NULL){
+        *slot = row;
+    }
+    if(HDR_RING(*hdr)){
+        range->stats.rings++;
+    } else {
+        range->stats.files++;
+    }
+
+}
+
+
+/*
+ * Check a run of isolated pages that starts at a page. Isolation covers
+ * the part of an obsolete extent on one side of a sector boundary, so
+ * the run stays within a sector and starts or ends at its boundary.
+ */
+static void check_isolated_run(struct range *range, coffee_page_t page){
+
+    struct file_header hdr;
+    coffee_page_t end, sector_end;
+
+    sector_end = (page / pages_per_sector + 1) * pages_per_sector;
+    for(end = page + 1; end < page_count && is_header(end); end++){
+        read_header(end, &hdr);
+        if(!HDR_ISOLATED(hdr)){
+            break;
+        }
+    }
+
+    range->stats.isolated_runs++;
+    if(end > sector_end){
+        report(range, page, "isolated pages cross a sector boundary");
+    } else if(page % pages_per_sector != 0 && end != sector_end){
+        report(range, page, "isolated pages do not touch a sector boundary");
+    }
+
+}
+
+
+/* Check that the rest of a sector after a free header is erased */
+static void check_free(struct range *range, coffee_page_t page,
+                       const struct file_header *hdr, coffee_page_t end){
+
+    const uint8_t *data, *data_end;
+
+    if(hdr->flags != 0){
+        report(range, page, "flags of a free page without "
+               "HDR_FLAG_ALLOCATED");
+    }
+    data = image + (size_t)page * page_size;
+    data_end = image + (size_t)end * page_size;
+    for(; data < data_end; data++){
+        if(*data != 0){
+            report(range, page, "free pages are not erased");
+            break;
+        }
+    }
+
+}
+
+
+static void set_use(coffee_page_t page, coffee_page_t end, uint8_t state){
+
+    memset(use + page, state, end - page);
+
+}
+
+
+/* Step 3: validate the headers of a range */
+static void * check_range(void *arg){
+
+    struct range *range = arg;
+    struct file_header hdr;
+    coffee_page_t page, end, previous;
+
+    previous = -1;
+    for(page = range->start; page < range->end; page++){
+        if(!(marks[page] & MARK_HEADER)){
+            continue;
+        }
+        read_header(page, &hdr);
+        end = next_header(page, &hdr);
+        range->stats.headers++;
+
+        if(HDR_FREE(hdr)){
+            check_free(range, page, &hdr, end);
+            range->stats.free_pages += end - page;
+            set_use(page, end, USE_FREE);
+        } else if(HDR_ISOLATED(hdr)){
+            if(previous != page - 1 || page % pages_per_sector == 0){
+                check_isolated_run(range, page);
+            }
+            range->stats.obsolete_pages++;
+            set_use(page, end, USE_OBSOLETE);
+        } else {
+            if(!HDR_VALID(hdr)){
+                report(range, page, "header is not completely written");
+            }
+            if(hdr.max_pages < 1 || hdr.max_pages > page_count - page){
+                report(range, page, "extent size is out of the volume");
+            }
+            if(HDR_OBSOLETE(hdr)){
+                range->stats.obsolete_pages += end - page;
+                set_use(page, end, USE_OBSOLETE);
+            } else {
+                range->stats.active_pages += end - page;
+                set_use(page, end, USE_ACTIVE);
+                if(HDR_LOG(hdr)){
+                    range->stats.logs++;
+                } else if(HDR_EXTENT(hdr)){
+                    range->stats.extents++;
+                } else if(!HDR_SUPERBLOCK(hdr)){
+                    check_file(range, page, &hdr);
+                }
+            }
+        }
+        previous = HDR_ISOLATED(hdr) ? page : -1;
+    }
+
+    return NULL;
+
+}
+
+
+static void add_stats(struct check_stats *total,
+                      const struct check_stats *stats){
+
+    total->headers += stats->headers;
+    total->files += stats->files;
+    total->rings += stats->rings;
+    total->compressed_files += stats->compressed_files;
+    total->raw_bytes += stats->raw_bytes;
+    total->stored_bytes += stats->stored_bytes;
+    total->chained_files += stats->chained_files;
+    total->extents += stats->extents;
+    total->logs += stats->logs;
+    total->modified_files += stats->modified_files;
+    total->log_records += stats->log_records;
+    total->log_used += stats->log_used;
+    total->isolated_runs += stats->isolated_runs;
+    total->active_pages += stats->active_pages;
+    total->obsolete_pages += stats->obsolete_pages;
+    total->free_pages += stats->free_pages;
+    total->problems += stats->problems;
+
+}
+
+
+static double ratio(unsigned long part, unsigned long whole){
+
+    return whole == 0 ? 0.0 : (double)part / whole;
+
+}
+
+
+/* Run one step of the check on all ranges in parallel */
+static void run_ranges(struct range *ranges, int count,
+                       void *(*step)(void *)){
+
+    int i;
+
+    for(i = 0; i < count; i++){
+        if(pthread_create(&ranges[i].thread, NULL, step, &ranges[i]) != 0){
+            step(&ranges[i]);
+            ranges[i].thread = pthread_self();
+        }
+    }
+    for(i = 0; i < count; i++){
+        if(!pthread_equal(ranges[i].thread, pthread_self())){
+            pthread_join(ranges[i].thread, NULL);
+        }
+    }
+
+}
+
+
+/* Take the page and sector sizes from the superblock, if there is one */
+static void read_geometry(void){
+
+    struct file_header hdr;
+    struct superblock sb;
+
+    page_size = COFFEE_PAGE_SIZE;
+    sector_size = COFFEE_SECTOR_SIZE;
+
+    read_header(0, &hdr);
+    if(!HDR_ACTIVE(hdr) || !HDR_SUPERBLOCK(hdr)){
+        return;
+    }
+    memcpy(&sb, image + sizeof(hdr), sizeof(sb));
+    if(sb.magic == SUPERBLOCK_MAGIC && sb.page_size >= sizeof(hdr) &&
+       sb.sector_size % sb.page_size == 0 &&
+       COFFEE_SIZE % sb.sector_size == 0){
+        page_size = sb.page_size;
+        sector_size = sb.sector_size;
+    }
+
+}
+
+
+static void print_files(const struct range *range){
+
+    const struct file_row *row;
+    unsigned long i;
+
+    for(i = 0; i < range->stats.files + range->stats.rings &&
+        i < range->file_space; i++){
+        row = &range->files[i];
+        printf("%ld %s %s %lu %u %u %u\n", (long)row->page, row->name,
+               row->kind == HDR_KIND_RING ? "ring" :
+               row->kind == HDR_KIND_COMPRESSED ? "compressed" : "file",
+               row->pages, row->extents, row->log_used, row->log_records);
+    }
+
+}
+
+
+static unsigned long print_problems(const struct range *range){
+
+    unsigned long i;
+
+    for(i = 0; i < range->stats.problems && i < range->problem_space; i++){
+        printf("page %ld: %s\n", (long)range->problems[i].page,
+               range->problems[i].what);
+    }
+
+    return range->stats.problems;
+
+}
+
+
+/* Find the runs of free pages and the active extents without a file */
+static void check_volume(unsigned long *orphans, unsigned long *free_runs,
+                         unsigned long *largest_free_run){
+
+    struct file_header hdr;
+    coffee_page_t page, run;
+
+    *orphans = *free_runs = *largest_free_run = 0;
+    run = 0;
+    for(page = 0; page < page_count; page++){
+        if((marks[page] & MARK_HEADER) && references[page] == 0){
+            read_header(page, &hdr);
+            if(HDR_ACTIVE(hdr) && (HDR_LOG(hdr) || HDR_EXTENT(hdr))){
+                printf("page %ld: active extent that no file refers to\n",
+                       (long)page);
+                (*orphans)++;
+            }
+        }
+        if(use[page] == USE_FREE){
+            run++;
+            if(run == 1){
+                (*free_runs)++;
+            }
+            if((unsigned long)run > *largest_free_run){
+                *largest_free_run = run;
+            }
+        } else {
+            run = 0;
+        }
+    }
+
+}
+
+
+int main(int argc, char *argv[]){
+
+    const char *name = "coffeedisk.img";
+    static struct range ranges[MAX_THREADS];
+    struct check_stats total;
+    unsigned long orphans, free_runs, largest_free_run, used;
+    int threads, quiet, opt, fd, i;
+    coffee_page_t sectors;
+    struct stat st;
+    void *map;
+    long online;
+
+    online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? (int)online : 1;
+    quiet = 0;
+    while((opt = getopt(argc, argv, "j:q")) != -1){
+        switch(opt){
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-j threads] [-q] [image]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(optind < argc){
+        name = argv[optind];
+    }
+    if(threads < 1){
+        threads = 1;
+    } else if(threads > MAX_THREADS){
+        threads = MAX_THREADS;
+    }
+
+    fd = open(name, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0 ||
+       st.st_size < (off_t)(COFFEE_START + COFFEE_SIZE)){
+        fprintf(stderr, "%s: cannot read a volume of %lu bytes\n", name,
+                (unsigned long)COFFEE_SIZE);
+        return 2;
+    }
+    map = mmap(NULL, COFFEE_START + COFFEE_SIZE, PROT_READ, MAP_PRIVATE,
+               fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        fprintf(stderr, "%s: cannot map the image\n", name);
+        return 2;
+    }
+    image = (const uint8_t *)map + COFFEE_START;
+
+    read_geometry();
+    page_count = COFFEE_SIZE / page_size;
+    pages_per_sector = sector_size / page_size;
+    sectors = page_count / pages_per_sector;
+    marks = calloc(page_count, 1);
+    use = calloc(page_count, 1);
+    references = calloc(page_count, 1);
+    if(marks == NULL || use == NULL || references == NULL){
+        fprintf(stderr, "Out of memory\n");
+        return 2;
+    }
+
+    if(threads > sectors){
+        threads = sectors;
+    }
+    for(i = 0; i < threads; i++){
+        ranges[i].start = sectors * i / threads * pages_per_sector;
+        ranges[i].end = sectors * (i + 1) / threads * pages_per_sector;
+    }
+
+    run_ranges(ranges, threads, walk_range);
+    stitch_ranges(ranges, threads);
+    run_ranges(ranges, threads, check_range);
+
+    memset(&total, 0, sizeof(total));
+    if(!quiet){
+        printf("# files: page name kind pages extents log_used "
+               "log_records\n");
+        for(i = 0; i < threads; i++){
+            print_files(&ranges[i]);
+        }
+    }
+    for(i = 0; i < threads; i++){
+        print_problems(&ranges[i]);
+        add_stats(&total, &ranges[i].stats);
+    }
+    check_volume(&orphans, &free_runs, &largest_free_run);
+    total.problems += orphans;
+
+    used = total.active_pages + total.obsolete_pages;
+    printf("# summary of %s: %u-byte pages, %u-byte sectors, %d threads\n",
+           name, (unsigned)page_size, (unsigned)sector_size, threads);
+    printf("headers %lu\n", total.headers);
+    printf("files %lu\n", total.files);
+    printf("ring_files %lu\n", total.rings);
+    printf("compressed_files %lu\n", total.compressed_files);
+    printf("compression_ratio %.3f\n",
+           ratio(total.raw_bytes, total.stored_bytes));
+    printf("continuation_extents %lu\n", total.extents);
+    printf("chained_files %lu\n", total.chained_files);
+    printf("active_pages %lu\n", total.active_pages);
+    printf("obsolete_pages %lu\n", total.obsolete_pages);
+    printf("free_pages %lu\n", total.free_pages);
+    printf("obsolete_ratio %.3f\n", ratio(total.obsolete_pages, used));
+    printf("isolated_runs %lu\n", total.isolated_runs);
+    printf("free_runs %lu\n", free_runs);
+    printf("largest_free_run %lu\n", largest_free_run);
+    printf("free_fragmentation %.3f\n", total.free_pages == 0 ? 0.0 :
+           1.0 - ratio(largest_free_run, total.free_pages));
+    printf("modified_files %lu\n", total.modified_files);
+    printf("log_fill %.3f\n", ratio(total.log_used, total.log_records));
+    printf("problems %lu\n", total.problems);
+
+    return total.problems == 0 ? 0 : 1;
+
+}
@@ -0,0 +1,483 @@
+/*
+ * cfsimage.c
+ *
+ *  Host tool that builds a Coffee image from a directory tree, or
+ *  extracts the files of an image into a directory.
+ *
+ *  The builder lays out the files directly, without the file system:
+ *  each file gets one extent of the pages that its header and data
+ *  need, the extents follow each other from the first page, and the
+ *  image is written front to back in one pass. The files are named by
+ *  their paths relative to the directory, which must be shorter than
+ *  COFFEE_NAME_LENGTH.
+ *
+ *  The extractor attaches the image as a volume whose flash operations
+ *  are copies from a read-only mapping of it, and reads the files with
+ *  the file system, so micro logs, extent chains and ring files are
+ *  read as the target would read them. Ring files are extracted as
+ *  their records from the oldest to the newest.
+ *
+ *  The tool must be built with the configuration of the file system
+ *  that uses the image, since that decides the layout of the headers.
+ *
+ *  Usage: cfsimage build <directory> [image]
+ *         cfsimage extract <directory> [image]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "coffee_fs/cfs.h"
+#include "coffee_fs/cfs-coffee.h"
+#include "coffee_fs/cfs-coffee-format.h"
+
+#define COPY_SIZE (64 * 1024)
+
+/* Files of the directory tree, in the order of their extents */
+struct image_file {
+    char name[COFFEE_NAME_LENGTH];
+    char *path;
+    cfs_offset_t size;
+    coffee_page_t pages;
+};
+
+static struct image_file *files;
+static int file_count;
+static int file_space;
+
+static char copy_buf[COPY_SIZE];
+
+
+static coffee_page_t page_count(cfs_offset_t size){
+
+    return (size + COFFEE_PAGE_SIZE - 1) / COFFEE_PAGE_SIZE;
+
+}
+
+
+static int add_file(const char *path, const char *name, cfs_offset_t size){
+
+    struct image_file *grown;
+    struct image_file *file;
+
+    if(strlen(name) >= COFFEE_NAME_LENGTH){
+        fprintf(stderr, "%s: name is longer than %d characters\n", name,
+                (int)COFFEE_NAME_LENGTH - 1);
+        return -1;
+    }
+    if(file_count == file_space){
+        file_space = file_space * 2 + 64;
+        grown = realloc(files, file_space * sizeof(*files));
+        if(grown == NULL){
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        files = grown;
+    }
+
+    file = &files[file_count++];
+    memset(file->name, 0, sizeof(file->name));
+    strcpy(file->name, name);
+    file->path = strdup(path);
+    file->size = size;
+    file->pages = page_count(sizeof(struct file_header) + size);
+
+    return file->path == NULL ? -1 : 0;
+
+}
+
+
+/*
+ * Add the regular files under a directory, in the order of their names.
+ * -path:   the directory on the host
+ * -prefix: its name relative to the top directory, "" for the top
+ */
+static int scan_directory(const char *path, const char *prefix){
+
+    struct dirent **entries;
+    char child[4096], name[4096];
+    struct stat st;
+    int count, i, result;
+
+    count = scandir(path, &entries, NULL, alphasort);
+    if(count < 0){
+        perror(path);
+        return -1;
+    }
+
+    result = 0;
+    for(i = 0; i < count; i++){
+        if(result == 0 && strcmp(entries[i]->d_name, ".") != 0 &&
+           strcmp(entries[i]->d_name, "..") != 0){
+            snprintf(child, sizeof(child), "%s/%s", path, entries[i]->d_name);
+            snprintf(name, sizeof(name), "%s%s", prefix, entries[i]->d_name);
+            if(stat(child, &st) != 0){
+                perror(child);
+                result = -1;
+            } else if(S_ISDIR(st.st_mode)){
+                strcat(name, "/");
+                result = scan_directory(child, name);
+            } else if(S_ISREG(st.st_mode)){
+                result = add_file(child, name, st.st_size);
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+
+    return result;
+
+}
+
+
+/* Write a header at the current position of the image */
+static int write_header(FILE *image, const struct file_header *hdr){
+
+    return fwrite(hdr, sizeof(*hdr), 1, image) == 1 ? 0 : -1;
+
+}
+
+
+/* Write the data of a file after its header, and pad its last page */
+static int write_file(FILE *image, const struct image_file *file){
+
+    cfs_offset_t left, padding;
+    size_t size;
+    FILE *in;
+
+    in = fopen(file->path, "rb");
+    if(in == NULL){
+        perror(file->path);
+        return -1;
+    }
+    for(left = file->size; left > 0; left -= size){
+        size = left < COPY_SIZE ? left : COPY_SIZE;
+        if(fread(copy_buf, 1, size, in) != size ||
+           fwrite(copy_buf, 1, size, image) != size){
+            fprintf(stderr, "%s: cannot copy the file\n", file->path);
+            fclose(in);
+            return -1;
+        }
+    }
+    fclose(in);
+
+    padding = (cfs_offset_t)file->pages * COFFEE_PAGE_SIZE -
+        sizeof(struct file_header) - file->size;
+    memset(copy_buf, 0, padding);
+
+    return fwrite(copy_buf, 1, padding, image) == (size_t)padding ? 0 : -1;
+
+}
+
+
+static int build(const char *directory, const char *name){
+
+    struct file_header hdr;
+    coffee_page_t pages;
+    FILE *image;
+    int i;
+
+    if(scan_directory(directory, "") != 0){
+        return 2;
+    }
+
+    /* The superblock takes the first page, as cfs_coffee_format() does. */
+    pages = COFFEE_RUNTIME_GEOMETRY ? 1 : 0;
+    for(i = 0; i < file_count; i++){
+        pages += files[i].pages;
+    }
+    if(pages > COFFEE_SIZE / COFFEE_PAGE_SIZE){
+        fprintf(stderr, "%s: %ld pages do not fit into %ld\n", directory,
+                (long)pages, (long)(COFFEE_SIZE / COFFEE_PAGE_SIZE));
+        return 2;
+    }
+
+    image = fopen(name, "wb");
+    if(image == NULL){
+        perror(name);
+        return 2;
+    }
+    if(fseek(image, COFFEE_START, SEEK_SET) != 0){
+        perror(name);
+        fclose(image);
+        return 2;
+    }
+
+#if COFFEE_RUNTIME_GEOMETRY
+    {
+        struct superblock sb;
+
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.max_pages = 1;
+        hdr.flags = HDR_FLAG_VALID | HDR_FLAG_ALLOCATED | HDR_FLAG_SUPERBLOCK;
+        sb.magic = SUPERBLOCK_MAGIC;
+        sb.page_size = COFFEE_PAGE_SIZE;
+        sb.sector_size = COFFEE_SECTOR_SIZE;
+        memset(copy_buf, 0, COFFEE_PAGE_SIZE - sizeof(hdr) - sizeof(sb));
+        if(write_header(image, &hdr) != 0 ||
+           fwrite(&sb, sizeof(sb), 1, image) != 1 ||
+           fwrite(copy_buf, COFFEE_PAGE_SIZE - sizeof(hdr) - sizeof(sb), 1,
+                  image) != 1){
+            perror(name);
+            fclose(image);
+            return 2;
+        }
+    }
+#endif
+
+    for(i = 0; i < file_count; i++){
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.max_pages = files[i].pages;
+        hdr.kind = HDR_KIND_FILE;
+        hdr.flags = HDR_FLAG_VALID | HDR_FLAG_ALLOCATED;
+        memcpy(hdr.name, files[i].name, sizeof(hdr.name));
+#if COFFEE_EOF_RECORDS
+        hdr.eof_records[0] = EOF_RECORD(files[i].size);
+#endif
+        if(write_header(image, &hdr) != 0 ||
+           write_file(image, &files[i]) != 0){
+            fprintf(stderr, "%s: cannot write the image\n", name);
+            fclose(image);
+            return 2;
+        }
+    }
+
+    /* The rest of the storage is erased, which is zero for Coffee. */
+    if(fflush(image) != 0 ||
+       ftruncate(fileno(image), COFFEE_START + COFFEE_SIZE) != 0){
+        perror(name);
+        fclose(image);
+        return 2;
+    }
+    fclose(image);
+
+    printf("%d files in %ld of %ld pages\n", file_count, (long)pages,
+           (long)(COFFEE_SIZE / COFFEE_PAGE_SIZE));
+
+    return 0;
+
+}
+
+
+/* Flash operations of the extracted image */
+static void image_read(void *arg, void *buf, cfs_offset_t size,
+                       cfs_offset_t offset){
+
+    memcpy(buf, (const uint8_t *)arg + offset, size);
+
+}
+
+
+/* The extraction only reads, so the image is never changed. */
+static void image_write(void *arg, const void *buf, cfs_offset_t size,
+                        cfs_offset_t offset){
+}
+
+
+static void image_erase(void *arg, unsigned sector){
+}
+
+
+/* Create the directories of a path below the top directory, which
+   exists and may be an absolute path */
+static int make_parents(char *path, const char *directory){
+
+    char *slash;
+
+    for(slash = strchr(path + strlen(directory) + 1, '/'); slash != NULL;
+        slash = strchr(slash + 1, '/')){
+        *slash = '\0';
+        if(mkdir(path, 0755) != 0 && errno != EEXIST){
+            perror(path);
+            *slash = '/';
+            return -1;
+        }
+        *slash = '/';
+    }
+
+    return 0;
+
+}
+
+
+/* Copy a file of the volume to the host */
+static int extract_file(struct cfs_coffee_volume *vol, const char *name,
+                        const char *path){
+
+#if COFFEE_RING_FILES
+    struct cfs_coffee_ring_cursor cursor;
+#endif
+    FILE *out;
+    int fd, size, result;
+
+    fd = cfs_coffee_vol_open(vol, name, CFS_READ);
+    if(fd < 0){
+        fprintf(stderr, "%s: cannot open the file\n", name);
+        return -1;
+    }
+    out = fopen(path, "wb");
+    if(out == NULL){
+        perror(path);
+        cfs_coffee_vol_close(vol, fd);
+        return -1;
+    }
+
+    result = 0;
+#if COFFEE_RING_FILES
+    if(cfs_coffee_vol_ring_rewind(vol, fd, &cursor) == 0){
+        while((size = cfs_coffee_vol_ring_next(vol, fd, &cursor, copy_buf,
+                                               COPY_SIZE)) >= 0){
+            if(fwrite(copy_buf, 1, size, out) != (size_t)size){
+                result = -1;
+                break;
+            }
+        }
+    } else
+#endif
+    {
+        while((size = cfs_coffee_vol_read(vol, fd, copy_buf, COPY_SIZE)) > 0){
+            if(fwrite(copy_buf, 1, size, out) != (size_t)size){
+                result = -1;
+                break;
+            }
+        }
+        /* A block of a compressed file can fail to decompress. */
+        if(size < 0){
+            fprintf(stderr, "%s: cannot read the file\n", name);
+            fclose(out);
+            cfs_coffee_vol_close(vol, fd);
+            return -1;
+        }
+    }
+    if(fclose(out) != 0 || result != 0){
+        fprintf(stderr, "%s: cannot write the file\n", path);
+        result = -1;
+    }
+    cfs_coffee_vol_close(vol, fd);
+
+    return result;
+
+}
+
+
+/* Copy the files of a volume below a directory */
+static int extract_files(struct cfs_coffee_volume *vol,
+                         const char *directory, const char *name){
+
+    struct cfs_dirent dirent;
+    struct cfs_dir dir;
+    char path[4096];
+    int count, result;
+
+    if(mkdir(directory, 0755) != 0 && errno != EEXIST){
+        perror(directory);
+        return 2;
+    }
+    if(cfs_coffee_vol_opendir(vol, &dir, "/") != 0){
+        fprintf(stderr, "%s: cannot list the files\n", name);
+        return 2;
+    }
+
+    count = 0;
+    result = 0;
+    while(cfs_coffee_vol_readdir(vol, &dir, &dirent) == 0){
+        /* Names are only written below the directory. */
+        if(dirent.name[0] == '/' || strstr(dirent.name, "..") != NULL){
+            fprintf(stderr, "%s: skipped the file\n", dirent.name);
+            result = 1;
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", directory, dirent.name);
+        if(make_parents(path, directory) != 0 ||
+           extract_file(vol, dirent.name, path) != 0){
+            result = 1;
+            continue;
+        }
+        count++;
+    }
+    cfs_closedir(&dir);
+
+    printf("%d files\n", count);
+
+    return result;
+
+}
+
+
+static int extract(const char *directory, const char *name){
+
+    struct cfs_coffee_geometry geometry;
+    struct cfs_coffee_flash flash;
+    struct cfs_coffee_volume *vol;
+    struct stat st;
+    int fd, result;
+    void *map;
+
+    fd = open(name, O_RDONLY);
+    if(fd < 0 || fstat(fd, &st) != 0 ||
+       st.st_size < (off_t)(COFFEE_START + COFFEE_SIZE)){
+        fprintf(stderr, "%s: cannot read a volume of %lu bytes\n", name,
+                (unsigned long)COFFEE_SIZE);
+        return 2;
+    }
+    map = mmap(NULL, COFFEE_START + COFFEE_SIZE, PROT_READ, MAP_PRIVATE,
+               fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        fprintf(stderr, "%s: cannot map the image\n", name);
+        return 2;
+    }
+
+    memset(&flash, 0, sizeof(flash));
+    flash.read = image_read;
+    flash.write = image_write;
+    flash.erase = image_erase;
+    flash.arg = map;
+    memset(&geometry, 0, sizeof(geometry));
+    geometry.start = COFFEE_START;
+    geometry.size = COFFEE_SIZE;
+    vol = cfs_coffee_attach(&flash, &geometry);
+    if(vol == NULL){
+        fprintf(stderr, "%s: cannot attach the image (needs "
+                "COFFEE_VOLUMES > 1)\n", name);
+        munmap(map, COFFEE_START + COFFEE_SIZE);
+        return 2;
+    }
+
+    result = extract_files(vol, directory, name);
+    cfs_coffee_detach(vol);
+    munmap(map, COFFEE_START + COFFEE_SIZE);
+
+    return result;
+
+}
+
+
+int main(int argc, char *argv[]){
+
+    const char *name = "coffeedisk.img";
+
+    if(argc == 3 || argc == 4){
+        if(argc == 4){
+            name = argv[3];
+        }
+        if(strcmp(argv[1], "build") == 0){
+            return build(argv[2], name);
+        }
+        if(strcmp(argv[1], "extract") == 0){
+            return extract(argv[2], name);
+        }
+    }
+
+    fprintf(stderr, "Usage: %s build <directory> [image]\n"
+            "       %s extract <directory> [image]\n", argv[0], argv[0]);
+
+    return 2;
+
+}
@@ -1,10 +1,50 @@
 #include <stdio.h>
 #include "coffee_fs/test-coffee.h"
+#include "coffee_fs/cfs-coffee.h"
+#include "coffee_fs/cfs-coffee-arch.h"
+#include "coffee_fs/coffee_flash.h"
+
+
+/* Print the distribution of the sector erase counts */
+static void print_wear_report(void){
+
+    struct cfs_coffee_wear_stats stats;
+    unsigned long range, low, high;
+    int i;
+
+    cfs_coffee_get_wear_stats(&stats);
+    if(stats.total_erases == 0){
+        return;
+    }
+
+    printf("Wear: %lu erases, %.1f per sector, min %lu, max %lu\n",
+           stats.total_erases,
+           (double)stats.total_erases / (COFFEE_SIZE / COFFEE_SECTOR_SIZE),
+           stats.min_erases, stats.max_erases);
+
+    range = stats.max_erases - stats.min_erases + 1;
+    for(i = 0; i < CFS_COFFEE_WEAR_BUCKETS; i++){
+        low = stats.min_erases +
+              (i * range + CFS_COFFEE_WEAR_BUCKETS - 1) / CFS_COFFEE_WEAR_BUCKETS;
+        high = stats.min_erases +
+               ((i + 1) * range + CFS_COFFEE_WEAR_BUCKETS - 1) /
+               CFS_COFFEE_WEAR_BUCKETS - 1;
+        if(low <= high){
+            printf("Wear: %lu-%lu erases: %u sectors\n",
+                   low, high, stats.histogram[i]);
+        }
+    }
+
+}
+
 
 int main(void){
 
     test_coffee();
 
+    print_wear_report();
+
+    cflash_flush();
+
     return 0;
 }
-
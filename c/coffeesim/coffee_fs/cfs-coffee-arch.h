@@ -53,12 +53,81 @@
 #define COFFEE_LOG_TABLE_LIMIT	256UL
 #define COFFEE_DYN_SIZE			4096UL
 #define COFFEE_LOG_SIZE			1024UL
+#ifndef COFFEE_LOG_BATCH_SIZE
+#define COFFEE_LOG_BATCH_SIZE		8192UL
+#endif
+#ifndef COFFEE_MERGE_BUFFER_SIZE
+#define COFFEE_MERGE_BUFFER_SIZE	COFFEE_SECTOR_SIZE
+#endif
+#ifndef COFFEE_LOG_MAP_SIZE
+#define COFFEE_LOG_MAP_SIZE		256UL
+#endif
+#ifndef COFFEE_HEADER_CACHE_SIZE
+#define COFFEE_HEADER_CACHE_SIZE	(256UL * 1024UL)
+#endif
+#ifndef COFFEE_NAME_INDEX_SIZE
+#define COFFEE_NAME_INDEX_SIZE		8191UL
+#endif
+#ifndef COFFEE_SECTOR_TABLE
+#define COFFEE_SECTOR_TABLE		1
+#endif
+#ifndef COFFEE_EXTENT_CHAINS
+#define COFFEE_EXTENT_CHAINS		1
+#endif
+#ifndef COFFEE_EOF_RECORDS
+#define COFFEE_EOF_RECORDS		4
+#endif
+#ifndef COFFEE_FREE_EXTENT_INDEX
+#define COFFEE_FREE_EXTENT_INDEX	COFFEE_SECTOR_TABLE
+#endif
+#ifndef COFFEE_WEAR_COUNTS
+#define COFFEE_WEAR_COUNTS		1
+#endif
+#ifndef COFFEE_WEAR_AWARE
+#define COFFEE_WEAR_AWARE		(COFFEE_WEAR_COUNTS && COFFEE_FREE_EXTENT_INDEX)
+#endif
+#ifndef COFFEE_VOLUMES
+#define COFFEE_VOLUMES			5
+#endif
+#ifndef COFFEE_IO_STATS
+#define COFFEE_IO_STATS			1
+#endif
+#ifndef COFFEE_POOL_LOW_WATER
+#define COFFEE_POOL_LOW_WATER		8
+#endif
+#ifndef COFFEE_POOL_HIGH_WATER
+#define COFFEE_POOL_HIGH_WATER		32
+#endif
+#ifndef COFFEE_THREADS
+#define COFFEE_THREADS			1
+#endif
+
+#ifndef COFFEE_RING_FILES
+#define COFFEE_RING_FILES		2
+#endif
+
+#ifndef COFFEE_COMPRESSED_FILES
+#define COFFEE_COMPRESSED_FILES		2
+#endif
+#ifndef COFFEE_COMPRESS_BLOCK_SIZE
+#define COFFEE_COMPRESS_BLOCK_SIZE	1024
+#endif
+
+#ifndef COFFEE_RUNTIME_GEOMETRY
+#define COFFEE_RUNTIME_GEOMETRY		0
+#endif
+/* Layouts that images may have with COFFEE_RUNTIME_GEOMETRY. */
+#define COFFEE_MAX_PAGE_SIZE		4096UL
+#define COFFEE_MIN_SECTOR_SIZE		4096UL
 
 #define COFFEE_MICRO_LOGS		1
 
 #define COFFEE_WATCHDOG_START()		watchdog_start()
 #define COFFEE_WATCHDOG_STOP()		watchdog_stop()
 
+/* Times the mount scan in the time of the flash timing model, if any. */
+#define COFFEE_CLOCK_US()		cflash_clock_us()
+
 /* Flash operations. */
 #define COFFEE_WRITE(buf, size, offset)				\
 		cflash_write((uint8_t*)(buf), (size), (offset))
@@ -69,6 +138,24 @@
 #define COFFEE_ERASE(sector)					\
   		cflash_erase((sector))
 
+#define COFFEE_ERASE_COUNT(sector)				\
+  		cflash_erase_count((sector))
+
+/* Locking, when the file system is shared by threads. */
+#if COFFEE_THREADS
+#include <pthread.h>
+
+#define COFFEE_LOCK_TYPE		pthread_rwlock_t
+#define COFFEE_LOCK_INITIALIZER		PTHREAD_RWLOCK_INITIALIZER
+#define COFFEE_LOCK_INIT(lock)		pthread_rwlock_init((lock), NULL)
+#define COFFEE_LOCK_SHARED(lock)	pthread_rwlock_rdlock(lock)
+#define COFFEE_UNLOCK_SHARED(lock)	pthread_rwlock_unlock(lock)
+#define COFFEE_LOCK_EXCLUSIVE(lock)	pthread_rwlock_wrlock(lock)
+#define COFFEE_UNLOCK_EXCLUSIVE(lock)	pthread_rwlock_unlock(lock)
+#define COFFEE_ATOMIC_ADD(var, amount)				\
+		__atomic_fetch_add(&(var), (amount), __ATOMIC_RELAXED)
+#endif
+
 /* Coffee types. */
 //typedef int16_t coffee_page_t;
 typedef int32_t coffee_page_t;
@@ -0,0 +1,158 @@
+/**
+ * \file
+ *	The layout of Coffee in the storage. It is shared by the file
+ *	system and by the host tools that read images, which must be
+ *	built with the same configuration.
+ */
+
+#ifndef CFS_COFFEE_FORMAT_H
+#define CFS_COFFEE_FORMAT_H
+
+#include <stdint.h>
+
+#include "cfs.h"
+#include "cfs-coffee-arch.h"
+
+/*
+ * Grow files that run out of space by linking a continuation extent
+ * from the header of their last extent, instead of copying them to an
+ * extent of twice the size. Appending then costs only the appended
+ * bytes. Continuation extents double the size of the file.
+ */
+#ifndef COFFEE_EXTENT_CHAINS
+#define COFFEE_EXTENT_CHAINS  0
+#endif
+
+/*
+ * Number of file end records in each file header. The records form an
+ * append-only journal of file sizes that is extended when a writer
+ * closes the file, so the size can be found without scanning the file
+ * contents. A writer sets the dirty bit of the last record before it
+ * writes, so that the file end of a file that was not closed is found by
+ * a scan. A writer that closes the file with a full journal compacts it
+ * by merging the file into a new extent, whose header keeps only the
+ * last file end. A reserved file records its empty end, so a single
+ * record merges the file after every write session. Setting this to zero
+ * changes the header format back and always finds the file end by a
+ * scan.
+ */
+#ifndef COFFEE_EOF_RECORDS
+#define COFFEE_EOF_RECORDS  0
+#endif
+/* A used file end record holds the file end with these bits, which are
+   only ever added to a programmed record. */
+#define EOF_RECORD_END    ((cfs_offset_t)1 << 30) /* Used record. */
+#define EOF_RECORD_DIRTY  ((cfs_offset_t)1 << 29) /* Written after the end. */
+#define EOF_RECORD(end)   (EOF_RECORD_END | (end))
+#define EOF_RECORD_OFFSET(record) ((record) & (EOF_RECORD_DIRTY - 1))
+
+/* File header flags. */
+#define HDR_FLAG_VALID    0x1 /* Completely written header. */
+#define HDR_FLAG_ALLOCATED  0x2 /* Allocated file. */
+#define HDR_FLAG_OBSOLETE 0x4 /* File marked for GC. */
+#define HDR_FLAG_MODIFIED 0x8 /* Modified file, log exists. */
+#define HDR_FLAG_LOG    0x10  /* Log file. */
+#define HDR_FLAG_ISOLATED 0x20  /* Isolated page. */
+#define HDR_FLAG_EXTENT   0x40  /* Continuation extent of a file. */
+#define HDR_FLAG_SUPERBLOCK 0x80  /* Geometry of the storage. */
+
+/* File header macros. */
+#define CHECK_FLAG(hdr, flag) ((hdr).flags & (flag))
+#define HDR_VALID(hdr)    CHECK_FLAG(hdr, HDR_FLAG_VALID)
+#define HDR_ALLOCATED(hdr)  CHECK_FLAG(hdr, HDR_FLAG_ALLOCATED)
+#define HDR_FREE(hdr)   !HDR_ALLOCATED(hdr)
+#define HDR_LOG(hdr)    CHECK_FLAG(hdr, HDR_FLAG_LOG)
+#define HDR_MODIFIED(hdr) CHECK_FLAG(hdr, HDR_FLAG_MODIFIED)
+#define HDR_ISOLATED(hdr) CHECK_FLAG(hdr, HDR_FLAG_ISOLATED)
+#define HDR_EXTENT(hdr)   CHECK_FLAG(hdr, HDR_FLAG_EXTENT)
+#define HDR_SUPERBLOCK(hdr) CHECK_FLAG(hdr, HDR_FLAG_SUPERBLOCK)
+/* Logs and continuation extents belong to a file without being one,
+   and the superblock is no file at all. */
+#define HDR_FILE_PART(hdr)  \
+  CHECK_FLAG(hdr, HDR_FLAG_LOG | HDR_FLAG_EXTENT | HDR_FLAG_SUPERBLOCK)
+#define HDR_OBSOLETE(hdr)   CHECK_FLAG(hdr, HDR_FLAG_OBSOLETE)
+#define HDR_ACTIVE(hdr)   (HDR_ALLOCATED(hdr) && \
+                           !HDR_OBSOLETE(hdr) && \
+                           !HDR_ISOLATED(hdr))
+
+/* File kinds, which are kept apart from the flags since all of the
+   flag bits are in use. */
+#define HDR_KIND_FILE 0
+#define HDR_KIND_RING 1 /* Ring file, see struct ring. */
+#define HDR_KIND_COMPRESSED 2 /* Compressed file, see struct compressed_block. */
+#define HDR_RING(hdr)     ((hdr).kind == HDR_KIND_RING)
+#define HDR_COMPRESSED(hdr) ((hdr).kind == HDR_KIND_COMPRESSED)
+
+/* The file header structure mimics the representation of file headers
+   in the physical storage medium. */
+struct file_header {
+  coffee_page_t log_page;
+  uint16_t log_records;
+  uint16_t log_record_size;
+  coffee_page_t max_pages;
+  uint8_t kind;           /* Formerly the unused EOF hint. */
+  uint8_t flags;
+  char name[COFFEE_NAME_LENGTH];
+#if COFFEE_EXTENT_CHAINS
+  /* Continuation extent plus one; zero if there is none. */
+  coffee_page_t next_extent;
+#endif
+#if COFFEE_EOF_RECORDS
+  /* See EOF_RECORD(); zero marks an unused record. */
+  cfs_offset_t eof_records[COFFEE_EOF_RECORDS];
+#endif
+};
+
+/* The data of the superblock, which follows its header in page 0 if
+   the storage was formatted with COFFEE_RUNTIME_GEOMETRY. */
+struct superblock {
+  uint32_t magic;
+  uint32_t page_size;
+  uint32_t sector_size;
+};
+
+#define SUPERBLOCK_MAGIC  0xc0ffee01UL
+
+/* The sequence number at the start of each sector of a ring file, and
+   the length at the start of each record. */
+#define RING_STAMP_SIZE   sizeof(uint32_t)
+#define RING_LENGTH_SIZE  sizeof(uint16_t)
+
+/*
+ * A micro log is an extent with HDR_FLAG_LOG that the log_page of a
+ * modified file points to. Its data starts with an index table of
+ * log_records 16-bit entries, followed by log_records records of
+ * log_record_size bytes. Entry i holds the region of the file that
+ * record i modifies plus one, or zero if the record is unused. The
+ * regions are log_record_size bytes of the file each. Zero in
+ * log_record_size of the file header selects records of one page, and
+ * zero in log_records selects COFFEE_LOG_SIZE / COFFEE_PAGE_SIZE
+ * records.
+ */
+
+/*
+ * The data of a compressed file starts with an index table of
+ * log_records entries, followed by the stored blocks in the order in
+ * which they were appended. Each block holds at most log_record_size
+ * bytes of the file. An entry is programmed after the data of its block,
+ * so a block whose entry is erased was never completed. A block whose
+ * stored size equals its raw size is stored as is; the others are
+ * compressed with LZSS. The compressed data is a sequence of groups of
+ * a control byte and eight items, whose bits from the least significant
+ * one on tell whether an item is a literal byte (0) or a match (1). A
+ * match of two bytes copies 3 to 18 bytes from 1 to 4096 bytes back:
+ * the low 8 bits of the distance minus one, then its high 4 bits above
+ * the length minus 3. The last group can be shorter.
+ */
+struct compressed_block {
+  uint32_t raw_end;       /* File offset after the block. */
+  uint32_t stored_start;  /* Offset of the stored block in the data. */
+  uint16_t stored_size;
+  uint16_t raw_size;      /* Zero if the entry is unused. */
+};
+
+#define LZSS_MIN_MATCH    3
+#define LZSS_MAX_MATCH    18
+#define LZSS_WINDOW_SIZE  4096
+
+#endif /* !CFS_COFFEE_FORMAT_H */
@@ -58,6 +58,7 @@
 #include "cfs.h"             /* MODIFICATION FOR AALTO-2 */
 #include "cfs-coffee-arch.h" /* MODIFICATION FOR AALTO-2 */
 #include "cfs-coffee.h"      /* MODIFICATION FOR AALTO-2 */
+#include "cfs-coffee-format.h"
 
 /* Micro logs enable modifications on storage types that do not support
    in-place updates. This applies primarily to flash memories. */
@@ -90,6 +91,244 @@
 #define COFFEE_EXTENDED_WEAR_LEVELLING  1
 #endif
 
+/*
+ * Memory budget in bytes for caching page headers in RAM. The cache is
+ * write-through, so it never holds data that has not reached the flash.
+ * Setting this to zero disables the cache.
+ */
+#ifndef COFFEE_HEADER_CACHE_SIZE
+#define COFFEE_HEADER_CACHE_SIZE  0
+#endif
+
+/*
+ * Number of slots in the in-RAM file name index, which maps file names
+ * to the pages of their headers. The index is built by scanning the
+ * storage on first use and kept current when files are reserved and
+ * removed. Setting this to zero disables the index.
+ */
+#ifndef COFFEE_NAME_INDEX_SIZE
+#define COFFEE_NAME_INDEX_SIZE  0
+#endif
+
+/*
+ * Keep a table of active, obsolete and free page counts for each sector
+ * in RAM. The table is updated as files are reserved, removed and
+ * erased, so the garbage collector can pick erasable sectors without
+ * reading the headers of the whole storage.
+ */
+#ifndef COFFEE_SECTOR_TABLE
+#define COFFEE_SECTOR_TABLE  0
+#endif
+
+/* Check the sector table against a full header scan before each
+   garbage collection, and rebuild it if they differ. */
+#ifndef COFFEE_SECTOR_TABLE_VERIFY
+#define COFFEE_SECTOR_TABLE_VERIFY  0
+#endif
+
+/*
+ * Answer free space requests from an in-RAM index of free page runs
+ * instead of walking the headers from *next_free. The index is a
+ * segment tree over the sector table, so it requires COFFEE_SECTOR_TABLE.
+ */
+#ifndef COFFEE_FREE_EXTENT_INDEX
+#define COFFEE_FREE_EXTENT_INDEX  0
+#endif
+
+#if COFFEE_FREE_EXTENT_INDEX && !COFFEE_SECTOR_TABLE
+#error "COFFEE_FREE_EXTENT_INDEX requires COFFEE_SECTOR_TABLE."
+#endif
+
+/*
+ * Keep the erase count of each sector in RAM. The counts are loaded
+ * with COFFEE_ERASE_COUNT(sector), which the platform defines to read
+ * the counts that its flash driver keeps across restarts, and are
+ * incremented as sectors are erased. Other volumes than the default
+ * one load the counts with the erase_count operation of their flash.
+ */
+#ifndef COFFEE_WEAR_COUNTS
+#define COFFEE_WEAR_COUNTS  0
+#endif
+
+#ifndef COFFEE_ERASE_COUNT
+#define COFFEE_ERASE_COUNT(sector)  0
+#endif
+
+/*
+ * Open the least erased run of free sectors when a reservation does not
+ * fit into the sector that is being filled, rather than the run with
+ * the lowest address. Requires COFFEE_WEAR_COUNTS and
+ * COFFEE_FREE_EXTENT_INDEX.
+ */
+#ifndef COFFEE_WEAR_AWARE
+#define COFFEE_WEAR_AWARE  0
+#endif
+
+#if COFFEE_WEAR_AWARE && !(COFFEE_WEAR_COUNTS && COFFEE_FREE_EXTENT_INDEX)
+#error "COFFEE_WEAR_AWARE requires COFFEE_WEAR_COUNTS and COFFEE_FREE_EXTENT_INDEX."
+#endif
+
+/*
+ * Number of log index entries that each open file can keep in RAM. The
+ * copy is loaded on the first access to a modified file and kept
+ * current by log writes, so reads of logged regions do not scan the
+ * index table in the flash. Logs with more records than this are
+ * searched in the flash. Setting this to zero disables the copy.
+ */
+#ifndef COFFEE_LOG_MAP_SIZE
+#define COFFEE_LOG_MAP_SIZE  0
+#endif
+
+/*
+ * Size of the buffer in which the records of one micro log write are
+ * staged. A write that modifies several regions of a file stores them
+ * as consecutive records with one index write and one data write.
+ */
+#ifndef COFFEE_LOG_BATCH_SIZE
+#define COFFEE_LOG_BATCH_SIZE  COFFEE_PAGE_SIZE
+#endif
+
+#if COFFEE_LOG_BATCH_SIZE < COFFEE_MAX_PAGE_SIZE
+#error "COFFEE_LOG_BATCH_SIZE must hold a log record of COFFEE_MAX_PAGE_SIZE."
+#endif
+
+/*
+ * Size of the buffer through which a merge copies a file and its micro
+ * log to a new extent. The new extent is programmed in pieces that end
+ * at multiples of this size in the storage, so a buffer of the sector
+ * size programs whole sectors.
+ */
+#ifndef COFFEE_MERGE_BUFFER_SIZE
+#define COFFEE_MERGE_BUFFER_SIZE  COFFEE_MAX_PAGE_SIZE
+#endif
+
+/*
+ * Default water marks of the pool of erased sectors, which
+ * cfs_coffee_refill_pool() keeps filled from a background task. Once
+ * the pool has fewer than COFFEE_POOL_LOW_WATER erased sectors, the
+ * refill erases obsolete sectors until the pool holds
+ * COFFEE_POOL_HIGH_WATER sectors. A low water mark of zero disables
+ * the refill. The pool requires COFFEE_SECTOR_TABLE.
+ */
+#ifndef COFFEE_POOL_LOW_WATER
+#define COFFEE_POOL_LOW_WATER  0
+#endif
+
+#ifndef COFFEE_POOL_HIGH_WATER
+#define COFFEE_POOL_HIGH_WATER COFFEE_POOL_LOW_WATER
+#endif
+
+#if COFFEE_POOL_HIGH_WATER < COFFEE_POOL_LOW_WATER
+#error COFFEE_POOL_HIGH_WATER must not be below COFFEE_POOL_LOW_WATER.
+#endif
+
+/*
+ * Count the flash reads, programs and erases, and attribute them to the
+ * public call that caused them, or to the garbage collector or a log
+ * merge running on its behalf. See cfs_coffee_get_stats().
+ */
+#ifndef COFFEE_IO_STATS
+#define COFFEE_IO_STATS  0
+#endif
+
+/*
+ * Number of volumes that can be attached at the same time, including
+ * the default volume on which the cfs_* calls operate. Each volume has
+ * its own copy of the file system state in RAM.
+ */
+#ifndef COFFEE_VOLUMES
+#define COFFEE_VOLUMES  1
+#endif
+
+/*
+ * Allow the public calls to be made from several threads. Each volume
+ * has a readers-writer lock: reads and seeks within files that have no
+ * micro log hold it shared, so they run side by side, and all other
+ * calls, merges and garbage collections hold it exclusively. The
+ * platform supplies the lock in COFFEE_LOCK_TYPE, COFFEE_LOCK_INITIALIZER,
+ * COFFEE_LOCK_INIT(), COFFEE_LOCK_SHARED(), COFFEE_UNLOCK_SHARED(),
+ * COFFEE_LOCK_EXCLUSIVE() and COFFEE_UNLOCK_EXCLUSIVE(), and an atomic
+ * counter increment in COFFEE_ATOMIC_ADD(var, amount).
+ */
+#ifndef COFFEE_THREADS
+#define COFFEE_THREADS  0
+#endif
+
+/*
+ * Take the page and sector sizes of each volume from a superblock that
+ * cfs_coffee_format() writes in the first page, so that one build can
+ * use storage of several layouts. COFFEE_PAGE_SIZE and
+ * COFFEE_SECTOR_SIZE remain the sizes of the default volume and of
+ * storage without a superblock. The buffers are sized for pages of up
+ * to COFFEE_MAX_PAGE_SIZE bytes, and the sector tables for sectors of
+ * COFFEE_MIN_SECTOR_SIZE bytes or more. The superblock page keeps the
+ * first sector from being erased.
+ */
+#ifndef COFFEE_RUNTIME_GEOMETRY
+#define COFFEE_RUNTIME_GEOMETRY  0
+#endif
+
+#if COFFEE_RUNTIME_GEOMETRY
+#ifndef COFFEE_MAX_PAGE_SIZE
+#define COFFEE_MAX_PAGE_SIZE  COFFEE_PAGE_SIZE
+#endif
+#ifndef COFFEE_MIN_SECTOR_SIZE
+#define COFFEE_MIN_SECTOR_SIZE  COFFEE_SECTOR_SIZE
+#endif
+#else
+#undef COFFEE_MAX_PAGE_SIZE
+#define COFFEE_MAX_PAGE_SIZE  COFFEE_PAGE_SIZE
+#undef COFFEE_MIN_SECTOR_SIZE
+#define COFFEE_MIN_SECTOR_SIZE  COFFEE_SECTOR_SIZE
+#endif /* COFFEE_RUNTIME_GEOMETRY */
+
+#if COFFEE_MAX_PAGE_SIZE < COFFEE_PAGE_SIZE || \
+    COFFEE_MIN_SECTOR_SIZE > COFFEE_SECTOR_SIZE
+#error The default geometry must be within the runtime geometry limits.
+#endif
+
+/*
+ * Number of ring files that can be open at the same time on each
+ * volume. A ring file has a fixed reservation of whole sectors to which
+ * records are appended. Once it is full, each new sector takes the place
+ * of the oldest one, whose records are erased; the file is never merged
+ * or copied. See cfs_coffee_ring_create(). Each open ring keeps a page
+ * of appended data in RAM until the page is full.
+ */
+#ifndef COFFEE_RING_FILES
+#define COFFEE_RING_FILES  0
+#endif
+
+/*
+ * Number of compressed files that can be open at the same time on each
+ * volume. Data that is appended to a compressed file is compressed in
+ * blocks of up to COFFEE_COMPRESS_BLOCK_SIZE bytes, and an index table
+ * at the start of the file finds the block that holds an offset. See
+ * cfs_coffee_configure_compression(). Each open compressed file keeps
+ * the block that is being appended to and the last block that was read
+ * in RAM. The compressor of each volume has a hash table of 2 KiB and
+ * three bytes of tables and buffers for each byte of a block.
+ */
+#ifndef COFFEE_COMPRESSED_FILES
+#define COFFEE_COMPRESSED_FILES  0
+#endif
+
+#ifndef COFFEE_COMPRESS_BLOCK_SIZE
+#define COFFEE_COMPRESS_BLOCK_SIZE  1024
+#endif
+
+#if COFFEE_COMPRESS_BLOCK_SIZE > LZSS_WINDOW_SIZE
+#error COFFEE_COMPRESS_BLOCK_SIZE must not exceed the window of the codec.
+#endif
+
+/*
+ * Clock in microseconds, with which cfs_coffee_mount() reports how long
+ * its scan took. Without a clock, the duration is reported as zero.
+ */
+#ifndef COFFEE_CLOCK_US
+#define COFFEE_CLOCK_US()  0
+#endif
+
 #if COFFEE_START & (COFFEE_SECTOR_SIZE - 1)
 #error COFFEE_START must point to the first byte in a sector.
 #endif
@@ -100,6 +339,10 @@
 #define COFFEE_FD_APPEND  0x4
 
 #define COFFEE_FILE_MODIFIED  0x1
+#define COFFEE_FILE_LOG_MAP   0x2
+#define COFFEE_FILE_RING      0x4
+#define COFFEE_FILE_COMPRESSED  0x8
+#define COFFEE_FILE_EOF_DIRTY 0x10
 
 #define INVALID_PAGE    ((coffee_page_t)-1)
 #define UNKNOWN_OFFSET    ((cfs_offset_t)-1)
@@ -123,42 +366,42 @@
 
 /* File object macros. */
 #define FILE_MODIFIED(file) ((file)->flags & COFFEE_FILE_MODIFIED)
+#define FILE_LOG_MAP(file)  ((file)->flags & COFFEE_FILE_LOG_MAP)
+#define FILE_RING(file)     ((file)->flags & COFFEE_FILE_RING)
+#define FILE_COMPRESSED(file) ((file)->flags & COFFEE_FILE_COMPRESSED)
 #define FILE_FREE(file)   ((file)->max_pages == 0)
 #define FILE_UNREFERENCED(file) ((file)->references == 0)
 
-/* File header flags. */
-#define HDR_FLAG_VALID    0x1 /* Completely written header. */
-#define HDR_FLAG_ALLOCATED  0x2 /* Allocated file. */
-#define HDR_FLAG_OBSOLETE 0x4 /* File marked for GC. */
-#define HDR_FLAG_MODIFIED 0x8 /* Modified file, log exists. */
-#define HDR_FLAG_LOG    0x10  /* Log file. */
-#define HDR_FLAG_ISOLATED 0x20  /* Isolated page. */
-
-/* File header macros. */
-#define CHECK_FLAG(hdr, flag) ((hdr).flags & (flag))
-#define HDR_VALID(hdr)    CHECK_FLAG(hdr, HDR_FLAG_VALID)
-#define HDR_ALLOCATED(hdr)  CHECK_FLAG(hdr, HDR_FLAG_ALLOCATED)
-#define HDR_FREE(hdr)   !HDR_ALLOCATED(hdr)
-#define HDR_LOG(hdr)    CHECK_FLAG(hdr, HDR_FLAG_LOG)
-#define HDR_MODIFIED(hdr) CHECK_FLAG(hdr, HDR_FLAG_MODIFIED)
-#define HDR_ISOLATED(hdr) CHECK_FLAG(hdr, HDR_FLAG_ISOLATED)
-#define HDR_OBSOLETE(hdr)   CHECK_FLAG(hdr, HDR_FLAG_OBSOLETE)
-#define HDR_ACTIVE(hdr)   (HDR_ALLOCATED(hdr) && \
-                           !HDR_OBSOLETE(hdr) && \
-                           !HDR_ISOLATED(hdr))
-
-/* Shortcuts derived from the hardware-dependent configuration of Coffee. */
-#define COFFEE_SECTOR_COUNT (unsigned)(COFFEE_SIZE / COFFEE_SECTOR_SIZE)
+/* Shortcuts derived from the hardware-dependent configuration of Coffee.
+   The sector tables have room for the smallest sectors. */
+#define COFFEE_SECTOR_COUNT (unsigned)(COFFEE_SIZE / COFFEE_MIN_SECTOR_SIZE)
 #define COFFEE_PAGE_COUNT \
   ((coffee_page_t)(COFFEE_SIZE / COFFEE_PAGE_SIZE))
 #define COFFEE_PAGES_PER_SECTOR \
   ((coffee_page_t)(COFFEE_SECTOR_SIZE / COFFEE_PAGE_SIZE))
 
+/* The geometry of the volume that is operated on. */
+#if COFFEE_RUNTIME_GEOMETRY
+#define VOL_PAGE_SIZE        (vol->page_size)
+#define VOL_SECTOR_SIZE      (vol->sector_size)
+#define VOL_PAGES_PER_SECTOR (vol->pages_per_sector)
+#define VOL_LOG_SIZE \
+  (COFFEE_LOG_SIZE / COFFEE_PAGE_SIZE * vol->page_size)
+#else
+#define VOL_PAGE_SIZE        COFFEE_PAGE_SIZE
+#define VOL_SECTOR_SIZE      COFFEE_SECTOR_SIZE
+#define VOL_PAGES_PER_SECTOR COFFEE_PAGES_PER_SECTOR
+#define VOL_LOG_SIZE         COFFEE_LOG_SIZE
+#endif
+
 /* This structure is used for garbage collection statistics. */
 struct sector_status {
   coffee_page_t active;
   coffee_page_t obsolete;
   coffee_page_t free;
+  /* Pages at the start of the sector that belong to an extent whose
+     header is in a previous sector. */
+  coffee_page_t carried;
 };
 
 /* The structure of cached file objects. */
@@ -169,6 +412,16 @@ struct file {
   int16_t record_count;
   uint8_t references;
   uint8_t flags;
+#if COFFEE_EXTENT_CHAINS
+  /* The last extent of the file and the file offset of its data. */
+  coffee_page_t last_page;
+  coffee_page_t last_pages;
+  cfs_offset_t last_offset;
+#endif
+#if COFFEE_MICRO_LOGS && COFFEE_LOG_MAP_SIZE
+  /* Copy of the log index table, valid if COFFEE_FILE_LOG_MAP is set. */
+  uint16_t log_map[COFFEE_LOG_MAP_SIZE];
+#endif
 };
 
 /* The file descriptor structure. */
@@ -181,24 +434,65 @@ struct file_desc {
 #endif
 };
 
-/* The file header structure mimics the representation of file headers
-   in the physical storage medium. */
-struct file_header {
-  coffee_page_t log_page;
-  uint16_t log_records;
-  uint16_t log_record_size;
-  coffee_page_t max_pages;
-  uint8_t deprecated_eof_hint;
-  uint8_t flags;
-  char name[COFFEE_NAME_LENGTH];
+#if COFFEE_RING_FILES
+/*
+ * An open ring file. The data sectors of a ring are the whole sectors
+ * of its extent after the one that holds its header, which is never
+ * erased. Each data sector starts with the sequence number with which
+ * the ring moved into it, followed by records of a 16-bit length and
+ * the data. A zero length, i.e. erased storage, ends the records of a
+ * sector. The sequence numbers are the persistent tail and head of the
+ * ring: the oldest sector has the lowest, and the head sector, to which
+ * records are appended, the highest.
+ */
+struct ring {
+  coffee_page_t page;     /* Header page of the file. */
+  uint16_t first;         /* First data sector. */
+  uint16_t sectors;       /* Number of data sectors. */
+  uint16_t head;          /* Data sector that records are appended to. */
+  uint32_t sequence;      /* Sequence number of the head; 0 if empty. */
+  uint32_t tail;          /* Sequence number of the oldest sector. */
+  cfs_offset_t end;       /* Offset of the next record in the head. */
+  cfs_offset_t flushed;   /* Bytes of the head that are in the flash. */
+  uint8_t references;     /* Zero if the slot is free. */
+  /* The appended bytes of the page that holds the end of the head. */
+  char buf[COFFEE_MAX_PAGE_SIZE];
+};
+#endif /* COFFEE_RING_FILES */
+
+#if COFFEE_COMPRESSED_FILES
+/* An open compressed file. */
+struct compressed {
+  coffee_page_t page;     /* Header page of the file. */
+  uint16_t blocks;        /* Entries in the index table. */
+  uint16_t used;          /* Entries of stored blocks. */
+  uint16_t block_size;
+  uint16_t pending;       /* Bytes in buf that are not stored yet. */
+  cfs_offset_t raw_end;   /* File offset after the stored blocks. */
+  cfs_offset_t stored_end; /* Offset after the stored data. */
+  int32_t cached;         /* Entry of the block in block; -1 if none. */
+  struct compressed_block entry; /* The entry of the cached block. */
+  uint8_t references;     /* Zero if the slot is free. */
+  unsigned char buf[COFFEE_COMPRESS_BLOCK_SIZE];
+  unsigned char block[COFFEE_COMPRESS_BLOCK_SIZE];
 };
 
+#define COMPRESS_HASH_BITS  10
+#define COMPRESS_HASH(p) \
+  ((((unsigned)(p)[0] << 10) ^ ((unsigned)(p)[1] << 5) ^ (p)[2]) & \
+   ((1 << COMPRESS_HASH_BITS) - 1))
+/* Positions of the hash chain that the compressor compares at most. */
+#define COMPRESS_CHAIN_DEPTH  8
+#endif /* COFFEE_COMPRESSED_FILES */
+
 /* This is needed because of a buggy compiler. */
 struct log_param {
   cfs_offset_t offset;
   const char *buf;
   uint16_t size;
 };
+/* The largest request that fits in a log parameter. */
+#define LOG_PARAM_SIZE(size) ((size) < 0xffff ? (size) : 0xffff)
 
 /*
  * The protected memory consists of structures that should not be
@@ -206,207 +500,511 @@ struct log_param {
  * the checkpointing implementation. These structures need not be
  * protected if checkpointing is not used.
  */
-static struct protected_mem_t {
+struct protected_mem_t {
   struct file coffee_files[COFFEE_MAX_OPEN_FILES];
   struct file_desc coffee_fd_set[COFFEE_FD_SET_SIZE];
   coffee_page_t next_free;
   char gc_wait;
-} protected_mem;
-static struct file *const coffee_files = protected_mem.coffee_files;
-static struct file_desc *const coffee_fd_set = protected_mem.coffee_fd_set;
-static coffee_page_t *const next_free = &protected_mem.next_free;
-static char *const gc_wait = &protected_mem.gc_wait;
+};
+
+#if COFFEE_HEADER_CACHE_SIZE
+/* A set-associative cache of page headers. The tag is the page number
+   plus one, so that zeroed memory denotes an empty slot. */
+struct header_cache_entry {
+  coffee_page_t tag;
+  struct file_header hdr;
+};
+
+#define HEADER_CACHE_WAYS 4
+
+struct header_cache_set {
+  struct header_cache_entry ways[HEADER_CACHE_WAYS];
+  uint8_t victim;
+};
+
+/* An odd number of sets keeps the sector-aligned headers visited by
+   the quick-skip walk from piling up in the same sets. */
+#define HEADER_CACHE_SETS \
+  (((COFFEE_HEADER_CACHE_SIZE / sizeof(struct header_cache_set)) - 1) | 1)
+
+struct header_cache {
+  struct header_cache_set sets[HEADER_CACHE_SETS];
+  struct cfs_coffee_cache_stats stats;
+};
+#endif /* COFFEE_HEADER_CACHE_SIZE */
+
+#if COFFEE_SECTOR_TABLE
+/* Page states in the sector table. */
+#define PAGE_ACTIVE   0
+#define PAGE_OBSOLETE 1
+#define PAGE_FREE     2
+
+struct sector_table {
+  struct sector_status sectors[COFFEE_SECTOR_COUNT];
+  uint16_t erased;        /* Sectors whose pages are all free. */
+  char built;
+};
+#endif /* COFFEE_SECTOR_TABLE */
+
+#if COFFEE_FREE_EXTENT_INDEX
+/*
+ * Free pages form runs that start with the free tail of a sector and
+ * continue through completely free sectors. Each node of the segment
+ * tree summarizes the runs in a range of sectors.
+ */
+struct free_run {
+  coffee_page_t best;   /* Longest run in the range. */
+  coffee_page_t suffix; /* Run that ends at the end of the range. */
+  uint16_t prefix;      /* Completely free sectors at the range start. */
+  uint16_t sectors;     /* Sectors in the range. */
+#if COFFEE_WEAR_AWARE
+  uint32_t coldest;     /* Fewest erasures of a completely free sector. */
+#endif
+};
+
+#define WEAR_NONE 0xffffffffUL
+#endif /* COFFEE_FREE_EXTENT_INDEX */
+
+#if COFFEE_NAME_INDEX_SIZE
+/* The name index is an open-addressing hash table. Each slot holds the
+   page number plus one, or zero for a never used slot. */
+#define NAME_INDEX_TOMBSTONE  ((coffee_page_t)-1)
+
+#define NAME_INDEX_UNBUILT  0
+#define NAME_INDEX_BUILT    1
+#define NAME_INDEX_OVERFLOW 2
+
+/* Rebuild the table before probe sequences grow too long. */
+#define NAME_INDEX_MAX_LOAD ((COFFEE_NAME_INDEX_SIZE * 3) / 4)
+
+struct name_index_entry {
+  coffee_page_t tag;
+  uint16_t hash;
+};
+
+struct name_index {
+  struct name_index_entry entries[COFFEE_NAME_INDEX_SIZE];
+  unsigned used;      /* Used slots, or files while overflowed. */
+  uint8_t state;
+};
+#endif /* COFFEE_NAME_INDEX_SIZE */
+
+/*
+ * A volume is a storage area with its own flash operations and its own
+ * copy of the file system state. The tables are sized for a volume of
+ * COFFEE_SIZE bytes, and smaller volumes use a part of them.
+ */
+struct cfs_coffee_volume {
+  struct cfs_coffee_flash flash;
+  cfs_offset_t start;     /* Byte offset of the storage area. */
+  unsigned sector_count;
+  coffee_page_t page_count;
+  struct protected_mem_t protected_mem;
+#if COFFEE_MICRO_LOGS
+  /* The records of one log write are staged here. */
+  struct {
+    uint16_t indices[COFFEE_LOG_TABLE_LIMIT];
+    char data[COFFEE_LOG_BATCH_SIZE];
+  } log_batch;
+#endif
+  struct {
+#if COFFEE_MICRO_LOGS
+    /* The newest log record of each logged region, ordered by region. */
+    uint16_t regions[COFFEE_LOG_TABLE_LIMIT];
+    uint16_t records[COFFEE_LOG_TABLE_LIMIT];
+#endif
+    char buf[COFFEE_MERGE_BUFFER_SIZE];
+  } merge;
+#if COFFEE_HEADER_CACHE_SIZE
+  struct header_cache header_cache;
+#endif
+#if COFFEE_SECTOR_TABLE
+  struct sector_table sector_table;
+#endif
+#if COFFEE_FREE_EXTENT_INDEX
+  struct free_run free_index[4 * COFFEE_SECTOR_COUNT];
+#endif
+#if COFFEE_WEAR_COUNTS
+  struct {
+    uint32_t erases[COFFEE_SECTOR_COUNT];
+    char loaded;
+  } wear;
+#endif
+#if COFFEE_NAME_INDEX_SIZE
+  struct name_index name_index;
+#endif
+#if COFFEE_RING_FILES
+  struct ring rings[COFFEE_RING_FILES];
+#endif
+#if COFFEE_COMPRESSED_FILES
+  struct compressed compressed[COFFEE_COMPRESSED_FILES];
+  struct {
+    /* The last position plus base of each hashed 3-byte sequence, and
+       the previous position with the same hash of each position. */
+    uint16_t head[1 << COMPRESS_HASH_BITS];
+    uint16_t prev[COFFEE_COMPRESS_BLOCK_SIZE];
+    unsigned base;
+    unsigned char buf[COFFEE_COMPRESS_BLOCK_SIZE];
+  } compress;
+#endif
+  struct {
+    struct cfs_coffee_pool_stats stats;
+    uint16_t low_water;
+    uint16_t high_water;
+    uint16_t idle_steps;  /* Sectors evaluated since the last erasure. */
+    char refilling;
+  } pool;
+#if COFFEE_IO_STATS
+  struct cfs_coffee_stats io_stats;
+  uint8_t io_op;
+#endif
+  /* The state of get_sector_status() between sectors. */
+  coffee_page_t skip_pages;
+  char last_pages_are_active;
+  /* The sector that cfs_coffee_gc_step() evaluates next. */
+  uint16_t gc_cursor;
+#if COFFEE_RUNTIME_GEOMETRY
+  unsigned long page_size;
+  unsigned long sector_size;
+  coffee_page_t pages_per_sector;
+#endif
+#if COFFEE_THREADS
+  COFFEE_LOCK_TYPE lock;
+  char exclusive;         /* Set while the lock is held exclusively. */
+#endif
+};
+
+/* The protected memory of the volume that is operated on. */
+#define coffee_files  (vol->protected_mem.coffee_files)
+#define coffee_fd_set (vol->protected_mem.coffee_fd_set)
+#define next_free     (&vol->protected_mem.next_free)
+#define gc_wait       (&vol->protected_mem.gc_wait)
+
+/* Flash operations of the volume, relative to its storage area. */
+#define VOLUME_READ(buf, size, offset) \
+  vol->flash.read(vol->flash.arg, (void *)(buf), (size), vol->start + (offset))
+#define VOLUME_WRITE(buf, size, offset) \
+  vol->flash.write(vol->flash.arg, (buf), (size), vol->start + (offset))
+#define VOLUME_ERASE(sector) \
+  vol->flash.erase(vol->flash.arg, vol->start / VOL_SECTOR_SIZE + (sector))
+#define VOLUME_ERASE_COUNT(sector)                                      \
+  (vol->flash.erase_count == NULL ? 0 :                                 \
+   vol->flash.erase_count(vol->flash.arg,                               \
+                          vol->start / VOL_SECTOR_SIZE + (sector)))
+
+#if COFFEE_THREADS
+#define LOCK_SHARED(vol)   COFFEE_LOCK_SHARED(&(vol)->lock)
+#define UNLOCK_SHARED(vol) COFFEE_UNLOCK_SHARED(&(vol)->lock)
+#define LOCK_EXCLUSIVE(vol) do {                      \
+    COFFEE_LOCK_EXCLUSIVE(&(vol)->lock);              \
+    (vol)->exclusive = 1;                             \
+  } while(0)
+/* Shared holders count their flash reads as reads. */
+#if COFFEE_IO_STATS
+#define UNLOCK_EXCLUSIVE(vol) do {                    \
+    (vol)->exclusive = 0;                             \
+    (vol)->io_op = CFS_COFFEE_OP_READ;                \
+    COFFEE_UNLOCK_EXCLUSIVE(&(vol)->lock);            \
+  } while(0)
+#else
+#define UNLOCK_EXCLUSIVE(vol) do {                    \
+    (vol)->exclusive = 0;                             \
+    COFFEE_UNLOCK_EXCLUSIVE(&(vol)->lock);            \
+  } while(0)
+#endif
+#define EXCLUSIVE(vol)     ((vol)->exclusive)
+/* Counters are also updated by the holders of a shared lock. */
+#define COUNT(var, amount) COFFEE_ATOMIC_ADD(var, amount)
+#else
+#define LOCK_SHARED(vol)
+#define UNLOCK_SHARED(vol)
+#define LOCK_EXCLUSIVE(vol)
+#define UNLOCK_EXCLUSIVE(vol)
+#define EXCLUSIVE(vol)     1
+#define COUNT(var, amount) ((var) += (amount))
+#endif /* COFFEE_THREADS */
+
+#if COFFEE_IO_STATS
+#define FLASH_READ(buf, size, offset) do {            \
+    COUNT(vol->io_stats.ops[vol->io_op].reads, 1);    \
+    COUNT(vol->io_stats.ops[vol->io_op].read_bytes, (size)); \
+    VOLUME_READ((buf), (size), (offset));             \
+  } while(0)
+#define FLASH_WRITE(buf, size, offset) do {           \
+    vol->io_stats.ops[vol->io_op].programs++;         \
+    vol->io_stats.ops[vol->io_op].program_bytes += (size); \
+    VOLUME_WRITE((buf), (size), (offset));            \
+  } while(0)
+#define FLASH_ERASE(sector) do {                      \
+    vol->io_stats.ops[vol->io_op].erases++;           \
+    VOLUME_ERASE(sector);                             \
+  } while(0)
+
+/* A public call made by the collector or a merge, e.g. the cfs_read()
+   calls of merge_log(), stays attributed to them. The holders of a
+   shared lock leave io_op alone, since it is CFS_COFFEE_OP_READ. */
+#define IO_CALL(op) do {                              \
+    if(!EXCLUSIVE(vol)) {                             \
+      COUNT(vol->io_stats.ops[op].calls, 1);          \
+    } else if(vol->io_op != CFS_COFFEE_OP_GC &&       \
+              vol->io_op != CFS_COFFEE_OP_MERGE) {    \
+      vol->io_op = (op);                              \
+      vol->io_stats.ops[op].calls++;                  \
+    }                                                 \
+  } while(0)
+#define IO_BYTES(field, bytes) COUNT(vol->io_stats.field, (bytes))
+#else
+#define FLASH_READ(buf, size, offset)  VOLUME_READ(buf, size, offset)
+#define FLASH_WRITE(buf, size, offset) VOLUME_WRITE(buf, size, offset)
+#define FLASH_ERASE(sector)            VOLUME_ERASE(sector)
+#define IO_CALL(op)
+#define IO_BYTES(field, bytes)
+#endif /* COFFEE_IO_STATS */
 
 /*---------------------------------------------------------------------------*/
+/* The default volume passes its offsets to the platform macros. */
 static void
-write_header(struct file_header *hdr, coffee_page_t page)
+default_read(void *arg, void *buf, cfs_offset_t size, cfs_offset_t offset)
 {
-  hdr->flags |= HDR_FLAG_VALID;
-  COFFEE_WRITE(hdr, sizeof(*hdr), page * COFFEE_PAGE_SIZE);
+  COFFEE_READ(buf, size, offset);
 }
 /*---------------------------------------------------------------------------*/
 static void
-read_header(struct file_header *hdr, coffee_page_t page)
+default_write(void *arg, const void *buf, cfs_offset_t size,
+              cfs_offset_t offset)
 {
-  COFFEE_READ(hdr, sizeof(*hdr), page * COFFEE_PAGE_SIZE);
-#if DEBUG
-  if(HDR_ACTIVE(*hdr) && !HDR_VALID(*hdr)) {
-    PRINTF("Invalid header at page %u!\n", (unsigned)page);
-  }
-#endif
+  COFFEE_WRITE(buf, size, offset);
 }
 /*---------------------------------------------------------------------------*/
-static cfs_offset_t
-absolute_offset(coffee_page_t page, cfs_offset_t offset)
+static void
+default_erase(void *arg, unsigned sector)
 {
-  return page * COFFEE_PAGE_SIZE + sizeof(struct file_header) + offset;
+  COFFEE_ERASE(sector);
 }
 /*---------------------------------------------------------------------------*/
-static coffee_page_t
-get_sector_status(uint16_t sector, struct sector_status *stats)
+static unsigned long
+default_erase_count(void *arg, unsigned sector)
 {
-  static coffee_page_t skip_pages;
-  static char last_pages_are_active;
-  struct file_header hdr;
-  coffee_page_t active, obsolete, free;
-  coffee_page_t sector_start, sector_end;
-  coffee_page_t page;
+  return COFFEE_ERASE_COUNT(sector);
+}
+/*---------------------------------------------------------------------------*/
+/* volumes[0] is the default volume, on which the cfs_* calls operate. */
+static struct cfs_coffee_volume volumes[COFFEE_VOLUMES] = {
+  {
+    .flash = { default_read, default_write, default_erase,
+               default_erase_count, NULL },
+    .start = 0,
+    .sector_count = COFFEE_SIZE / COFFEE_SECTOR_SIZE,
+    .page_count = COFFEE_PAGE_COUNT,
+#if COFFEE_RUNTIME_GEOMETRY
+    .page_size = COFFEE_PAGE_SIZE,
+    .sector_size = COFFEE_SECTOR_SIZE,
+    .pages_per_sector = COFFEE_PAGES_PER_SECTOR,
+#endif
+    .pool = { .low_water = COFFEE_POOL_LOW_WATER,
+              .high_water = COFFEE_POOL_HIGH_WATER },
+#if COFFEE_THREADS
+    .lock = COFFEE_LOCK_INITIALIZER,
+#endif
+#if COFFEE_IO_STATS
+    .io_op = CFS_COFFEE_OP_READ
+#endif
+  }
+};
 
-  memset(stats, 0, sizeof(*stats));
-  active = obsolete = free = 0;
+#if COFFEE_THREADS
+/* Serializes the attaching and detaching of volumes. */
+static COFFEE_LOCK_TYPE volumes_lock = COFFEE_LOCK_INITIALIZER;
+#endif
 
-  /*
-   * get_sector_status() is an iterative function using local static
-   * state. It therefore requires that the caller starts iterating from
-   * sector 0 in order to reset the internal state.
-   */
-  if(sector == 0) {
-    skip_pages = 0;
-    last_pages_are_active = 0;
-  }
+#if COFFEE_FREE_EXTENT_INDEX
+static void free_index_sector_changed(struct cfs_coffee_volume *vol,
+                                      uint16_t sector);
+#endif
+static int open_locked(struct cfs_coffee_volume *vol, const char *name,
+                       int flags);
+static void close_locked(struct cfs_coffee_volume *vol, int fd);
+static int read_locked(struct cfs_coffee_volume *vol, int fd, void *buf,
+                       unsigned size);
+static int verify_sector_table_locked(struct cfs_coffee_volume *vol);
+static coffee_page_t scan_headers(struct cfs_coffee_volume *vol,
+                                  struct cfs_coffee_mount_stats *stats);
+#if COFFEE_MICRO_LOGS
+static int find_next_record(struct cfs_coffee_volume *vol, struct file *file,
+                            coffee_page_t log_page, int log_records);
+#endif
+#if COFFEE_RING_FILES
+static struct ring *ring_find(struct cfs_coffee_volume *vol,
+                              coffee_page_t page);
+#endif
+#if COFFEE_COMPRESSED_FILES
+static struct compressed *compressed_find(struct cfs_coffee_volume *vol,
+                                          coffee_page_t page);
+#endif
 
-  sector_start = sector * COFFEE_PAGES_PER_SECTOR;
-  sector_end = sector_start + COFFEE_PAGES_PER_SECTOR;
+/*---------------------------------------------------------------------------*/
+#if COFFEE_HEADER_CACHE_SIZE
+static struct header_cache_entry *
+header_cache_find(struct cfs_coffee_volume *vol, coffee_page_t page)
+{
+  struct header_cache_set *set;
+  int i;
 
-  /*
-   * Account for pages belonging to a file starting in a previous
-   * segment that extends into this segment. If the whole segment is
-   * covered, we do not need to continue counting pages in this iteration.
-   */
-  if(last_pages_are_active) {
-    if(skip_pages >= COFFEE_PAGES_PER_SECTOR) {
-      stats->active = COFFEE_PAGES_PER_SECTOR;
-      skip_pages -= COFFEE_PAGES_PER_SECTOR;
-      return 0;
-    }
-    active = skip_pages;
-  } else {
-    if(skip_pages >= COFFEE_PAGES_PER_SECTOR) {
-      stats->obsolete = COFFEE_PAGES_PER_SECTOR;
-      skip_pages -= COFFEE_PAGES_PER_SECTOR;
-      return skip_pages >= COFFEE_PAGES_PER_SECTOR ? 0 : skip_pages;
+  set = &vol->header_cache.sets[(unsigned long)page % HEADER_CACHE_SETS];
+  for(i = 0; i < HEADER_CACHE_WAYS; i++) {
+    if(set->ways[i].tag == page + 1) {
+      return &set->ways[i];
     }
-    obsolete = skip_pages;
   }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static void
+header_cache_store(struct cfs_coffee_volume *vol, coffee_page_t page,
+                   const struct file_header *hdr)
+{
+  struct header_cache_set *set;
+  struct header_cache_entry *entry;
+  int i;
 
-  /* Determine the amount of pages of each type that have not been
-     accounted for yet in the current sector. */
-  for(page = sector_start + skip_pages; page < sector_end;) {
-    read_header(&hdr, page);
-    last_pages_are_active = 0;
-    if(HDR_ACTIVE(hdr)) {
-      last_pages_are_active = 1;
-      page += hdr.max_pages;
-      active += hdr.max_pages;
-    } else if(HDR_ISOLATED(hdr)) {
-      page++;
-      obsolete++;
-    } else if(HDR_OBSOLETE(hdr)) {
-      page += hdr.max_pages;
-      obsolete += hdr.max_pages;
-    } else {
-      free = sector_end - page;
-      break;
+  entry = header_cache_find(vol, page);
+  if(entry == NULL) {
+    set = &vol->header_cache.sets[(unsigned long)page % HEADER_CACHE_SETS];
+    for(i = 0; i < HEADER_CACHE_WAYS; i++) {
+      if(set->ways[i].tag == 0) {
+        break;
+      }
     }
-  }
-
-  /*
-   * Determine the amount of pages in the following sectors that
-   * should be remembered for the next iteration. This is necessary
-   * because no page except the first of a file contains information
-   * about what type of page it is. A side effect of remembering this
-   * amount is that there is no need to read in the headers of each
-   * of these pages from the storage.
-   */
-  skip_pages = active + obsolete + free - COFFEE_PAGES_PER_SECTOR;
-  if(skip_pages > 0) {
-    if(last_pages_are_active) {
-      active = COFFEE_PAGES_PER_SECTOR - obsolete;
-    } else {
-      obsolete = COFFEE_PAGES_PER_SECTOR - active;
+    if(i == HEADER_CACHE_WAYS) {
+      i = set->victim;
+      set->victim = (set->victim + 1) % HEADER_CACHE_WAYS;
     }
+    entry = &set->ways[i];
+    entry->tag = page + 1;
   }
-
-  stats->active = active;
-  stats->obsolete = obsolete;
-  stats->free = free;
-
-  /*
-   * To avoid unnecessary page isolation, we notify the caller that
-   * "skip_pages" pages should be isolated only if the current file extent
-   * ends in the next sector. If the file extent ends in a more distant
-   * sector, however, the garbage collection can free the next sector
-   * immediately without requiring page isolation.
-   */
-  return (last_pages_are_active || (skip_pages >= COFFEE_PAGES_PER_SECTOR)) ?
-         0 : skip_pages;
+  memcpy(&entry->hdr, hdr, sizeof(*hdr));
 }
+#endif /* COFFEE_HEADER_CACHE_SIZE */
 /*---------------------------------------------------------------------------*/
 static void
-isolate_pages(coffee_page_t start, coffee_page_t skip_pages)
+invalidate_headers(struct cfs_coffee_volume *vol, cfs_offset_t offset,
+                   cfs_offset_t size)
 {
-  struct file_header hdr;
-  coffee_page_t page;
+#if COFFEE_HEADER_CACHE_SIZE
+  struct header_cache_entry *entry;
+  coffee_page_t page, last;
 
-  /* Split an obsolete file starting in the previous sector and mark
-     the following pages as isolated. */
-  memset(&hdr, 0, sizeof(hdr));
-  hdr.flags = HDR_FLAG_ALLOCATED | HDR_FLAG_ISOLATED;
+  if(size == 0) {
+    return;
+  }
 
-  /* Isolation starts from the next sector. */
-  for(page = 0; page < skip_pages; page++) {
-    write_header(&hdr, start + page);
+  /* Skip the first page if the write starts after its header. */
+  page = offset / VOL_PAGE_SIZE;
+  if(offset - page * VOL_PAGE_SIZE >= sizeof(struct file_header)) {
+    page++;
   }
-  PRINTF("Coffee: Isolated %u pages starting in sector %d\n",
-         (unsigned)skip_pages, (int)start / COFFEE_PAGES_PER_SECTOR);
+  last = (offset + size - 1) / VOL_PAGE_SIZE;
+
+  for(; page <= last; page++) {
+    entry = header_cache_find(vol, page);
+    if(entry != NULL) {
+      entry->tag = 0;
+    }
+  }
+#endif /* COFFEE_HEADER_CACHE_SIZE */
 }
 /*---------------------------------------------------------------------------*/
-static void
-collect_garbage(int mode)
+/* Attribute the flash I/O to the collector or a merge until io_leave(). */
+static uint8_t
+io_enter(struct cfs_coffee_volume *vol, uint8_t op)
 {
-  uint16_t sector;
-  struct sector_status stats;
-  coffee_page_t first_page, isolation_count;
-
-  PRINTF("Coffee: Running the file system garbage collector in %s mode\n",
-         mode == GC_RELUCTANT ? "reluctant" : "greedy");
-  /*
-   * The garbage collector erases as many sectors as possible. A sector is
-   * erasable if there are only free or obsolete pages in it.
-   */
-  for(sector = 0; sector < COFFEE_SECTOR_COUNT; sector++) {
-    isolation_count = get_sector_status(sector, &stats);
-    PRINTF("Coffee: Sector %u has %u active, %u obsolete, and %u free pages.\n",
-           sector, (unsigned)stats.active,
-           (unsigned)stats.obsolete, (unsigned)stats.free);
-
-    if(stats.active > 0) {
-      continue;
-    }
-
-    if((mode == GC_RELUCTANT && stats.free == 0) ||
-       (mode == GC_GREEDY && stats.obsolete > 0)) {
-      first_page = sector * COFFEE_PAGES_PER_SECTOR;
-      if(first_page < *next_free) {
-        *next_free = first_page;
-      }
-
-      if(isolation_count > 0) {
-        isolate_pages(first_page + COFFEE_PAGES_PER_SECTOR, isolation_count);
-      }
+#if COFFEE_IO_STATS
+  uint8_t saved;
 
-      COFFEE_ERASE(sector);
-      PRINTF("Coffee: Erased sector %d!\n", sector);
+  saved = vol->io_op;
+  vol->io_op = op;
+  vol->io_stats.ops[op].calls++;
+  return saved;
+#else
+  return op;
+#endif
+}
+/*---------------------------------------------------------------------------*/
+static void
+io_leave(struct cfs_coffee_volume *vol, uint8_t saved)
+{
+#if COFFEE_IO_STATS
+  vol->io_op = saved;
+#else
+  (void)saved;
+#endif
+}
+/*---------------------------------------------------------------------------*/
+static void
+flash_write(struct cfs_coffee_volume *vol, const void *buf, cfs_offset_t size,
+            cfs_offset_t offset)
+{
+  FLASH_WRITE(buf, size, offset);
+  invalidate_headers(vol, offset, size);
+}
+/*---------------------------------------------------------------------------*/
+static void
+write_header(struct cfs_coffee_volume *vol, struct file_header *hdr,
+             coffee_page_t page)
+{
+  hdr->flags |= HDR_FLAG_VALID;
+  FLASH_WRITE(hdr, sizeof(*hdr), page * VOL_PAGE_SIZE);
+#if COFFEE_HEADER_CACHE_SIZE
+  header_cache_store(vol, page, hdr);
+#endif
+}
+/*---------------------------------------------------------------------------*/
+static void
+read_header(struct cfs_coffee_volume *vol, struct file_header *hdr,
+            coffee_page_t page)
+{
+#if COFFEE_HEADER_CACHE_SIZE
+  struct header_cache_entry *entry;
+
+  entry = header_cache_find(vol, page);
+  if(entry != NULL) {
+    COUNT(vol->header_cache.stats.hits, 1);
+    memcpy(hdr, &entry->hdr, sizeof(*hdr));
+    return;
+  }
+  COUNT(vol->header_cache.stats.misses, 1);
+#endif
 
-      if(mode == GC_RELUCTANT && isolation_count > 0) {
-        break;
-      }
-    }
+  FLASH_READ(hdr, sizeof(*hdr), page * VOL_PAGE_SIZE);
+#if COFFEE_HEADER_CACHE_SIZE
+  /* The holders of a shared lock only look up the cache. */
+  if(EXCLUSIVE(vol)) {
+    header_cache_store(vol, page, hdr);
+  }
+#endif
+#if DEBUG
+  if(HDR_ACTIVE(*hdr) && !HDR_VALID(*hdr)) {
+    PRINTF("Invalid header at page %u!\n", (unsigned)page);
   }
+#endif
+}
+/*---------------------------------------------------------------------------*/
+static cfs_offset_t
+absolute_offset(struct cfs_coffee_volume *vol, coffee_page_t page,
+                cfs_offset_t offset)
+{
+  return page * VOL_PAGE_SIZE + sizeof(struct file_header) + offset;
+}
+/*---------------------------------------------------------------------------*/
+static cfs_offset_t
+extent_capacity(struct cfs_coffee_volume *vol, coffee_page_t pages)
+{
+  return pages * VOL_PAGE_SIZE - sizeof(struct file_header);
 }
 /*---------------------------------------------------------------------------*/
 static coffee_page_t
-next_file(coffee_page_t page, struct file_header *hdr)
+next_file(struct cfs_coffee_volume *vol, coffee_page_t page,
+          struct file_header *hdr)
 {
   /*
    * The quick-skip algorithm for finding file extents is the most
@@ -419,955 +1017,4576 @@ next_file(coffee_page_t page, struct file_header *hdr)
    * always shorter than a sector.
    */
   if(HDR_FREE(*hdr)) {
-    return (page + COFFEE_PAGES_PER_SECTOR) & ~(COFFEE_PAGES_PER_SECTOR - 1);
+    return (page + VOL_PAGES_PER_SECTOR) & ~(VOL_PAGES_PER_SECTOR - 1);
   } else if(HDR_ISOLATED(*hdr)) {
     return page + 1;
   }
   return page + hdr->max_pages;
 }
 /*---------------------------------------------------------------------------*/
-static struct file *
-load_file(coffee_page_t start, struct file_header *hdr)
+#if COFFEE_SECTOR_TABLE
+static coffee_page_t *
+page_counter(struct sector_status *stats, int state)
 {
-  int i, unreferenced, free;
-  struct file *file;
-
-  /*
-   * We prefer to overwrite a free slot since unreferenced ones
-   * contain usable data. Free slots are designated by the page
-   * value INVALID_PAGE.
-   */
-  for(i = 0, unreferenced = free = -1; i < COFFEE_MAX_OPEN_FILES; i++) {
-    if(FILE_FREE(&coffee_files[i])) {
-      free = i;
-      break;
-    } else if(FILE_UNREFERENCED(&coffee_files[i])) {
-      unreferenced = i;
-    }
+  switch(state) {
+  case PAGE_ACTIVE:
+    return &stats->active;
+  case PAGE_OBSOLETE:
+    return &stats->obsolete;
+  default:
+    return &stats->free;
   }
+}
+/*---------------------------------------------------------------------------*/
+static void
+sector_table_move(struct cfs_coffee_volume *vol, coffee_page_t start,
+                  coffee_page_t count, int from, int to)
+{
+  coffee_page_t end, sector_end, amount;
+  struct sector_status *stats;
 
-  if(free == -1) {
-    if(unreferenced != -1) {
-      i = unreferenced;
-    } else {
-      return NULL;
-    }
+  end = start + count;
+  if(end > vol->page_count) {
+    end = vol->page_count;
   }
 
-  file = &coffee_files[i];
-  file->page = start;
-  file->end = UNKNOWN_OFFSET;
-  file->max_pages = hdr->max_pages;
-  file->flags = 0;
-  if(HDR_MODIFIED(*hdr)) {
-    file->flags |= COFFEE_FILE_MODIFIED;
+  while(start < end) {
+    stats = &vol->sector_table.sectors[start / VOL_PAGES_PER_SECTOR];
+    sector_end = (start / VOL_PAGES_PER_SECTOR + 1) *
+                 VOL_PAGES_PER_SECTOR;
+    amount = (end < sector_end ? end : sector_end) - start;
+    if(stats->free == VOL_PAGES_PER_SECTOR) {
+      vol->sector_table.erased--;
+    }
+    if(from >= 0) {
+      *page_counter(stats, from) -= amount;
+    }
+    *page_counter(stats, to) += amount;
+    if(stats->free == VOL_PAGES_PER_SECTOR) {
+      vol->sector_table.erased++;
+    }
+#if COFFEE_FREE_EXTENT_INDEX
+    if(vol->sector_table.built && (from == PAGE_FREE || to == PAGE_FREE)) {
+      free_index_sector_changed(vol, start / VOL_PAGES_PER_SECTOR);
+    }
+#endif
+    start += amount;
   }
-  /* We don't know the amount of records yet. */
-  file->record_count = -1;
-
-  return file;
 }
 /*---------------------------------------------------------------------------*/
-static struct file *
-find_file(const char *name)
+static void
+sector_table_set_extent(struct cfs_coffee_volume *vol, coffee_page_t start,
+                        coffee_page_t count)
 {
-  int i;
-  struct file_header hdr;
-  coffee_page_t page;
-
-  /* First check if the file metadata is cached. */
-  for(i = 0; i < COFFEE_MAX_OPEN_FILES; i++) {
-    if(FILE_FREE(&coffee_files[i])) {
-      continue;
-    }
+  coffee_page_t end;
+  uint16_t sector;
 
-    read_header(&hdr, coffee_files[i].page);
-    if(HDR_ACTIVE(hdr) && !HDR_LOG(hdr) && strcmp(name, hdr.name) == 0) {
-      return &coffee_files[i];
+  /* Remember how far the extent reaches into each following sector. */
+  end = start + count;
+  for(sector = start / VOL_PAGES_PER_SECTOR + 1;
+      sector < vol->sector_count &&
+      sector * VOL_PAGES_PER_SECTOR < end;
+      sector++) {
+    vol->sector_table.sectors[sector].carried =
+      end - sector * VOL_PAGES_PER_SECTOR;
+    if(vol->sector_table.sectors[sector].carried > VOL_PAGES_PER_SECTOR) {
+      vol->sector_table.sectors[sector].carried = VOL_PAGES_PER_SECTOR;
     }
   }
+}
+/*---------------------------------------------------------------------------*/
+static void
+sector_table_reset(struct cfs_coffee_volume *vol)
+{
+  uint16_t sector;
 
-  /* Scan the flash memory sequentially otherwise. */
-  for(page = 0; page < COFFEE_PAGE_COUNT; page = next_file(page, &hdr)) {
-    read_header(&hdr, page);
-    if(HDR_ACTIVE(hdr) && !HDR_LOG(hdr) && strcmp(name, hdr.name) == 0) {
-      return load_file(page, &hdr);
-    }
+  memset(&vol->sector_table, 0, sizeof(vol->sector_table));
+  for(sector = 0; sector < vol->sector_count; sector++) {
+    vol->sector_table.sectors[sector].free = VOL_PAGES_PER_SECTOR;
   }
+  vol->sector_table.erased = vol->sector_count;
+  vol->sector_table.built = 1;
+#if COFFEE_FREE_EXTENT_INDEX
+  free_index_sector_changed(vol, vol->sector_count);
+#endif
+}
+/*---------------------------------------------------------------------------*/
+static void
+sector_table_build(struct cfs_coffee_volume *vol)
+{
+  struct cfs_coffee_mount_stats stats;
 
-  return NULL;
+  vol->sector_table.built = 0;
+  scan_headers(vol, &stats);
 }
 /*---------------------------------------------------------------------------*/
-static cfs_offset_t
-file_end(coffee_page_t start)
+/* Get the sector statistics from the table. Returns the amount of pages
+   to isolate in the next sector if this sector is erased. */
+static coffee_page_t
+sector_table_status(struct cfs_coffee_volume *vol, uint16_t sector,
+                    struct sector_status *stats)
 {
-  struct file_header hdr;
-  unsigned char buf[COFFEE_PAGE_SIZE];
-  coffee_page_t page;
-  int i;
+  coffee_page_t skip_pages;
+
+  if(!vol->sector_table.built) {
+    sector_table_build(vol);
+  }
 
-  read_header(&hdr, start);
+  *stats = vol->sector_table.sectors[sector];
+  if(sector + 1 >= vol->sector_count) {
+    return 0;
+  }
 
   /*
-   * Move from the end of the range towards the beginning and look for
-   * a byte that has been modified.
-   *
-   * An important implication of this is that if the last written bytes
-   * are zeroes, then these are skipped from the calculation.
+   * An obsolete extent reaching into the next sector leaves pages
+   * without a header behind when this sector is erased. Like
+   * get_sector_status(), this asks for isolation only if the extent
+   * ends in the next sector.
    */
+  skip_pages = vol->sector_table.sectors[sector + 1].carried;
+  return skip_pages < VOL_PAGES_PER_SECTOR ? skip_pages : 0;
+}
+#endif /* COFFEE_SECTOR_TABLE */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_WEAR_COUNTS
+static void
+wear_load(struct cfs_coffee_volume *vol)
+{
+  uint16_t sector;
 
-  for(page = hdr.max_pages - 1; page >= 0; page--) {
-    COFFEE_READ(buf, sizeof(buf), (start + page) * COFFEE_PAGE_SIZE);
-    for(i = COFFEE_PAGE_SIZE - 1; i >= 0; i--) {
-      if(buf[i] != 0) {
-        if(page == 0 && i < sizeof(hdr)) {
-          return 0;
-        }
-        return 1 + i + (page * COFFEE_PAGE_SIZE) - sizeof(hdr);
-      }
+  if(!vol->wear.loaded) {
+    for(sector = 0; sector < vol->sector_count; sector++) {
+      vol->wear.erases[sector] = VOLUME_ERASE_COUNT(sector);
     }
+    vol->wear.loaded = 1;
   }
-
-  /* All bytes are writable. */
-  return 0;
 }
+#endif /* COFFEE_WEAR_COUNTS */
 /*---------------------------------------------------------------------------*/
-static coffee_page_t
-find_contiguous_pages(coffee_page_t amount)
+#if COFFEE_FREE_EXTENT_INDEX
+static void
+free_index_merge(struct cfs_coffee_volume *vol, struct free_run *run,
+                 const struct free_run *left, const struct free_run *right)
 {
-  coffee_page_t page, start;
-  struct file_header hdr;
-
-  start = INVALID_PAGE;
-  for(page = *next_free; page < COFFEE_PAGE_COUNT;) {
-    read_header(&hdr, page);
-    if(HDR_FREE(hdr)) {
-      if(start == INVALID_PAGE) {
-        start = page;
-        if(start + amount >= COFFEE_PAGE_COUNT) {
-          /* We can stop immediately if the remaining pages are not enough. */
-          break;
-        }
-      }
-
-      /* All remaining pages in this sector are free --
-         jump to the next sector. */
-      page = next_file(page, &hdr);
+  coffee_page_t joined;
+
+  run->sectors = left->sectors + right->sectors;
+  run->prefix = left->prefix == left->sectors ?
+                left->sectors + right->prefix : left->prefix;
+  run->suffix = right->prefix == right->sectors ?
+                left->suffix + right->sectors * VOL_PAGES_PER_SECTOR :
+                right->suffix;
+
+  joined = left->suffix + right->prefix * VOL_PAGES_PER_SECTOR;
+  run->best = left->best > right->best ? left->best : right->best;
+  if(joined > run->best) {
+    run->best = joined;
+  }
+#if COFFEE_WEAR_AWARE
+  run->coldest = left->coldest < right->coldest ?
+                 left->coldest : right->coldest;
+#endif
+}
+/*---------------------------------------------------------------------------*/
+static void
+free_index_update(struct cfs_coffee_volume *vol, unsigned node, uint16_t lo,
+                  uint16_t hi, uint16_t sector)
+{
+  struct free_run *run;
+  uint16_t mid;
+
+  run = &vol->free_index[node];
+  if(hi - lo == 1) {
+    run->best = run->suffix = vol->sector_table.sectors[lo].free;
+    run->prefix = run->suffix == VOL_PAGES_PER_SECTOR;
+    run->sectors = 1;
+#if COFFEE_WEAR_AWARE
+    run->coldest = run->prefix ? vol->wear.erases[lo] : WEAR_NONE;
+#endif
+    return;
+  }
 
-      if(start + amount <= page) {
-        if(start == *next_free) {
-          *next_free = start + amount;
-        }
-        return start;
-      }
-    } else {
-      start = INVALID_PAGE;
-      page = next_file(page, &hdr);
-    }
+  /* Update the whole range if the sector is out of bounds. */
+  mid = lo + (hi - lo) / 2;
+  if(sector < mid || sector >= vol->sector_count) {
+    free_index_update(vol, 2 * node, lo, mid, sector);
   }
-  return INVALID_PAGE;
+  if(sector >= mid) {
+    free_index_update(vol, 2 * node + 1, mid, hi, sector);
+  }
+  free_index_merge(vol, run, &vol->free_index[2 * node],
+                   &vol->free_index[2 * node + 1]);
 }
 /*---------------------------------------------------------------------------*/
-static int
-remove_by_page(coffee_page_t page, int remove_log, int close_fds,
-               int gc_allowed)
+static void
+free_index_sector_changed(struct cfs_coffee_volume *vol, uint16_t sector)
 {
-  struct file_header hdr;
-  int i;
+#if COFFEE_WEAR_AWARE
+  wear_load(vol);
+#endif
+  free_index_update(vol, 1, 0, vol->sector_count, sector);
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Search for the first run of "amount" free pages that starts in
+ * sector "first" or later. "carry" is the length of the run that ends
+ * where the node's range begins.
+ */
+static coffee_page_t
+free_index_search(struct cfs_coffee_volume *vol, unsigned node, uint16_t lo,
+                  uint16_t hi, uint16_t first, coffee_page_t amount,
+                  coffee_page_t *carry)
+{
+  struct free_run *run;
+  coffee_page_t start;
+  uint16_t mid;
 
-  read_header(&hdr, page);
-  if(!HDR_ACTIVE(hdr)) {
-    return -1;
+  if(hi <= first) {
+    return INVALID_PAGE;
   }
 
-  if(remove_log && HDR_MODIFIED(hdr)) {
-    if(remove_by_page(hdr.log_page, !REMOVE_LOG, !CLOSE_FDS, !ALLOW_GC) < 0) {
-      return -1;
+  run = &vol->free_index[node];
+  if(lo >= first) {
+    if(*carry + run->prefix * VOL_PAGES_PER_SECTOR >= amount) {
+      return lo * VOL_PAGES_PER_SECTOR - *carry;
+    }
+    if(run->best < amount) {
+      *carry = run->prefix == run->sectors ?
+               *carry + run->sectors * VOL_PAGES_PER_SECTOR : run->suffix;
+      return INVALID_PAGE;
+    }
+    if(hi - lo == 1) {
+      return hi * VOL_PAGES_PER_SECTOR - run->suffix;
     }
   }
 
-  hdr.flags |= HDR_FLAG_OBSOLETE;
-  write_header(&hdr, page);
-
-  *gc_wait = 0;
-
-  /* Close all file descriptors that reference the removed file. */
-  if(close_fds) {
-    for(i = 0; i < COFFEE_FD_SET_SIZE; i++) {
-      if(coffee_fd_set[i].file != NULL && coffee_fd_set[i].file->page == page) {
-        coffee_fd_set[i].flags = COFFEE_FD_FREE;
+  mid = lo + (hi - lo) / 2;
+  start = free_index_search(vol, 2 * node, lo, mid, first, amount, carry);
+  if(start == INVALID_PAGE) {
+    start = free_index_search(vol, 2 * node + 1, mid, hi, first, amount,
+                              carry);
+  }
+  return start;
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_WEAR_AWARE
+/*
+ * Find the completely free sectors for "amount" pages that have been
+ * erased the fewest times in total. Ties go to the lowest address.
+ */
+static coffee_page_t
+wear_find(struct cfs_coffee_volume *vol, coffee_page_t amount)
+{
+  uint16_t sector, need, run, best;
+  uint32_t cost, best_cost;
+  unsigned node;
+
+  need = (amount + VOL_PAGES_PER_SECTOR - 1) / VOL_PAGES_PER_SECTOR;
+  if(need == 1 && vol->free_index[1].coldest != WEAR_NONE) {
+    /* Descend to the coldest free sector in the index. */
+    node = 1;
+    sector = 0;
+    run = vol->sector_count;
+    while(run > 1) {
+      if(vol->free_index[2 * node].coldest <=
+         vol->free_index[2 * node + 1].coldest) {
+        node = 2 * node;
+        run = run / 2;
+      } else {
+        node = 2 * node + 1;
+        sector += run / 2;
+        run = run - run / 2;
       }
     }
+    if((coffee_page_t)sector * VOL_PAGES_PER_SECTOR + amount <
+       vol->page_count) {
+      return (coffee_page_t)sector * VOL_PAGES_PER_SECTOR;
+    }
   }
 
-  for(i = 0; i < COFFEE_MAX_OPEN_FILES; i++) {
-    if(coffee_files[i].page == page) {
-      coffee_files[i].page = INVALID_PAGE;
-      coffee_files[i].references = 0;
-      coffee_files[i].max_pages = 0;
+  /* Slide a window of "need" sectors over the table. */
+  best = vol->sector_count;
+  best_cost = 0;
+  run = 0;
+  cost = 0;
+  for(sector = 0; sector < vol->sector_count; sector++) {
+    if(vol->sector_table.sectors[sector].free != VOL_PAGES_PER_SECTOR) {
+      run = 0;
+      cost = 0;
+      continue;
     }
-  }
 
-#if !COFFEE_EXTENDED_WEAR_LEVELLING
-  if(gc_allowed) {
-    collect_garbage(GC_RELUCTANT);
+    cost += vol->wear.erases[sector];
+    if(++run > need) {
+      cost -= vol->wear.erases[sector - need];
+      run = need;
+    }
+
+    /* Like the header walk, do not use the very last pages. */
+    if(run == need &&
+       (coffee_page_t)(sector + 1 - need) * VOL_PAGES_PER_SECTOR +
+       amount < vol->page_count &&
+       (best == vol->sector_count || cost < best_cost)) {
+      best = sector + 1 - need;
+      best_cost = cost;
+    }
   }
-#endif
 
-  return 0;
+  if(best == vol->sector_count) {
+    return INVALID_PAGE;
+  }
+  return (coffee_page_t)best * VOL_PAGES_PER_SECTOR;
 }
+#endif /* COFFEE_WEAR_AWARE */
 /*---------------------------------------------------------------------------*/
 static coffee_page_t
-page_count(cfs_offset_t size)
-{
-  return (size + sizeof(struct file_header) + COFFEE_PAGE_SIZE - 1) /
-         COFFEE_PAGE_SIZE;
-}
-/*---------------------------------------------------------------------------*/
-static struct file *
-reserve(const char *name, coffee_page_t pages,
-        int allow_duplicates, unsigned flags)
+free_index_find(struct cfs_coffee_volume *vol, coffee_page_t amount)
 {
-  struct file_header hdr;
-  coffee_page_t page;
-  struct file *file;
+  coffee_page_t start, sector_end, carry;
+  uint16_t sector;
 
-  if(!allow_duplicates && find_file(name) != NULL) {
-    return NULL;
+  if(!vol->sector_table.built) {
+    sector_table_build(vol);
   }
 
-  page = find_contiguous_pages(pages);
-  if(page == INVALID_PAGE) {
-    if(*gc_wait) {
-      return NULL;
-    }
-    collect_garbage(GC_GREEDY);
-    page = find_contiguous_pages(pages);
-    if(page == INVALID_PAGE) {
-      *gc_wait = 1;
-      return NULL;
-    }
+  /* The run may start in the free tail of the sector of *next_free. */
+  sector = *next_free / VOL_PAGES_PER_SECTOR;
+  if(sector >= vol->sector_count) {
+    return INVALID_PAGE;
+  }
+  sector_end = (sector + 1) * VOL_PAGES_PER_SECTOR;
+  start = sector_end - vol->sector_table.sectors[sector].free;
+  if(start < *next_free) {
+    start = *next_free;
   }
 
-  memset(&hdr, 0, sizeof(hdr));
-  strncpy(hdr.name, name, sizeof(hdr.name) - 1);
-  hdr.max_pages = pages;
-  hdr.flags = HDR_FLAG_ALLOCATED | flags;
-  write_header(&hdr, page);
+  carry = sector_end - start;
+#if COFFEE_WEAR_AWARE
+  /* Fill the current sector, but choose the sectors to open by wear. */
+  if(carry < amount || carry == VOL_PAGES_PER_SECTOR ||
+     start + amount >= vol->page_count) {
+    start = wear_find(vol, amount);
+    if(start != INVALID_PAGE) {
+      *next_free = start + amount;
+      return start;
+    }
 
-  PRINTF("Coffee: Reserved %u pages starting from %u for file %s\n",
-         pages, page, name);
+    /* Settle for any run, also below *next_free. */
+    carry = 0;
+    start = free_index_search(vol, 1, 0, vol->sector_count, 0, amount, &carry);
+  }
+#else
+  if(carry < amount) {
+    start = free_index_search(vol, 1, 0, vol->sector_count, sector + 1,
+                              amount, &carry);
+  }
+#endif
 
-  file = load_file(page, &hdr);
-  if(file != NULL) {
-    file->end = 0;
+  /* Like the header walk, do not use the very last pages. */
+  if(start == INVALID_PAGE || start + amount >= vol->page_count) {
+    return INVALID_PAGE;
   }
 
-  return file;
+  if(start == *next_free) {
+    *next_free = start + amount;
+  }
+  return start;
 }
+#endif /* COFFEE_FREE_EXTENT_INDEX */
 /*---------------------------------------------------------------------------*/
-#if COFFEE_MICRO_LOGS
+/* Erase a sector without changing the state of its pages in the tables,
+   as for the sectors of a ring file, which remain allocated. */
 static void
-adjust_log_config(struct file_header *hdr,
-                  uint16_t *log_record_size, uint16_t *log_records)
+erase_sector_data(struct cfs_coffee_volume *vol, uint16_t sector)
 {
-  *log_record_size = hdr->log_record_size == 0 ?
-    COFFEE_PAGE_SIZE : hdr->log_record_size;
-  *log_records = hdr->log_records == 0 ?
-    COFFEE_LOG_SIZE / *log_record_size : hdr->log_records;
+#if COFFEE_WEAR_COUNTS
+  wear_load(vol);
+  vol->wear.erases[sector]++;
+#endif
+  FLASH_ERASE(sector);
+  invalidate_headers(vol, (cfs_offset_t)sector * VOL_SECTOR_SIZE,
+                     VOL_SECTOR_SIZE);
 }
-#endif /* COFFEE_MICRO_LOGS */
 /*---------------------------------------------------------------------------*/
-#if COFFEE_MICRO_LOGS
-static uint16_t
-modify_log_buffer(uint16_t log_record_size,
-                  cfs_offset_t *offset, uint16_t *size)
+static void
+erase_sector(struct cfs_coffee_volume *vol, uint16_t sector)
 {
-  uint16_t region;
-
-  region = *offset / log_record_size;
-  *offset %= log_record_size;
-
-  if(*size > log_record_size - *offset) {
-    *size = log_record_size - *offset;
+  erase_sector_data(vol, sector);
+#if COFFEE_SECTOR_TABLE
+  if(vol->sector_table.sectors[sector].free != VOL_PAGES_PER_SECTOR) {
+    vol->sector_table.erased++;
   }
-
-  return region;
+  memset(&vol->sector_table.sectors[sector], 0, sizeof(struct sector_status));
+  vol->sector_table.sectors[sector].free = VOL_PAGES_PER_SECTOR;
+#endif
+#if COFFEE_FREE_EXTENT_INDEX
+  if(vol->sector_table.built) {
+    free_index_sector_changed(vol, sector);
+  }
+#endif
 }
-#endif /* COFFEE_MICRO_LOGS */
 /*---------------------------------------------------------------------------*/
-#if COFFEE_MICRO_LOGS
-static int
-get_record_index(coffee_page_t log_page, uint16_t search_records,
-                 uint16_t region)
+static coffee_page_t
+get_sector_status(struct cfs_coffee_volume *vol, uint16_t sector,
+                  struct sector_status *stats)
 {
-  cfs_offset_t base;
-  uint16_t processed;
-  uint16_t batch_size;
-  int16_t match_index, i;
+  struct file_header hdr;
+  coffee_page_t active, obsolete, free;
+  coffee_page_t sector_start, sector_end;
+  coffee_page_t page;
 
-  base = absolute_offset(log_page, sizeof(uint16_t) * search_records);
-  batch_size = search_records > COFFEE_LOG_TABLE_LIMIT ?
-    COFFEE_LOG_TABLE_LIMIT : search_records;
-  processed = 0;
-  match_index = -1;
+  memset(stats, 0, sizeof(*stats));
+  active = obsolete = free = 0;
 
-  {
-    //uint16_t indices[batch_size]; /* AALTO-2 NOTE: NOT COMPLIANT WITH C90, POSSIBLE SOURCE OF PROBLEMS */
-	uint16_t indices[COFFEE_LOG_TABLE_LIMIT]; /* AALTO-2 NOTE: C90 COMPLIANCE */
+  /*
+   * get_sector_status() is an iterative function that keeps its state
+   * in the volume. It therefore requires that the caller starts
+   * iterating from sector 0 in order to reset the state.
+   */
+  if(sector == 0) {
+    vol->skip_pages = 0;
+    vol->last_pages_are_active = 0;
+  }
 
-    while(processed < search_records && match_index < 0) {
-      if(batch_size + processed > search_records) {
-        batch_size = search_records - processed;
-      }
+  sector_start = sector * VOL_PAGES_PER_SECTOR;
+  sector_end = sector_start + VOL_PAGES_PER_SECTOR;
+  stats->carried = vol->skip_pages < VOL_PAGES_PER_SECTOR ?
+                   vol->skip_pages : VOL_PAGES_PER_SECTOR;
 
-      base -= batch_size * sizeof(indices[0]);
-      COFFEE_READ(&indices, sizeof(indices[0]) * batch_size, base);
+  /*
+   * Account for pages belonging to a file starting in a previous
+   * segment that extends into this segment. If the whole segment is
+   * covered, we do not need to continue counting pages in this iteration.
+   */
+  if(vol->last_pages_are_active) {
+    if(vol->skip_pages >= VOL_PAGES_PER_SECTOR) {
+      stats->active = VOL_PAGES_PER_SECTOR;
+      vol->skip_pages -= VOL_PAGES_PER_SECTOR;
+      return 0;
+    }
+    active = vol->skip_pages;
+  } else {
+    if(vol->skip_pages >= VOL_PAGES_PER_SECTOR) {
+      stats->obsolete = VOL_PAGES_PER_SECTOR;
+      vol->skip_pages -= VOL_PAGES_PER_SECTOR;
+      return vol->skip_pages >= VOL_PAGES_PER_SECTOR ? 0 : vol->skip_pages;
+    }
+    obsolete = vol->skip_pages;
+  }
 
-      for(i = batch_size - 1; i >= 0; i--) {
-        if(indices[i] - 1 == region) {
-          match_index = search_records - processed - (batch_size - i);
-          break;
-        }
-      }
+  /* Determine the amount of pages of each type that have not been
+     accounted for yet in the current sector. */
+  for(page = sector_start + vol->skip_pages; page < sector_end;) {
+    read_header(vol, &hdr, page);
+    vol->last_pages_are_active = 0;
+    if(HDR_ACTIVE(hdr)) {
+      vol->last_pages_are_active = 1;
+      page += hdr.max_pages;
+      active += hdr.max_pages;
+    } else if(HDR_ISOLATED(hdr)) {
+      page++;
+      obsolete++;
+    } else if(HDR_OBSOLETE(hdr)) {
+      page += hdr.max_pages;
+      obsolete += hdr.max_pages;
+    } else {
+      free = sector_end - page;
+      break;
+    }
+  }
 
-      processed += batch_size;
+  /*
+   * Determine the amount of pages in the following sectors that
+   * should be remembered for the next iteration. This is necessary
+   * because no page except the first of a file contains information
+   * about what type of page it is. A side effect of remembering this
+   * amount is that there is no need to read in the headers of each
+   * of these pages from the storage.
+   */
+  vol->skip_pages = active + obsolete + free - VOL_PAGES_PER_SECTOR;
+  if(vol->skip_pages > 0) {
+    if(vol->last_pages_are_active) {
+      active = VOL_PAGES_PER_SECTOR - obsolete;
+    } else {
+      obsolete = VOL_PAGES_PER_SECTOR - active;
     }
   }
 
-  return match_index;
+  stats->active = active;
+  stats->obsolete = obsolete;
+  stats->free = free;
+
+  /*
+   * To avoid unnecessary page isolation, we notify the caller that
+   * "skip_pages" pages should be isolated only if the current file extent
+   * ends in the next sector. If the file extent ends in a more distant
+   * sector, however, the garbage collection can free the next sector
+   * immediately without requiring page isolation.
+   */
+  return (vol->last_pages_are_active ||
+          vol->skip_pages >= VOL_PAGES_PER_SECTOR) ?
+         0 : vol->skip_pages;
 }
-#endif /* COFFEE_MICRO_LOGS */
 /*---------------------------------------------------------------------------*/
-#if COFFEE_MICRO_LOGS
-static int
-read_log_page(struct file_header *hdr, int16_t record_count,
-              struct log_param *lp)
+static void
+isolate_pages(struct cfs_coffee_volume *vol, coffee_page_t start,
+              coffee_page_t skip_pages)
 {
-  uint16_t region;
-  int16_t match_index;
-  uint16_t log_record_size;
-  uint16_t log_records;
-  cfs_offset_t base;
-  uint16_t search_records;
+  struct file_header hdr;
+  coffee_page_t page;
 
-  adjust_log_config(hdr, &log_record_size, &log_records);
-  region = modify_log_buffer(log_record_size, &lp->offset, &lp->size);
+  /* Split an obsolete file starting in the previous sector and mark
+     the following pages as isolated. */
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.flags = HDR_FLAG_ALLOCATED | HDR_FLAG_ISOLATED;
 
-  search_records = record_count < 0 ? log_records : record_count;
-  match_index = get_record_index(hdr->log_page, search_records, region);
-  if(match_index < 0) {
-    return -1;
+  /* Isolation starts from the next sector. */
+  for(page = 0; page < skip_pages; page++) {
+    write_header(vol, &hdr, start + page);
   }
-
-  base = absolute_offset(hdr->log_page, log_records * sizeof(region));
-  base += (cfs_offset_t)match_index * log_record_size;
-  base += lp->offset;
-  COFFEE_READ(lp->buf, lp->size, base);
-
-  return lp->size;
+#if COFFEE_SECTOR_TABLE
+  /* Isolated pages at the start of a sector have headers of their own. */
+  if(start % VOL_PAGES_PER_SECTOR == 0) {
+    vol->sector_table.sectors[start / VOL_PAGES_PER_SECTOR].carried = 0;
+  }
+#endif
+  PRINTF("Coffee: Isolated %u pages starting in sector %d\n",
+         (unsigned)skip_pages, (int)start / VOL_PAGES_PER_SECTOR);
 }
-#endif /* COFFEE_MICRO_LOGS */
 /*---------------------------------------------------------------------------*/
-#if COFFEE_MICRO_LOGS
-static coffee_page_t
-create_log(struct file *file, struct file_header *hdr)
+static void
+isolate_extent_head(struct cfs_coffee_volume *vol, coffee_page_t start,
+                    coffee_page_t end)
 {
-  uint16_t log_record_size, log_records;
-  cfs_offset_t size;
-  struct file *log_file;
-
-  adjust_log_config(hdr, &log_record_size, &log_records);
-
-  /* Log index size + log data size. */
-  size = log_records * (sizeof(uint16_t) + log_record_size);
+  struct file_header hdr;
+  coffee_page_t page, head;
 
-  log_file = reserve(hdr->name, page_count(size), 1, HDR_FLAG_LOG);
-  if(log_file == NULL) {
-    return INVALID_PAGE;
+  /*
+   * Find the extent that reaches from the previous sector into the
+   * sector starting at "end". The walk starts after the pages that the
+   * previous sector itself carries over from an earlier sector.
+   */
+  head = INVALID_PAGE;
+  for(page = start; page < end; page = next_file(vol, page, &hdr)) {
+    read_header(vol, &hdr, page);
+    head = page;
   }
 
-  hdr->flags |= HDR_FLAG_MODIFIED;
-  hdr->log_page = log_file->page;
-  write_header(hdr, file->page);
+  if(head == INVALID_PAGE || !HDR_OBSOLETE(hdr) || HDR_ISOLATED(hdr) ||
+     head + hdr.max_pages <= end) {
+    return;
+  }
 
-  file->flags |= COFFEE_FILE_MODIFIED;
-  return log_file->page;
+  isolate_pages(vol, head, end - head);
 }
-#endif /* COFFEE_MICRO_LOGS */
 /*---------------------------------------------------------------------------*/
-static int
-merge_log(coffee_page_t file_page, int extend)
+#if COFFEE_SECTOR_TABLE
+/*
+ * Write a header for the pages that an obsolete extent carries into a
+ * sector, which makes them an obsolete extent of their own.
+ */
+static void
+split_obsolete_extent(struct cfs_coffee_volume *vol, uint16_t sector)
 {
-  struct file_header hdr, hdr2;
-  int fd, n;
-  cfs_offset_t offset;
-  coffee_page_t max_pages;
-  struct file *new_file;
-  int i;
+  struct file_header hdr;
+  coffee_page_t pages;
+  uint16_t i;
+
+  pages = 0;
+  for(i = sector; i < vol->sector_count; i++) {
+    pages += vol->sector_table.sectors[i].carried;
+    if(vol->sector_table.sectors[i].carried < VOL_PAGES_PER_SECTOR) {
+      break;
+    }
+  }
 
-  read_header(&hdr, file_page);
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.flags = HDR_FLAG_ALLOCATED | HDR_FLAG_OBSOLETE;
+  hdr.max_pages = pages;
+  write_header(vol, &hdr, sector * VOL_PAGES_PER_SECTOR);
+  vol->sector_table.sectors[sector].carried = 0;
+}
+#endif /* COFFEE_SECTOR_TABLE */
 
-  fd = cfs_open(hdr.name, CFS_READ);
-  if(fd < 0) {
+/*
+ * Erase a sector if it holds no active pages and the mode allows it.
+ * The caller passes the state of the previous sector in *prev_carried
+ * and *prev_erased and gets that of this sector back. Return the number
+ * of isolated pages in the next sector if the sector was erased, or -1.
+ */
+static int
+collect_sector(struct cfs_coffee_volume *vol, uint16_t sector, int mode,
+               coffee_page_t *prev_carried, char *prev_erased)
+{
+  struct sector_status stats;
+  coffee_page_t first_page, isolation_count;
+
+#if COFFEE_SECTOR_TABLE
+  isolation_count = sector_table_status(vol, sector, &stats);
+#else
+  isolation_count = get_sector_status(vol, sector, &stats);
+#endif
+  PRINTF("Coffee: Sector %u has %u active, %u obsolete, and %u free pages.\n",
+         sector, (unsigned)stats.active,
+         (unsigned)stats.obsolete, (unsigned)stats.free);
+
+  if(stats.active > 0 ||
+     !((mode == GC_RELUCTANT && stats.free == 0) ||
+       (mode == GC_GREEDY && stats.obsolete > 0))) {
+    *prev_carried = stats.carried;
+    *prev_erased = 0;
     return -1;
   }
 
+  first_page = sector * VOL_PAGES_PER_SECTOR;
+
   /*
-   * The reservation function adds extra space for the header, which has
-   * already been accounted for in the previous reservation.
+   * If the sector starts with pages of an obsolete extent whose header
+   * is in a sector that is kept, the header would still claim the pages
+   * of this sector after the erasure, and a later scan would treat new
+   * files allocated here as part of the old extent. Isolate the pages
+   * of the extent in the previous sector first.
    */
-  max_pages = hdr.max_pages << extend;
-  new_file = reserve(hdr.name, max_pages, 1, 0);
-  if(new_file == NULL) {
-    cfs_close(fd);
-    return -1;
-  }
-
-  offset = 0;
-  do {
-    //char buf[hdr.log_record_size == 0 ? COFFEE_PAGE_SIZE : hdr.log_record_size]; /* AALTO-2 NOTE: NOT COMPLIANT WITH C90, POSSIBLE SOURCE OF PROBLEMS */
-	char buf[COFFEE_PAGE_SIZE]; /* AALTO-2 NOTE: C90 COMPLIANCE */
-    n = cfs_read(fd, buf, sizeof(buf));
-    if(n < 0) {
-      remove_by_page(new_file->page, !REMOVE_LOG, !CLOSE_FDS, ALLOW_GC);
-      cfs_close(fd);
+  if(stats.carried > 0 && !*prev_erased) {
+    if(*prev_carried >= VOL_PAGES_PER_SECTOR) {
+      *prev_carried = stats.carried;
       return -1;
-    } else if(n > 0) {
-      COFFEE_WRITE(buf, n, absolute_offset(new_file->page, offset));
-      offset += n;
     }
-  } while(n != 0);
+    isolate_extent_head(vol,
+                        first_page - VOL_PAGES_PER_SECTOR + *prev_carried,
+                        first_page);
+  }
 
-  for(i = 0; i < COFFEE_FD_SET_SIZE; i++) {
-    if(coffee_fd_set[i].flags != COFFEE_FD_FREE &&
-       coffee_fd_set[i].file->page == file_page) {
-      coffee_fd_set[i].file = new_file;
-      new_file->references++;
-    }
+  if(first_page < *next_free) {
+    *next_free = first_page;
   }
 
-  if(remove_by_page(file_page, REMOVE_LOG, !CLOSE_FDS, !ALLOW_GC) < 0) {
-    remove_by_page(new_file->page, !REMOVE_LOG, !CLOSE_FDS, !ALLOW_GC);
-    cfs_close(fd);
-    return -1;
+  if(isolation_count > 0) {
+    isolate_pages(vol, first_page + VOL_PAGES_PER_SECTOR, isolation_count);
   }
 
-  /* Copy the log configuration and the EOF hint. */
-  read_header(&hdr2, new_file->page);
-  hdr2.log_record_size = hdr.log_record_size;
-  hdr2.log_records = hdr.log_records;
-  write_header(&hdr2, new_file->page);
+  erase_sector(vol, sector);
+  PRINTF("Coffee: Erased sector %d!\n", sector);
+  *prev_carried = 0;
+  *prev_erased = 1;
 
-  new_file->flags &= ~COFFEE_FILE_MODIFIED;
-  new_file->end = offset;
+  return isolation_count;
+}
+/*---------------------------------------------------------------------------*/
+static void
+collect_garbage(struct cfs_coffee_volume *vol, int mode)
+{
+  uint16_t sector;
+  coffee_page_t prev_carried;
+  int isolation_count;
+  char prev_erased;
+  uint8_t saved_op;
 
-  cfs_close(fd);
+  PRINTF("Coffee: Running the file system garbage collector in %s mode\n",
+         mode == GC_RELUCTANT ? "reluctant" : "greedy");
+  saved_op = io_enter(vol, CFS_COFFEE_OP_GC);
+#if COFFEE_SECTOR_TABLE && COFFEE_SECTOR_TABLE_VERIFY
+  if(verify_sector_table_locked(vol) != 0) {
+    sector_table_build(vol);
+  }
+#endif
+  /*
+   * The garbage collector erases as many sectors as possible. A sector is
+   * erasable if there are only free or obsolete pages in it.
+   */
+  prev_carried = 0;
+  prev_erased = 0;
+  for(sector = 0; sector < vol->sector_count; sector++) {
+    isolation_count = collect_sector(vol, sector, mode,
+                                     &prev_carried, &prev_erased);
+    if(isolation_count >= 0) {
+      vol->pool.stats.foreground_erases++;
+    }
+    if(isolation_count > 0 && mode == GC_RELUCTANT) {
+      break;
+    }
+  }
+  io_leave(vol, saved_op);
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_NAME_INDEX_SIZE
+static uint32_t
+name_hash(const char *name)
+{
+  uint32_t hash;
 
-  return 0;
+  /* FNV-1a */
+  for(hash = 2166136261UL; *name != '\0'; name++) {
+    hash = (hash ^ (unsigned char)*name) * 16777619UL;
+  }
+  return hash;
 }
 /*---------------------------------------------------------------------------*/
-#if COFFEE_MICRO_LOGS
-static int
-find_next_record(struct file *file, coffee_page_t log_page,
-                 int log_records)
+static void
+name_index_insert(struct cfs_coffee_volume *vol, const char *name,
+                  coffee_page_t page)
 {
-  int log_record, preferred_batch_size;
+  struct name_index_entry *entry;
+  uint32_t hash;
+  unsigned i;
 
-  if(file->record_count >= 0) {
-    return file->record_count;
+  if(vol->name_index.state == NAME_INDEX_OVERFLOW) {
+    vol->name_index.used++;
+  }
+  if(vol->name_index.state != NAME_INDEX_BUILT) {
+    /* The file will be found when the index is built. */
+    return;
   }
 
-  preferred_batch_size = log_records > COFFEE_LOG_TABLE_LIMIT ?
-    COFFEE_LOG_TABLE_LIMIT : log_records;
-  {
-    /* The next log record is unknown at this point; search for it. */
-    //uint16_t indices[preferred_batch_size]; /* AALTO-2 NOTE: NOT COMPLIANT WITH C90, POSSIBLE SOURCE OF PROBLEMS */
-    uint16_t indices[COFFEE_LOG_TABLE_LIMIT]; /* AALTO-2 NOTE: C90 COMPLIANCE */
-    uint16_t processed;
-    uint16_t batch_size;
-
-    log_record = log_records;
-    for(processed = 0; processed < log_records; processed += batch_size) {
-      batch_size = log_records - processed >= preferred_batch_size ?
-        preferred_batch_size : log_records - processed;
+  if(vol->name_index.used >= NAME_INDEX_MAX_LOAD) {
+    /* Too many used slots or tombstones; rebuild on the next lookup. */
+    vol->name_index.state = NAME_INDEX_UNBUILT;
+    return;
+  }
 
-      COFFEE_READ(&indices, batch_size * sizeof(indices[0]),
-                  absolute_offset(log_page, processed * sizeof(indices[0])));
-      for(log_record = 0; log_record < batch_size; log_record++) {
-        if(indices[log_record] == 0) {
-          log_record += processed;
-          break;
-        }
-      }
+  hash = name_hash(name);
+  for(i = hash % COFFEE_NAME_INDEX_SIZE;; i = (i + 1) % COFFEE_NAME_INDEX_SIZE) {
+    entry = &vol->name_index.entries[i];
+    if(entry->tag == 0) {
+      vol->name_index.used++;
+      break;
+    } else if(entry->tag == NAME_INDEX_TOMBSTONE) {
+      break;
     }
   }
-
-  return log_record;
+  entry->tag = page + 1;
+  entry->hash = (uint16_t)hash;
 }
-#endif /* COFFEE_MICRO_LOGS */
 /*---------------------------------------------------------------------------*/
-#if COFFEE_MICRO_LOGS
-static int
-write_log_page(struct file *file, struct log_param *lp)
+static void
+name_index_remove(struct cfs_coffee_volume *vol, const char *name,
+                  coffee_page_t page)
 {
-  struct file_header hdr;
-  uint16_t region;
-  coffee_page_t log_page;
-  int16_t log_record;
-  uint16_t log_record_size;
-  uint16_t log_records;
-  cfs_offset_t offset;
-  struct log_param lp_out;
-
-  read_header(&hdr, file->page);
-
-  adjust_log_config(&hdr, &log_record_size, &log_records);
-  region = modify_log_buffer(log_record_size, &lp->offset, &lp->size);
+  struct name_index_entry *entry;
+  unsigned i;
 
-//log_page = 0; /* AALTO-2 MODIFICATION: Flagged unnecessary by clang static checker */
-  if(HDR_MODIFIED(hdr)) {
-    /* A log structure has already been created. */
-    log_page = hdr.log_page;
-    log_record = find_next_record(file, log_page, log_records);
-    if(log_record >= log_records) {
-      /* The log is full; merge the log. */
-      PRINTF("Coffee: Merging the file %s with its log\n", hdr.name);
-      return merge_log(file->page, 0);
-    }
-  } else {
-    /* Create a log structure. */
-    log_page = create_log(file, &hdr);
-    if(log_page == INVALID_PAGE) {
-      return -1;
+  if(vol->name_index.state == NAME_INDEX_OVERFLOW) {
+    /* Rebuild on the next lookup once the files fit in the index. */
+    if(--vol->name_index.used < NAME_INDEX_MAX_LOAD) {
+      vol->name_index.state = NAME_INDEX_UNBUILT;
     }
-    PRINTF("Coffee: Created a log structure for file %s at page %u\n",
-           hdr.name, (unsigned)log_page);
-    hdr.log_page = log_page;
-    log_record = 0;
+    return;
+  }
+  if(vol->name_index.state != NAME_INDEX_BUILT) {
+    return;
   }
 
-  {
-    //char copy_buf[log_record_size]; /* AALTO-2 NOTE: NOT COMPLIANT WITH C90, POSSIBLE SOURCE OF PROBLEMS */
-    char copy_buf[COFFEE_PAGE_SIZE]; /* AALTO-2 NOTE: C90 COMPLIANCE */
-
-    lp_out.offset = offset = region * log_record_size;
-    lp_out.buf = copy_buf;
-    lp_out.size = log_record_size;
-
-    if((lp->offset > 0 || lp->size != log_record_size) &&
-       read_log_page(&hdr, log_record, &lp_out) < 0) {
-      COFFEE_READ(copy_buf, sizeof(copy_buf),
-                  absolute_offset(file->page, offset));
+  for(i = name_hash(name) % COFFEE_NAME_INDEX_SIZE;
+      vol->name_index.entries[i].tag != 0;
+      i = (i + 1) % COFFEE_NAME_INDEX_SIZE) {
+    entry = &vol->name_index.entries[i];
+    if(entry->tag == page + 1) {
+      entry->tag = NAME_INDEX_TOMBSTONE;
+      return;
     }
-
-    memcpy(&copy_buf[lp->offset], lp->buf, lp->size);
-
-    /*
-     * Write the region number in the region index table.
-     * The region number is incremented to avoid values of zero.
-     */
-    offset = absolute_offset(log_page, 0);
-    ++region;
-    COFFEE_WRITE(&region, sizeof(region),
-                 offset + log_record * sizeof(region));
-
-    offset += log_records * sizeof(region);
-    COFFEE_WRITE(copy_buf, sizeof(copy_buf),
-                 offset + log_record * log_record_size);
-    file->record_count = log_record + 1;
   }
-
-  return lp->size;
 }
-#endif /* COFFEE_MICRO_LOGS */
 /*---------------------------------------------------------------------------*/
-static int
-get_available_fd(void)
+static void
+name_index_build(struct cfs_coffee_volume *vol)
 {
-  int i;
+  struct cfs_coffee_mount_stats stats;
 
-  for(i = 0; i < COFFEE_FD_SET_SIZE; i++) {
-    if(coffee_fd_set[i].flags == COFFEE_FD_FREE) {
-      return i;
-    }
-  }
-  return -1;
+  vol->name_index.state = NAME_INDEX_UNBUILT;
+  scan_headers(vol, &stats);
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_open(const char *name, int flags)
+/*
+ * Look up the header page of an active file. Returns INVALID_PAGE if
+ * the file does not exist, or UNKNOWN_PAGE if the index cannot answer
+ * and the caller must scan the storage.
+ */
+#define UNKNOWN_PAGE  ((coffee_page_t)-2)
+
+static coffee_page_t
+name_index_lookup(struct cfs_coffee_volume *vol, const char *name,
+                  struct file_header *hdr)
 {
-  int fd;
-  struct file_desc *fdp;
+  struct name_index_entry *entry;
+  uint32_t hash;
+  unsigned i;
 
-  fd = get_available_fd();
-  if(fd < 0) {
-    PRINTF("Coffee: Failed to allocate a new file descriptor!\n");
-    return -1;
+  if(vol->name_index.state == NAME_INDEX_UNBUILT) {
+    name_index_build(vol);
+  }
+  if(vol->name_index.state != NAME_INDEX_BUILT) {
+    return UNKNOWN_PAGE;
   }
 
-  fdp = &coffee_fd_set[fd];
-  fdp->flags = 0;
-
-  fdp->file = find_file(name);
-  if(fdp->file == NULL) {
-    if((flags & (CFS_READ | CFS_WRITE)) == CFS_READ) {
-      return -1;
+  hash = name_hash(name);
+  for(i = hash % COFFEE_NAME_INDEX_SIZE;
+      vol->name_index.entries[i].tag != 0;
+      i = (i + 1) % COFFEE_NAME_INDEX_SIZE) {
+    entry = &vol->name_index.entries[i];
+    if(entry->tag == NAME_INDEX_TOMBSTONE || entry->hash != (uint16_t)hash) {
+      continue;
     }
-    fdp->file = reserve(name, page_count(COFFEE_DYN_SIZE), 1, 0);
-    if(fdp->file == NULL) {
-      return -1;
+    read_header(vol, hdr, entry->tag - 1);
+    if(HDR_ACTIVE(*hdr) && !HDR_FILE_PART(*hdr) &&
+       strcmp(name, hdr->name) == 0) {
+      return entry->tag - 1;
     }
-    fdp->file->end = 0;
-  } else if(fdp->file->end == UNKNOWN_OFFSET) {
-    fdp->file->end = file_end(fdp->file->page);
   }
 
-  fdp->flags |= flags;
-  fdp->offset = flags & CFS_APPEND ? fdp->file->end : 0;
-  fdp->file->references++;
-
-  return fd;
-}
-/*---------------------------------------------------------------------------*/
-void
-cfs_close(int fd)
-{
-  if(FD_VALID(fd)) {
-    coffee_fd_set[fd].flags = COFFEE_FD_FREE;
-    coffee_fd_set[fd].file->references--;
-    coffee_fd_set[fd].file = NULL;
-  }
+  return INVALID_PAGE;
 }
+#endif /* COFFEE_NAME_INDEX_SIZE */
 /*---------------------------------------------------------------------------*/
-cfs_offset_t
-cfs_seek(int fd, cfs_offset_t offset, int whence)
+/*
+ * Walk the headers like next_file() does, and rebuild the sector table
+ * and the name index if they are not built, so that whichever is needed
+ * first brings the other along. Count what the walk finds, and return
+ * the first free page, or INVALID_PAGE if no page is free.
+ */
+static coffee_page_t
+scan_headers(struct cfs_coffee_volume *vol,
+             struct cfs_coffee_mount_stats *stats)
 {
-  struct file_desc *fdp;
-  cfs_offset_t new_offset;
+  struct file_header hdr;
+  coffee_page_t page, count, first_free;
+#if COFFEE_SECTOR_TABLE
+  char table;
+#endif
+#if COFFEE_NAME_INDEX_SIZE
+  char index;
+#endif
 
-  if(!FD_VALID(fd)) {
-    return -1;
+  memset(stats, 0, sizeof(*stats));
+#if COFFEE_SECTOR_TABLE
+  table = !vol->sector_table.built;
+  if(table) {
+    memset(&vol->sector_table, 0, sizeof(vol->sector_table));
   }
-  fdp = &coffee_fd_set[fd];
-
-  if(whence == CFS_SEEK_SET) {
-    new_offset = offset;
-  } else if(whence == CFS_SEEK_END) {
-    new_offset = fdp->file->end + offset;
-  } else if(whence == CFS_SEEK_CUR) {
-    new_offset = fdp->offset + offset;
-  } else {
-    return (cfs_offset_t)-1;
+#endif
+#if COFFEE_NAME_INDEX_SIZE
+  index = vol->name_index.state == NAME_INDEX_UNBUILT;
+  if(index) {
+    memset(&vol->name_index, 0, sizeof(vol->name_index));
+    vol->name_index.state = NAME_INDEX_BUILT;
   }
+#endif
 
-  if(new_offset < 0 || new_offset > fdp->file->max_pages * COFFEE_PAGE_SIZE) {
-    return -1;
+  first_free = INVALID_PAGE;
+  for(page = 0; page < vol->page_count; page += count) {
+    read_header(vol, &hdr, page);
+    stats->headers++;
+    if(HDR_FREE(hdr)) {
+      count = (page / VOL_PAGES_PER_SECTOR + 1) * VOL_PAGES_PER_SECTOR - page;
+      stats->free_pages += count;
+      if(first_free == INVALID_PAGE) {
+        first_free = page;
+      }
+#if COFFEE_SECTOR_TABLE
+      if(table) {
+        sector_table_move(vol, page, count, -1, PAGE_FREE);
+      }
+#endif
+    } else if(HDR_ISOLATED(hdr)) {
+      count = 1;
+      stats->obsolete_pages++;
+#if COFFEE_SECTOR_TABLE
+      if(table) {
+        sector_table_move(vol, page, 1, -1, PAGE_OBSOLETE);
+      }
+#endif
+    } else {
+      count = hdr.max_pages;
+      if(HDR_OBSOLETE(hdr)) {
+        stats->obsolete_pages += count;
+      } else {
+        stats->active_pages += count;
+      }
+#if COFFEE_SECTOR_TABLE
+      if(table) {
+        sector_table_move(vol, page, count, -1,
+                          HDR_OBSOLETE(hdr) ? PAGE_OBSOLETE : PAGE_ACTIVE);
+        sector_table_set_extent(vol, page, count);
+      }
+#endif
+      if(HDR_ACTIVE(hdr) && !HDR_FILE_PART(hdr)) {
+        stats->files++;
+#if COFFEE_NAME_INDEX_SIZE
+        if(index && vol->name_index.state == NAME_INDEX_BUILT) {
+          name_index_insert(vol, hdr.name, page);
+          if(vol->name_index.state != NAME_INDEX_BUILT) {
+            /* There are more files than the index can hold. */
+            vol->name_index.state = NAME_INDEX_OVERFLOW;
+          }
+        }
+#endif
+      }
+    }
   }
 
-  if(fdp->file->end < new_offset) {
-    fdp->file->end = new_offset;
+#if COFFEE_NAME_INDEX_SIZE
+  if(index && vol->name_index.state == NAME_INDEX_OVERFLOW) {
+    /* Count the files, so that removals tell when they fit again. */
+    vol->name_index.used = stats->files;
   }
-
-  return fdp->offset = new_offset;
+#endif
+#if COFFEE_SECTOR_TABLE
+  if(table) {
+    vol->sector_table.built = 1;
+#if COFFEE_FREE_EXTENT_INDEX
+    free_index_sector_changed(vol, vol->sector_count);
+#endif
+  }
+#endif
+  return first_free;
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_remove(const char *name)
+#if COFFEE_EOF_RECORDS
+/*
+ * Return the last recorded file end, or UNKNOWN_OFFSET if none exists.
+ * The number of used records is stored in "records".
+ */
+static cfs_offset_t
+eof_record_last(struct file_header *hdr, int *records)
 {
-  struct file *file;
+  int i;
 
-  /*
-   * Coffee removes files by marking them as obsolete. The space
-   * is not guaranteed to be reclaimed immediately, but must be
-   * sweeped by the garbage collector. The garbage collector is
-   * called once a file reservation request cannot be granted.
-   */
-  file = find_file(name);
-  if(file == NULL) {
-    return -1;
-  }
+  for(i = 0; i < COFFEE_EOF_RECORDS && hdr->eof_records[i] != 0; i++);
+  *records = i;
+  return i == 0 ? UNKNOWN_OFFSET : EOF_RECORD_OFFSET(hdr->eof_records[i - 1]);
+}
+/*---------------------------------------------------------------------------*/
+/* Check whether the file has been written since its last record. */
+static int
+eof_record_dirty(struct file_header *hdr)
+{
+  int records;
 
-  return remove_by_page(file->page, REMOVE_LOG, CLOSE_FDS, ALLOW_GC);
+  eof_record_last(hdr, &records);
+  return records > 0 && (hdr->eof_records[records - 1] & EOF_RECORD_DIRTY);
 }
+#endif /* COFFEE_EOF_RECORDS */
 /*---------------------------------------------------------------------------*/
-int
-cfs_read(int fd, void *buf, unsigned size)
+static struct file *
+load_file(struct cfs_coffee_volume *vol, coffee_page_t start,
+          struct file_header *hdr)
 {
-  struct file_desc *fdp;
+  int i, unreferenced, free;
   struct file *file;
-#if COFFEE_MICRO_LOGS
-  struct file_header hdr;
-  struct log_param lp;
-  unsigned bytes_left;
-  int r;
-#endif
 
-  if(!(FD_VALID(fd) && FD_READABLE(fd))) {
-    return -1;
+  /*
+   * We prefer to overwrite a free slot since unreferenced ones
+   * contain usable data. Free slots are designated by the page
+   * value INVALID_PAGE.
+   */
+  for(i = 0, unreferenced = free = -1; i < COFFEE_MAX_OPEN_FILES; i++) {
+    if(FILE_FREE(&coffee_files[i])) {
+      free = i;
+      break;
+    } else if(FILE_UNREFERENCED(&coffee_files[i])) {
+      unreferenced = i;
+    }
   }
 
-  fdp = &coffee_fd_set[fd];
-  file = fdp->file;
-  if(fdp->offset + size > file->end) {
-    size = file->end - fdp->offset;
+  if(free == -1) {
+    if(unreferenced != -1) {
+      i = unreferenced;
+    } else {
+      return NULL;
+    }
   }
 
-  /* If the file is allocated, read directly in the file. */
-  if(!FILE_MODIFIED(file)) {
-    COFFEE_READ(buf, size, absolute_offset(file->page, fdp->offset));
-    fdp->offset += size;
-    return size;
+  file = &coffee_files[i];
+  file->page = start;
+  file->end = UNKNOWN_OFFSET;
+  file->max_pages = hdr->max_pages;
+  file->flags = 0;
+  if(HDR_MODIFIED(*hdr)) {
+    file->flags |= COFFEE_FILE_MODIFIED;
   }
+  if(HDR_RING(*hdr)) {
+    file->flags |= COFFEE_FILE_RING;
+  }
+#if COFFEE_EOF_RECORDS
+  if(eof_record_dirty(hdr)) {
+    file->flags |= COFFEE_FILE_EOF_DIRTY;
+  }
+#endif
+  if(HDR_COMPRESSED(*hdr)) {
+    file->flags |= COFFEE_FILE_COMPRESSED;
+  }
+  /* We don't know the amount of records yet. */
+  file->record_count = -1;
 
-#if COFFEE_MICRO_LOGS
-  read_header(&hdr, file->page);
-
-  /*
-   * Fill the buffer by copying from the log in first hand, or the
-   * ordinary file if the page has no log record.
-   */
-  for(bytes_left = size; bytes_left > 0; bytes_left -= r) {
-    lp.offset = fdp->offset;
-    lp.buf = buf;
-    lp.size = bytes_left;
-    r = read_log_page(&hdr, file->record_count, &lp);
-
-    /* Read from the original file if we cannot find the data in the log. */
-    if(r < 0) {
-      COFFEE_READ(buf, lp.size, absolute_offset(file->page, fdp->offset));
-      r = lp.size;
+#if COFFEE_EXTENT_CHAINS
+  {
+    struct file_header extent;
+
+    /* Find the last extent, to which the file is appended. */
+    file->last_page = start;
+    file->last_pages = hdr->max_pages;
+    file->last_offset = 0;
+    for(extent = *hdr; extent.next_extent != 0;) {
+      file->last_offset += extent_capacity(vol, extent.max_pages);
+      file->last_page = extent.next_extent - 1;
+      read_header(vol, &extent, file->last_page);
+      file->last_pages = extent.max_pages;
     }
-    fdp->offset += r;
-    buf = (char *)buf + r;
   }
-#endif /* COFFEE_MICRO_LOGS */
+#endif
 
-  return size;
+  return file;
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_write(int fd, const void *buf, unsigned size)
+static cfs_offset_t
+file_capacity(struct cfs_coffee_volume *vol, struct file *file)
 {
-  struct file_desc *fdp;
-  struct file *file;
-#if COFFEE_MICRO_LOGS
-  int i;
-  struct log_param lp;
-  cfs_offset_t bytes_left;
-  int8_t need_dummy_write;
-  const unsigned char dummy[1] = { 0xff }; /* AALTO-2 MODIFICATION: added "unsigned" */
+#if COFFEE_EXTENT_CHAINS
+  return file->last_offset + extent_capacity(vol, file->last_pages);
+#else
+  return extent_capacity(vol, file->max_pages);
 #endif
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_EXTENT_CHAINS
+/*
+ * Find the extent that holds a file offset. Return the number of bytes
+ * of the extent from that offset on, and its page and file offset in
+ * *page and *base.
+ */
+static cfs_offset_t
+extent_lookup(struct cfs_coffee_volume *vol, struct file *file,
+              cfs_offset_t offset, coffee_page_t *page, cfs_offset_t *base)
+{
+  struct file_header hdr;
 
-  if(!(FD_VALID(fd) && FD_WRITABLE(fd))) {
-    return -1;
+  /* Appends go to the last extent, which does not need a walk. */
+  if(offset >= file->last_offset) {
+    *page = file->last_page;
+    *base = file->last_offset;
+    return file->last_offset + extent_capacity(vol, file->last_pages) - offset;
   }
 
-  fdp = &coffee_fd_set[fd];
-  file = fdp->file;
-
-  /* Attempt to extend the file if we try to write past the end. */
-#if COFFEE_IO_SEMANTICS
-  if(!(fdp->io_flags & CFS_COFFEE_IO_FIRM_SIZE)) {
-#endif
-  while(size + fdp->offset + sizeof(struct file_header) >
-        (file->max_pages * COFFEE_PAGE_SIZE)) {
-    if(merge_log(file->page, 1) < 0) {
-      return -1;
+  *page = file->page;
+  *base = 0;
+  for(;;) {
+    read_header(vol, &hdr, *page);
+    if(offset < *base + extent_capacity(vol, hdr.max_pages)) {
+      return *base + extent_capacity(vol, hdr.max_pages) - offset;
     }
-    file = fdp->file;
-    PRINTF("Extended the file at page %u\n", (unsigned)file->page);
+    *base += extent_capacity(vol, hdr.max_pages);
+    *page = hdr.next_extent - 1;
   }
-#if COFFEE_IO_SEMANTICS
 }
+#endif /* COFFEE_EXTENT_CHAINS */
+/*---------------------------------------------------------------------------*/
+static void
+file_read(struct cfs_coffee_volume *vol, struct file *file, void *buf,
+          cfs_offset_t size, cfs_offset_t offset)
+{
+#if COFFEE_EXTENT_CHAINS
+  coffee_page_t page;
+  cfs_offset_t base, length;
+
+  for(; size > 0; size -= length) {
+    length = extent_lookup(vol, file, offset, &page, &base);
+    if(length > size || page == file->last_page) {
+      length = size;
+    }
+    FLASH_READ(buf, length, absolute_offset(vol, page, offset - base));
+    buf = (char *)buf + length;
+    offset += length;
+  }
+#else
+  FLASH_READ(buf, size, absolute_offset(vol, file->page, offset));
 #endif
+}
+/*---------------------------------------------------------------------------*/
+static void
+file_write(struct cfs_coffee_volume *vol, struct file *file, const void *buf,
+           cfs_offset_t size, cfs_offset_t offset)
+{
+#if COFFEE_EXTENT_CHAINS
+  coffee_page_t page;
+  cfs_offset_t base, length;
 
-#if COFFEE_MICRO_LOGS
-#if COFFEE_IO_SEMANTICS
-  if(!(fdp->io_flags & CFS_COFFEE_IO_FLASH_AWARE) &&
-     (FILE_MODIFIED(file) || fdp->offset < file->end)) {
+  for(; size > 0; size -= length) {
+    length = extent_lookup(vol, file, offset, &page, &base);
+    if(length > size || page == file->last_page) {
+      length = size;
+    }
+    flash_write(vol, buf, length, absolute_offset(vol, page, offset - base));
+    buf = (const char *)buf + length;
+    offset += length;
+  }
 #else
-  if(FILE_MODIFIED(file) || fdp->offset < file->end) {
+  flash_write(vol, buf, size, absolute_offset(vol, file->page, offset));
 #endif
-    need_dummy_write = 0;
-    for(bytes_left = size; bytes_left > 0;) {
-      lp.offset = fdp->offset;
-      lp.buf = buf;
-      lp.size = bytes_left;
-      i = write_log_page(file, &lp);
-      if(i < 0) {
-        /* Return -1 if we wrote nothing because the log write failed. */
-        if(size == bytes_left) {
-          return -1;
-        }
-        break;
-      } else if(i == 0) {
-        /* The file was merged with the log. */
-        file = fdp->file;
-      } else {
-        /* A log record was written. */
-        bytes_left -= i;
-        fdp->offset += i;
-        buf = (char *)buf + i;
+}
+/*---------------------------------------------------------------------------*/
+static struct file *
+find_file(struct cfs_coffee_volume *vol, const char *name)
+{
+  int i;
+  struct file_header hdr;
+  coffee_page_t page;
 
-        /* Update the file end for a potential log merge that might
-           occur while writing log records. */
-        if(fdp->offset > file->end) {
-          file->end = fdp->offset;
-          need_dummy_write = 1;
-        }
+#if COFFEE_NAME_INDEX_SIZE
+  page = name_index_lookup(vol, name, &hdr);
+  if(page == INVALID_PAGE) {
+    return NULL;
+  } else if(page != UNKNOWN_PAGE) {
+    for(i = 0; i < COFFEE_MAX_OPEN_FILES; i++) {
+      if(!FILE_FREE(&coffee_files[i]) && coffee_files[i].page == page) {
+        return &coffee_files[i];
       }
     }
+    return load_file(vol, page, &hdr);
+  }
+  IO_BYTES(name_scans, 1);
+#endif /* COFFEE_NAME_INDEX_SIZE */
 
-    if(need_dummy_write) {
-      /*
-       * A log record has been written at an offset beyond the original
-       * extent's end. Consequently, we need to write a dummy value at the
-       * corresponding end offset in the original extent to ensure that
-       * the correct file size is calculated when opening the file again.
-       */
-      COFFEE_WRITE(dummy, 1, absolute_offset(file->page, fdp->offset - 1));
+  /* First check if the file metadata is cached. */
+  for(i = 0; i < COFFEE_MAX_OPEN_FILES; i++) {
+    if(FILE_FREE(&coffee_files[i])) {
+      continue;
+    }
+
+    read_header(vol, &hdr, coffee_files[i].page);
+    if(HDR_ACTIVE(hdr) && !HDR_FILE_PART(hdr) &&
+       strcmp(name, hdr.name) == 0) {
+      return &coffee_files[i];
     }
-  } else {
-#endif /* COFFEE_MICRO_LOGS */
-#if COFFEE_APPEND_ONLY
-  if(fdp->offset < file->end) {
-    return -1;
   }
-#endif /* COFFEE_APPEND_ONLY */
 
-  COFFEE_WRITE(buf, size, absolute_offset(file->page, fdp->offset));
-  fdp->offset += size;
-#if COFFEE_MICRO_LOGS
+  /* Scan the flash memory sequentially otherwise. */
+  for(page = 0; page < vol->page_count; page = next_file(vol, page, &hdr)) {
+    read_header(vol, &hdr, page);
+    if(HDR_ACTIVE(hdr) && !HDR_FILE_PART(hdr) &&
+       strcmp(name, hdr.name) == 0) {
+      return load_file(vol, page, &hdr);
+    }
+  }
+
+  return NULL;
 }
-#endif /* COFFEE_MICRO_LOGS */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_EOF_RECORDS
+/*
+ * Add a file end record to the header. Return 1 if the header must be
+ * written, or 0 if the end is already recorded or no records are left.
+ */
+static int
+eof_record_add(struct file_header *hdr, cfs_offset_t end)
+{
+  int records;
 
-  if(fdp->offset > file->end) {
-    file->end = fdp->offset;
+  if(end == UNKNOWN_OFFSET ||
+     (eof_record_last(hdr, &records) == end && !eof_record_dirty(hdr)) ||
+     records == COFFEE_EOF_RECORDS) {
+    return 0;
   }
-
-  return size;
+  hdr->eof_records[records] = EOF_RECORD(end);
+  return 1;
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_opendir(struct cfs_dir *dir, const char *name)
+/*
+ * Set the dirty bit of the last record before the file is written.
+ * Return 1 if the header must be written.
+ */
+static int
+eof_record_mark(struct file_header *hdr)
 {
-  /*
-   * Coffee is only guaranteed to support "/" and ".", but it does not
-   * currently enforce this.
-   */
-  memset(dir->dummy_space, 0, sizeof(coffee_page_t));
-  return 0;
+  int records;
+
+  eof_record_last(hdr, &records);
+  if(records == 0 || eof_record_dirty(hdr)) {
+    return 0;
+  }
+  hdr->eof_records[records - 1] |= EOF_RECORD_DIRTY;
+  return 1;
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_readdir(struct cfs_dir *dir, struct cfs_dirent *record)
+/*
+ * Mark the header of a file before its first write after the last
+ * record, so that a crash before the next record makes file_end() scan
+ * the whole extent. Zeros written after the record cannot be told from
+ * erased bytes, so the data after them is only found by that scan.
+ */
+static void
+eof_record_mark_file(struct cfs_coffee_volume *vol, struct file *file)
 {
   struct file_header hdr;
-  coffee_page_t page;
-
-  memcpy(&page, dir->dummy_space, sizeof(coffee_page_t));
-
-  while(page < COFFEE_PAGE_COUNT) {
-    read_header(&hdr, page);
-    if(HDR_ACTIVE(hdr) && !HDR_LOG(hdr)) {
-      coffee_page_t next_page;
-      memcpy(record->name, hdr.name, sizeof(record->name));
-      record->name[sizeof(record->name) - 1] = '\0';
-      record->size = file_end(page);
 
-      next_page = next_file(page, &hdr);
-      memcpy(dir->dummy_space, &next_page, sizeof(coffee_page_t));
-      return 0;
-    }
-    page = next_file(page, &hdr);
+  if(file->flags & COFFEE_FILE_EOF_DIRTY) {
+    return;
   }
-
-  return -1;
+  read_header(vol, &hdr, file->page);
+  if(eof_record_mark(&hdr)) {
+    write_header(vol, &hdr, file->page);
+  }
+  file->flags |= COFFEE_FILE_EOF_DIRTY;
 }
 /*---------------------------------------------------------------------------*/
-void
-cfs_closedir(struct cfs_dir *dir)
+/*
+ * A clean record is current unless the file was written by a writer
+ * that did not mark the header. The bytes after a current end are still
+ * erased, so checking the rest of its page and the following page bounds
+ * the cost of trusting it.
+ */
+static int
+eof_record_current(struct cfs_coffee_volume *vol, coffee_page_t start,
+                   struct file_header *hdr, cfs_offset_t end)
 {
-  return;
+  unsigned char buf[COFFEE_MAX_PAGE_SIZE];
+  cfs_offset_t offset, limit;
+  unsigned size, i;
+
+  offset = absolute_offset(vol, start, end);
+  limit = (offset / VOL_PAGE_SIZE + 2) * VOL_PAGE_SIZE;
+  if(limit > (start + hdr->max_pages) * VOL_PAGE_SIZE) {
+    limit = (start + hdr->max_pages) * VOL_PAGE_SIZE;
+  }
+
+  for(; offset < limit; offset += size) {
+    size = limit - offset > sizeof(buf) ? sizeof(buf) : limit - offset;
+    FLASH_READ(buf, size, offset);
+    for(i = 0; i < size; i++) {
+      if(buf[i] != 0) {
+        return 0;
+      }
+    }
+  }
+  return 1;
 }
+#endif /* COFFEE_EOF_RECORDS */
 /*---------------------------------------------------------------------------*/
-int
-cfs_coffee_reserve(const char *name, cfs_offset_t size)
+/* Find the end of the data in an extent, which is at least "end". */
+static cfs_offset_t
+extent_end(struct cfs_coffee_volume *vol, coffee_page_t start,
+           struct file_header *hdr, coffee_page_t first_page, cfs_offset_t end)
 {
-  return reserve(name, page_count(size), 0, 0) == NULL ? -1 : 0;
+  unsigned char buf[COFFEE_MAX_PAGE_SIZE];
+  coffee_page_t page;
+  cfs_offset_t offset;
+  int i;
+
+  /*
+   * Move from the end of the range towards the beginning and look for
+   * a byte that has been modified.
+   *
+   * An important implication of this is that if the last written bytes
+   * are zeroes, then these are skipped from the calculation.
+   */
+
+  for(page = hdr->max_pages - 1; page >= first_page; page--) {
+    FLASH_READ(buf, VOL_PAGE_SIZE, (start + page) * VOL_PAGE_SIZE);
+    for(i = VOL_PAGE_SIZE - 1; i >= 0; i--) {
+      if(buf[i] != 0) {
+        if(page == 0 && i < sizeof(*hdr)) {
+          return end;
+        }
+        offset = 1 + i + (page * VOL_PAGE_SIZE) - sizeof(*hdr);
+        return offset > end ? offset : end;
+      }
+    }
+  }
+
+  /* All bytes are writable. */
+  return end;
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_coffee_configure_log(const char *filename, unsigned log_size,
-                         unsigned log_record_size)
+static cfs_offset_t
+file_end(struct cfs_coffee_volume *vol, coffee_page_t start)
 {
-  struct file *file;
   struct file_header hdr;
+  coffee_page_t page, first_page;
+  cfs_offset_t base, end;
+#if COFFEE_EXTENT_CHAINS
+  coffee_page_t prev_page;
+  cfs_offset_t prev_base;
+#endif
+#if COFFEE_EOF_RECORDS
+  cfs_offset_t recorded;
+  int records, dirty;
+#endif
 
-  if(log_record_size == 0 || log_record_size > COFFEE_PAGE_SIZE ||
-     log_size < log_record_size) {
-    return -1;
-  }
+  read_header(vol, &hdr, start);
+#if COFFEE_EOF_RECORDS
+  recorded = eof_record_last(&hdr, &records);
+  dirty = eof_record_dirty(&hdr);
+#endif
 
-  file = find_file(filename);
-  if(file == NULL) {
-    return -1;
+  /* The end of the file is in its last extent. */
+  page = start;
+  base = 0;
+#if COFFEE_EXTENT_CHAINS
+  prev_page = INVALID_PAGE;
+  prev_base = 0;
+  while(hdr.next_extent != 0) {
+    prev_page = page;
+    prev_base = base;
+    base += extent_capacity(vol, hdr.max_pages);
+    page = hdr.next_extent - 1;
+    read_header(vol, &hdr, page);
   }
+#endif
 
-  read_header(&hdr, file->page);
-  if(HDR_MODIFIED(hdr)) {
-    /* Too late to customize the log. */
-    return -1;
+  end = 0;
+  first_page = 0;
+#if COFFEE_EOF_RECORDS
+  if(recorded != UNKNOWN_OFFSET && recorded >= base) {
+    end = recorded - base;
+    if(!dirty && eof_record_current(vol, page, &hdr, end)) {
+      return recorded;
+    }
+    /* Recover the end of a file that has grown since the last record,
+       which is at least the recorded end. */
+    first_page = (end + sizeof(hdr)) / VOL_PAGE_SIZE;
   }
+#endif
 
-  hdr.log_records = log_size / log_record_size;
-  hdr.log_record_size = log_record_size;
-  write_header(&hdr, file->page);
-
-  return 0;
+  end = extent_end(vol, page, &hdr, first_page, end);
+#if COFFEE_EXTENT_CHAINS
+  if(end == 0 && prev_page != INVALID_PAGE) {
+    /* The last extent was linked, but nothing was written to it. */
+    read_header(vol, &hdr, prev_page);
+    return prev_base + extent_end(vol, prev_page, &hdr, 0, 0);
+  }
+#endif
+  return base + end;
 }
 /*---------------------------------------------------------------------------*/
-#if COFFEE_IO_SEMANTICS
-int
-cfs_coffee_set_io_semantics(int fd, unsigned flags)
+static coffee_page_t
+find_contiguous_pages(struct cfs_coffee_volume *vol, coffee_page_t amount)
 {
-  if(!FD_VALID(fd)) {
-    return -1;
-  }
+#if COFFEE_FREE_EXTENT_INDEX
+  return free_index_find(vol, amount);
+#else
+  coffee_page_t page, start;
+  struct file_header hdr;
 
-  coffee_fd_set[fd].io_flags |= flags;
+  start = INVALID_PAGE;
+  for(page = *next_free; page < vol->page_count;) {
+    read_header(vol, &hdr, page);
+    if(HDR_FREE(hdr)) {
+      if(start == INVALID_PAGE) {
+        start = page;
+        if(start + amount >= vol->page_count) {
+          /* We can stop immediately if the remaining pages are not enough. */
+          break;
+        }
+      }
 
-  return 0;
+      /* All remaining pages in this sector are free --
+         jump to the next sector. */
+      page = next_file(vol, page, &hdr);
+
+      if(start + amount <= page) {
+        if(start == *next_free) {
+          *next_free = start + amount;
+        }
+        return start;
+      }
+    } else {
+      start = INVALID_PAGE;
+      page = next_file(vol, page, &hdr);
+    }
+  }
+  return INVALID_PAGE;
+#endif /* COFFEE_FREE_EXTENT_INDEX */
 }
-#endif
 /*---------------------------------------------------------------------------*/
-int
-cfs_coffee_format(void)
+static int
+remove_by_page(struct cfs_coffee_volume *vol, coffee_page_t page,
+               int remove_log, int close_fds, int gc_allowed)
 {
-  unsigned i;
-
-  PRINTF("Coffee: Formatting %u sectors", COFFEE_SECTOR_COUNT);
-
-  *next_free = 0;
+  struct file_header hdr;
+  int i;
+#if COFFEE_RING_FILES
+  struct ring *ring;
+#endif
+#if COFFEE_COMPRESSED_FILES
+  struct compressed *compressed;
+#endif
 
-  for(i = 0; i < COFFEE_SECTOR_COUNT; i++) {
-    COFFEE_ERASE(i);
-    PRINTF(".");
+  read_header(vol, &hdr, page);
+  if(!HDR_ACTIVE(hdr)) {
+    return -1;
   }
 
-  /* Formatting invalidates the file information. */
-  memset(&protected_mem, 0, sizeof(protected_mem));
-
-  PRINTF(" done!\n");
-
-  return 0;
+  if(remove_log && HDR_MODIFIED(hdr)) {
+    if(remove_by_page(vol, hdr.log_page, !REMOVE_LOG, !CLOSE_FDS,
+                      !ALLOW_GC) < 0) {
+      return -1;
+    }
+  }
+#if COFFEE_EXTENT_CHAINS
+  if(hdr.next_extent != 0 &&
+     remove_by_page(vol, hdr.next_extent - 1, !REMOVE_LOG, !CLOSE_FDS,
+                    !ALLOW_GC) < 0) {
+    return -1;
+  }
+#endif
+
+  hdr.flags |= HDR_FLAG_OBSOLETE;
+  write_header(vol, &hdr, page);
+#if COFFEE_SECTOR_TABLE
+  if(vol->sector_table.built) {
+    sector_table_move(vol, page, hdr.max_pages, PAGE_ACTIVE, PAGE_OBSOLETE);
+  }
+#endif
+#if COFFEE_NAME_INDEX_SIZE
+  if(!HDR_FILE_PART(hdr)) {
+    name_index_remove(vol, hdr.name, page);
+  }
+#endif
+
+  *gc_wait = 0;
+
+  /* Close all file descriptors that reference the removed file. */
+  if(close_fds) {
+    for(i = 0; i < COFFEE_FD_SET_SIZE; i++) {
+      if(coffee_fd_set[i].file != NULL && coffee_fd_set[i].file->page == page) {
+        coffee_fd_set[i].flags = COFFEE_FD_FREE;
+      }
+    }
+  }
+
+#if COFFEE_RING_FILES
+  /* The records of a removed ring that are not programmed are lost. */
+  ring = ring_find(vol, page);
+  if(ring != NULL) {
+    ring->references = 0;
+  }
+#endif
+#if COFFEE_COMPRESSED_FILES
+  /* Likewise the data that is not stored in blocks, unless the file is
+     only moved by a merge. */
+  compressed = compressed_find(vol, page);
+  if(compressed != NULL && close_fds) {
+    compressed->references = 0;
+  }
+#endif
+
+  for(i = 0; i < COFFEE_MAX_OPEN_FILES; i++) {
+    if(coffee_files[i].page == page) {
+      coffee_files[i].page = INVALID_PAGE;
+      coffee_files[i].references = 0;
+      coffee_files[i].max_pages = 0;
+    }
+  }
+
+#if !COFFEE_EXTENDED_WEAR_LEVELLING
+  if(gc_allowed) {
+    collect_garbage(vol, GC_RELUCTANT);
+  }
+#endif
+
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static coffee_page_t
+page_count(struct cfs_coffee_volume *vol, cfs_offset_t size)
+{
+  return (size + sizeof(struct file_header) + VOL_PAGE_SIZE - 1) /
+         VOL_PAGE_SIZE;
+}
+/*---------------------------------------------------------------------------*/
+static coffee_page_t
+reserve_pages(struct cfs_coffee_volume *vol, const char *name,
+              coffee_page_t pages, unsigned flags, uint8_t kind,
+              struct file_header *hdr_out)
+{
+  struct file_header hdr;
+  coffee_page_t page;
+
+  page = find_contiguous_pages(vol, pages);
+  if(page == INVALID_PAGE) {
+    if(*gc_wait) {
+      return INVALID_PAGE;
+    }
+    vol->pool.stats.foreground_gcs++;
+    collect_garbage(vol, GC_GREEDY);
+    page = find_contiguous_pages(vol, pages);
+    if(page == INVALID_PAGE) {
+      *gc_wait = 1;
+      return INVALID_PAGE;
+    }
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  strncpy(hdr.name, name, sizeof(hdr.name) - 1);
+  hdr.max_pages = pages;
+  hdr.flags = HDR_FLAG_ALLOCATED | flags;
+  hdr.kind = kind;
+#if COFFEE_EOF_RECORDS
+  if(!HDR_FILE_PART(hdr)) {
+    eof_record_add(&hdr, 0);
+  }
+#endif
+  write_header(vol, &hdr, page);
+#if COFFEE_SECTOR_TABLE
+  if(vol->sector_table.built) {
+    sector_table_move(vol, page, pages, PAGE_FREE, PAGE_ACTIVE);
+    sector_table_set_extent(vol, page, pages);
+  }
+#endif
+#if COFFEE_NAME_INDEX_SIZE
+  if(!HDR_FILE_PART(hdr)) {
+    name_index_insert(vol, hdr.name, page);
+  }
+#endif
+
+  PRINTF("Coffee: Reserved %u pages starting from %u for file %s\n",
+         pages, page, name);
+
+  *hdr_out = hdr;
+  return page;
+}
+/*---------------------------------------------------------------------------*/
+static struct file *
+reserve(struct cfs_coffee_volume *vol, const char *name, coffee_page_t pages,
+        int allow_duplicates, unsigned flags)
+{
+  struct file_header hdr;
+  coffee_page_t page;
+  struct file *file;
+
+  if(!allow_duplicates && find_file(vol, name) != NULL) {
+    return NULL;
+  }
+
+  page = reserve_pages(vol, name, pages, flags, HDR_KIND_FILE, &hdr);
+  if(page == INVALID_PAGE) {
+    return NULL;
+  }
+
+  file = load_file(vol, page, &hdr);
+  if(file != NULL) {
+    file->end = 0;
+  }
+
+  return file;
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_EXTENT_CHAINS
+/*
+ * Link a continuation extent to a file, so that it can hold "capacity"
+ * bytes. The extent doubles the size of the file if there is space.
+ */
+static int
+extend_file(struct cfs_coffee_volume *vol, struct file *file,
+            cfs_offset_t capacity)
+{
+  struct file_header hdr;
+  coffee_page_t page, pages, min_pages;
+
+  read_header(vol, &hdr, file->last_page);
+  min_pages = page_count(vol, capacity - file_capacity(vol, file));
+  pages = page_count(vol, file_capacity(vol, file));
+  if(pages < min_pages) {
+    pages = min_pages;
+  }
+
+  for(;; pages /= 2) {
+    if(pages < min_pages) {
+      pages = min_pages;
+    }
+    page = reserve_pages(vol, hdr.name, pages, HDR_FLAG_EXTENT,
+                         HDR_KIND_FILE, &hdr);
+    if(page != INVALID_PAGE || pages == min_pages) {
+      break;
+    }
+  }
+  if(page == INVALID_PAGE) {
+    return -1;
+  }
+
+  read_header(vol, &hdr, file->last_page);
+  hdr.next_extent = page + 1;
+  write_header(vol, &hdr, file->last_page);
+
+  file->last_offset += extent_capacity(vol, file->last_pages);
+  file->last_page = page;
+  file->last_pages = pages;
+  return 0;
+}
+#endif /* COFFEE_EXTENT_CHAINS */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_MICRO_LOGS
+static void
+adjust_log_config(struct cfs_coffee_volume *vol, struct file_header *hdr,
+                  uint16_t *log_record_size, uint16_t *log_records)
+{
+  *log_record_size = hdr->log_record_size == 0 ?
+    VOL_PAGE_SIZE : hdr->log_record_size;
+  *log_records = hdr->log_records == 0 ?
+    VOL_LOG_SIZE / *log_record_size : hdr->log_records;
+}
+#endif /* COFFEE_MICRO_LOGS */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_MICRO_LOGS
+static uint16_t
+modify_log_buffer(uint16_t log_record_size, cfs_offset_t *offset,
+                  uint16_t *size)
+{
+  uint16_t region;
+
+  region = *offset / log_record_size;
+  *offset %= log_record_size;
+
+  if(*size > log_record_size - *offset) {
+    *size = log_record_size - *offset;
+  }
+
+  return region;
+}
+#endif /* COFFEE_MICRO_LOGS */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_MICRO_LOGS
+static int
+get_record_index(struct cfs_coffee_volume *vol, coffee_page_t log_page,
+                 uint16_t search_records, uint16_t region)
+{
+  cfs_offset_t base;
+  uint16_t processed;
+  uint16_t batch_size;
+  int16_t match_index, i;
+
+  base = absolute_offset(vol, log_page, sizeof(uint16_t) * search_records);
+  batch_size = search_records > COFFEE_LOG_TABLE_LIMIT ?
+    COFFEE_LOG_TABLE_LIMIT : search_records;
+  processed = 0;
+  match_index = -1;
+
+  {
+    //uint16_t indices[batch_size]; /* AALTO-2 NOTE: NOT COMPLIANT WITH C90, POSSIBLE SOURCE OF PROBLEMS */
+	uint16_t indices[COFFEE_LOG_TABLE_LIMIT]; /* AALTO-2 NOTE: C90 COMPLIANCE */
+
+    while(processed < search_records && match_index < 0) {
+      if(batch_size + processed > search_records) {
+        batch_size = search_records - processed;
+      }
+
+      base -= batch_size * sizeof(indices[0]);
+      FLASH_READ(&indices, sizeof(indices[0]) * batch_size, base);
+
+      for(i = batch_size - 1; i >= 0; i--) {
+        if(indices[i] - 1 == region) {
+          match_index = search_records - processed - (batch_size - i);
+          break;
+        }
+      }
+
+      processed += batch_size;
+    }
+  }
+
+  return match_index;
+}
+#endif /* COFFEE_MICRO_LOGS */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_MICRO_LOGS && COFFEE_LOG_MAP_SIZE
+/*
+ * Load the log index table of a file into RAM unless it is already
+ * there. Return 0 if the table does not fit.
+ */
+static int
+log_map_load(struct cfs_coffee_volume *vol, struct file *file,
+             coffee_page_t log_page, uint16_t log_records)
+{
+  int16_t i;
+
+  if(FILE_LOG_MAP(file)) {
+    return 1;
+  }
+  if(log_records > COFFEE_LOG_MAP_SIZE) {
+    return 0;
+  }
+
+  FLASH_READ(file->log_map, log_records * sizeof(file->log_map[0]),
+              absolute_offset(vol, log_page, 0));
+  for(i = 0; i < log_records && file->log_map[i] != 0; i++);
+  file->record_count = i;
+  file->flags |= COFFEE_FILE_LOG_MAP;
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static int16_t
+log_map_find(struct file *file, uint16_t search_records, uint16_t region)
+{
+  int16_t i;
+
+  /* The newest record of the region is the valid one. */
+  for(i = search_records - 1; i >= 0; i--) {
+    if(file->log_map[i] - 1 == region) {
+      break;
+    }
+  }
+  return i;
+}
+#endif /* COFFEE_MICRO_LOGS && COFFEE_LOG_MAP_SIZE */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_MICRO_LOGS
+static int
+read_log_page(struct cfs_coffee_volume *vol, struct file *file,
+              struct file_header *hdr, int16_t record_count,
+              struct log_param *lp)
+{
+  uint16_t region;
+  int16_t match_index;
+  uint16_t log_record_size;
+  uint16_t log_records;
+  cfs_offset_t base;
+  uint16_t search_records;
+
+  adjust_log_config(vol, hdr, &log_record_size, &log_records);
+  region = modify_log_buffer(log_record_size, &lp->offset, &lp->size);
+
+#if COFFEE_LOG_MAP_SIZE
+  if(log_map_load(vol, file, hdr->log_page, log_records)) {
+    search_records = record_count < 0 ? file->record_count : record_count;
+    match_index = log_map_find(file, search_records, region);
+  } else
+#endif
+  {
+    search_records = record_count < 0 ? log_records : record_count;
+    match_index = get_record_index(vol, hdr->log_page, search_records, region);
+  }
+  if(match_index < 0) {
+    return -1;
+  }
+
+  base = absolute_offset(vol, hdr->log_page, log_records * sizeof(region));
+  base += (cfs_offset_t)match_index * log_record_size;
+  base += lp->offset;
+  FLASH_READ(lp->buf, lp->size, base);
+
+  return lp->size;
+}
+#endif /* COFFEE_MICRO_LOGS */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_MICRO_LOGS
+static coffee_page_t
+create_log(struct cfs_coffee_volume *vol, struct file *file,
+           struct file_header *hdr)
+{
+  uint16_t log_record_size, log_records;
+  cfs_offset_t size;
+  struct file *log_file;
+
+  adjust_log_config(vol, hdr, &log_record_size, &log_records);
+
+  /* Log index size + log data size. */
+  size = log_records * (sizeof(uint16_t) + log_record_size);
+
+  log_file = reserve(vol, hdr->name, page_count(vol, size), 1, HDR_FLAG_LOG);
+  if(log_file == NULL) {
+    return INVALID_PAGE;
+  }
+
+  hdr->flags |= HDR_FLAG_MODIFIED;
+  hdr->log_page = log_file->page;
+  write_header(vol, hdr, file->page);
+
+  file->flags |= COFFEE_FILE_MODIFIED;
+#if COFFEE_LOG_MAP_SIZE
+  /* The new log is empty. */
+  if(log_records <= COFFEE_LOG_MAP_SIZE) {
+    memset(file->log_map, 0, log_records * sizeof(file->log_map[0]));
+    file->record_count = 0;
+    file->flags |= COFFEE_FILE_LOG_MAP;
+  }
+#endif
+  return log_file->page;
+}
+#endif /* COFFEE_MICRO_LOGS */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_MICRO_LOGS
+/*
+ * Find the newest log record of each logged region of a file, in one
+ * pass over the log index table, and order them by region. Return the
+ * number of regions, or -1 if the index table does not fit in RAM.
+ */
+static int
+merge_plan(struct cfs_coffee_volume *vol, struct file *file,
+           coffee_page_t log_page, uint16_t log_records)
+{
+  uint16_t *indices;
+  int records, count, i, j;
+
+  records = find_next_record(vol, file, log_page, log_records);
+  if(records > COFFEE_LOG_TABLE_LIMIT) {
+    return -1;
+  }
+
+#if COFFEE_LOG_MAP_SIZE
+  if(FILE_LOG_MAP(file)) {
+    indices = file->log_map;
+  } else
+#endif
+  {
+    indices = vol->log_batch.indices;
+    FLASH_READ(indices, records * sizeof(indices[0]),
+               absolute_offset(vol, log_page, 0));
+  }
+
+  for(i = count = 0; i < records; i++) {
+    for(j = count; j > 0 && vol->merge.regions[j - 1] > indices[i] - 1; j--);
+    if(j > 0 && vol->merge.regions[j - 1] == indices[i] - 1) {
+      /* A newer record of the region replaces the older one. */
+      vol->merge.records[j - 1] = i;
+      continue;
+    }
+    memmove(&vol->merge.regions[j + 1], &vol->merge.regions[j],
+            (count - j) * sizeof(vol->merge.regions[0]));
+    memmove(&vol->merge.records[j + 1], &vol->merge.records[j],
+            (count - j) * sizeof(vol->merge.records[0]));
+    vol->merge.regions[j] = indices[i] - 1;
+    vol->merge.records[j] = i;
+    count++;
+  }
+  return count;
+}
+#endif /* COFFEE_MICRO_LOGS */
+/*---------------------------------------------------------------------------*/
+/*
+ * Copy a file to a new extent through the merge buffer. Each piece of
+ * the file is read from its extents in one read, the newest log records
+ * of the regions in it are laid over it, and the piece is programmed in
+ * one write. Return the number of bytes copied, or -1 if the log is too
+ * large to be planned in RAM.
+ */
+static cfs_offset_t
+merge_copy(struct cfs_coffee_volume *vol, struct file *file,
+           coffee_page_t new_page)
+{
+  cfs_offset_t offset, length;
+#if COFFEE_MICRO_LOGS
+  struct file_header hdr;
+  uint16_t log_record_size, log_records;
+  cfs_offset_t data, start, end;
+  int regions, i;
+
+  regions = 0;
+  if(FILE_MODIFIED(file)) {
+    read_header(vol, &hdr, file->page);
+    adjust_log_config(vol, &hdr, &log_record_size, &log_records);
+    regions = merge_plan(vol, file, hdr.log_page, log_records);
+    if(regions < 0) {
+      return -1;
+    }
+    data = absolute_offset(vol, hdr.log_page,
+                           log_records * sizeof(uint16_t));
+  }
+  i = 0;
+#endif
+
+  for(offset = 0; offset < file->end; offset += length) {
+    length = COFFEE_MERGE_BUFFER_SIZE -
+             absolute_offset(vol, new_page, offset) % COFFEE_MERGE_BUFFER_SIZE;
+    if(length > file->end - offset) {
+      length = file->end - offset;
+    }
+    file_read(vol, file, vol->merge.buf, length, offset);
+
+#if COFFEE_MICRO_LOGS
+    /* A region that continues in the next piece is visited again. */
+    for(; i < regions; i++) {
+      start = (cfs_offset_t)vol->merge.regions[i] * log_record_size;
+      end = start + log_record_size;
+      if(start >= offset + length) {
+        break;
+      }
+      if(start < offset) {
+        start = offset;
+      }
+      FLASH_READ(vol->merge.buf + (start - offset),
+                 (end < offset + length ? end : offset + length) - start,
+                 data + (cfs_offset_t)vol->merge.records[i] * log_record_size +
+                 start % log_record_size);
+      if(end > offset + length) {
+        break;
+      }
+    }
+#endif
+
+    flash_write(vol, vol->merge.buf, length,
+                absolute_offset(vol, new_page, offset));
+  }
+  return offset;
+}
+/*---------------------------------------------------------------------------*/
+/* Copy a file to a new extent by reading it through a descriptor, which
+   finds each region in the log separately. */
+static cfs_offset_t
+merge_copy_reads(struct cfs_coffee_volume *vol, int fd,
+                 coffee_page_t new_page)
+{
+  cfs_offset_t offset;
+  int n;
+
+  offset = 0;
+  do {
+    n = read_locked(vol, fd, vol->merge.buf, sizeof(vol->merge.buf));
+    if(n < 0) {
+      return -1;
+    } else if(n > 0) {
+      flash_write(vol, vol->merge.buf, n,
+                  absolute_offset(vol, new_page, offset));
+      offset += n;
+    }
+  } while(n != 0);
+  return offset;
+}
+/*---------------------------------------------------------------------------*/
+static int
+merge_file_log(struct cfs_coffee_volume *vol, coffee_page_t file_page,
+               int extend)
+{
+  struct file_header hdr, hdr2;
+  int fd;
+  cfs_offset_t offset;
+  coffee_page_t max_pages;
+  struct file *new_file;
+  int i;
+#if COFFEE_COMPRESSED_FILES
+  struct compressed *compressed;
+#endif
+#if COFFEE_EOF_RECORDS
+  int dirty;
+#endif
+
+  read_header(vol, &hdr, file_page);
+
+  fd = open_locked(vol, hdr.name, CFS_READ);
+  if(fd < 0) {
+    return -1;
+  }
+#if COFFEE_EOF_RECORDS
+  dirty = coffee_fd_set[fd].file->flags & COFFEE_FILE_EOF_DIRTY;
+#endif
+
+  /* The merged file holds all extents of the original one. */
+  max_pages = page_count(vol, file_capacity(vol, coffee_fd_set[fd].file))
+              << extend;
+  new_file = reserve(vol, hdr.name, max_pages, 1, 0);
+  if(new_file == NULL) {
+    close_locked(vol, fd);
+    return -1;
+  }
+
+  offset = merge_copy(vol, coffee_fd_set[fd].file, new_file->page);
+  if(offset < 0) {
+    offset = merge_copy_reads(vol, fd, new_file->page);
+  }
+  if(offset < 0) {
+    remove_by_page(vol, new_file->page, !REMOVE_LOG, !CLOSE_FDS, ALLOW_GC);
+    close_locked(vol, fd);
+    return -1;
+  }
+
+  for(i = 0; i < COFFEE_FD_SET_SIZE; i++) {
+    if(coffee_fd_set[i].flags != COFFEE_FD_FREE &&
+       coffee_fd_set[i].file->page == file_page) {
+      coffee_fd_set[i].file = new_file;
+      new_file->references++;
+    }
+  }
+
+  if(remove_by_page(vol, file_page, REMOVE_LOG, !CLOSE_FDS, !ALLOW_GC) < 0) {
+    remove_by_page(vol, new_file->page, !REMOVE_LOG, !CLOSE_FDS, !ALLOW_GC);
+    close_locked(vol, fd);
+    return -1;
+  }
+
+#if COFFEE_COMPRESSED_FILES
+  compressed = compressed_find(vol, file_page);
+  if(compressed != NULL) {
+    compressed->page = new_file->page;
+  }
+#endif
+
+  /* Copy the log configuration, which is the index of a compressed
+     file, and the kind, and record the file end. */
+  read_header(vol, &hdr2, new_file->page);
+  hdr2.log_record_size = hdr.log_record_size;
+  hdr2.log_records = hdr.log_records;
+  hdr2.kind = hdr.kind;
+#if COFFEE_EOF_RECORDS
+  /* The file end only adds bits to the record of the empty file, which
+     leaves the other records to the writers of the merged file. */
+  hdr2.eof_records[0] = EOF_RECORD(offset);
+  /* A writer of the file continues in the new extent. */
+  if(dirty) {
+    eof_record_mark(&hdr2);
+    new_file->flags |= COFFEE_FILE_EOF_DIRTY;
+  }
+#endif
+  write_header(vol, &hdr2, new_file->page);
+
+  new_file->flags &= ~COFFEE_FILE_MODIFIED;
+  if(HDR_COMPRESSED(hdr)) {
+    new_file->flags |= COFFEE_FILE_COMPRESSED;
+  }
+  new_file->end = offset;
+
+  close_locked(vol, fd);
+
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+merge_log(struct cfs_coffee_volume *vol, coffee_page_t file_page, int extend)
+{
+  uint8_t saved_op;
+  int result;
+
+  saved_op = io_enter(vol, CFS_COFFEE_OP_MERGE);
+  result = merge_file_log(vol, file_page, extend);
+  io_leave(vol, saved_op);
+
+  return result;
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_MICRO_LOGS
+static int
+find_next_record(struct cfs_coffee_volume *vol, struct file *file,
+                 coffee_page_t log_page, int log_records)
+{
+  int log_record, preferred_batch_size;
+
+  if(file->record_count >= 0) {
+    return file->record_count;
+  }
+#if COFFEE_LOG_MAP_SIZE
+  if(log_map_load(vol, file, log_page, log_records)) {
+    return file->record_count;
+  }
+#endif
+
+  preferred_batch_size = log_records > COFFEE_LOG_TABLE_LIMIT ?
+    COFFEE_LOG_TABLE_LIMIT : log_records;
+  {
+    /* The next log record is unknown at this point; search for it. */
+    //uint16_t indices[preferred_batch_size]; /* AALTO-2 NOTE: NOT COMPLIANT WITH C90, POSSIBLE SOURCE OF PROBLEMS */
+    uint16_t indices[COFFEE_LOG_TABLE_LIMIT]; /* AALTO-2 NOTE: C90 COMPLIANCE */
+    uint16_t processed;
+    uint16_t batch_size;
+
+    log_record = log_records;
+    for(processed = 0; processed < log_records; processed += batch_size) {
+      batch_size = log_records - processed >= preferred_batch_size ?
+        preferred_batch_size : log_records - processed;
+
+      FLASH_READ(&indices, batch_size * sizeof(indices[0]),
+                 absolute_offset(vol, log_page,
+                                 processed * sizeof(indices[0])));
+      for(log_record = 0; log_record < batch_size; log_record++) {
+        if(indices[log_record] == 0) {
+          log_record += processed;
+          break;
+        }
+      }
+    }
+  }
+
+  return log_record;
+}
+#endif /* COFFEE_MICRO_LOGS */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_MICRO_LOGS
+static void
+read_log_region(struct cfs_coffee_volume *vol, struct file *file,
+                struct file_header *hdr, int16_t record_count, uint16_t region,
+                uint16_t log_record_size, char *buf)
+{
+  struct log_param lp;
+  cfs_offset_t offset;
+
+  lp.offset = offset = (cfs_offset_t)region * log_record_size;
+  lp.buf = buf;
+  lp.size = log_record_size;
+
+  if(read_log_page(vol, file, hdr, record_count, &lp) < 0) {
+    file_read(vol, file, buf, log_record_size, offset);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Write the regions of a modification as consecutive log records: the
+ * region numbers are appended to the index table in one write and the
+ * record data in another. Return the number of bytes written, which is
+ * less than requested if the log or the batch buffer runs out, or 0 if
+ * the log had to be merged first.
+ */
+static int
+write_log_page(struct cfs_coffee_volume *vol, struct file *file,
+               struct log_param *lp)
+{
+  struct file_header hdr;
+  uint16_t region, regions, first_offset, size, i;
+  coffee_page_t log_page;
+  int16_t log_record;
+  uint16_t log_record_size;
+  uint16_t log_records;
+  cfs_offset_t offset;
+
+  read_header(vol, &hdr, file->page);
+
+  adjust_log_config(vol, &hdr, &log_record_size, &log_records);
+  region = lp->offset / log_record_size;
+  first_offset = lp->offset % log_record_size;
+
+//log_page = 0; /* AALTO-2 MODIFICATION: Flagged unnecessary by clang static checker */
+  if(HDR_MODIFIED(hdr)) {
+    /* A log structure has already been created. */
+    log_page = hdr.log_page;
+    log_record = find_next_record(vol, file, log_page, log_records);
+    if(log_record >= log_records) {
+      /* The log is full; merge the log. */
+      PRINTF("Coffee: Merging the file %s with its log\n", hdr.name);
+      return merge_log(vol, file->page, 0);
+    }
+  } else {
+    /* Create a log structure. */
+    log_page = create_log(vol, file, &hdr);
+    if(log_page == INVALID_PAGE) {
+      return -1;
+    }
+    PRINTF("Coffee: Created a log structure for file %s at page %u\n",
+           hdr.name, (unsigned)log_page);
+    hdr.log_page = log_page;
+    log_record = 0;
+  }
+
+  /* Plan as many regions as there are free records and buffer space. */
+  regions = (first_offset + lp->size + log_record_size - 1) / log_record_size;
+  if(regions > log_records - log_record) {
+    regions = log_records - log_record;
+  }
+  if(regions > sizeof(vol->log_batch.data) / log_record_size) {
+    regions = sizeof(vol->log_batch.data) / log_record_size;
+  }
+  if(regions > COFFEE_LOG_TABLE_LIMIT) {
+    regions = COFFEE_LOG_TABLE_LIMIT;
+  }
+  size = regions * log_record_size - first_offset;
+  if(size > lp->size) {
+    size = lp->size;
+  }
+
+  /* Regions that are only partly overwritten keep their other data. */
+  if(first_offset > 0) {
+    read_log_region(vol, file, &hdr, log_record, region, log_record_size,
+                    vol->log_batch.data);
+  }
+  if((first_offset + size) % log_record_size != 0 &&
+     (regions > 1 || first_offset == 0)) {
+    read_log_region(vol, file, &hdr, log_record, region + regions - 1,
+                    log_record_size,
+                    &vol->log_batch.data[(regions - 1) * log_record_size]);
+  }
+  memcpy(&vol->log_batch.data[first_offset], lp->buf, size);
+
+  /*
+   * Write the region numbers in the region index table.
+   * The region numbers are incremented to avoid values of zero.
+   */
+  for(i = 0; i < regions; i++) {
+    vol->log_batch.indices[i] = region + i + 1;
+  }
+  offset = absolute_offset(vol, log_page, 0);
+  flash_write(vol, vol->log_batch.indices, regions * sizeof(region),
+              offset + log_record * sizeof(region));
+#if COFFEE_LOG_MAP_SIZE
+  if(FILE_LOG_MAP(file)) {
+    memcpy(&file->log_map[log_record], vol->log_batch.indices,
+           regions * sizeof(region));
+  }
+#endif
+
+  offset += log_records * sizeof(region);
+  flash_write(vol, vol->log_batch.data, regions * log_record_size,
+              offset + log_record * log_record_size);
+  file->record_count = log_record + regions;
+
+  return size;
+}
+#endif /* COFFEE_MICRO_LOGS */
+/*---------------------------------------------------------------------------*/
+/* Find the data sectors of a ring file, which are the whole sectors of
+   its extent after the sector of its header. */
+static uint16_t
+ring_sectors(struct cfs_coffee_volume *vol, coffee_page_t page,
+             coffee_page_t max_pages, uint16_t *first)
+{
+  *first = page / VOL_PAGES_PER_SECTOR + 1;
+  return (page + max_pages) / VOL_PAGES_PER_SECTOR - *first;
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_RING_FILES
+static struct ring *
+ring_find(struct cfs_coffee_volume *vol, coffee_page_t page)
+{
+  int i;
+
+  for(i = 0; i < COFFEE_RING_FILES; i++) {
+    if(vol->rings[i].references > 0 && vol->rings[i].page == page) {
+      return &vol->rings[i];
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+/* The storage offset of the data sector with a sequence number between
+   the tail and the head. */
+static cfs_offset_t
+ring_offset(struct cfs_coffee_volume *vol, struct ring *ring,
+            uint32_t sequence)
+{
+  uint16_t index;
+
+  index = (ring->head + ring->sectors -
+           (ring->sequence - sequence) % ring->sectors) % ring->sectors;
+  return (cfs_offset_t)(ring->first + index) * VOL_SECTOR_SIZE;
+}
+/*---------------------------------------------------------------------------*/
+/* Program the appended bytes that are not in the flash yet. */
+static void
+ring_flush(struct cfs_coffee_volume *vol, struct ring *ring)
+{
+  cfs_offset_t base;
+
+  if(ring->end > ring->flushed) {
+    base = ring->flushed - ring->flushed % VOL_PAGE_SIZE;
+    flash_write(vol, ring->buf + (ring->flushed - base),
+                ring->end - ring->flushed,
+                ring_offset(vol, ring, ring->sequence) + ring->flushed);
+    ring->flushed = ring->end;
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* Append bytes to the head sector, programming each page once it is
+   full. The caller has checked that the bytes fit into the sector. */
+static void
+ring_put(struct cfs_coffee_volume *vol, struct ring *ring, const void *buf,
+         cfs_offset_t size)
+{
+  cfs_offset_t base, length;
+
+  while(size > 0) {
+    base = ring->flushed - ring->flushed % VOL_PAGE_SIZE;
+    length = base + VOL_PAGE_SIZE - ring->end;
+    if(length > size) {
+      length = size;
+    }
+    memcpy(ring->buf + (ring->end - base), buf, length);
+    ring->end += length;
+    buf = (const char *)buf + length;
+    size -= length;
+
+    if(ring->end == base + VOL_PAGE_SIZE) {
+      ring_flush(vol, ring);
+      memset(ring->buf, 0, VOL_PAGE_SIZE);
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* Move the head to the next data sector, erasing the oldest sector when
+   the ring is full. */
+static void
+ring_advance(struct cfs_coffee_volume *vol, struct ring *ring)
+{
+  ring_flush(vol, ring);
+
+  ring->head = (ring->head + 1) % ring->sectors;
+  ring->sequence++;
+  if(ring->tail == 0) {
+    ring->tail = ring->sequence;
+  } else if(ring->sequence - ring->tail == ring->sectors) {
+    erase_sector_data(vol, ring->first + ring->head);
+    ring->tail++;
+  }
+
+  ring->end = ring->flushed = 0;
+  memset(ring->buf, 0, VOL_PAGE_SIZE);
+  ring_put(vol, ring, &ring->sequence, RING_STAMP_SIZE);
+}
+/*---------------------------------------------------------------------------*/
+/* Read bytes of a data sector, including the ones that are appended but
+   not yet programmed. */
+static void
+ring_read(struct cfs_coffee_volume *vol, struct ring *ring,
+          uint32_t sequence, cfs_offset_t offset, void *buf,
+          cfs_offset_t size)
+{
+  cfs_offset_t base, length;
+
+  length = size;
+  if(sequence == ring->sequence && offset + size > ring->flushed) {
+    length = offset < ring->flushed ? ring->flushed - offset : 0;
+    base = ring->flushed - ring->flushed % VOL_PAGE_SIZE;
+    memcpy((char *)buf + length, ring->buf + (offset + length - base),
+           size - length);
+  }
+  if(length > 0) {
+    FLASH_READ(buf, length, ring_offset(vol, ring, sequence) + offset);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* Find the tail and the head of a ring from the sequence numbers of its
+   sectors, and the end of the records in the head. */
+static void
+ring_load(struct cfs_coffee_volume *vol, struct ring *ring,
+          struct file *file)
+{
+  uint32_t stamp;
+  uint16_t i, length;
+  cfs_offset_t offset;
+
+  memset(ring, 0, sizeof(*ring));
+  ring->page = file->page;
+  ring->sectors = ring_sectors(vol, file->page, file->max_pages,
+                               &ring->first);
+  ring->head = ring->sectors - 1;
+
+  for(i = 0; i < ring->sectors; i++) {
+    FLASH_READ(&stamp, sizeof(stamp),
+               (cfs_offset_t)(ring->first + i) * VOL_SECTOR_SIZE);
+    if(stamp == 0) {
+      continue;
+    }
+    if(stamp > ring->sequence) {
+      ring->sequence = stamp;
+      ring->head = i;
+    }
+    if(ring->tail == 0 || stamp < ring->tail) {
+      ring->tail = stamp;
+    }
+  }
+  if(ring->sequence == 0) {
+    return;
+  }
+
+  offset = ring_offset(vol, ring, ring->sequence);
+  for(ring->end = RING_STAMP_SIZE;
+      ring->end + RING_LENGTH_SIZE <= VOL_SECTOR_SIZE;
+      ring->end += RING_LENGTH_SIZE + length) {
+    FLASH_READ(&length, sizeof(length), offset + ring->end);
+    if(length == 0 ||
+       ring->end + RING_LENGTH_SIZE + length > VOL_SECTOR_SIZE) {
+      break;
+    }
+  }
+  ring->flushed = ring->end;
+}
+/*---------------------------------------------------------------------------*/
+static int
+ring_open(struct cfs_coffee_volume *vol, struct file *file)
+{
+  struct ring *ring;
+  uint16_t first;
+  int i;
+
+  ring = ring_find(vol, file->page);
+  if(ring == NULL) {
+    for(i = 0; i < COFFEE_RING_FILES; i++) {
+      if(vol->rings[i].references == 0) {
+        ring = &vol->rings[i];
+        break;
+      }
+    }
+    if(ring == NULL ||
+       ring_sectors(vol, file->page, file->max_pages, &first) < 2) {
+      return -1;
+    }
+    ring_load(vol, ring, file);
+  }
+
+  ring->references++;
+  file->end = 0;
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static void
+ring_close(struct cfs_coffee_volume *vol, struct file *file)
+{
+  struct ring *ring;
+
+  ring = ring_find(vol, file->page);
+  if(ring != NULL && --ring->references == 0) {
+    ring_flush(vol, ring);
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* The ring of a descriptor, or NULL if it is not open on a ring file. */
+static struct ring *
+ring_of(struct cfs_coffee_volume *vol, int fd)
+{
+  if(!FD_VALID(fd) || !FILE_RING(coffee_fd_set[fd].file)) {
+    return NULL;
+  }
+  return ring_find(vol, coffee_fd_set[fd].file->page);
+}
+#endif /* COFFEE_RING_FILES */
+/*---------------------------------------------------------------------------*/
+/*
+ * Extend the file of a descriptor until it can hold "end" bytes. A
+ * merge moves the file, so the file of the descriptor can change.
+ */
+static int
+grow_file(struct cfs_coffee_volume *vol, struct file_desc *fdp,
+          cfs_offset_t end)
+{
+  while(end > file_capacity(vol, fdp->file)) {
+#if COFFEE_EXTENT_CHAINS
+    if(extend_file(vol, fdp->file, end) < 0) {
+      return -1;
+    }
+#else
+    if(merge_log(vol, fdp->file->page, 1) < 0) {
+      return -1;
+    }
+#endif
+    PRINTF("Extended the file at page %u\n", (unsigned)fdp->file->page);
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_COMPRESSED_FILES
+/*
+ * Compress a block into vol->compress.buf with LZSS, whose format is
+ * described with struct compressed_block. Each position is hashed by
+ * its next three bytes, and the hash chain of the position is searched
+ * for the longest match. The positions in the chains are offset by the
+ * base of the block, so that positions of previous blocks are told
+ * apart without clearing the table. Return the size of the compressed
+ * data, or size if it would not be smaller.
+ */
+static unsigned
+compress_block(struct cfs_coffee_volume *vol, const unsigned char *in,
+               unsigned size)
+{
+  uint16_t *prev;
+  unsigned char *out;
+  unsigned i, o, k, control, bit, len, max, best, distance, hash;
+  unsigned base, candidate, depth;
+
+  if(vol->compress.base > 0xffff - size) {
+    memset(vol->compress.head, 0, sizeof(vol->compress.head));
+    vol->compress.base = 0;
+  }
+  base = vol->compress.base;
+  vol->compress.base += size;
+
+  prev = vol->compress.prev;
+  out = vol->compress.buf;
+  control = o = 0;
+  best = distance = 0;
+  for(i = 0, bit = 8; i < size; bit++) {
+    if(bit == 8) {
+      if(o + 1 >= size) {
+        return size;
+      }
+      control = o++;
+      out[control] = 0;
+      bit = 0;
+    }
+
+    best = 0;
+    if(i + LZSS_MIN_MATCH <= size) {
+      max = size - i < LZSS_MAX_MATCH ? size - i : LZSS_MAX_MATCH;
+      hash = COMPRESS_HASH(in + i);
+      candidate = vol->compress.head[hash];
+      for(depth = 0; depth < COMPRESS_CHAIN_DEPTH &&
+          candidate >= base && candidate - base < i; depth++) {
+        candidate -= base;
+        for(len = 0; len < max && in[candidate + len] == in[i + len]; len++);
+        if(len > best) {
+          best = len;
+          distance = i - candidate;
+          if(len == max) {
+            break;
+          }
+        }
+        candidate = prev[candidate];
+      }
+    }
+
+    if(best >= LZSS_MIN_MATCH) {
+      if(o + 2 >= size) {
+        return size;
+      }
+      out[control] |= 1 << bit;
+      out[o++] = (distance - 1) & 0xff;
+      out[o++] = ((distance - 1) >> 8) << 4 | (best - LZSS_MIN_MATCH);
+    } else {
+      if(o + 1 >= size) {
+        return size;
+      }
+      out[o++] = in[i];
+      best = 1;
+    }
+
+    /* Enter the positions that were passed into the hash chains. */
+    for(k = i + best; i < k; i++) {
+      if(i + LZSS_MIN_MATCH <= size) {
+        hash = COMPRESS_HASH(in + i);
+        prev[i] = vol->compress.head[hash];
+        vol->compress.head[hash] = base + i;
+      }
+    }
+  }
+  return o;
+}
+/*---------------------------------------------------------------------------*/
+/* Decompress a block. Return 0 if the data decompresses to exactly
+   size bytes, or -1 if it is corrupt. */
+static int
+decompress_block(const unsigned char *in, unsigned in_size,
+                 unsigned char *out, unsigned size)
+{
+  unsigned i, o, control, bit, distance, len;
+
+  for(i = o = 0; o < size;) {
+    if(i >= in_size) {
+      return -1;
+    }
+    control = in[i++];
+    for(bit = 0; bit < 8 && o < size; bit++) {
+      if(control & (1 << bit)) {
+        if(i + 2 > in_size) {
+          return -1;
+        }
+        distance = (in[i] | (in[i + 1] >> 4) << 8) + 1;
+        len = (in[i + 1] & 0xf) + LZSS_MIN_MATCH;
+        i += 2;
+        if(distance > o || len > size - o) {
+          return -1;
+        }
+        for(; len > 0; len--, o++) {
+          out[o] = out[o - distance];
+        }
+      } else {
+        if(i >= in_size) {
+          return -1;
+        }
+        out[o++] = in[i++];
+      }
+    }
+  }
+  return i == in_size ? 0 : -1;
+}
+/*---------------------------------------------------------------------------*/
+static void
+compressed_entry(struct cfs_coffee_volume *vol, coffee_page_t page,
+                 uint16_t index, struct compressed_block *entry)
+{
+  FLASH_READ(entry, sizeof(*entry),
+             absolute_offset(vol, page, index * sizeof(*entry)));
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Find the number of used entries in the index of a compressed file by
+ * a binary search, since the entries are programmed in order. The last
+ * used entry is returned in *last, which is zeroed if there is none.
+ */
+static uint16_t
+compressed_index(struct cfs_coffee_volume *vol, coffee_page_t page,
+                 uint16_t blocks, struct compressed_block *last)
+{
+  struct compressed_block entry;
+  uint16_t lo, hi, mid;
+
+  for(lo = 0, hi = blocks; lo < hi;) {
+    mid = lo + (hi - lo) / 2;
+    compressed_entry(vol, page, mid, &entry);
+    if(entry.raw_size != 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  memset(last, 0, sizeof(*last));
+  if(lo > 0) {
+    compressed_entry(vol, page, lo - 1, last);
+  }
+  return lo;
+}
+/*---------------------------------------------------------------------------*/
+static struct compressed *
+compressed_find(struct cfs_coffee_volume *vol, coffee_page_t page)
+{
+  int i;
+
+  for(i = 0; i < COFFEE_COMPRESSED_FILES; i++) {
+    if(vol->compressed[i].references > 0 &&
+       vol->compressed[i].page == page) {
+      return &vol->compressed[i];
+    }
+  }
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+static int
+compressed_open(struct cfs_coffee_volume *vol, struct file *file)
+{
+  struct compressed *compressed;
+  struct compressed_block last;
+  struct file_header hdr;
+  int i;
+
+  compressed = compressed_find(vol, file->page);
+  if(compressed == NULL) {
+    for(i = 0; i < COFFEE_COMPRESSED_FILES; i++) {
+      if(vol->compressed[i].references == 0) {
+        compressed = &vol->compressed[i];
+        break;
+      }
+    }
+    if(compressed == NULL) {
+      return -1;
+    }
+
+    read_header(vol, &hdr, file->page);
+    compressed->page = file->page;
+    compressed->blocks = hdr.log_records;
+    compressed->block_size = hdr.log_record_size;
+    compressed->pending = 0;
+    compressed->cached = -1;
+    compressed->used = compressed_index(vol, file->page, hdr.log_records,
+                                        &last);
+    compressed->raw_end = last.raw_end;
+    compressed->stored_end = compressed->used > 0 ?
+      (cfs_offset_t)last.stored_start + last.stored_size :
+      (cfs_offset_t)hdr.log_records * sizeof(last);
+
+    /* Data of a block whose entry was not programmed is skipped. */
+    if(compressed->stored_end < file->end) {
+      compressed->stored_end = file->end;
+    }
+    file->end = compressed->stored_end;
+  }
+
+  compressed->references++;
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+/* Store the pending data of a compressed file as a block. */
+static int
+compressed_store(struct cfs_coffee_volume *vol, struct file_desc *fdp,
+                 struct compressed *compressed)
+{
+  struct compressed_block entry;
+  const void *data;
+  unsigned size;
+
+  if(compressed->used == compressed->blocks) {
+    return -1;
+  }
+
+  size = compress_block(vol, compressed->buf, compressed->pending);
+  data = size < compressed->pending ?
+    (const void *)vol->compress.buf : (const void *)compressed->buf;
+  if(grow_file(vol, fdp, compressed->stored_end + size) < 0) {
+    return -1;
+  }
+
+  /* The data is programmed before its entry, which completes it. */
+  file_write(vol, fdp->file, data, size, compressed->stored_end);
+  entry.raw_end = compressed->raw_end + compressed->pending;
+  entry.stored_start = compressed->stored_end;
+  entry.stored_size = size;
+  entry.raw_size = compressed->pending;
+  flash_write(vol, &entry, sizeof(entry),
+              absolute_offset(vol, compressed->page,
+                              compressed->used * sizeof(entry)));
+
+  compressed->used++;
+  compressed->raw_end = entry.raw_end;
+  compressed->stored_end += size;
+  compressed->pending = 0;
+  if(fdp->file->end < compressed->stored_end) {
+    fdp->file->end = compressed->stored_end;
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static void
+compressed_close(struct cfs_coffee_volume *vol, int fd)
+{
+  struct compressed *compressed;
+
+  /* The last reference stores the pending data while it keeps the file
+     open, since the store can merge the file. */
+  compressed = compressed_find(vol, coffee_fd_set[fd].file->page);
+  if(compressed != NULL) {
+    if(compressed->references == 1 && compressed->pending > 0) {
+      compressed_store(vol, &coffee_fd_set[fd], compressed);
+    }
+    compressed->references--;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static cfs_offset_t
+compressed_size(struct cfs_coffee_volume *vol, struct file *file)
+{
+  struct compressed *compressed;
+
+  compressed = compressed_find(vol, file->page);
+  return compressed->raw_end + compressed->pending;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * Decompress the block that holds a file offset into compressed->block,
+ * unless it is there already. Sequential reads find the block after the
+ * cached one, and others search the index.
+ */
+static int
+compressed_load(struct cfs_coffee_volume *vol, struct file *file,
+                struct compressed *compressed, cfs_offset_t offset)
+{
+  struct compressed_block *entry;
+  int32_t index;
+  uint16_t lo, hi, mid;
+
+  entry = &compressed->entry;
+  index = compressed->cached;
+  if(index >= 0 && offset < entry->raw_end &&
+     offset >= entry->raw_end - entry->raw_size) {
+    return 0;
+  }
+
+  if(index >= 0 && index + 1 < compressed->used &&
+     offset >= entry->raw_end) {
+    compressed_entry(vol, compressed->page, ++index, entry);
+    if(offset >= entry->raw_end) {
+      index = -1;
+    }
+  } else {
+    index = -1;
+  }
+  if(index < 0) {
+    for(lo = 0, hi = compressed->used - 1; lo < hi;) {
+      mid = lo + (hi - lo) / 2;
+      compressed_entry(vol, compressed->page, mid, entry);
+      if(entry->raw_end > offset) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    index = lo;
+    compressed_entry(vol, compressed->page, index, entry);
+  }
+
+  compressed->cached = -1;
+  if(entry->raw_size > compressed->block_size ||
+     entry->stored_size > entry->raw_size) {
+    return -1;
+  }
+  if(entry->stored_size == entry->raw_size) {
+    file_read(vol, file, compressed->block, entry->raw_size,
+              entry->stored_start);
+  } else {
+    file_read(vol, file, vol->compress.buf, entry->stored_size,
+              entry->stored_start);
+    if(decompress_block(vol->compress.buf, entry->stored_size,
+                        compressed->block, entry->raw_size) < 0) {
+      return -1;
+    }
+  }
+  compressed->cached = index;
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+compressed_read(struct cfs_coffee_volume *vol, int fd, void *buf,
+                unsigned size)
+{
+  struct file_desc *fdp;
+  struct compressed *compressed;
+  cfs_offset_t start;
+  unsigned done, n;
+
+  fdp = &coffee_fd_set[fd];
+  compressed = compressed_find(vol, fdp->file->page);
+  if(fdp->offset + size > compressed->raw_end + compressed->pending) {
+    size = compressed->raw_end + compressed->pending - fdp->offset;
+  }
+
+  for(done = 0; done < size; done += n) {
+    if(fdp->offset >= compressed->raw_end) {
+      /* The data has not been stored yet. */
+      n = size - done;
+      memcpy((char *)buf + done,
+             compressed->buf + (fdp->offset - compressed->raw_end), n);
+    } else {
+      /* The data before a corrupt block is returned first. */
+      if(compressed_load(vol, fdp->file, compressed, fdp->offset) < 0) {
+        if(done == 0) {
+          return -1;
+        }
+        size = done;
+        break;
+      }
+      start = compressed->entry.raw_end - compressed->entry.raw_size;
+      n = compressed->entry.raw_end - fdp->offset;
+      if(n > size - done) {
+        n = size - done;
+      }
+      memcpy((char *)buf + done, compressed->block + (fdp->offset - start),
+             n);
+    }
+    fdp->offset += n;
+  }
+
+  IO_BYTES(user_read_bytes, size);
+  return size;
+}
+/*---------------------------------------------------------------------------*/
+/* Append to a compressed file. A block is stored when it is full. */
+static int
+compressed_write(struct cfs_coffee_volume *vol, int fd, const void *buf,
+                 unsigned size)
+{
+  struct file_desc *fdp;
+  struct compressed *compressed;
+  unsigned done, n;
+
+  fdp = &coffee_fd_set[fd];
+  compressed = compressed_find(vol, fdp->file->page);
+  if(fdp->offset != compressed->raw_end + compressed->pending) {
+    return -1;
+  }
+
+  for(done = 0; done < size && compressed->used < compressed->blocks;
+      done += n) {
+    n = compressed->block_size - compressed->pending;
+    if(n > size - done) {
+      n = size - done;
+    }
+    memcpy(compressed->buf + compressed->pending, (const char *)buf + done,
+           n);
+    compressed->pending += n;
+    if(compressed->pending == compressed->block_size &&
+       compressed_store(vol, fdp, compressed) < 0) {
+      compressed->pending -= n;
+      break;
+    }
+  }
+  if(done == 0 && size > 0) {
+    return -1;
+  }
+
+  fdp->offset += done;
+  IO_BYTES(user_write_bytes, done);
+  return done;
+}
+#endif /* COFFEE_COMPRESSED_FILES */
+/*---------------------------------------------------------------------------*/
+/* The size of the data of a file, which a compressed file stores in
+   fewer bytes. */
+static cfs_offset_t
+data_end(struct cfs_coffee_volume *vol, struct file *file)
+{
+#if COFFEE_COMPRESSED_FILES
+  if(FILE_COMPRESSED(file)) {
+    return compressed_size(vol, file);
+  }
+#endif
+  return file->end;
+}
+/*---------------------------------------------------------------------------*/
+static int
+get_available_fd(struct cfs_coffee_volume *vol)
+{
+  int i;
+
+  for(i = 0; i < COFFEE_FD_SET_SIZE; i++) {
+    if(coffee_fd_set[i].flags == COFFEE_FD_FREE) {
+      return i;
+    }
+  }
+  return -1;
+}
+/*---------------------------------------------------------------------------*/
+static int
+open_locked(struct cfs_coffee_volume *vol, const char *name, int flags)
+{
+  int fd;
+  struct file_desc *fdp;
+
+  IO_CALL(CFS_COFFEE_OP_OPEN);
+  fd = get_available_fd(vol);
+  if(fd < 0) {
+    PRINTF("Coffee: Failed to allocate a new file descriptor!\n");
+    return -1;
+  }
+
+  fdp = &coffee_fd_set[fd];
+  fdp->flags = 0;
+
+  fdp->file = find_file(vol, name);
+  if(fdp->file == NULL) {
+    if((flags & (CFS_READ | CFS_WRITE)) == CFS_READ) {
+      return -1;
+    }
+    fdp->file = reserve(vol, name, page_count(vol, COFFEE_DYN_SIZE), 1, 0);
+    if(fdp->file == NULL) {
+      return -1;
+    }
+    fdp->file->end = 0;
+  } else if(FILE_RING(fdp->file)) {
+    /* Ring files are accessed with the cfs_coffee_ring_*() calls. */
+#if COFFEE_RING_FILES
+    if(ring_open(vol, fdp->file) < 0) {
+      return -1;
+    }
+#else
+    return -1;
+#endif
+  } else {
+    if(fdp->file->end == UNKNOWN_OFFSET) {
+      fdp->file->end = file_end(vol, fdp->file->page);
+    }
+    if(FILE_COMPRESSED(fdp->file)) {
+#if COFFEE_COMPRESSED_FILES
+      if(compressed_open(vol, fdp->file) < 0) {
+        return -1;
+      }
+#else
+      return -1;
+#endif
+    }
+  }
+
+  fdp->flags |= flags;
+  fdp->offset = flags & CFS_APPEND ? data_end(vol, fdp->file) : 0;
+  fdp->file->references++;
+
+  return fd;
+}
+/*---------------------------------------------------------------------------*/
+static void
+close_locked(struct cfs_coffee_volume *vol, int fd)
+{
+#if COFFEE_EOF_RECORDS
+  struct file_header hdr;
+  struct file *file;
+#endif
+
+  IO_CALL(CFS_COFFEE_OP_OTHER);
+  if(FD_VALID(fd)) {
+#if COFFEE_RING_FILES
+    if(FILE_RING(coffee_fd_set[fd].file)) {
+      ring_close(vol, coffee_fd_set[fd].file);
+    }
+#endif
+#if COFFEE_COMPRESSED_FILES
+    if(FILE_COMPRESSED(coffee_fd_set[fd].file)) {
+      compressed_close(vol, fd);
+    }
+#endif
+#if COFFEE_EOF_RECORDS
+    /* Record the file end when the writer is done with the file, or when
+       the last reader of a compressed file stores the data of a writer. */
+    file = coffee_fd_set[fd].file;
+    if((FD_WRITABLE(fd) || FILE_COMPRESSED(file)) && !FILE_RING(file)) {
+      read_header(vol, &hdr, file->page);
+      file->flags &= ~COFFEE_FILE_EOF_DIRTY;
+      if(eof_record_add(&hdr, file->end)) {
+        write_header(vol, &hdr, file->page);
+      } else if(eof_record_dirty(&hdr)) {
+        /* Compact the full journal into the first record of a merged
+           file, or leave the file end to a scan if the merge fails. */
+        merge_log(vol, file->page, 0);
+      }
+    }
+#endif
+    coffee_fd_set[fd].flags = COFFEE_FD_FREE;
+    coffee_fd_set[fd].file->references--;
+    coffee_fd_set[fd].file = NULL;
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* The offset that a seek on a valid descriptor moves to, or -1. */
+static cfs_offset_t
+seek_offset(struct cfs_coffee_volume *vol, int fd, cfs_offset_t offset,
+            int whence)
+{
+  struct file_desc *fdp;
+  cfs_offset_t new_offset;
+
+  fdp = &coffee_fd_set[fd];
+
+  if(whence == CFS_SEEK_SET) {
+    new_offset = offset;
+  } else if(whence == CFS_SEEK_END) {
+    new_offset = data_end(vol, fdp->file) + offset;
+  } else if(whence == CFS_SEEK_CUR) {
+    new_offset = fdp->offset + offset;
+  } else {
+    return (cfs_offset_t)-1;
+  }
+
+  /* A compressed file does not have gaps. */
+  if(new_offset < 0 || (FILE_COMPRESSED(fdp->file) ?
+     new_offset > data_end(vol, fdp->file) :
+     new_offset > file_capacity(vol, fdp->file) +
+                  sizeof(struct file_header))) {
+    return -1;
+  }
+  return new_offset;
+}
+/*---------------------------------------------------------------------------*/
+static cfs_offset_t
+seek_locked(struct cfs_coffee_volume *vol, int fd, cfs_offset_t offset,
+            int whence)
+{
+  struct file_desc *fdp;
+  cfs_offset_t new_offset;
+
+  IO_CALL(CFS_COFFEE_OP_OTHER);
+  if(!FD_VALID(fd)) {
+    return -1;
+  }
+  fdp = &coffee_fd_set[fd];
+
+  new_offset = seek_offset(vol, fd, offset, whence);
+  if(new_offset < 0) {
+    return -1;
+  }
+
+  if(fdp->file->end < new_offset && !FILE_COMPRESSED(fdp->file)) {
+    fdp->file->end = new_offset;
+  }
+
+  return fdp->offset = new_offset;
+}
+/*---------------------------------------------------------------------------*/
+static int
+remove_locked(struct cfs_coffee_volume *vol, const char *name)
+{
+  struct file *file;
+
+  /*
+   * Coffee removes files by marking them as obsolete. The space
+   * is not guaranteed to be reclaimed immediately, but must be
+   * sweeped by the garbage collector. The garbage collector is
+   * called once a file reservation request cannot be granted.
+   */
+  IO_CALL(CFS_COFFEE_OP_REMOVE);
+  file = find_file(vol, name);
+  if(file == NULL) {
+    return -1;
+  }
+
+  return remove_by_page(vol, file->page, REMOVE_LOG, CLOSE_FDS, ALLOW_GC);
+}
+/*---------------------------------------------------------------------------*/
+static int
+read_locked(struct cfs_coffee_volume *vol, int fd, void *buf,
+            unsigned size)
+{
+  struct file_desc *fdp;
+  struct file *file;
+#if COFFEE_MICRO_LOGS
+  struct file_header hdr;
+  struct log_param lp;
+  unsigned bytes_left;
+  int r;
+#endif
+
+  IO_CALL(CFS_COFFEE_OP_READ);
+  if(!(FD_VALID(fd) && FD_READABLE(fd)) ||
+     FILE_RING(coffee_fd_set[fd].file)) {
+    return -1;
+  }
+
+#if COFFEE_COMPRESSED_FILES
+  if(FILE_COMPRESSED(coffee_fd_set[fd].file)) {
+    return compressed_read(vol, fd, buf, size);
+  }
+#endif
+
+  fdp = &coffee_fd_set[fd];
+  file = fdp->file;
+  if(fdp->offset + size > file->end) {
+    size = file->end - fdp->offset;
+  }
+  IO_BYTES(user_read_bytes, size);
+
+  /* If the file is allocated, read directly in the file. */
+  if(!FILE_MODIFIED(file)) {
+    file_read(vol, file, buf, size, fdp->offset);
+    fdp->offset += size;
+    return size;
+  }
+
+#if COFFEE_MICRO_LOGS
+  read_header(vol, &hdr, file->page);
+
+  /*
+   * Fill the buffer by copying from the log in first hand, or the
+   * ordinary file if the page has no log record.
+   */
+  for(bytes_left = size; bytes_left > 0; bytes_left -= r) {
+    lp.offset = fdp->offset;
+    lp.buf = buf;
+    lp.size = LOG_PARAM_SIZE(bytes_left);
+    r = read_log_page(vol, file, &hdr, file->record_count, &lp);
+
+    /* Read from the original file if we cannot find the data in the log. */
+    if(r < 0) {
+      file_read(vol, file, buf, lp.size, fdp->offset);
+      r = lp.size;
+    }
+    fdp->offset += r;
+    buf = (char *)buf + r;
+  }
+#endif /* COFFEE_MICRO_LOGS */
+
+  return size;
+}
+/*---------------------------------------------------------------------------*/
+static int
+write_locked(struct cfs_coffee_volume *vol, int fd, const void *buf,
+             unsigned size)
+{
+  struct file_desc *fdp;
+  struct file *file;
+#if COFFEE_MICRO_LOGS
+  int i;
+  struct log_param lp;
+  cfs_offset_t bytes_left;
+  int8_t need_dummy_write;
+  const unsigned char dummy[1] = { 0xff }; /* AALTO-2 MODIFICATION: added "unsigned" */
+#endif
+
+  IO_CALL(CFS_COFFEE_OP_WRITE);
+  if(!(FD_VALID(fd) && FD_WRITABLE(fd)) ||
+     FILE_RING(coffee_fd_set[fd].file)) {
+    return -1;
+  }
+
+  fdp = &coffee_fd_set[fd];
+  file = fdp->file;
+
+#if COFFEE_EOF_RECORDS
+  eof_record_mark_file(vol, file);
+#endif
+#if COFFEE_COMPRESSED_FILES
+  if(FILE_COMPRESSED(file)) {
+    return compressed_write(vol, fd, buf, size);
+  }
+#endif
+
+  /* Attempt to extend the file if we try to write past the end. */
+#if COFFEE_IO_SEMANTICS
+  if(!(fdp->io_flags & CFS_COFFEE_IO_FIRM_SIZE)) {
+#endif
+  if(grow_file(vol, fdp, size + fdp->offset) < 0) {
+    return -1;
+  }
+  file = fdp->file;
+#if COFFEE_IO_SEMANTICS
+}
+#endif
+
+#if COFFEE_MICRO_LOGS
+#if COFFEE_IO_SEMANTICS
+  if(!(fdp->io_flags & CFS_COFFEE_IO_FLASH_AWARE) &&
+     (FILE_MODIFIED(file) || fdp->offset < file->end)) {
+#else
+  if(FILE_MODIFIED(file) || fdp->offset < file->end) {
+#endif
+    need_dummy_write = 0;
+    for(bytes_left = size; bytes_left > 0;) {
+      lp.offset = fdp->offset;
+      lp.buf = buf;
+      lp.size = LOG_PARAM_SIZE(bytes_left);
+      i = write_log_page(vol, file, &lp);
+      if(i < 0) {
+        /* Return -1 if we wrote nothing because the log write failed. */
+        if(size == bytes_left) {
+          return -1;
+        }
+        break;
+      } else if(i == 0) {
+        /* The file was merged with the log. */
+        file = fdp->file;
+      } else {
+        /* A log record was written. */
+        bytes_left -= i;
+        fdp->offset += i;
+        buf = (char *)buf + i;
+
+        /* Update the file end for a potential log merge that might
+           occur while writing log records. */
+        if(fdp->offset > file->end) {
+          file->end = fdp->offset;
+          need_dummy_write = 1;
+        }
+      }
+    }
+
+    if(need_dummy_write) {
+      /*
+       * A log record has been written at an offset beyond the original
+       * extent's end. Consequently, we need to write a dummy value at the
+       * corresponding end offset in the original extent to ensure that
+       * the correct file size is calculated when opening the file again.
+       */
+      file_write(vol, file, dummy, 1, fdp->offset - 1);
+    }
+  } else {
+#endif /* COFFEE_MICRO_LOGS */
+#if COFFEE_APPEND_ONLY
+  if(fdp->offset < file->end) {
+    return -1;
+  }
+#endif /* COFFEE_APPEND_ONLY */
+
+  file_write(vol, file, buf, size, fdp->offset);
+  fdp->offset += size;
+#if COFFEE_MICRO_LOGS
+}
+#endif /* COFFEE_MICRO_LOGS */
+
+  if(fdp->offset > file->end) {
+    file->end = fdp->offset;
+  }
+
+  IO_BYTES(user_write_bytes, size);
+  return size;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_opendir(struct cfs_coffee_volume *vol, struct cfs_dir *dir,
+                       const char *name)
+{
+  /*
+   * Coffee is only guaranteed to support "/" and ".", but it does not
+   * currently enforce this.
+   */
+  memset(dir->dummy_space, 0, sizeof(coffee_page_t));
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+readdir_locked(struct cfs_coffee_volume *vol, struct cfs_dir *dir,
+               struct cfs_dirent *record)
+{
+  struct file_header hdr;
+  coffee_page_t page;
+  uint16_t first;
+#if COFFEE_COMPRESSED_FILES
+  struct compressed *compressed;
+  struct compressed_block last;
+#endif
+
+  IO_CALL(CFS_COFFEE_OP_OTHER);
+  memcpy(&page, dir->dummy_space, sizeof(coffee_page_t));
+
+  while(page < vol->page_count) {
+    read_header(vol, &hdr, page);
+    if(HDR_ACTIVE(hdr) && !HDR_FILE_PART(hdr)) {
+      coffee_page_t next_page;
+      memcpy(record->name, hdr.name, sizeof(record->name));
+      record->name[sizeof(record->name) - 1] = '\0';
+      if(HDR_RING(hdr)) {
+        /* A ring file has the size of the records that it can hold. */
+        record->size = ring_sectors(vol, page, hdr.max_pages, &first) *
+                       (VOL_SECTOR_SIZE - RING_STAMP_SIZE);
+#if COFFEE_COMPRESSED_FILES
+      } else if(HDR_COMPRESSED(hdr)) {
+        /* The size of a compressed file is the size of its data. */
+        compressed = compressed_find(vol, page);
+        if(compressed != NULL) {
+          record->size = compressed->raw_end + compressed->pending;
+        } else {
+          compressed_index(vol, page, hdr.log_records, &last);
+          record->size = last.raw_end;
+        }
+#endif
+      } else {
+        record->size = file_end(vol, page);
+      }
+
+      next_page = next_file(vol, page, &hdr);
+      memcpy(dir->dummy_space, &next_page, sizeof(coffee_page_t));
+      return 0;
+    }
+    page = next_file(vol, page, &hdr);
+  }
+
+  return -1;
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_closedir(struct cfs_dir *dir)
+{
+  return;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_reserve(struct cfs_coffee_volume *vol, const char *name,
+                       cfs_offset_t size)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  IO_CALL(CFS_COFFEE_OP_OTHER);
+  r = reserve(vol, name, page_count(vol, size), 0, 0) == NULL ? -1 : 0;
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+static int
+configure_log_locked(struct cfs_coffee_volume *vol,
+                     const char *filename, unsigned log_size,
+                     unsigned log_record_size)
+{
+  struct file *file;
+  struct file_header hdr;
+
+  IO_CALL(CFS_COFFEE_OP_OTHER);
+  if(log_record_size == 0 || log_record_size > VOL_PAGE_SIZE ||
+     log_size < log_record_size) {
+    return -1;
+  }
+
+  file = find_file(vol, filename);
+  if(file == NULL) {
+    return -1;
+  }
+
+  read_header(vol, &hdr, file->page);
+  if(HDR_MODIFIED(hdr)) {
+    /* Too late to customize the log. */
+    return -1;
+  }
+
+  hdr.log_records = log_size / log_record_size;
+  hdr.log_record_size = log_record_size;
+  write_header(vol, &hdr, file->page);
+
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_COMPRESSED_FILES
+static int
+configure_compression_locked(struct cfs_coffee_volume *vol,
+                             const char *filename, cfs_offset_t size,
+                             unsigned block_size)
+{
+  struct file *file;
+  struct file_header hdr;
+  cfs_offset_t blocks;
+
+  IO_CALL(CFS_COFFEE_OP_OTHER);
+  if(block_size == 0 || block_size > COFFEE_COMPRESS_BLOCK_SIZE ||
+     size < (cfs_offset_t)block_size) {
+    return -1;
+  }
+  blocks = (size + block_size - 1) / block_size;
+  if(blocks > 0xffff) {
+    return -1;
+  }
+
+  file = find_file(vol, filename);
+  if(file == NULL || !FILE_UNREFERENCED(file) || FILE_RING(file) ||
+     FILE_COMPRESSED(file)) {
+    return -1;
+  }
+  if(file->end == UNKNOWN_OFFSET) {
+    file->end = file_end(vol, file->page);
+  }
+
+  /* The file must be empty, and its first extent must hold the index. */
+  read_header(vol, &hdr, file->page);
+  if(file->end != 0 || HDR_MODIFIED(hdr) || hdr.log_records != 0 ||
+     hdr.log_record_size != 0 ||
+     blocks * sizeof(struct compressed_block) >
+     extent_capacity(vol, hdr.max_pages)) {
+    return -1;
+  }
+
+  hdr.kind = HDR_KIND_COMPRESSED;
+  hdr.log_records = blocks;
+  hdr.log_record_size = block_size;
+  write_header(vol, &hdr, file->page);
+  file->flags |= COFFEE_FILE_COMPRESSED;
+
+  return 0;
+}
+#endif /* COFFEE_COMPRESSED_FILES */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_IO_SEMANTICS
+static int
+set_io_semantics_locked(struct cfs_coffee_volume *vol, int fd,
+                        unsigned flags)
+{
+  if(!FD_VALID(fd)) {
+    return -1;
+  }
+
+  coffee_fd_set[fd].io_flags |= flags;
+
+  return 0;
+}
+#endif
+/*---------------------------------------------------------------------------*/
+#if COFFEE_RING_FILES
+static int
+ring_create_locked(struct cfs_coffee_volume *vol, const char *name,
+                   cfs_offset_t size)
+{
+  struct file_header hdr;
+  cfs_offset_t sectors;
+
+  IO_CALL(CFS_COFFEE_OP_OTHER);
+  sectors = (size + VOL_SECTOR_SIZE - RING_STAMP_SIZE - 1) /
+            (VOL_SECTOR_SIZE - RING_STAMP_SIZE);
+  if(sectors < 2) {
+    sectors = 2;
+  }
+  if(size < 0 || sectors >= vol->sector_count ||
+     find_file(vol, name) != NULL) {
+    return -1;
+  }
+
+  /* One more sector holds the header, wherever the extent starts. */
+  if(reserve_pages(vol, name, (sectors + 1) * VOL_PAGES_PER_SECTOR, 0,
+                   HDR_KIND_RING, &hdr) == INVALID_PAGE) {
+    return -1;
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+ring_append_locked(struct cfs_coffee_volume *vol, int fd, const void *buf,
+                   unsigned size)
+{
+  struct ring *ring;
+  uint16_t length;
+
+  IO_CALL(CFS_COFFEE_OP_WRITE);
+  ring = ring_of(vol, fd);
+  if(ring == NULL || !FD_WRITABLE(fd) || size == 0 || size > 0xffff ||
+     RING_STAMP_SIZE + RING_LENGTH_SIZE + size > VOL_SECTOR_SIZE) {
+    return -1;
+  }
+
+  /* Records do not span sectors. */
+  if(ring->sequence == 0 ||
+     ring->end + RING_LENGTH_SIZE + size > VOL_SECTOR_SIZE) {
+    ring_advance(vol, ring);
+  }
+
+  length = size;
+  ring_put(vol, ring, &length, RING_LENGTH_SIZE);
+  ring_put(vol, ring, buf, size);
+
+  IO_BYTES(user_write_bytes, size);
+  return size;
+}
+/*---------------------------------------------------------------------------*/
+static int
+ring_flush_locked(struct cfs_coffee_volume *vol, int fd)
+{
+  struct ring *ring;
+
+  IO_CALL(CFS_COFFEE_OP_OTHER);
+  ring = ring_of(vol, fd);
+  if(ring == NULL) {
+    return -1;
+  }
+  ring_flush(vol, ring);
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+ring_rewind_locked(struct cfs_coffee_volume *vol, int fd,
+                   struct cfs_coffee_ring_cursor *cursor)
+{
+  struct ring *ring;
+
+  IO_CALL(CFS_COFFEE_OP_OTHER);
+  ring = ring_of(vol, fd);
+  if(ring == NULL) {
+    return -1;
+  }
+  cursor->sequence = ring->tail;
+  cursor->offset = RING_STAMP_SIZE;
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+ring_next_locked(struct cfs_coffee_volume *vol, int fd,
+                 struct cfs_coffee_ring_cursor *cursor, void *buf,
+                 unsigned size)
+{
+  struct ring *ring;
+  uint16_t length;
+
+  IO_CALL(CFS_COFFEE_OP_READ);
+  ring = ring_of(vol, fd);
+  if(ring == NULL || !FD_READABLE(fd) || ring->sequence == 0) {
+    return -1;
+  }
+
+  /* A cursor into an erased sector continues from the oldest record. */
+  if(cursor->sequence < ring->tail || cursor->sequence > ring->sequence) {
+    cursor->sequence = ring->tail;
+    cursor->offset = RING_STAMP_SIZE;
+  }
+
+  for(;;) {
+    if(cursor->sequence == ring->sequence && cursor->offset >= ring->end) {
+      return -1;
+    }
+    length = 0;
+    if(cursor->offset + RING_LENGTH_SIZE <= VOL_SECTOR_SIZE) {
+      ring_read(vol, ring, cursor->sequence, cursor->offset,
+                &length, RING_LENGTH_SIZE);
+    }
+    if(length != 0 &&
+       cursor->offset + RING_LENGTH_SIZE + length <= VOL_SECTOR_SIZE) {
+      break;
+    }
+    if(cursor->sequence == ring->sequence) {
+      return -1;
+    }
+    cursor->sequence++;
+    cursor->offset = RING_STAMP_SIZE;
+  }
+
+  if(size > length) {
+    size = length;
+  }
+  ring_read(vol, ring, cursor->sequence, cursor->offset + RING_LENGTH_SIZE,
+            buf, size);
+  cursor->offset += RING_LENGTH_SIZE + length;
+
+  IO_BYTES(user_read_bytes, size);
+  return length;
+}
+#endif /* COFFEE_RING_FILES */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_RUNTIME_GEOMETRY
+/* Record the geometry in a one-page extent at the start of the storage. */
+static void
+write_superblock(struct cfs_coffee_volume *vol)
+{
+  struct file_header hdr;
+  struct superblock sb;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.max_pages = 1;
+  hdr.flags = HDR_FLAG_ALLOCATED | HDR_FLAG_SUPERBLOCK;
+  write_header(vol, &hdr, 0);
+
+  sb.magic = SUPERBLOCK_MAGIC;
+  sb.page_size = vol->page_size;
+  sb.sector_size = vol->sector_size;
+  flash_write(vol, &sb, sizeof(sb), absolute_offset(vol, 0, 0));
+
+#if COFFEE_SECTOR_TABLE
+  sector_table_move(vol, 0, 1, PAGE_FREE, PAGE_ACTIVE);
+  sector_table_set_extent(vol, 0, 1);
+#endif
+  *next_free = 1;
+}
+/*---------------------------------------------------------------------------*/
+/* Take the page and sector sizes from the superblock of a storage area,
+   if it has one. */
+static void
+read_superblock(const struct cfs_coffee_flash *flash,
+                struct cfs_coffee_geometry *geometry)
+{
+  struct file_header hdr;
+  struct superblock sb;
+
+  flash->read(flash->arg, &hdr, sizeof(hdr), geometry->start);
+  if(!HDR_ACTIVE(hdr) || !HDR_SUPERBLOCK(hdr)) {
+    return;
+  }
+  flash->read(flash->arg, &sb, sizeof(sb), geometry->start + sizeof(hdr));
+  if(sb.magic == SUPERBLOCK_MAGIC) {
+    geometry->page_size = sb.page_size;
+    geometry->sector_size = sb.sector_size;
+  }
+}
+#endif /* COFFEE_RUNTIME_GEOMETRY */
+/*---------------------------------------------------------------------------*/
+static int
+format_locked(struct cfs_coffee_volume *vol)
+{
+  unsigned i;
+
+  PRINTF("Coffee: Formatting %u sectors", vol->sector_count);
+  IO_CALL(CFS_COFFEE_OP_OTHER);
+
+  *next_free = 0;
+  vol->gc_cursor = 0;
+
+  for(i = 0; i < vol->sector_count; i++) {
+    erase_sector(vol, i);
+    PRINTF(".");
+  }
+
+  /* Formatting invalidates the file information. */
+  memset(&vol->protected_mem, 0, sizeof(vol->protected_mem));
+#if COFFEE_RING_FILES
+  memset(vol->rings, 0, sizeof(vol->rings));
+#endif
+#if COFFEE_COMPRESSED_FILES
+  memset(vol->compressed, 0, sizeof(vol->compressed));
+#endif
+#if COFFEE_SECTOR_TABLE
+  sector_table_reset(vol);
+#endif
+#if COFFEE_NAME_INDEX_SIZE
+  memset(&vol->name_index, 0, sizeof(vol->name_index));
+  vol->name_index.state = NAME_INDEX_BUILT;
+#endif
+#if COFFEE_RUNTIME_GEOMETRY
+  write_superblock(vol);
+#endif
+
+  PRINTF(" done!\n");
+
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+mount_locked(struct cfs_coffee_volume *vol,
+             struct cfs_coffee_mount_stats *stats)
+{
+  struct cfs_coffee_mount_stats found;
+  unsigned long start;
+  coffee_page_t first_free;
+  int i;
+
+  IO_CALL(CFS_COFFEE_OP_OTHER);
+  for(i = 0; i < COFFEE_FD_SET_SIZE; i++) {
+    if(coffee_fd_set[i].flags != COFFEE_FD_FREE) {
+      return -1;
+    }
+  }
+
+  start = COFFEE_CLOCK_US();
+
+  /* Nothing known about the storage is trusted. */
+  memset(&vol->protected_mem, 0, sizeof(vol->protected_mem));
+#if COFFEE_RING_FILES
+  memset(vol->rings, 0, sizeof(vol->rings));
+#endif
+#if COFFEE_COMPRESSED_FILES
+  memset(vol->compressed, 0, sizeof(vol->compressed));
+#endif
+#if COFFEE_HEADER_CACHE_SIZE
+  memset(vol->header_cache.sets, 0, sizeof(vol->header_cache.sets));
+#endif
+#if COFFEE_SECTOR_TABLE
+  vol->sector_table.built = 0;
+#endif
+#if COFFEE_NAME_INDEX_SIZE
+  vol->name_index.state = NAME_INDEX_UNBUILT;
+#endif
+#if COFFEE_WEAR_COUNTS
+  vol->wear.loaded = 0;
+  wear_load(vol);
+#endif
+  vol->skip_pages = 0;
+  vol->last_pages_are_active = 0;
+  vol->gc_cursor = 0;
+
+  first_free = scan_headers(vol, &found);
+  *next_free = first_free == INVALID_PAGE ? 0 : first_free;
+
+  found.microseconds = COFFEE_CLOCK_US() - start;
+  if(stats != NULL) {
+    *stats = found;
+  }
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+gc_step_locked(struct cfs_coffee_volume *vol, unsigned budget)
+{
+#if COFFEE_SECTOR_TABLE
+  struct sector_status stats;
+  coffee_page_t prev_carried;
+  char prev_erased;
+  uint16_t sector;
+  int erased;
+  uint8_t saved_op;
+
+  saved_op = io_enter(vol, CFS_COFFEE_OP_GC);
+
+  /*
+   * Find the state of the sector before the cursor. An erased sector
+   * holds no extent head to isolate.
+   */
+  prev_carried = 0;
+  prev_erased = 1;
+  if(vol->gc_cursor > 0) {
+    sector_table_status(vol, vol->gc_cursor - 1, &stats);
+    prev_carried = stats.carried;
+    prev_erased = stats.free == VOL_PAGES_PER_SECTOR;
+  }
+
+  for(erased = 0; budget > 0; budget--) {
+    sector = vol->gc_cursor;
+    if(collect_sector(vol, sector, GC_GREEDY, &prev_carried,
+                      &prev_erased) >= 0) {
+      erased++;
+      vol->pool.stats.background_erases++;
+      *gc_wait = 0;
+    }
+
+    vol->gc_cursor = (sector + 1) % vol->sector_count;
+    if(vol->gc_cursor == 0) {
+      prev_carried = 0;
+      prev_erased = 1;
+    }
+  }
+
+  /*
+   * The step may stop inside an obsolete extent whose header has just
+   * been erased. Give the rest of the extent a header, so that the
+   * storage can still be walked.
+   */
+  if(prev_erased && vol->gc_cursor > 0 &&
+     vol->sector_table.sectors[vol->gc_cursor].carried >=
+     VOL_PAGES_PER_SECTOR) {
+    split_obsolete_extent(vol, vol->gc_cursor);
+  }
+
+  io_leave(vol, saved_op);
+  return erased;
+#else
+  /* Without the sector table, only a full pass knows the sector states,
+     which a bounded step cannot afford. */
+  return -1;
+#endif /* COFFEE_SECTOR_TABLE */
+}
+/*---------------------------------------------------------------------------*/
+static int
+refill_pool_locked(struct cfs_coffee_volume *vol, unsigned budget)
+{
+#if COFFEE_SECTOR_TABLE
+  int erased;
+
+  if(vol->pool.low_water == 0) {
+    return 0;
+  }
+  if(!vol->sector_table.built) {
+    sector_table_build(vol);
+  }
+
+  if(!vol->pool.refilling) {
+    if(vol->sector_table.erased >= vol->pool.low_water) {
+      return 0;
+    }
+    vol->pool.refilling = 1;
+    vol->pool.idle_steps = 0;
+    vol->pool.stats.refills++;
+  }
+
+  /* Evaluating a sector costs no I/O, so the budget limits erasures. */
+  erased = 0;
+  while(erased < budget && vol->sector_table.erased < vol->pool.high_water) {
+    if(gc_step_locked(vol, 1) > 0) {
+      erased++;
+      vol->pool.idle_steps = 0;
+    } else if(++vol->pool.idle_steps >= vol->sector_count) {
+      /* A whole lap found nothing to erase. */
+      break;
+    }
+#if COFFEE_THREADS
+    /* Let the waiting calls in between the erasures. */
+    UNLOCK_EXCLUSIVE(vol);
+    LOCK_EXCLUSIVE(vol);
+#endif
+  }
+
+  if(vol->sector_table.erased >= vol->pool.high_water ||
+     vol->pool.idle_steps >= vol->sector_count) {
+    vol->pool.refilling = 0;
+  }
+
+  return erased;
+#else
+  return 0;
+#endif /* COFFEE_SECTOR_TABLE */
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_set_pool_marks(struct cfs_coffee_volume *vol,
+                              unsigned low_water, unsigned high_water)
+{
+  if(high_water < low_water || high_water > vol->sector_count) {
+    return -1;
+  }
+
+  LOCK_EXCLUSIVE(vol);
+  vol->pool.low_water = low_water;
+  vol->pool.high_water = high_water;
+  vol->pool.refilling = 0;
+  UNLOCK_EXCLUSIVE(vol);
+
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_vol_get_pool_stats(struct cfs_coffee_volume *vol,
+                              struct cfs_coffee_pool_stats *stats)
+{
+  LOCK_EXCLUSIVE(vol);
+  *stats = vol->pool.stats;
+#if COFFEE_SECTOR_TABLE
+  if(!vol->sector_table.built) {
+    sector_table_build(vol);
+  }
+  stats->erased_sectors = vol->sector_table.erased;
+#endif
+  UNLOCK_EXCLUSIVE(vol);
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_vol_reset_pool_stats(struct cfs_coffee_volume *vol)
+{
+  LOCK_EXCLUSIVE(vol);
+  memset(&vol->pool.stats, 0, sizeof(vol->pool.stats));
+  UNLOCK_EXCLUSIVE(vol);
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_vol_get_stats(struct cfs_coffee_volume *vol,
+                         struct cfs_coffee_stats *stats)
+{
+#if COFFEE_IO_STATS
+  LOCK_EXCLUSIVE(vol);
+  *stats = vol->io_stats;
+  UNLOCK_EXCLUSIVE(vol);
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_vol_reset_stats(struct cfs_coffee_volume *vol)
+{
+#if COFFEE_IO_STATS
+  LOCK_EXCLUSIVE(vol);
+  memset(&vol->io_stats, 0, sizeof(vol->io_stats));
+  UNLOCK_EXCLUSIVE(vol);
+#endif
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_vol_get_wear_stats(struct cfs_coffee_volume *vol,
+                              struct cfs_coffee_wear_stats *stats)
+{
+#if COFFEE_WEAR_COUNTS
+  uint16_t sector;
+  unsigned long range;
+
+  LOCK_EXCLUSIVE(vol);
+  wear_load(vol);
+  memset(stats, 0, sizeof(*stats));
+  stats->min_erases = vol->wear.erases[0];
+  for(sector = 0; sector < vol->sector_count; sector++) {
+    if(vol->wear.erases[sector] < stats->min_erases) {
+      stats->min_erases = vol->wear.erases[sector];
+    }
+    if(vol->wear.erases[sector] > stats->max_erases) {
+      stats->max_erases = vol->wear.erases[sector];
+    }
+    stats->total_erases += vol->wear.erases[sector];
+  }
+
+  range = stats->max_erases - stats->min_erases + 1;
+  for(sector = 0; sector < vol->sector_count; sector++) {
+    stats->histogram[(vol->wear.erases[sector] - stats->min_erases) *
+                     CFS_COFFEE_WEAR_BUCKETS / range]++;
+  }
+  UNLOCK_EXCLUSIVE(vol);
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif /* COFFEE_WEAR_COUNTS */
+}
+/*---------------------------------------------------------------------------*/
+static int
+verify_sector_table_locked(struct cfs_coffee_volume *vol)
+{
+#if COFFEE_SECTOR_TABLE
+  struct sector_status scanned, *stats;
+  uint16_t sector, erased;
+  int mismatches;
+
+  if(!vol->sector_table.built) {
+    return 0;
+  }
+
+  mismatches = 0;
+  erased = 0;
+  for(sector = 0; sector < vol->sector_count; sector++) {
+    get_sector_status(vol, sector, &scanned);
+    stats = &vol->sector_table.sectors[sector];
+    if(stats->active != scanned.active ||
+       stats->obsolete != scanned.obsolete ||
+       stats->free != scanned.free) {
+      PRINTF("Coffee: Sector %u table %u/%u/%u, scan %u/%u/%u\n",
+             sector, (unsigned)stats->active, (unsigned)stats->obsolete,
+             (unsigned)stats->free, (unsigned)scanned.active,
+             (unsigned)scanned.obsolete, (unsigned)scanned.free);
+      mismatches++;
+    }
+    if(stats->free == VOL_PAGES_PER_SECTOR) {
+      erased++;
+    }
+  }
+
+  /* The erased sector count must match the one in the table. */
+  if(vol->sector_table.erased != erased) {
+    PRINTF("Coffee: %u erased sectors in the table, counted %u\n",
+           (unsigned)vol->sector_table.erased, (unsigned)erased);
+    mismatches++;
+  }
+
+#if COFFEE_FREE_EXTENT_INDEX
+  {
+    coffee_page_t run, best;
+
+    /* The longest free run must match the one in the table. */
+    run = best = 0;
+    for(sector = 0; sector < vol->sector_count; sector++) {
+      stats = &vol->sector_table.sectors[sector];
+      run = stats->free == VOL_PAGES_PER_SECTOR ?
+            run + stats->free : stats->free;
+      if(run > best) {
+        best = run;
+      }
+    }
+    if(vol->free_index[1].best != best) {
+      PRINTF("Coffee: Free index run %u, table run %u\n",
+             (unsigned)vol->free_index[1].best, (unsigned)best);
+      mismatches++;
+    }
+  }
+#endif
+  return mismatches;
+#else
+  return 0;
+#endif /* COFFEE_SECTOR_TABLE */
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_vol_get_cache_stats(struct cfs_coffee_volume *vol,
+                               struct cfs_coffee_cache_stats *stats)
+{
+#if COFFEE_HEADER_CACHE_SIZE
+  LOCK_EXCLUSIVE(vol);
+  *stats = vol->header_cache.stats;
+  UNLOCK_EXCLUSIVE(vol);
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_vol_reset_cache_stats(struct cfs_coffee_volume *vol)
+{
+#if COFFEE_HEADER_CACHE_SIZE
+  LOCK_EXCLUSIVE(vol);
+  memset(&vol->header_cache.stats, 0, sizeof(vol->header_cache.stats));
+  UNLOCK_EXCLUSIVE(vol);
+#endif
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * The public calls take the lock of the volume. A read or a seek that
+ * changes nothing but the offset of its descriptor can share the lock,
+ * unless the file has a micro log, whose map is built on demand.
+ */
+int
+cfs_coffee_vol_open(struct cfs_coffee_volume *vol, const char *name,
+                    int flags)
+{
+  int fd;
+
+  LOCK_EXCLUSIVE(vol);
+  fd = open_locked(vol, name, flags);
+  UNLOCK_EXCLUSIVE(vol);
+  return fd;
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_vol_close(struct cfs_coffee_volume *vol, int fd)
+{
+  LOCK_EXCLUSIVE(vol);
+  close_locked(vol, fd);
+  UNLOCK_EXCLUSIVE(vol);
+}
+/*---------------------------------------------------------------------------*/
+cfs_offset_t
+cfs_coffee_vol_seek(struct cfs_coffee_volume *vol, int fd,
+                    cfs_offset_t offset, int whence)
+{
+  cfs_offset_t r;
+
+  LOCK_SHARED(vol);
+  if(FD_VALID(fd) && seek_offset(vol, fd, offset, whence) <=
+     coffee_fd_set[fd].file->end) {
+    r = seek_locked(vol, fd, offset, whence);
+    UNLOCK_SHARED(vol);
+    return r;
+  }
+  UNLOCK_SHARED(vol);
+
+  /* The seek extends the file or fails. */
+  LOCK_EXCLUSIVE(vol);
+  r = seek_locked(vol, fd, offset, whence);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_remove(struct cfs_coffee_volume *vol, const char *name)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = remove_locked(vol, name);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_read(struct cfs_coffee_volume *vol, int fd, void *buf,
+                    unsigned size)
+{
+  int r;
+
+  LOCK_SHARED(vol);
+  if(FD_VALID(fd) && !FILE_MODIFIED(coffee_fd_set[fd].file) &&
+     !FILE_COMPRESSED(coffee_fd_set[fd].file)) {
+    r = read_locked(vol, fd, buf, size);
+    UNLOCK_SHARED(vol);
+    return r;
+  }
+  UNLOCK_SHARED(vol);
+
+  LOCK_EXCLUSIVE(vol);
+  r = read_locked(vol, fd, buf, size);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_write(struct cfs_coffee_volume *vol, int fd, const void *buf,
+                     unsigned size)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = write_locked(vol, fd, buf, size);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_readdir(struct cfs_coffee_volume *vol, struct cfs_dir *dir,
+                       struct cfs_dirent *record)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = readdir_locked(vol, dir, record);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_configure_log(struct cfs_coffee_volume *vol,
+                             const char *filename, unsigned log_size,
+                             unsigned log_record_size)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = configure_log_locked(vol, filename, log_size, log_record_size);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_COMPRESSED_FILES
+int
+cfs_coffee_vol_configure_compression(struct cfs_coffee_volume *vol,
+                                     const char *filename, cfs_offset_t size,
+                                     unsigned block_size)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = configure_compression_locked(vol, filename, size, block_size);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+#endif
+/*---------------------------------------------------------------------------*/
+#if COFFEE_IO_SEMANTICS
+int
+cfs_coffee_vol_set_io_semantics(struct cfs_coffee_volume *vol, int fd,
+                                unsigned flags)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = set_io_semantics_locked(vol, fd, flags);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+#endif
+/*---------------------------------------------------------------------------*/
+#if COFFEE_RING_FILES
+int
+cfs_coffee_vol_ring_create(struct cfs_coffee_volume *vol, const char *name,
+                           cfs_offset_t size)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = ring_create_locked(vol, name, size);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_ring_append(struct cfs_coffee_volume *vol, int fd,
+                           const void *buf, unsigned size)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = ring_append_locked(vol, fd, buf, size);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_ring_flush(struct cfs_coffee_volume *vol, int fd)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = ring_flush_locked(vol, fd);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_ring_rewind(struct cfs_coffee_volume *vol, int fd,
+                           struct cfs_coffee_ring_cursor *cursor)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = ring_rewind_locked(vol, fd, cursor);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_ring_next(struct cfs_coffee_volume *vol, int fd,
+                         struct cfs_coffee_ring_cursor *cursor, void *buf,
+                         unsigned size)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = ring_next_locked(vol, fd, cursor, buf, size);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+#endif /* COFFEE_RING_FILES */
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_format(struct cfs_coffee_volume *vol)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = format_locked(vol);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_mount(struct cfs_coffee_volume *vol,
+                     struct cfs_coffee_mount_stats *stats)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = mount_locked(vol, stats);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_gc_step(struct cfs_coffee_volume *vol, unsigned budget)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = gc_step_locked(vol, budget);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_refill_pool(struct cfs_coffee_volume *vol, unsigned budget)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = refill_pool_locked(vol, budget);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_vol_verify_sector_table(struct cfs_coffee_volume *vol)
+{
+  int r;
+
+  LOCK_EXCLUSIVE(vol);
+  r = verify_sector_table_locked(vol);
+  UNLOCK_EXCLUSIVE(vol);
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+struct cfs_coffee_volume *
+cfs_coffee_attach(const struct cfs_coffee_flash *flash,
+                  const struct cfs_coffee_geometry *geometry)
+{
+  struct cfs_coffee_geometry layout;
+  struct cfs_coffee_volume *vol;
+  int i;
+
+  layout = *geometry;
+  if(layout.page_size == 0 && layout.sector_size == 0) {
+    layout.page_size = COFFEE_PAGE_SIZE;
+    layout.sector_size = COFFEE_SECTOR_SIZE;
+#if COFFEE_RUNTIME_GEOMETRY
+    if(layout.start >= 0) {
+      read_superblock(flash, &layout);
+    }
+#endif
+  }
+
+#if COFFEE_RUNTIME_GEOMETRY
+  if(layout.page_size <= sizeof(struct file_header) ||
+     layout.page_size > COFFEE_MAX_PAGE_SIZE ||
+     layout.sector_size < COFFEE_MIN_SECTOR_SIZE ||
+     layout.sector_size % layout.page_size != 0) {
+    return NULL;
+  }
+#else
+  if(layout.page_size != COFFEE_PAGE_SIZE ||
+     layout.sector_size != COFFEE_SECTOR_SIZE) {
+    return NULL;
+  }
+#endif
+  if(layout.start < 0 || layout.size <= 0 ||
+     layout.start % layout.sector_size != 0 ||
+     layout.size % layout.sector_size != 0 ||
+     layout.size > COFFEE_SIZE) {
+    return NULL;
+  }
+
+#if COFFEE_THREADS
+  COFFEE_LOCK_EXCLUSIVE(&volumes_lock);
+#endif
+  for(i = 1; i < COFFEE_VOLUMES; i++) {
+    vol = &volumes[i];
+    if(vol->flash.read == NULL) {
+      memset(vol, 0, sizeof(*vol));
+      vol->flash = *flash;
+      vol->start = layout.start;
+      vol->sector_count = layout.size / layout.sector_size;
+      vol->page_count = layout.size / layout.page_size;
+#if COFFEE_RUNTIME_GEOMETRY
+      vol->page_size = layout.page_size;
+      vol->sector_size = layout.sector_size;
+      vol->pages_per_sector = layout.sector_size / layout.page_size;
+#endif
+      vol->pool.low_water = COFFEE_POOL_LOW_WATER;
+      vol->pool.high_water = COFFEE_POOL_HIGH_WATER;
+#if COFFEE_IO_STATS
+      vol->io_op = CFS_COFFEE_OP_READ;
+#endif
+#if COFFEE_THREADS
+      COFFEE_LOCK_INIT(&vol->lock);
+      COFFEE_UNLOCK_EXCLUSIVE(&volumes_lock);
+#endif
+      return vol;
+    }
+  }
+#if COFFEE_THREADS
+  COFFEE_UNLOCK_EXCLUSIVE(&volumes_lock);
+#endif
+  return NULL;
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_vol_get_geometry(struct cfs_coffee_volume *vol,
+                            struct cfs_coffee_geometry *geometry)
+{
+  geometry->start = vol->start;
+  geometry->size = vol->page_count * VOL_PAGE_SIZE;
+  geometry->page_size = VOL_PAGE_SIZE;
+  geometry->sector_size = VOL_SECTOR_SIZE;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_detach(struct cfs_coffee_volume *vol)
+{
+  int i, r;
+
+  if(vol == &volumes[0]) {
+    return -1;
+  }
+
+#if COFFEE_THREADS
+  COFFEE_LOCK_EXCLUSIVE(&volumes_lock);
+#endif
+  LOCK_EXCLUSIVE(vol);
+  r = 0;
+  for(i = 0; i < COFFEE_FD_SET_SIZE; i++) {
+    if(coffee_fd_set[i].flags != COFFEE_FD_FREE) {
+      r = -1;
+      break;
+    }
+  }
+  if(r == 0) {
+    vol->flash.read = NULL;
+  }
+  UNLOCK_EXCLUSIVE(vol);
+#if COFFEE_THREADS
+  COFFEE_UNLOCK_EXCLUSIVE(&volumes_lock);
+#endif
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+struct cfs_coffee_volume *
+cfs_coffee_default_volume(void)
+{
+  return &volumes[0];
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_open(const char *name, int flags)
+{
+  return cfs_coffee_vol_open(&volumes[0], name, flags);
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_close(int fd)
+{
+  cfs_coffee_vol_close(&volumes[0], fd);
+}
+/*---------------------------------------------------------------------------*/
+cfs_offset_t
+cfs_seek(int fd, cfs_offset_t offset, int whence)
+{
+  return cfs_coffee_vol_seek(&volumes[0], fd, offset, whence);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_remove(const char *name)
+{
+  return cfs_coffee_vol_remove(&volumes[0], name);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_read(int fd, void *buf, unsigned size)
+{
+  return cfs_coffee_vol_read(&volumes[0], fd, buf, size);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_write(int fd, const void *buf, unsigned size)
+{
+  return cfs_coffee_vol_write(&volumes[0], fd, buf, size);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_opendir(struct cfs_dir *dir, const char *name)
+{
+  return cfs_coffee_vol_opendir(&volumes[0], dir, name);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_readdir(struct cfs_dir *dir, struct cfs_dirent *record)
+{
+  return cfs_coffee_vol_readdir(&volumes[0], dir, record);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_reserve(const char *name, cfs_offset_t size)
+{
+  return cfs_coffee_vol_reserve(&volumes[0], name, size);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_configure_log(const char *filename, unsigned log_size,
+                         unsigned log_record_size)
+{
+  return cfs_coffee_vol_configure_log(&volumes[0], filename, log_size,
+                                      log_record_size);
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_COMPRESSED_FILES
+int
+cfs_coffee_configure_compression(const char *filename, cfs_offset_t size,
+                                 unsigned block_size)
+{
+  return cfs_coffee_vol_configure_compression(&volumes[0], filename, size,
+                                              block_size);
+}
+#endif
+/*---------------------------------------------------------------------------*/
+#if COFFEE_IO_SEMANTICS
+int
+cfs_coffee_set_io_semantics(int fd, unsigned flags)
+{
+  return cfs_coffee_vol_set_io_semantics(&volumes[0], fd, flags);
+}
+#endif
+/*---------------------------------------------------------------------------*/
+#if COFFEE_RING_FILES
+int
+cfs_coffee_ring_create(const char *name, cfs_offset_t size)
+{
+  return cfs_coffee_vol_ring_create(&volumes[0], name, size);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_ring_append(int fd, const void *buf, unsigned size)
+{
+  return cfs_coffee_vol_ring_append(&volumes[0], fd, buf, size);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_ring_flush(int fd)
+{
+  return cfs_coffee_vol_ring_flush(&volumes[0], fd);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_ring_rewind(int fd, struct cfs_coffee_ring_cursor *cursor)
+{
+  return cfs_coffee_vol_ring_rewind(&volumes[0], fd, cursor);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_ring_next(int fd, struct cfs_coffee_ring_cursor *cursor,
+                     void *buf, unsigned size)
+{
+  return cfs_coffee_vol_ring_next(&volumes[0], fd, cursor, buf, size);
+}
+#endif
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_format(void)
+{
+  return cfs_coffee_vol_format(&volumes[0]);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_mount(struct cfs_coffee_mount_stats *stats)
+{
+  return cfs_coffee_vol_mount(&volumes[0], stats);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_gc_step(unsigned budget)
+{
+  return cfs_coffee_vol_gc_step(&volumes[0], budget);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_refill_pool(unsigned budget)
+{
+  return cfs_coffee_vol_refill_pool(&volumes[0], budget);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_set_pool_marks(unsigned low_water, unsigned high_water)
+{
+  return cfs_coffee_vol_set_pool_marks(&volumes[0], low_water, high_water);
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_get_pool_stats(struct cfs_coffee_pool_stats *stats)
+{
+  cfs_coffee_vol_get_pool_stats(&volumes[0], stats);
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_reset_pool_stats(void)
+{
+  cfs_coffee_vol_reset_pool_stats(&volumes[0]);
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_get_stats(struct cfs_coffee_stats *stats)
+{
+  cfs_coffee_vol_get_stats(&volumes[0], stats);
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_reset_stats(void)
+{
+  cfs_coffee_vol_reset_stats(&volumes[0]);
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_get_wear_stats(struct cfs_coffee_wear_stats *stats)
+{
+  cfs_coffee_vol_get_wear_stats(&volumes[0], stats);
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_verify_sector_table(void)
+{
+  return cfs_coffee_vol_verify_sector_table(&volumes[0]);
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_get_cache_stats(struct cfs_coffee_cache_stats *stats)
+{
+  cfs_coffee_vol_get_cache_stats(&volumes[0], stats);
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_coffee_reset_cache_stats(void)
+{
+  cfs_coffee_vol_reset_cache_stats(&volumes[0]);
 }
 /*---------------------------------------------------------------------------*/
 void *
 cfs_coffee_get_protected_mem(unsigned *size)
 {
-  *size = sizeof(protected_mem);
-  return &protected_mem;
+  *size = sizeof(volumes[0].protected_mem);
+  return &volumes[0].protected_mem;
 }
@@ -116,6 +116,113 @@ int cfs_coffee_configure_log(const char *file, unsigned log_size,
  */
 int cfs_coffee_set_io_semantics(int fd, unsigned flags);
 
+/**
+ * \brief Configure a file to be compressed.
+ * \param file The filename of an empty file.
+ * \param size The largest size of the data that the file holds.
+ * \param block_size The size of the blocks that are compressed, at most
+ * COFFEE_COMPRESS_BLOCK_SIZE.
+ * \return 0 on success, -1 on failure.
+ *
+ * Data that is written to a compressed file is compressed in blocks,
+ * and cfs_read() decompresses it. An index table at the start of the
+ * file, of 12 bytes for each block of size, finds the block that holds
+ * an offset, so seeks and random reads decompress one block. The file
+ * must have been reserved, e.g. with cfs_coffee_reserve(), with room for
+ * the index, and must not be open.
+ *
+ * A compressed file can only be appended to. The block that is being
+ * appended to is kept in RAM until it is full or the file is closed for
+ * the last time, so its data can be lost at a power failure. Each block
+ * that is stored programs its compressed size, or its size if it does
+ * not compress, and closing the file stores a partial block, which
+ * compresses less well. Up to COFFEE_COMPRESSED_FILES compressed files
+ * can be open at the same time. cfs_readdir() reports the size of the
+ * data. Compressed files require COFFEE_COMPRESSED_FILES.
+ */
+int cfs_coffee_configure_compression(const char *file, cfs_offset_t size,
+                                     unsigned block_size);
+
+/**
+ * \brief Create a ring file.
+ * \param name The filename.
+ * \param size The number of bytes of records that the ring holds.
+ * \return 0 on success, -1 on failure.
+ *
+ * A ring file keeps the most recent records that were appended to it,
+ * e.g. for telemetry that is written at a high rate. Its space is
+ * reserved once, in whole sectors: at least two sectors of records,
+ * plus one sector for the header, which is partly unused. When the ring
+ * is full, appending to it erases the sector with the oldest records.
+ * A ring is never merged or copied, and each page of records is
+ * programmed once.
+ *
+ * A ring file is opened with cfs_open() and closed with cfs_close(),
+ * which program the records that are still buffered, but it is accessed
+ * with cfs_coffee_ring_append() and cfs_coffee_ring_next() instead of
+ * cfs_write() and cfs_read(). Up to COFFEE_RING_FILES rings can be open
+ * at the same time. cfs_readdir() reports the size of a ring. Ring
+ * files require COFFEE_RING_FILES.
+ */
+int cfs_coffee_ring_create(const char *name, cfs_offset_t size);
+
+/**
+ * \brief Append a record to a ring file.
+ * \param fd A file descriptor of a ring opened with CFS_WRITE.
+ * \param buf The record.
+ * \param size The size of the record, from 1 to 65535 bytes and at
+ * most the sector size minus 6 bytes.
+ * \return size on success, -1 on failure.
+ *
+ * The record is buffered in RAM until its page is full, so a record
+ * that is not flushed with cfs_coffee_ring_flush() or cfs_close() can
+ * be lost at a power failure. A record does not span sectors.
+ */
+int cfs_coffee_ring_append(int fd, const void *buf, unsigned size);
+
+/**
+ * \brief Program the buffered records of a ring file.
+ * \param fd A file descriptor of a ring.
+ * \return 0 on success, -1 on failure.
+ */
+int cfs_coffee_ring_flush(int fd);
+
+/**
+ * A position in a ring file.
+ *
+ * \sa cfs_coffee_ring_next()
+ */
+struct cfs_coffee_ring_cursor {
+  unsigned long sequence;
+  cfs_offset_t offset;
+};
+
+/**
+ * \brief Move a cursor to the oldest record of a ring file.
+ * \param fd A file descriptor of a ring.
+ * \param cursor The cursor.
+ * \return 0 on success, -1 on failure.
+ *
+ * A zeroed cursor also starts from the oldest record.
+ */
+int cfs_coffee_ring_rewind(int fd, struct cfs_coffee_ring_cursor *cursor);
+
+/**
+ * \brief Read the next record of a ring file.
+ * \param fd A file descriptor of a ring opened with CFS_READ.
+ * \param cursor The position, which is moved past the record.
+ * \param buf Receives the record, truncated to size bytes.
+ * \param size The size of buf.
+ * \return The size of the record, or -1 if there are no more records.
+ *
+ * Records are read from the oldest to the newest, including buffered
+ * ones. A cursor whose records have been erased by appends continues
+ * from the oldest record. A cursor at the end of the ring returns the
+ * records that are appended later.
+ */
+int cfs_coffee_ring_next(int fd, struct cfs_coffee_ring_cursor *cursor,
+                         void *buf, unsigned size);
+
 /**
  * \brief Format the storage area assigned to Coffee.
  * \return 0 on success, -1 on failure.
@@ -126,15 +233,418 @@ int cfs_coffee_set_io_semantics(int fd, unsigned flags);
  */
 int cfs_coffee_format(void);
 
+/**
+ * What the header scan of cfs_coffee_mount() found.
+ *
+ * \sa cfs_coffee_mount()
+ */
+struct cfs_coffee_mount_stats {
+  /** Page headers read by the scan. */
+  unsigned long headers;
+  /** Files, not counting the extents and logs that belong to them. */
+  unsigned long files;
+  unsigned long active_pages;
+  unsigned long obsolete_pages;
+  unsigned long free_pages;
+  /** Duration of the scan, or 0 if Coffee has no COFFEE_CLOCK_US(). */
+  unsigned long microseconds;
+};
+
+/**
+ * \brief Mount the storage area assigned to Coffee.
+ * \param stats Receives what the scan found, unless it is NULL.
+ * \return 0 on success, -1 if files are open.
+ *
+ * Coffee keeps tables of the files, the sectors and the free space in
+ * RAM. Without a mount, each table is built by its own walk over the
+ * headers when it is first needed, which makes the first operations
+ * after a restart slow. This function discards the tables and the
+ * cached file information, and rebuilds them in one sequential walk,
+ * which reads each header once. The end of each file is still found
+ * when the file is opened. Call this at startup, or after the storage
+ * has been changed by other means.
+ */
+int cfs_coffee_mount(struct cfs_coffee_mount_stats *stats);
+
+/**
+ * \brief Run a bounded step of the garbage collector.
+ * \param budget The maximum number of sectors to evaluate, each of which
+ * may be erased.
+ * \return The number of sectors erased, or -1 if steps are not supported.
+ *
+ * Coffee runs the garbage collector when a file cannot be reserved,
+ * which can erase many sectors during a single cfs_open() or
+ * cfs_write(). An idle task can call this function instead to erase
+ * sectors that hold only obsolete pages ahead of time, so that
+ * reservations find free space. Each call continues where the previous
+ * one stopped. Without COFFEE_SECTOR_TABLE, the state of a sector is
+ * only known during a pass over all sectors, so steps are not supported
+ * and each call returns -1 without erasing anything.
+ */
+int cfs_coffee_gc_step(unsigned budget);
+
+/**
+ * Counters of the pool of erased sectors.
+ *
+ * \sa cfs_coffee_get_pool_stats()
+ */
+struct cfs_coffee_pool_stats {
+  /** Reservations that ran the garbage collector themselves. */
+  unsigned long foreground_gcs;
+  /** Sectors erased by the garbage collector during file operations. */
+  unsigned long foreground_erases;
+  /** Sectors erased by cfs_coffee_gc_step() and cfs_coffee_refill_pool(). */
+  unsigned long background_erases;
+  /** Times the pool fell below the low water mark. */
+  unsigned long refills;
+  /** Sectors whose pages are all free at the time of the call. */
+  unsigned erased_sectors;
+};
+
+/**
+ * \brief Refill the pool of erased sectors.
+ * \param budget The maximum number of sectors to erase.
+ * \return The number of sectors erased.
+ *
+ * A background task calls this function periodically, so that
+ * reservations find erased sectors and rarely run the garbage collector
+ * themselves. Nothing is done until the pool has fewer erased sectors
+ * than the low water mark; then obsolete sectors are erased with
+ * cfs_coffee_gc_step() over one or more calls until the pool reaches
+ * the high water mark, or until a whole pass finds nothing to erase.
+ * The pool requires COFFEE_SECTOR_TABLE; without it, this function
+ * returns 0.
+ */
+int cfs_coffee_refill_pool(unsigned budget);
+
+/**
+ * \brief Set the water marks of the pool of erased sectors.
+ * \param low_water The number of erased sectors below which a refill
+ * starts, or 0 to disable the refill.
+ * \param high_water The number of erased sectors at which a refill stops.
+ * \return 0 on success, -1 if the marks are out of order or exceed the
+ * number of sectors.
+ *
+ * The defaults are COFFEE_POOL_LOW_WATER and COFFEE_POOL_HIGH_WATER.
+ */
+int cfs_coffee_set_pool_marks(unsigned low_water, unsigned high_water);
+
+/**
+ * \brief Get the counters of the pool of erased sectors.
+ * \param stats Receives the counters accumulated since the last reset.
+ *
+ * foreground_gcs shows how often a reservation still had to wait for
+ * erasures despite the pool.
+ */
+void cfs_coffee_get_pool_stats(struct cfs_coffee_pool_stats *stats);
+
+/**
+ * \brief Reset the counters of the pool of erased sectors.
+ */
+void cfs_coffee_reset_pool_stats(void);
+
+/** Number of ranges in the erase count histogram. */
+#define CFS_COFFEE_WEAR_BUCKETS 8
+
+/**
+ * Distribution of the sector erase counts.
+ *
+ * \sa cfs_coffee_get_wear_stats()
+ */
+struct cfs_coffee_wear_stats {
+  unsigned long min_erases;
+  unsigned long max_erases;
+  unsigned long total_erases;
+  /** Sectors in each of the equal ranges from min_erases to max_erases. */
+  unsigned histogram[CFS_COFFEE_WEAR_BUCKETS];
+};
+
+/**
+ * \brief Get the distribution of the sector erase counts.
+ * \param stats Receives the distribution.
+ *
+ * With COFFEE_WEAR_COUNTS, Coffee keeps the number of times each sector
+ * has been erased, including erasures before the last restart if the
+ * flash driver stores them. The distribution shows how evenly a
+ * workload wears the storage; the maximum bounds the device lifetime.
+ * The counts are zero if COFFEE_WEAR_COUNTS is disabled.
+ */
+void cfs_coffee_get_wear_stats(struct cfs_coffee_wear_stats *stats);
+
+/**
+ * \brief Check the sector status table against the storage.
+ * \return The number of sectors whose page counts differ from a full
+ * header scan, or 0 if the table is disabled.
+ *
+ * With COFFEE_SECTOR_TABLE, Coffee keeps the active, obsolete and free
+ * page counts of each sector in RAM and updates them incrementally.
+ * With COFFEE_FREE_EXTENT_INDEX, the longest free page run in the index
+ * of free extents is checked against the table as well.
+ * This function is a verification mode for the table; it reads the
+ * headers of the whole storage and should not be used in normal
+ * operation.
+ */
+int cfs_coffee_verify_sector_table(void);
+
+/**
+ * Hit and miss counters of the page header cache.
+ *
+ * \sa cfs_coffee_get_cache_stats()
+ */
+struct cfs_coffee_cache_stats {
+  unsigned long hits;
+  unsigned long misses;
+};
+
+/**
+ * \brief Get the page header cache statistics.
+ * \param stats Receives the counters accumulated since the last reset.
+ *
+ * Coffee can keep recently used page headers in RAM (see
+ * COFFEE_HEADER_CACHE_SIZE), so that repeated metadata walks do not
+ * read the storage again. The counters are zero if the cache is disabled.
+ */
+void cfs_coffee_get_cache_stats(struct cfs_coffee_cache_stats *stats);
+
+/**
+ * \brief Reset the page header cache statistics.
+ */
+void cfs_coffee_reset_cache_stats(void);
+
+/**
+ * \name Operations that flash I/O is attributed to
+ * \sa cfs_coffee_get_stats()
+ * @{
+ */
+#define CFS_COFFEE_OP_OPEN    0 /**< cfs_open() */
+#define CFS_COFFEE_OP_READ    1 /**< cfs_read() */
+#define CFS_COFFEE_OP_WRITE   2 /**< cfs_write(), except merges and GC */
+#define CFS_COFFEE_OP_REMOVE  3 /**< cfs_remove(), except GC */
+#define CFS_COFFEE_OP_GC      4 /**< The garbage collector */
+#define CFS_COFFEE_OP_MERGE   5 /**< Merges of micro logs into their files */
+#define CFS_COFFEE_OP_OTHER   6 /**< Other calls, e.g. cfs_close() */
+#define CFS_COFFEE_OPS        7
+/** @} */
+
+/**
+ * Flash I/O caused by one kind of operation.
+ */
+struct cfs_coffee_op_stats {
+  unsigned long calls;
+  unsigned long reads;
+  unsigned long read_bytes;
+  unsigned long programs;
+  unsigned long program_bytes;
+  unsigned long erases;
+};
+
+/**
+ * Flash I/O counters.
+ *
+ * \sa cfs_coffee_get_stats()
+ */
+struct cfs_coffee_stats {
+  struct cfs_coffee_op_stats ops[CFS_COFFEE_OPS];
+  /** Bytes returned by cfs_read(). */
+  unsigned long user_read_bytes;
+  /** Bytes accepted by cfs_write(). */
+  unsigned long user_write_bytes;
+  /** File lookups that walked the headers because the name index could
+      not answer, e.g. while it holds too many files. */
+  unsigned long name_scans;
+};
+
+/**
+ * \brief Get the flash I/O counters.
+ * \param stats Receives the counters accumulated since the last reset.
+ *
+ * With COFFEE_IO_STATS, Coffee counts every flash read, program and
+ * erase with its size, and attributes it to the call that caused it.
+ * I/O done by the garbage collector or by merging a micro log is
+ * attributed to CFS_COFFEE_OP_GC or CFS_COFFEE_OP_MERGE, even when
+ * a cfs_write() started it. Dividing the programmed bytes by
+ * user_write_bytes gives the write amplification. Reads of page
+ * headers that hit the header cache do not reach the flash and are
+ * not counted. The counters are zero if COFFEE_IO_STATS is disabled.
+ */
+void cfs_coffee_get_stats(struct cfs_coffee_stats *stats);
+
+/**
+ * \brief Reset the flash I/O counters.
+ */
+void cfs_coffee_reset_stats(void);
+
+/**
+ * \name Volumes
+ *
+ * The functions above operate on the default volume, whose storage is
+ * accessed with the COFFEE_READ, COFFEE_WRITE and COFFEE_ERASE macros
+ * of the platform. Other storage areas, on the same device or on other
+ * devices, can be attached as volumes with their own flash operations,
+ * files, file descriptors and state, e.g. to keep frequently written
+ * logs apart from configuration files. Up to COFFEE_VOLUMES volumes,
+ * including the default volume, can be attached at the same time.
+ *
+ * Each function named cfs_coffee_vol_*() takes the volume as its first
+ * parameter, and otherwise works like the cfs_*() or cfs_coffee_*()
+ * function of the same name. File descriptors and directories belong
+ * to the volume on which they were opened. cfs_closedir() works for
+ * directories of all volumes. Different volumes can be used from
+ * different threads at the same time.
+ *
+ * When COFFEE_THREADS is set, one volume can also be used from several
+ * threads. Reads and seeks within files that have not been modified
+ * after they were written run at the same time, while the other calls
+ * wait for each other. A file descriptor must still be used by one
+ * thread at a time.
+ * @{
+ */
+
+/**
+ * Flash operations of a volume. Offsets are bytes from the start of
+ * the device, and sectors are numbered from the start of the device in
+ * units of the sector size of the volume. The erased value of a byte is 0x00, as with COFFEE_READ. The arg
+ * member is passed to each operation.
+ */
+struct cfs_coffee_flash {
+  void (*read)(void *arg, void *buf, cfs_offset_t size, cfs_offset_t offset);
+  void (*write)(void *arg, const void *buf, cfs_offset_t size,
+                cfs_offset_t offset);
+  void (*erase)(void *arg, unsigned sector);
+  /** Number of times the device has erased a sector, or NULL if the
+      driver does not keep erase counts. */
+  unsigned long (*erase_count)(void *arg, unsigned sector);
+  void *arg;
+};
+
+/**
+ * The storage area of a volume on its device, and its layout.
+ *
+ * Unless COFFEE_RUNTIME_GEOMETRY is set, the page and sector sizes are
+ * COFFEE_PAGE_SIZE and COFFEE_SECTOR_SIZE. Otherwise, they can be up to
+ * COFFEE_MAX_PAGE_SIZE bytes and down to COFFEE_MIN_SECTOR_SIZE bytes,
+ * respectively, and cfs_coffee_vol_format() records them in a
+ * superblock. When both are zero, they are read from the superblock,
+ * or are COFFEE_PAGE_SIZE and COFFEE_SECTOR_SIZE if there is none.
+ */
+struct cfs_coffee_geometry {
+  /** Offset of the first byte, at the start of a sector. */
+  cfs_offset_t start;
+  /** Size in bytes, a multiple of the sector size up to COFFEE_SIZE. */
+  cfs_offset_t size;
+  /** Page size in bytes. */
+  cfs_offset_t page_size;
+  /** Sector size in bytes, a multiple of the page size. */
+  cfs_offset_t sector_size;
+};
+
+struct cfs_coffee_volume;
+
+/**
+ * \brief Attach a storage area as a volume.
+ * \param flash The flash operations of the device, which are copied.
+ * \param geometry The storage area on the device.
+ * \return The volume, or NULL if the geometry is not supported or
+ * COFFEE_VOLUMES volumes are attached.
+ *
+ * The storage area must be formatted with cfs_coffee_vol_format()
+ * before it is used for the first time.
+ */
+struct cfs_coffee_volume *
+cfs_coffee_attach(const struct cfs_coffee_flash *flash,
+                  const struct cfs_coffee_geometry *geometry);
+
+/**
+ * \brief Detach a volume.
+ * \param vol A volume returned by cfs_coffee_attach().
+ * \return 0 on success, -1 on failure.
+ *
+ * A volume with open files is not detached. The default volume cannot
+ * be detached.
+ */
+int cfs_coffee_detach(struct cfs_coffee_volume *vol);
+
+/**
+ * \brief Get the default volume, on which the cfs_*() calls operate.
+ *
+ * The default volume always has the COFFEE_PAGE_SIZE and
+ * COFFEE_SECTOR_SIZE layout.
+ */
+struct cfs_coffee_volume *cfs_coffee_default_volume(void);
+
+/**
+ * \brief Get the storage area and the layout of a volume.
+ */
+void cfs_coffee_vol_get_geometry(struct cfs_coffee_volume *vol,
+                                 struct cfs_coffee_geometry *geometry);
+
+int cfs_coffee_vol_open(struct cfs_coffee_volume *vol, const char *name,
+                        int flags);
+void cfs_coffee_vol_close(struct cfs_coffee_volume *vol, int fd);
+cfs_offset_t cfs_coffee_vol_seek(struct cfs_coffee_volume *vol, int fd,
+                                 cfs_offset_t offset, int whence);
+int cfs_coffee_vol_remove(struct cfs_coffee_volume *vol, const char *name);
+int cfs_coffee_vol_read(struct cfs_coffee_volume *vol, int fd, void *buf,
+                        unsigned size);
+int cfs_coffee_vol_write(struct cfs_coffee_volume *vol, int fd,
+                         const void *buf, unsigned size);
+int cfs_coffee_vol_opendir(struct cfs_coffee_volume *vol,
+                           struct cfs_dir *dir, const char *name);
+int cfs_coffee_vol_readdir(struct cfs_coffee_volume *vol,
+                           struct cfs_dir *dir, struct cfs_dirent *record);
+int cfs_coffee_vol_reserve(struct cfs_coffee_volume *vol, const char *name,
+                           cfs_offset_t size);
+int cfs_coffee_vol_configure_log(struct cfs_coffee_volume *vol,
+                                 const char *file, unsigned log_size,
+                                 unsigned log_entry_size);
+int cfs_coffee_vol_set_io_semantics(struct cfs_coffee_volume *vol, int fd,
+                                    unsigned flags);
+int cfs_coffee_vol_configure_compression(struct cfs_coffee_volume *vol,
+                                         const char *file, cfs_offset_t size,
+                                         unsigned block_size);
+int cfs_coffee_vol_ring_create(struct cfs_coffee_volume *vol,
+                               const char *name, cfs_offset_t size);
+int cfs_coffee_vol_ring_append(struct cfs_coffee_volume *vol, int fd,
+                               const void *buf, unsigned size);
+int cfs_coffee_vol_ring_flush(struct cfs_coffee_volume *vol, int fd);
+int cfs_coffee_vol_ring_rewind(struct cfs_coffee_volume *vol, int fd,
+                               struct cfs_coffee_ring_cursor *cursor);
+int cfs_coffee_vol_ring_next(struct cfs_coffee_volume *vol, int fd,
+                             struct cfs_coffee_ring_cursor *cursor,
+                             void *buf, unsigned size);
+int cfs_coffee_vol_format(struct cfs_coffee_volume *vol);
+int cfs_coffee_vol_mount(struct cfs_coffee_volume *vol,
+                         struct cfs_coffee_mount_stats *stats);
+int cfs_coffee_vol_gc_step(struct cfs_coffee_volume *vol, unsigned budget);
+int cfs_coffee_vol_refill_pool(struct cfs_coffee_volume *vol,
+                               unsigned budget);
+int cfs_coffee_vol_set_pool_marks(struct cfs_coffee_volume *vol,
+                                  unsigned low_water, unsigned high_water);
+void cfs_coffee_vol_get_pool_stats(struct cfs_coffee_volume *vol,
+                                   struct cfs_coffee_pool_stats *stats);
+void cfs_coffee_vol_reset_pool_stats(struct cfs_coffee_volume *vol);
+void cfs_coffee_vol_get_wear_stats(struct cfs_coffee_volume *vol,
+                                   struct cfs_coffee_wear_stats *stats);
+int cfs_coffee_vol_verify_sector_table(struct cfs_coffee_volume *vol);
+void cfs_coffee_vol_get_cache_stats(struct cfs_coffee_volume *vol,
+                                    struct cfs_coffee_cache_stats *stats);
+void cfs_coffee_vol_reset_cache_stats(struct cfs_coffee_volume *vol);
+void cfs_coffee_vol_get_stats(struct cfs_coffee_volume *vol,
+                              struct cfs_coffee_stats *stats);
+void cfs_coffee_vol_reset_stats(struct cfs_coffee_volume *vol);
+
+/** @} */
+
 /**
  * \brief Points out a memory region that may not be altered during
  * checkpointing operations that use the file system.
  * \param size
  * \return A pointer to the protected memory.
  *
- * This function returns the protected memory pointer and writes its size
- * to the given parameter. Mainly used by sensornet checkpointing to protect
- * the coffee state during CFS-based checkpointing operations.
+ * This function returns the protected memory pointer of the default
+ * volume and writes its size to the given parameter. Mainly used by
+ * sensornet checkpointing to protect the coffee state during CFS-based
+ * checkpointing operations.
  */
 void *cfs_coffee_get_protected_mem(unsigned *size);
 
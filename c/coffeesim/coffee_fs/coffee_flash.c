@@ -26,6 +26,10 @@
 
 const char* diskname = "coffeedisk.img";
 
+/* The erase counts of the sectors follow the storage in the image. */
+#define DISK_SIZE (COFFEE_START + COFFEE_SIZE)
+#define SECTOR_COUNT (DISK_SIZE / COFFEE_SECTOR_SIZE)
+
 #define TRUE 1
 #define FALSE 0
 
@@ -50,7 +54,9 @@ static void create_file_if_needed(const char * const filename){
 }
 
 
-void cflash_write(const uint8_t * const buf, uint32_t size, uint32_t offset){
+/* Write to the image without charging the timing model */
+static void write_image(const uint8_t * const buf, uint32_t size,
+                        uint32_t offset){
 
     FILE * pFile;
 
@@ -74,10 +80,20 @@ void cflash_write(const uint8_t * const buf, uint32_t size, uint32_t offset){
 }
 
 
+void cflash_write(const uint8_t * const buf, uint32_t size, uint32_t offset){
+
+    cflash_timing_write(size, offset);
+    write_image(buf, size, offset);
+
+}
+
+
 void cflash_read(uint8_t* buf, uint32_t size, uint32_t offset){
     
     FILE * pFile;
 
+    cflash_timing_read(size);
+
     create_file_if_needed(diskname);
 
     pFile = fopen(diskname, "rb");
@@ -98,12 +114,58 @@ void cflash_read(uint8_t* buf, uint32_t size, uint32_t offset){
 }
 
 
+uint32_t cflash_erase_count(uint16_t sector){
+
+    FILE * pFile;
+    uint32_t count = 0;
+    long offset = DISK_SIZE + sector * sizeof(uint32_t);
+
+    if(sector >= SECTOR_COUNT){
+        return 0;
+    }
+
+    pFile = fopen(diskname, "rb");
+
+    if(pFile != NULL){
+
+        // Counts that were never written are beyond the end of the image
+        fseek(pFile, 0, SEEK_END);
+        if(ftell(pFile) >= offset + (long)sizeof(count)){
+            fseek(pFile, offset, SEEK_SET);
+            if(fread(&count, sizeof(count), 1, pFile) != 1){
+                count = 0;
+            }
+        }
+
+        fclose(pFile);
+
+    }
+
+    return count;
+
+}
+
+
 void cflash_erase(uint16_t sector){
 
     const uint8_t zeroes[COFFEE_SECTOR_SIZE] = {0};
+    uint32_t count;
+
+    cflash_timing_erase();
+
+    write_image(zeroes, COFFEE_SECTOR_SIZE, COFFEE_SECTOR_SIZE*sector);    
 
-    cflash_write(zeroes, COFFEE_SECTOR_SIZE, COFFEE_SECTOR_SIZE*sector);    
+    if(sector < SECTOR_COUNT){
+        count = cflash_erase_count(sector) + 1;
+        write_image((const uint8_t *)&count, sizeof(count),
+                    DISK_SIZE + sector * sizeof(uint32_t));
+    }
 
 }
 
 
+void cflash_flush(void){
+
+    /* Every access opens and closes the image, nothing is buffered. */
+
+}
@@ -34,4 +34,111 @@ void cflash_read(uint8_t* buf, uint32_t size, uint32_t offset);
 void cflash_erase(uint16_t sector);
 
 
+/*
+ * Get the number of times a sector has been erased. The counts are
+ * stored in the image after the storage area, so they survive restarts
+ * and formatting.
+ * -sector: sector number
+ */
+uint32_t cflash_erase_count(uint16_t sector);
+
+
+/*
+ * Flush written data to the backing store (msync-style)
+ */
+void cflash_flush(void);
+
+
+/*
+ * Timing model of the memory device. The simulation drivers advance a
+ * virtual clock by the modelled cost of each operation:
+ * -read_ns_per_byte:    array access time per byte read
+ * -program_ns_per_page: time to program one page
+ * -program_page_size:   size of a program page in bytes
+ * -erase_ns_per_sector: time to erase one sector
+ * -bus_bytes_per_s:     bus bandwidth for the transferred data, 0 if free
+ */
+struct cflash_timing {
+    uint32_t read_ns_per_byte;
+    uint32_t program_ns_per_page;
+    uint32_t program_page_size;
+    uint32_t erase_ns_per_sector;
+    uint32_t bus_bytes_per_s;
+};
+
+/* Models that can be selected at build time with -DCFLASH_TIMING=... */
+#define CFLASH_TIMING_NONE  0
+#define CFLASH_TIMING_NOR   1
+#define CFLASH_TIMING_NAND  2
+
+extern const struct cflash_timing cflash_timing_nor;
+extern const struct cflash_timing cflash_timing_nand;
+
+
+/*
+ * Select the timing model
+ * -model: timing model, or NULL to turn the model off
+ */
+void cflash_set_timing(const struct cflash_timing * const model);
+
+
+/*
+ * Get the timing model, or NULL if the model is off
+ */
+const struct cflash_timing * cflash_get_timing(void);
+
+
+/*
+ * Get the virtual time in nanoseconds spent in modelled operations
+ */
+uint64_t cflash_clock_ns(void);
+
+
+/*
+ * Get the time in microseconds: the virtual time if the model is on,
+ * or the monotonic time of the host otherwise
+ */
+uint64_t cflash_clock_us(void);
+
+
+/*
+ * Operations that reached the memory device, counted whether or not
+ * a timing model is selected:
+ * -reads, read_bytes:       read operations and the bytes read
+ * -programs, program_bytes: write operations and the bytes written
+ * -erases:                  erased sectors
+ */
+struct cflash_stats {
+    uint64_t reads;
+    uint64_t read_bytes;
+    uint64_t programs;
+    uint64_t program_bytes;
+    uint64_t erases;
+};
+
+
+/*
+ * Get the operation counters
+ * -stats: receives the counts since the last reset
+ */
+void cflash_get_stats(struct cflash_stats * const stats);
+
+
+/*
+ * Reset the operation counters
+ */
+void cflash_reset_stats(void);
+
+
+/*
+ * Count the operation and advance the virtual clock, called by the
+ * simulation drivers
+ * -size:   number of bytes read or written
+ * -offset: location of the written data
+ */
+void cflash_timing_read(uint32_t size);
+void cflash_timing_write(uint32_t size, uint32_t offset);
+void cflash_timing_erase(void);
+
+
 #endif /* COFFEE_FLASH_H_ */
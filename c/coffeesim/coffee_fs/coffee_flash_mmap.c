@@ -0,0 +1,139 @@
+/*
+ * coffee_flash_mmap.c
+ *
+ *  Memory-mapped flash simulation: the disk image is mapped once and
+ *  reads, writes and erases become plain memory copies.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "coffee_flash.h"
+#include "cfs-coffee-arch.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/*
+ * NOTE: THIS IS A SIMULATION FOR LINUX
+ *
+ * Coffee considers 0x00 to be the erased value of a byte, so the image
+ * is grown with ftruncate() (which zero fills) when it is too small.
+ */
+
+static const char* diskname = "coffeedisk.img";
+
+#define DISK_SIZE (COFFEE_START + COFFEE_SIZE)
+
+/* The erase counts of the sectors follow the storage in the image. */
+#define SECTOR_COUNT (DISK_SIZE / COFFEE_SECTOR_SIZE)
+#define IMAGE_SIZE (DISK_SIZE + SECTOR_COUNT * sizeof(uint32_t))
+
+static uint8_t * disk = NULL;
+
+static uint32_t * erase_counts = NULL;
+
+
+/* Map the disk image on first use. Return NULL if it cannot be mapped. */
+static uint8_t * map_disk(void){
+
+    int fd;
+    struct stat st;
+    void * map;
+
+    if(disk != NULL){
+        return disk;
+    }
+
+    fd = open(diskname, O_RDWR | O_CREAT, 0644);
+    if(fd < 0){
+        return NULL;
+    }
+
+    if(fstat(fd, &st) != 0 ||
+       (st.st_size < (off_t)IMAGE_SIZE && ftruncate(fd, IMAGE_SIZE) != 0)){
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    /* The mapping keeps its own reference to the file. */
+    close(fd);
+
+    if(map == MAP_FAILED){
+        return NULL;
+    }
+
+    disk = map;
+    erase_counts = (uint32_t *)(disk + DISK_SIZE);
+    return disk;
+
+}
+
+
+/* Return TRUE if the access lies within the image. */
+static int in_range(uint32_t size, uint32_t offset){
+
+    return offset <= DISK_SIZE && size <= DISK_SIZE - offset;
+
+}
+
+
+void cflash_write(const uint8_t * const buf, uint32_t size, uint32_t offset){
+
+    cflash_timing_write(size, offset);
+
+    if(map_disk() != NULL && in_range(size, offset)){
+        memcpy(disk + offset, buf, size);
+    }
+
+}
+
+
+void cflash_read(uint8_t* buf, uint32_t size, uint32_t offset){
+
+    cflash_timing_read(size);
+
+    if(map_disk() != NULL && in_range(size, offset)){
+        memcpy(buf, disk + offset, size);
+    }
+
+}
+
+
+void cflash_erase(uint16_t sector){
+
+    uint32_t offset = COFFEE_SECTOR_SIZE * sector;
+
+    cflash_timing_erase();
+
+    if(map_disk() != NULL && in_range(COFFEE_SECTOR_SIZE, offset)){
+        memset(disk + offset, 0, COFFEE_SECTOR_SIZE);
+        erase_counts[sector]++;
+    }
+
+}
+
+
+uint32_t cflash_erase_count(uint16_t sector){
+
+    if(map_disk() == NULL || sector >= SECTOR_COUNT){
+        return 0;
+    }
+
+    return erase_counts[sector];
+
+}
+
+
+void cflash_flush(void){
+
+    if(disk != NULL){
+        msync(disk, IMAGE_SIZE, MS_SYNC);
+    }
+
+}
@@ -0,0 +1,181 @@
+/*
+ * coffee_flash_pread.c
+ *
+ *  Flash simulation on a persistent file descriptor: the disk image is
+ *  opened once and whole buffers are transferred with pread()/pwrite().
+ *  Use this driver on hosts where mapping a large image is not allowed.
+ */
+
+#define _GNU_SOURCE
+
+#include "coffee_flash.h"
+#include "cfs-coffee-arch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/*
+ * NOTE: THIS IS A SIMULATION FOR LINUX
+ *
+ * Coffee considers 0x00 to be the erased value of a byte. Holes punched
+ * into the image read back as zeroes, so an erase can simply deallocate
+ * the sector.
+ */
+
+static const char* diskname = "coffeedisk.img";
+
+static int disk = -1;
+
+/* The erase counts of the sectors follow the storage in the image. */
+#define DISK_SIZE (COFFEE_START + COFFEE_SIZE)
+#define SECTOR_COUNT (DISK_SIZE / COFFEE_SECTOR_SIZE)
+
+static uint32_t erase_counts[SECTOR_COUNT];
+static int erase_counts_loaded = 0;
+
+/* Fallback erase pattern, used if the file system cannot punch holes. */
+static const uint8_t zeroes[COFFEE_SECTOR_SIZE];
+
+
+/* Open the disk image on first use. Return -1 if it cannot be opened. */
+static int open_disk(void){
+
+    if(disk < 0){
+        disk = open(diskname, O_RDWR | O_CREAT, 0644);
+    }
+
+    return disk;
+
+}
+
+
+/* Write to the image without charging the timing model. */
+static void write_disk(const uint8_t * const buf, uint32_t size,
+                       uint32_t offset){
+
+    ssize_t n;
+    uint32_t done = 0;
+
+    if(open_disk() < 0){
+        return;
+    }
+
+    while(size > 0){
+        n = pwrite(disk, buf + done, size, offset);
+        if(n < 0 && errno == EINTR){
+            continue;
+        } else if(n <= 0){
+            return;
+        }
+        done += n;
+        size -= n;
+        offset += n;
+    }
+
+}
+
+
+/* Read from the image without charging the timing model. */
+static void read_disk(uint8_t* buf, uint32_t size, uint32_t offset){
+
+    ssize_t n;
+
+    if(open_disk() < 0){
+        return;
+    }
+
+    while(size > 0){
+        n = pread(disk, buf, size, offset);
+        if(n < 0 && errno == EINTR){
+            continue;
+        } else if(n <= 0){
+            /* Reading past the end of the image returns erased bytes. */
+            memset(buf, 0, size);
+            return;
+        }
+        buf += n;
+        size -= n;
+        offset += n;
+    }
+
+}
+
+
+void cflash_write(const uint8_t * const buf, uint32_t size, uint32_t offset){
+
+    cflash_timing_write(size, offset);
+    write_disk(buf, size, offset);
+
+}
+
+
+void cflash_read(uint8_t* buf, uint32_t size, uint32_t offset){
+
+    cflash_timing_read(size);
+    read_disk(buf, size, offset);
+
+}
+
+
+/* Read the erase counts from the image on first use. */
+static void load_erase_counts(void){
+
+    if(!erase_counts_loaded){
+        read_disk((uint8_t *)erase_counts, sizeof(erase_counts), DISK_SIZE);
+        erase_counts_loaded = 1;
+    }
+
+}
+
+
+void cflash_erase(uint16_t sector){
+
+    uint32_t offset = COFFEE_SECTOR_SIZE * sector;
+
+    cflash_timing_erase();
+
+    if(open_disk() < 0){
+        return;
+    }
+
+    if(sector < SECTOR_COUNT){
+        load_erase_counts();
+        erase_counts[sector]++;
+        write_disk((uint8_t *)&erase_counts[sector], sizeof(uint32_t),
+                   DISK_SIZE + sector * sizeof(uint32_t));
+    }
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if(fallocate(disk, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                 offset, COFFEE_SECTOR_SIZE) == 0){
+        return;
+    }
+#endif
+
+    write_disk(zeroes, COFFEE_SECTOR_SIZE, offset);
+
+}
+
+
+uint32_t cflash_erase_count(uint16_t sector){
+
+    if(open_disk() < 0 || sector >= SECTOR_COUNT){
+        return 0;
+    }
+
+    load_erase_counts();
+    return erase_counts[sector];
+
+}
+
+
+void cflash_flush(void){
+
+    if(disk >= 0){
+        fdatasync(disk);
+    }
+
+}
@@ -0,0 +1,174 @@
+/*
+ * coffee_flash_timing.c
+ *
+ *  Timing model for the flash simulation drivers. Each driver reports
+ *  its reads, writes and erases here, and the model advances a virtual
+ *  clock by what the operation would cost on the modelled device. The
+ *  host never sleeps, so a run takes as long as the host needs, but the
+ *  virtual clock predicts the time on the target. The operations are
+ *  also counted, so that the I/O of a run can be checked against what
+ *  the file system believes it did.
+ */
+
+#include "coffee_flash.h"
+
+#include <stddef.h>
+#include <time.h>
+
+
+#ifndef CFLASH_TIMING
+#define CFLASH_TIMING CFLASH_TIMING_NONE
+#endif
+
+
+/*
+ * Serial NOR flash on a quad SPI bus, e.g. a 256 Mbit part: reads are
+ * limited by the bus, programming works in 256 byte pages and erasing
+ * a 64 KiB sector is slow.
+ */
+const struct cflash_timing cflash_timing_nor = {
+    .read_ns_per_byte = 0,
+    .program_ns_per_page = 350000,
+    .program_page_size = 256,
+    .erase_ns_per_sector = 150000000,
+    .bus_bytes_per_s = 40000000
+};
+
+
+/*
+ * SLC NAND flash with 2 KiB pages: each page costs an array read,
+ * programming is fast per byte and erasing is fast per sector.
+ */
+const struct cflash_timing cflash_timing_nand = {
+    .read_ns_per_byte = 12,
+    .program_ns_per_page = 250000,
+    .program_page_size = 2048,
+    .erase_ns_per_sector = 2000000,
+    .bus_bytes_per_s = 40000000
+};
+
+
+#if CFLASH_TIMING == CFLASH_TIMING_NOR
+static const struct cflash_timing * timing = &cflash_timing_nor;
+#elif CFLASH_TIMING == CFLASH_TIMING_NAND
+static const struct cflash_timing * timing = &cflash_timing_nand;
+#else
+static const struct cflash_timing * timing = NULL;
+#endif
+
+static uint64_t clock_ns = 0;
+
+static struct cflash_stats stats;
+
+
+/* Time to move size bytes over the bus */
+static uint64_t bus_ns(uint32_t size){
+
+    if(timing->bus_bytes_per_s == 0){
+        return 0;
+    }
+
+    return (uint64_t)size * 1000000000ULL / timing->bus_bytes_per_s;
+
+}
+
+
+void cflash_set_timing(const struct cflash_timing * const model){
+
+    timing = model;
+
+}
+
+
+const struct cflash_timing * cflash_get_timing(void){
+
+    return timing;
+
+}
+
+
+uint64_t cflash_clock_ns(void){
+
+    return clock_ns;
+
+}
+
+
+uint64_t cflash_clock_us(void){
+
+    struct timespec spec;
+
+    if(timing != NULL){
+        return clock_ns / 1000;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+
+    return (uint64_t)spec.tv_sec * 1000000 + spec.tv_nsec / 1000;
+
+}
+
+
+void cflash_get_stats(struct cflash_stats * const out){
+
+    *out = stats;
+
+}
+
+
+void cflash_reset_stats(void){
+
+    stats = (struct cflash_stats){0};
+
+}
+
+
+void cflash_timing_read(uint32_t size){
+
+    // Reads can come from several threads at once
+    __atomic_fetch_add(&stats.reads, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.read_bytes, size, __ATOMIC_RELAXED);
+
+    if(timing == NULL){
+        return;
+    }
+
+    __atomic_fetch_add(&clock_ns,
+                       (uint64_t)size * timing->read_ns_per_byte + bus_ns(size),
+                       __ATOMIC_RELAXED);
+
+}
+
+
+void cflash_timing_write(uint32_t size, uint32_t offset){
+
+    uint32_t pages;
+
+    stats.programs++;
+    stats.program_bytes += size;
+
+    if(timing == NULL || size == 0){
+        return;
+    }
+
+    // Every program page that the data touches is programmed once
+    pages = 1;
+    if(timing->program_page_size > 0){
+        pages = (offset + size - 1) / timing->program_page_size -
+                offset / timing->program_page_size + 1;
+    }
+
+    clock_ns += (uint64_t)pages * timing->program_ns_per_page + bus_ns(size);
+
+}
+
+
+void cflash_timing_erase(void){
+
+    stats.erases++;
+
+    if(timing != NULL){
+        clock_ns += timing->erase_ns_per_sector;
+    }
+
+}
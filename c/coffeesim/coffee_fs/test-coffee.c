@@ -40,11 +40,18 @@
 //#include "contiki.h"    /* MODIFICATION FOR AALTO-2 */
 #include "cfs.h"          /* MODIFICATION FOR AALTO-2 */
 #include "cfs-coffee.h"   /* MODIFICATION FOR AALTO-2 */
+#include "cfs-coffee-arch.h"
+#include "coffee_flash.h"
 //#include "lib/crc16.h"  /* MODIFICATION FOR AALTO-2 */
 //#include "lib/random.h" /* MODIFICATION FOR AALTO-2 */
 
 #include <stdio.h>
 #include <string.h>
+#if COFFEE_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#endif
 
 #include "FreeRTOS.h"   /* MODIFICATION FOR AALTO-2 */
 #include "os_task.h"    /* MODIFICATION FOR AALTO-2 */
@@ -345,6 +352,2192 @@ coffee_test_gc(void)
   return 0;
 }
 /*---------------------------------------------------------------------------*/
+static int
+coffee_test_cache(void)
+{
+  struct cfs_coffee_cache_stats stats;
+  struct cfs_dir dir;
+  struct cfs_dirent dirent;
+  int i;
+
+  /* Test 1: A directory listing walks the headers of the whole volume. */
+  for(i = 0; i < 2; i++) {
+    if(i == 1) {
+      /* Test 2: Repeating the walk is served from the header cache. */
+      cfs_coffee_reset_cache_stats();
+    }
+    if(cfs_opendir(&dir, "/") < 0) {
+      return 1 + i;
+    }
+    while(cfs_readdir(&dir, &dirent) == 0);
+    cfs_closedir(&dir);
+  }
+
+  cfs_coffee_get_cache_stats(&stats);
+  printf("Header cache: %lu hits, %lu misses\n", stats.hits, stats.misses);
+
+  /* Test 3: The repeated walk reads nearly every header from the cache.
+     Without the cache, both counters stay at zero. */
+  if(stats.misses > stats.hits / 100) {
+    return 3;
+  }
+
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_gc_extent_head(void)
+{
+  char name[16];
+  int fd;
+  int i, files;
+
+  /* Test 1: An obsolete extent starts in a sector that stays active. */
+  if(cfs_coffee_format() < 0 ||
+     cfs_coffee_reserve("head", 100) < 0 ||
+     cfs_coffee_reserve("big", 4L * 1024 * 1024) < 0 ||
+     cfs_remove("big") < 0) {
+    return 1;
+  }
+
+  /*
+   * Test 2: Fill the volume, so that garbage collection erases the
+   * sectors of the obsolete extent and new files are placed there.
+   * All files must survive the following garbage collections.
+   */
+  for(files = 0; files < 1000; files++) {
+    sprintf(name, "fill%d", files);
+    if(cfs_coffee_reserve(name, 512L * 1024) < 0) {
+      break;
+    }
+  }
+  for(i = 0; i < files; i++) {
+    sprintf(name, "fill%d", i);
+    fd = cfs_open(name, CFS_READ);
+    if(fd < 0) {
+      return 2;
+    }
+    cfs_close(fd);
+    cfs_remove(name);
+  }
+  cfs_remove("head");
+
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_sector_table(void)
+{
+  int i;
+
+  /* Test 1: The incrementally kept sector table matches a full scan. */
+  if(cfs_coffee_verify_sector_table() != 0) {
+    return 1;
+  }
+
+  /* Test 2: It still does after garbage collections that erase sectors. */
+  for(i = 0; i < 10; i++) {
+    if(cfs_coffee_reserve("huge", 12L * 1024 * 1024) < 0) {
+      return 2;
+    }
+    cfs_remove("huge");
+  }
+  if(cfs_coffee_verify_sector_table() != 0) {
+    return 3;
+  }
+
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_gc_step(void)
+{
+  int i, erased, step;
+
+  /* Test 1: Removed files leave obsolete sectors behind. */
+  if(cfs_coffee_reserve("step", 8L * 1024 * 1024) < 0 ||
+     cfs_remove("step") < 0) {
+    return 1;
+  }
+
+  /* Test 2: A step erases no more sectors than its budget, and leaves
+     the storage consistent. */
+  erased = 0;
+  for(i = 0; i < 1000; i++) {
+    step = cfs_coffee_gc_step(3);
+#if COFFEE_SECTOR_TABLE
+    if(step < 0 || step > 3 ||
+       (i % 10 == 0 && cfs_coffee_verify_sector_table() != 0)) {
+#else
+    /* Without the sector table, steps are not supported. */
+    if(step != -1) {
+#endif
+      return 2;
+    }
+    erased += step;
+  }
+
+#if COFFEE_SECTOR_TABLE
+  /* Test 3: The steps erased the sectors of the removed file. */
+  if(erased < 8L * 1024 * 1024 / COFFEE_SECTOR_SIZE - 1) {
+    return 3;
+  }
+#endif
+
+  /* Test 4: The file system is consistent after the steps. */
+  if(cfs_coffee_verify_sector_table() != 0 ||
+     cfs_coffee_reserve("step", 8L * 1024 * 1024) < 0 ||
+     cfs_remove("step") < 0) {
+    return 4;
+  }
+
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_erase_pool(void)
+{
+#if COFFEE_SECTOR_TABLE
+  struct cfs_coffee_pool_stats stats;
+  unsigned start;
+  int i, erased;
+#endif
+
+  /* Test 1: Water marks out of order are refused. */
+  if(cfs_coffee_set_pool_marks(8, 4) == 0) {
+    return 1;
+  }
+
+  /* Test 2: Without a refill, nothing is erased. */
+  if(cfs_coffee_reserve("pool", 8L * 1024 * 1024) < 0 ||
+     cfs_remove("pool") < 0 ||
+     cfs_coffee_set_pool_marks(0, 0) < 0 ||
+     cfs_coffee_refill_pool(16) != 0) {
+    return 2;
+  }
+
+#if COFFEE_SECTOR_TABLE
+  cfs_coffee_get_pool_stats(&stats);
+  start = stats.erased_sectors;
+  cfs_coffee_reset_pool_stats();
+
+  /* Test 3: A pool below the low water mark is refilled up to the high
+     water mark over several calls. */
+  if(cfs_coffee_set_pool_marks(start + 4, start + 8) < 0) {
+    return 3;
+  }
+  erased = 0;
+  for(i = 0; i < 100; i++) {
+    erased += cfs_coffee_refill_pool(2);
+  }
+  cfs_coffee_get_pool_stats(&stats);
+  if(stats.erased_sectors != start + 8 || erased != 8 ||
+     stats.background_erases != 8 || stats.refills != 1 ||
+     stats.foreground_gcs != 0) {
+    return 3;
+  }
+
+  /* Test 4: The refill starts again only below the low water mark. */
+  if(cfs_coffee_reserve("pool",
+                        2L * COFFEE_SECTOR_SIZE - COFFEE_PAGE_SIZE) < 0 ||
+     cfs_coffee_refill_pool(16) != 0) {
+    return 4;
+  }
+  cfs_remove("pool");
+  if(cfs_coffee_reserve("pool",
+                        6L * COFFEE_SECTOR_SIZE - COFFEE_PAGE_SIZE) < 0 ||
+     cfs_coffee_refill_pool(64) <= 0) {
+    return 4;
+  }
+  cfs_coffee_get_pool_stats(&stats);
+  if(stats.refills != 2 || cfs_coffee_verify_sector_table() != 0) {
+    return 4;
+  }
+#endif
+
+  cfs_remove("pool");
+  cfs_coffee_set_pool_marks(COFFEE_POOL_LOW_WATER, COFFEE_POOL_HIGH_WATER);
+
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_wear(void)
+{
+  struct cfs_coffee_wear_stats before, after;
+  struct cfs_coffee_pool_stats pool;
+#if COFFEE_WEAR_COUNTS
+  unsigned long sectors;
+#endif
+  int i;
+
+  /* Start without obsolete sectors, so only the test's files are erased. */
+  while(cfs_coffee_gc_step(1000) > 0);
+  cfs_coffee_get_wear_stats(&before);
+  cfs_coffee_reset_pool_stats();
+
+  for(i = 0; i < 32; i++) {
+    if(cfs_coffee_reserve("wear", COFFEE_SECTOR_SIZE - COFFEE_PAGE_SIZE) < 0 ||
+       cfs_remove("wear") < 0) {
+      return 1;
+    }
+    cfs_coffee_gc_step(1000);
+  }
+  cfs_coffee_get_wear_stats(&after);
+  cfs_coffee_get_pool_stats(&pool);
+
+#if COFFEE_WEAR_COUNTS
+  /* Test 2: Every erasure is counted, and every sector is in the
+     histogram. */
+  if(after.total_erases - before.total_erases !=
+     pool.foreground_erases + pool.background_erases) {
+    return 2;
+  }
+#if COFFEE_SECTOR_TABLE
+  /* The steps erased the sector of each file. */
+  if(after.total_erases - before.total_erases < 32) {
+    return 2;
+  }
+#endif
+  for(i = 0, sectors = 0; i < CFS_COFFEE_WEAR_BUCKETS; i++) {
+    sectors += after.histogram[i];
+  }
+  if(sectors != COFFEE_SIZE / COFFEE_SECTOR_SIZE) {
+    return 2;
+  }
+#endif
+
+#if COFFEE_WEAR_AWARE
+  /* Test 3: The files went to cold sectors instead of wearing out the
+     same sector 32 times. */
+  if(after.max_erases > before.max_erases + 1) {
+    return 3;
+  }
+#endif
+
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_flash_timing(void)
+{
+  static const struct cflash_timing model = { 1, 1000, 256, 1000000, 0 };
+  const struct cflash_timing *saved;
+  uint8_t buf[512];
+  uint64_t start;
+  int error, erased;
+
+  saved = cflash_get_timing();
+  cflash_set_timing(&model);
+  error = 0;
+
+  /* Test 1: Reads cost their bytes. */
+  start = cflash_clock_ns();
+  cflash_read(buf, sizeof(buf), 0);
+  if(cflash_clock_ns() - start != sizeof(buf)) {
+    FAIL(1);
+  }
+
+  /* Test 2: Writes cost every page that they touch. Write back the same
+     bytes, so the storage does not change. */
+  start = cflash_clock_ns();
+  cflash_write(buf + 255, 2, 255);
+  if(cflash_clock_ns() - start != 2000) {
+    FAIL(2);
+  }
+
+  /* Test 3: Each erased sector costs an erasure. */
+  if(cfs_coffee_reserve("timing", 4L * COFFEE_SECTOR_SIZE) < 0 ||
+     cfs_remove("timing") < 0) {
+    FAIL(3);
+  }
+  start = cflash_clock_ns();
+  erased = cfs_coffee_gc_step(1000);
+  if(erased > 0 && cflash_clock_ns() - start < (uint64_t)erased * 1000000) {
+    FAIL(3);
+  }
+
+  /* Test 4: The clock stops when the model is turned off. */
+  cflash_set_timing(NULL);
+  start = cflash_clock_ns();
+  cflash_read(buf, sizeof(buf), 0);
+  if(cflash_clock_ns() != start) {
+    FAIL(4);
+  }
+
+end:
+  cflash_set_timing(saved);
+  return error;
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_IO_STATS
+static int
+coffee_test_io_stats(void)
+{
+  struct cfs_coffee_stats stats;
+  struct cflash_stats flash;
+  unsigned long reads, programs, program_bytes, erases;
+  unsigned char buf[1000];
+  int error;
+  int fd;
+  int i;
+
+  cfs_remove("io");
+  fd = -1;
+  memset(buf, 'i', sizeof(buf));
+  cfs_coffee_reset_stats();
+  cflash_reset_stats();
+
+  /* Test 1: A write is attributed to cfs_write() and programs the data. */
+  fd = cfs_open("io", CFS_WRITE);
+  if(fd < 0 || cfs_write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+    FAIL(1);
+  }
+  cfs_close(fd);
+  fd = -1;
+  cfs_coffee_get_stats(&stats);
+  if(stats.ops[CFS_COFFEE_OP_OPEN].calls != 1 ||
+     stats.ops[CFS_COFFEE_OP_WRITE].calls != 1 ||
+     stats.ops[CFS_COFFEE_OP_WRITE].program_bytes < sizeof(buf) ||
+     stats.user_write_bytes != sizeof(buf)) {
+    FAIL(1);
+  }
+
+  /* Test 2: A read is attributed to cfs_read() and reads the data. */
+  fd = cfs_open("io", CFS_READ);
+  if(fd < 0 || cfs_read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+    FAIL(2);
+  }
+  cfs_close(fd);
+  fd = -1;
+  cfs_coffee_get_stats(&stats);
+  if(stats.ops[CFS_COFFEE_OP_READ].calls != 1 ||
+     stats.ops[CFS_COFFEE_OP_READ].read_bytes < sizeof(buf) ||
+     stats.ops[CFS_COFFEE_OP_READ].programs != 0 ||
+     stats.user_read_bytes != sizeof(buf)) {
+    FAIL(2);
+  }
+
+  /* Test 3: Overwrites fill the micro log, and merging it is counted
+     separately from the writes. */
+  fd = cfs_open("io", CFS_READ | CFS_WRITE);
+  for(i = 0; i < 100; i++) {
+    if(cfs_seek(fd, (i * 7) % sizeof(buf), CFS_SEEK_SET) < 0 ||
+       cfs_write(fd, buf, 64) != 64) {
+      FAIL(3);
+    }
+  }
+  cfs_close(fd);
+  fd = -1;
+  cfs_coffee_get_stats(&stats);
+  if(stats.ops[CFS_COFFEE_OP_MERGE].calls == 0 ||
+     stats.ops[CFS_COFFEE_OP_MERGE].program_bytes == 0 ||
+     stats.ops[CFS_COFFEE_OP_WRITE].calls != 101) {
+    FAIL(3);
+  }
+
+  /* Test 4: Every operation that reached the flash was attributed. */
+  if(cfs_remove("io") < 0) {
+    FAIL(4);
+  }
+  cfs_coffee_gc_step(COFFEE_SIZE / COFFEE_SECTOR_SIZE);
+  cfs_coffee_get_stats(&stats);
+  cflash_get_stats(&flash);
+  reads = programs = program_bytes = erases = 0;
+  for(i = 0; i < CFS_COFFEE_OPS; i++) {
+    reads += stats.ops[i].reads;
+    programs += stats.ops[i].programs;
+    program_bytes += stats.ops[i].program_bytes;
+    erases += stats.ops[i].erases;
+  }
+  if(reads != flash.reads || programs != flash.programs ||
+     program_bytes != flash.program_bytes || erases != flash.erases) {
+    FAIL(4);
+  }
+
+  /* Test 5: The counters can be reset. */
+  cfs_coffee_reset_stats();
+  cfs_coffee_get_stats(&stats);
+  if(stats.ops[CFS_COFFEE_OP_WRITE].calls != 0 ||
+     stats.user_write_bytes != 0) {
+    FAIL(5);
+  }
+
+  error = 0;
+end:
+  cfs_close(fd);
+  cfs_remove("io");
+  return error;
+}
+#endif /* COFFEE_IO_STATS */
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_many_files(void)
+{
+  int error;
+  int fd;
+  char name[16];
+  int i;
+#define MANY_FILES 300
+
+  fd = -1;
+
+  /* Test 1: Reserve many small files. */
+  for(i = 0; i < MANY_FILES; i++) {
+    sprintf(name, "many%d", i);
+    if(cfs_coffee_reserve(name, 1) < 0) {
+      FAIL(1);
+    }
+  }
+
+  /* Test 2: Duplicate reservations are refused. */
+  if(cfs_coffee_reserve("many0", 1) == 0) {
+    FAIL(2);
+  }
+
+  /* Test 3 and 4: Every file can be found, and a missing one cannot. */
+  for(i = 0; i < MANY_FILES; i++) {
+    sprintf(name, "many%d", i);
+    fd = cfs_open(name, CFS_READ);
+    if(fd < 0) {
+      FAIL(3);
+    }
+    cfs_close(fd);
+  }
+  fd = cfs_open("many", CFS_READ);
+  if(fd >= 0) {
+    FAIL(4);
+  }
+
+  /* Test 5 and 6: Removed files can no longer be found. */
+  for(i = 0; i < MANY_FILES; i += 2) {
+    sprintf(name, "many%d", i);
+    if(cfs_remove(name) < 0) {
+      FAIL(5);
+    }
+  }
+  for(i = 0; i < MANY_FILES; i++) {
+    sprintf(name, "many%d", i);
+    fd = cfs_open(name, CFS_READ);
+    if((fd >= 0) != (i & 1)) {
+      FAIL(6);
+    }
+    cfs_close(fd);
+  }
+  fd = -1;
+
+  for(i = 1; i < MANY_FILES; i += 2) {
+    sprintf(name, "many%d", i);
+    cfs_remove(name);
+  }
+
+  error = 0;
+end:
+  cfs_close(fd);
+  return error;
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_NAME_INDEX_SIZE && COFFEE_IO_STATS
+/* More files than the name index holds at its maximum load. */
+#define INDEX_FILES ((int)(COFFEE_NAME_INDEX_SIZE * 3 / 4) + 10)
+
+/* The lookups of an open that the name index could not answer. */
+static unsigned long
+open_name_scans(const char *name, int *fd)
+{
+  struct cfs_coffee_stats stats;
+
+  cfs_coffee_reset_stats();
+  *fd = cfs_open(name, CFS_READ);
+  cfs_coffee_get_stats(&stats);
+  return stats.name_scans;
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_name_index(void)
+{
+  int error;
+  int fd;
+  char name[16];
+  int i;
+
+  fd = -1;
+
+  /* Test 1: The lookups of more files than the index holds scan the
+     headers. */
+  for(i = 0; i < INDEX_FILES; i++) {
+    sprintf(name, "ix%d", i);
+    if(cfs_coffee_reserve(name, 1) < 0) {
+      FAIL(1);
+    }
+  }
+  if(open_name_scans("ix1", &fd) == 0 || fd < 0) {
+    FAIL(1);
+  }
+  cfs_close(fd);
+
+  /* Test 2: Once enough files are removed, the index is rebuilt and
+     answers the lookups again. */
+  for(i = 0; i < 20; i++) {
+    sprintf(name, "ix%d", INDEX_FILES - 1 - i);
+    if(cfs_remove(name) < 0) {
+      FAIL(2);
+    }
+  }
+  if(open_name_scans("ix2", &fd) != 0 || fd < 0) {
+    FAIL(2);
+  }
+  cfs_close(fd);
+  fd = -1;
+  sprintf(name, "ix%d", INDEX_FILES - 1);
+  if(open_name_scans(name, &fd) != 0 || fd >= 0) {
+    FAIL(2);
+  }
+
+  error = 0;
+end:
+  cfs_close(fd);
+  for(i = 0; i < INDEX_FILES; i++) {
+    sprintf(name, "ix%d", i);
+    cfs_remove(name);
+  }
+  return error;
+}
+#endif /* COFFEE_NAME_INDEX_SIZE && COFFEE_IO_STATS */
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_log_regions(void)
+{
+  int error;
+  int fd;
+  static unsigned char shadow[FILE_SIZE];
+  unsigned char buf[FILE_SIZE];
+  unsigned long seed;
+  unsigned offset, size;
+  int r, i;
+
+  cfs_remove("logr");
+  fd = -1;
+  seed = 1;
+
+  /* Test 1: A file with a log of many small records. */
+  if(cfs_coffee_reserve("logr", FILE_SIZE) < 0 ||
+     cfs_coffee_configure_log("logr", FILE_SIZE / 2, 32) < 0) {
+    FAIL(1);
+  }
+  fd = cfs_open("logr", CFS_READ | CFS_WRITE);
+  for(i = 0; i < FILE_SIZE; i++) {
+    shadow[i] = i % 251;
+  }
+  if(fd < 0 || cfs_write(fd, shadow, FILE_SIZE) != FILE_SIZE) {
+    FAIL(2);
+  }
+
+  /*
+   * Test 3 and 4: Overwrite random ranges, which spans several regions
+   * and fills the log until it is merged, and read the file back.
+   */
+  for(r = 0; r < 300; r++) {
+    seed = seed * 1103515245UL + 12345UL;
+    offset = (seed >> 8) % FILE_SIZE;
+    size = 1 + (seed >> 20) % 100;
+    if(offset + size > FILE_SIZE) {
+      size = FILE_SIZE - offset;
+    }
+    for(i = 0; i < size; i++) {
+      shadow[offset + i] = r;
+    }
+    if(cfs_seek(fd, offset, CFS_SEEK_SET) != offset ||
+       cfs_write(fd, &shadow[offset], size) != size) {
+      FAIL(3);
+    }
+
+    if(r % 25 == 0) {
+      cfs_close(fd);
+      fd = cfs_open("logr", CFS_READ | CFS_WRITE);
+      if(fd < 0 || cfs_read(fd, buf, FILE_SIZE) != FILE_SIZE ||
+         memcmp(buf, shadow, FILE_SIZE) != 0) {
+        FAIL(4);
+      }
+    }
+  }
+
+  error = 0;
+end:
+  cfs_close(fd);
+  cfs_remove("logr");
+  return error;
+}
+/*---------------------------------------------------------------------------*/
+/* Overwrite a byte range of a file and its copy in RAM, and read the
+   whole file back. */
+static int
+log_overwrite(int fd, unsigned char *shadow, unsigned offset, unsigned size,
+              int r)
+{
+  unsigned char buf[FILE_SIZE];
+
+  memset(&shadow[offset], r, size);
+  return cfs_seek(fd, offset, CFS_SEEK_SET) == offset &&
+         cfs_write(fd, &shadow[offset], size) == size &&
+         cfs_seek(fd, 0, CFS_SEEK_SET) == 0 &&
+         cfs_read(fd, buf, FILE_SIZE) == FILE_SIZE &&
+         memcmp(buf, shadow, FILE_SIZE) == 0 ? 0 : -1;
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_log_overwrite(void)
+{
+  static unsigned char shadow[FILE_SIZE];
+  int error;
+  int fd;
+  int i;
+#if COFFEE_IO_STATS
+  struct cfs_coffee_stats stats;
+#endif
+
+  cfs_remove("logo");
+  fd = -1;
+
+  /* Test 1: A file with a log of eight records of 32 bytes. */
+  if(cfs_coffee_reserve("logo", FILE_SIZE) < 0 ||
+     cfs_coffee_configure_log("logo", 8 * 32, 32) < 0) {
+    FAIL(1);
+  }
+  fd = cfs_open("logo", CFS_READ | CFS_WRITE);
+  for(i = 0; i < FILE_SIZE; i++) {
+    shadow[i] = i % 251;
+  }
+  if(fd < 0 || cfs_write(fd, shadow, FILE_SIZE) != FILE_SIZE) {
+    FAIL(1);
+  }
+
+  /*
+   * Test 2: Overwrites that start and end inside regions take one record
+   * for each region, keep the rest of the first and last region, and
+   * leave one record free.
+   */
+  if(log_overwrite(fd, shadow, 10, 100, 0xa1) < 0 ||
+     log_overwrite(fd, shadow, 207, 60, 0xa2) < 0) {
+    FAIL(2);
+  }
+
+#if COFFEE_IO_STATS
+  cfs_coffee_reset_stats();
+#endif
+  /*
+   * Test 3: An overwrite of six regions fills the log with its first
+   * region, merges the file, and goes on in a new log.
+   */
+  if(log_overwrite(fd, shadow, 1003, 150, 0xa3) < 0) {
+    FAIL(3);
+  }
+#if COFFEE_IO_STATS
+  cfs_coffee_get_stats(&stats);
+  if(stats.ops[CFS_COFFEE_OP_MERGE].calls != 1) {
+    FAIL(3);
+  }
+#endif
+
+  /* Test 4: The merged file with the new log has the newest data. */
+  if(log_overwrite(fd, shadow, 2047, 3, 0xa4) < 0) {
+    FAIL(4);
+  }
+  cfs_close(fd);
+  fd = cfs_open("logo", CFS_READ | CFS_WRITE);
+  if(fd < 0 || log_overwrite(fd, shadow, 0, 1, 0xa5) < 0) {
+    FAIL(4);
+  }
+
+  error = 0;
+end:
+  cfs_close(fd);
+  cfs_remove("logo");
+  return error;
+}
+/*---------------------------------------------------------------------------*/
+#define MERGE_FILE_SIZE (200L * 1024)
+#ifndef COFFEE_MERGE_BUFFER_SIZE
+#define COFFEE_MERGE_BUFFER_SIZE COFFEE_MAX_PAGE_SIZE
+#endif
+
+/* Overwrite a byte range of a file and of its copy in RAM. */
+static int
+merge_overwrite(int fd, unsigned char *shadow, long offset, int size, int r)
+{
+  memset(&shadow[offset], r, size);
+  return cfs_seek(fd, offset, CFS_SEEK_SET) == offset &&
+         cfs_write(fd, &shadow[offset], size) == size ? 0 : -1;
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_merge(void)
+{
+  static unsigned char shadow[MERGE_FILE_SIZE], buf[MERGE_FILE_SIZE];
+  static const unsigned record_sizes[] = { 128, 16 };
+  static const unsigned log_records[] = { 128, 512 };
+  unsigned long seed;
+  long offset;
+  int error;
+  int fd;
+  int i, r;
+#if COFFEE_IO_STATS
+  struct cfs_coffee_stats stats;
+#endif
+
+  fd = -1;
+  seed = 1;
+
+  /* The second log has more records than a merge can plan in RAM. */
+  for(i = 0; i < 2; i++) {
+    cfs_remove("merge");
+    for(offset = 0; offset < MERGE_FILE_SIZE; offset++) {
+      shadow[offset] = offset % 253;
+    }
+    if(cfs_coffee_reserve("merge", MERGE_FILE_SIZE) < 0 ||
+       cfs_coffee_configure_log("merge", record_sizes[i] * log_records[i],
+                                record_sizes[i]) < 0) {
+      FAIL(1);
+    }
+    fd = cfs_open("merge", CFS_READ | CFS_WRITE);
+    if(fd < 0 || cfs_write(fd, shadow, MERGE_FILE_SIZE) != MERGE_FILE_SIZE) {
+      FAIL(1);
+    }
+
+    /* Test 2: Fill the log with one record per write, rewriting some
+       regions several times, and the next write merges it. */
+    for(r = 0; r < log_records[i]; r++) {
+      seed = seed * 1103515245UL + 12345UL;
+      offset = (seed >> 8) % (log_records[i] / 2) * record_sizes[i];
+      if(merge_overwrite(fd, shadow, offset + r % 7, 1 + r % 5, r) < 0) {
+        FAIL(2);
+      }
+    }
+    cfs_coffee_reset_stats();
+    if(merge_overwrite(fd, shadow, MERGE_FILE_SIZE - 100, 50, 0xee) < 0) {
+      FAIL(2);
+    }
+#if COFFEE_IO_STATS
+    /*
+     * Test 3: The merge reads the file in pieces of the merge buffer and
+     * each logged region once, and programs the pieces.
+     */
+    cfs_coffee_get_stats(&stats);
+    if(i == 0 &&
+       (stats.ops[CFS_COFFEE_OP_MERGE].calls != 1 ||
+        stats.ops[CFS_COFFEE_OP_MERGE].reads >
+        MERGE_FILE_SIZE / COFFEE_MERGE_BUFFER_SIZE + log_records[i] + 8 ||
+        stats.ops[CFS_COFFEE_OP_MERGE].read_bytes >
+        MERGE_FILE_SIZE + log_records[i] * (record_sizes[i] + 2) +
+        8 * COFFEE_PAGE_SIZE ||
+        stats.ops[CFS_COFFEE_OP_MERGE].program_bytes >
+        MERGE_FILE_SIZE + 8 * COFFEE_PAGE_SIZE ||
+        stats.ops[CFS_COFFEE_OP_MERGE].programs >
+        MERGE_FILE_SIZE / COFFEE_MERGE_BUFFER_SIZE + 8)) {
+      FAIL(3);
+    }
+#endif
+
+    /* Test 4: The merged file has the newest data. */
+    cfs_close(fd);
+    fd = cfs_open("merge", CFS_READ);
+    if(fd < 0 || cfs_read(fd, buf, MERGE_FILE_SIZE) != MERGE_FILE_SIZE ||
+       memcmp(buf, shadow, MERGE_FILE_SIZE) != 0) {
+      FAIL(4);
+    }
+    cfs_close(fd);
+    fd = -1;
+  }
+
+  error = 0;
+end:
+  cfs_close(fd);
+  cfs_remove("merge");
+  return error;
+}
+/*---------------------------------------------------------------------------*/
+#define MOUNT_FILES 30
+
+static int
+coffee_test_mount(void)
+{
+  struct cfs_coffee_mount_stats mount;
+  struct cfs_dir dir;
+  struct cfs_dirent dirent;
+#if COFFEE_IO_STATS
+  struct cfs_coffee_stats stats;
+#endif
+  unsigned long files;
+  char name[16], buf[16];
+  int error;
+  int fd;
+  int i, n;
+
+  /* Test 1: Write some files and remove every third of them. */
+  fd = -1;
+  for(i = 0; i < MOUNT_FILES; i++) {
+    sprintf(name, "mount%d", i);
+    fd = cfs_open(name, CFS_WRITE);
+    if(fd < 0 || cfs_write(fd, name, strlen(name)) != strlen(name)) {
+      FAIL(1);
+    }
+    cfs_close(fd);
+    fd = -1;
+    if(i % 3 == 0 && cfs_remove(name) < 0) {
+      FAIL(1);
+    }
+  }
+
+  /* Test 2: A volume with open files is not mounted. */
+  fd = cfs_open("mount1", CFS_READ);
+  if(fd < 0 || cfs_coffee_mount(NULL) != -1) {
+    FAIL(2);
+  }
+  cfs_close(fd);
+  fd = -1;
+
+  /* Test 3: The scan reads each header once and accounts for each page. */
+  cfs_coffee_reset_stats();
+  if(cfs_coffee_mount(&mount) < 0 ||
+     mount.active_pages + mount.obsolete_pages + mount.free_pages !=
+     COFFEE_SIZE / COFFEE_PAGE_SIZE) {
+    FAIL(3);
+  }
+#if COFFEE_IO_STATS
+  cfs_coffee_get_stats(&stats);
+  if(stats.ops[CFS_COFFEE_OP_OTHER].reads != mount.headers) {
+    FAIL(3);
+  }
+#endif
+
+  /* Test 4: The scan counts the files that a directory listing shows. */
+  if(cfs_opendir(&dir, "/") < 0) {
+    FAIL(4);
+  }
+  for(files = 0; cfs_readdir(&dir, &dirent) == 0; files++);
+  cfs_closedir(&dir);
+  if(files != mount.files) {
+    FAIL(4);
+  }
+
+  /*
+   * Test 5: The tables are current after the mount, and the files are
+   * found without another walk over the headers.
+   */
+  if(cfs_coffee_verify_sector_table() != 0 ||
+     cfs_coffee_mount(&mount) < 0) {
+    FAIL(5);
+  }
+  cfs_coffee_reset_stats();
+  for(i = 0; i < MOUNT_FILES; i++) {
+    sprintf(name, "mount%d", i);
+    fd = cfs_open(name, CFS_READ);
+    if(i % 3 == 0) {
+      if(fd >= 0) {
+        FAIL(5);
+      }
+      continue;
+    }
+    n = cfs_read(fd, buf, sizeof(buf));
+    if(fd < 0 || n != strlen(name) || memcmp(buf, name, n) != 0) {
+      FAIL(5);
+    }
+    cfs_close(fd);
+    fd = -1;
+  }
+  /* Without file end records, each open also scans the file for its end. */
+#if COFFEE_IO_STATS && COFFEE_NAME_INDEX_SIZE && COFFEE_EOF_RECORDS
+  cfs_coffee_get_stats(&stats);
+  if(stats.ops[CFS_COFFEE_OP_OPEN].reads > MOUNT_FILES * 4) {
+    FAIL(5);
+  }
+#endif
+
+  /* Test 6: New files go to free pages. */
+  fd = cfs_open("mount_new", CFS_WRITE);
+  if(fd < 0 || cfs_write(fd, "new", 3) != 3) {
+    FAIL(6);
+  }
+  cfs_close(fd);
+  fd = cfs_open("mount1", CFS_READ);
+  if(fd < 0 || cfs_read(fd, buf, sizeof(buf)) != 6 ||
+     memcmp(buf, "mount1", 6) != 0 ||
+     cfs_coffee_verify_sector_table() != 0) {
+    FAIL(6);
+  }
+
+  error = 0;
+end:
+  cfs_close(fd);
+  for(i = 0; i < MOUNT_FILES; i++) {
+    sprintf(name, "mount%d", i);
+    cfs_remove(name);
+  }
+  cfs_remove("mount_new");
+  return error;
+}
+/*---------------------------------------------------------------------------*/
+static cfs_offset_t
+dir_size(const char *name)
+{
+  struct cfs_dir dir;
+  struct cfs_dirent record;
+
+  if(cfs_opendir(&dir, "/") < 0) {
+    return -1;
+  }
+  while(cfs_readdir(&dir, &record) == 0) {
+    if(strcmp(record.name, name) == 0) {
+      cfs_closedir(&dir);
+      return record.size;
+    }
+  }
+  cfs_closedir(&dir);
+  return -1;
+}
+/*---------------------------------------------------------------------------*/
+/* The size of the test file after the sessions that each append 250
+   bytes and 250 zeros to the 1000 bytes that it starts with. */
+#if COFFEE_EOF_RECORDS
+#define EOF_SESSIONS (3 * COFFEE_EOF_RECORDS + 2)
+#define EOF_SIZE(sessions) (1000 + (sessions) * 500)
+#else
+#define EOF_SESSIONS 10
+/* The scan misses the zeros of the last session. */
+#define EOF_SIZE(sessions) (1000 + (sessions) * 500 - 250)
+#endif
+
+static int
+coffee_test_file_end(void)
+{
+#if COFFEE_IO_STATS && COFFEE_EOF_RECORDS
+  struct cfs_coffee_stats stats;
+#endif
+  int error;
+  int fd;
+  unsigned char buf[1000];
+  int i;
+
+  fd = -1;
+  memset(buf, 0, sizeof(buf));
+  memset(buf, 'e', sizeof(buf) / 2);
+
+  /* Test 1: A reserved file without data has no size. */
+  if(cfs_coffee_reserve("eof", 1024L * 1024) < 0 || dir_size("eof") != 0) {
+    FAIL(1);
+  }
+
+  /* Test 2: The recorded size includes trailing zero bytes. */
+  fd = cfs_open("eof", CFS_WRITE);
+  if(fd < 0 || cfs_write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+    FAIL(2);
+  }
+  cfs_close(fd);
+  fd = -1;
+#if COFFEE_EOF_RECORDS
+  if(dir_size("eof") != sizeof(buf)) {
+#else
+  if(dir_size("eof") != sizeof(buf) / 2) {
+#endif
+    FAIL(3);
+  }
+
+  /* Test 4: Trailing zero bytes are kept over more write sessions than
+     there are end records. */
+  for(i = 1; i <= EOF_SESSIONS; i++) {
+    fd = cfs_open("eof", CFS_WRITE | CFS_APPEND);
+    if(fd < 0 || cfs_write(fd, buf + sizeof(buf) / 4, sizeof(buf) / 2) !=
+       sizeof(buf) / 2) {
+      FAIL(4);
+    }
+    cfs_close(fd);
+    fd = -1;
+    if(dir_size("eof") != EOF_SIZE(i)) {
+      FAIL(5);
+    }
+  }
+
+  /* Test 6: After a mount, the open finds the size without a scan. */
+  if(cfs_coffee_mount(NULL) < 0) {
+    FAIL(6);
+  }
+  cfs_coffee_reset_stats();
+  fd = cfs_open("eof", CFS_READ);
+  if(fd < 0 || cfs_seek(fd, 0, CFS_SEEK_END) != EOF_SIZE(EOF_SESSIONS)) {
+    FAIL(6);
+  }
+#if COFFEE_IO_STATS && COFFEE_EOF_RECORDS
+  cfs_coffee_get_stats(&stats);
+  if(stats.ops[CFS_COFFEE_OP_OPEN].read_bytes > 4 * COFFEE_PAGE_SIZE) {
+    FAIL(6);
+  }
+#endif
+  cfs_close(fd);
+  fd = -1;
+  if(dir_size("eof") != EOF_SIZE(EOF_SESSIONS)) {
+    FAIL(7);
+  }
+
+  error = 0;
+end:
+  cfs_close(fd);
+  cfs_remove("eof");
+  return error;
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_extent_chain(void)
+{
+  int error;
+  int fd;
+  unsigned char buf[1000];
+  int i, j;
+#define CHAIN_RECORDS 300
+
+  cfs_remove("chain");
+  fd = -1;
+
+  /* Test 1: Append records until the file has grown many times. */
+  for(i = 0; i < CHAIN_RECORDS; i++) {
+    fd = cfs_open("chain", CFS_WRITE | CFS_APPEND);
+    memset(buf, i + 1, sizeof(buf));
+    if(fd < 0 || cfs_write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+      FAIL(1);
+    }
+    cfs_close(fd);
+  }
+  fd = -1;
+
+  /* Test 2: The size of the file includes all records. */
+  if(dir_size("chain") != CHAIN_RECORDS * sizeof(buf)) {
+    FAIL(2);
+  }
+
+  /* Test 3: Every record can be read back in order. */
+  fd = cfs_open("chain", CFS_READ | CFS_WRITE);
+  for(i = 0; i < CHAIN_RECORDS; i++) {
+    if(cfs_read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+      FAIL(3);
+    }
+    for(j = 0; j < sizeof(buf); j++) {
+      if(buf[j] != (unsigned char)(i + 1)) {
+        FAIL(3);
+      }
+    }
+  }
+
+  /* Test 4 and 5: Seek across extents, and modify records. */
+  for(i = CHAIN_RECORDS - 1; i >= 0; i -= 37) {
+    memset(buf, 0xaa, sizeof(buf));
+    if(cfs_seek(fd, i * sizeof(buf) + 500, CFS_SEEK_SET) < 0 ||
+       cfs_write(fd, buf, 10) != 10) {
+      FAIL(4);
+    }
+    if(cfs_seek(fd, i * sizeof(buf) + 495, CFS_SEEK_SET) < 0 ||
+       cfs_read(fd, buf, 20) != 20 ||
+       buf[4] != (unsigned char)(i + 1) || buf[5] != 0xaa ||
+       buf[14] != 0xaa || buf[15] != (unsigned char)(i + 1)) {
+      FAIL(5);
+    }
+  }
+  cfs_close(fd);
+  fd = -1;
+
+  /* Test 6: The file and its extents can be removed. */
+  if(cfs_remove("chain") < 0 || dir_size("chain") >= 0 ||
+     cfs_coffee_verify_sector_table() != 0) {
+    FAIL(6);
+  }
+
+  error = 0;
+end:
+  cfs_close(fd);
+  return error;
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_RING_FILES
+#define RING_RECORD   100
+/* Each sector of a ring starts with a 4-byte sequence number, and each
+   record with a 2-byte length. */
+#define RING_PER_SECTOR ((COFFEE_SECTOR_SIZE - 4) / (RING_RECORD + 2))
+
+static void
+ring_record(unsigned char *buf, unsigned n)
+{
+  memset(buf, n, RING_RECORD);
+  memcpy(buf, &n, sizeof(n));
+}
+/*---------------------------------------------------------------------------*/
+/* Read the records of a ring from a cursor on, and check that they are
+   numbered consecutively up to last. Return the first one, or -1. */
+static long
+ring_check(int fd, struct cfs_coffee_ring_cursor *cursor, unsigned last)
+{
+  unsigned char buf[RING_RECORD], expected[RING_RECORD];
+  unsigned first, n;
+
+  if(cfs_coffee_ring_next(fd, cursor, buf, sizeof(buf)) != RING_RECORD) {
+    return -1;
+  }
+  memcpy(&first, buf, sizeof(first));
+  for(n = first;; n++) {
+    ring_record(expected, n);
+    if(memcmp(buf, expected, sizeof(buf)) != 0) {
+      return -1;
+    }
+    if(n == last) {
+      break;
+    }
+    if(cfs_coffee_ring_next(fd, cursor, buf, sizeof(buf)) != RING_RECORD) {
+      return -1;
+    }
+  }
+  return cfs_coffee_ring_next(fd, cursor, buf, sizeof(buf)) < 0 ? first : -1;
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_ring(void)
+{
+  struct cfs_coffee_ring_cursor cursor, old;
+  unsigned char buf[RING_RECORD];
+  cfs_offset_t capacity;
+  unsigned records;
+  long first;
+  int error;
+  int fd;
+  unsigned i;
+#if COFFEE_IO_STATS
+  struct cfs_coffee_stats stats;
+  unsigned long pages, erases;
+  cfs_offset_t used;
+#endif
+
+  cfs_remove("ring");
+  fd = -1;
+
+  /* Test 1: A ring is reserved once, and is no ordinary file. */
+  if(cfs_coffee_ring_create("ring", 2 * COFFEE_SECTOR_SIZE) < 0 ||
+     cfs_coffee_ring_create("ring", 2 * COFFEE_SECTOR_SIZE) == 0) {
+    FAIL(1);
+  }
+  fd = cfs_open("ring", CFS_READ | CFS_WRITE);
+  ring_record(buf, 0);
+  if(fd < 0 || cfs_write(fd, buf, sizeof(buf)) >= 0 ||
+     cfs_read(fd, buf, sizeof(buf)) >= 0) {
+    FAIL(1);
+  }
+
+  /* Test 2: Its size is what it holds. */
+  capacity = dir_size("ring");
+  if(capacity < 2 * COFFEE_SECTOR_SIZE) {
+    FAIL(2);
+  }
+
+  /* Test 3: Appends wrap around and drop the oldest records, programming
+     each page once. */
+  records = 3 * capacity / (RING_RECORD + 2);
+  cfs_coffee_reset_stats();
+  for(i = 0; i < records; i++) {
+    ring_record(buf, i);
+    if(cfs_coffee_ring_append(fd, buf, sizeof(buf)) != sizeof(buf)) {
+      FAIL(3);
+    }
+  }
+#if COFFEE_IO_STATS
+  cfs_coffee_get_stats(&stats);
+  pages = erases = 0;
+  used = 0;
+  for(i = 0; i < records; i++) {
+    if(used == 0 || used + RING_RECORD + 2 > COFFEE_SECTOR_SIZE) {
+      pages += (used + COFFEE_PAGE_SIZE - 1) / COFFEE_PAGE_SIZE;
+      erases += i >= capacity / (COFFEE_SECTOR_SIZE - 4) * RING_PER_SECTOR;
+      used = 4;
+    }
+    used += RING_RECORD + 2;
+  }
+  pages += used / COFFEE_PAGE_SIZE;
+  if(stats.ops[CFS_COFFEE_OP_WRITE].programs != pages ||
+     stats.ops[CFS_COFFEE_OP_WRITE].erases != erases ||
+     stats.ops[CFS_COFFEE_OP_MERGE].calls != 0) {
+    FAIL(3);
+  }
+#endif
+
+  /* Test 4: The records are read from the oldest one, which is
+     followed by all of the newer ones. */
+  memset(&cursor, 0, sizeof(cursor));
+  first = ring_check(fd, &cursor, records - 1);
+  if(first <= 0 || records - first <
+     (capacity / (COFFEE_SECTOR_SIZE - 4) - 1) * RING_PER_SECTOR) {
+    FAIL(4);
+  }
+
+  /* Test 5: The ring is found again after it has been closed. */
+  cfs_close(fd);
+  fd = cfs_open("ring", CFS_READ | CFS_WRITE);
+  if(fd < 0 || cfs_coffee_ring_rewind(fd, &cursor) < 0 ||
+     ring_check(fd, &cursor, records - 1) != first) {
+    FAIL(5);
+  }
+
+  /* Test 6: Appends continue after the last record, and a cursor at the
+     end returns them. */
+  ring_record(buf, records);
+  if(cfs_coffee_ring_append(fd, buf, sizeof(buf)) != sizeof(buf) ||
+     cfs_coffee_ring_next(fd, &cursor, buf, sizeof(buf)) != RING_RECORD ||
+     memcmp(buf, &records, sizeof(records)) != 0) {
+    FAIL(6);
+  }
+  records++;
+
+  /* Test 7: A cursor whose records are erased skips to the oldest. */
+  cfs_coffee_ring_rewind(fd, &old);
+  for(i = 0; i < RING_PER_SECTOR * 2; i++, records++) {
+    ring_record(buf, records);
+    cfs_coffee_ring_append(fd, buf, sizeof(buf));
+  }
+  if(cfs_coffee_ring_next(fd, &old, buf, sizeof(buf)) != RING_RECORD) {
+    FAIL(7);
+  }
+  memcpy(&i, buf, sizeof(i));
+  if(i <= first) {
+    FAIL(7);
+  }
+
+  /* Test 8: A removed ring is gone, and its sectors are collected. */
+  cfs_close(fd);
+  fd = -1;
+  if(cfs_remove("ring") < 0 || cfs_open("ring", CFS_READ) >= 0 ||
+     cfs_coffee_verify_sector_table() != 0) {
+    FAIL(8);
+  }
+
+  error = 0;
+end:
+  cfs_close(fd);
+  cfs_remove("ring");
+  return error;
+}
+#endif /* COFFEE_RING_FILES */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_COMPRESSED_FILES
+#define COMPRESS_DATA_SIZE (96 * 1024)
+#define COMPRESS_BLOCK    COFFEE_COMPRESS_BLOCK_SIZE
+
+static char compress_data[COMPRESS_DATA_SIZE];
+static char compress_buf[COMPRESS_DATA_SIZE];
+
+/* Telemetry lines, which repeat their field names and change slowly. */
+static void
+compress_sample(void)
+{
+  unsigned long t;
+  int n;
+
+  for(t = n = 0; n < COMPRESS_DATA_SIZE; t++) {
+    n += snprintf(compress_data + n, COMPRESS_DATA_SIZE - n,
+                  "t=%lu temp=%d.%d volt=%lu state=%s\n", 1000 + t * 10,
+                  21 + (int)(t / 97 % 5), (int)(t * 7 % 10),
+                  3300 - t / 50 % 40, t % 64 < 60 ? "idle" : "tx");
+  }
+}
+/*---------------------------------------------------------------------------*/
+static int
+coffee_test_compression(void)
+{
+  cfs_offset_t offset, size;
+  int error;
+  int fd;
+  int i, n;
+#if COFFEE_IO_STATS
+  struct cfs_coffee_stats stats;
+  unsigned long programmed;
+#endif
+
+  cfs_remove("comp");
+  fd = -1;
+  compress_sample();
+
+  /* Test 1: Only an existing, empty file can be configured, once. */
+  if(cfs_coffee_configure_compression("comp", 2 * COMPRESS_DATA_SIZE,
+                                      COMPRESS_BLOCK) == 0 ||
+     cfs_coffee_reserve("comp", COMPRESS_DATA_SIZE / 4) < 0 ||
+     cfs_coffee_configure_compression("comp", 2 * COMPRESS_DATA_SIZE,
+                                      8 * COMPRESS_BLOCK) == 0 ||
+     cfs_coffee_configure_compression("comp", 2 * COMPRESS_DATA_SIZE,
+                                      COMPRESS_BLOCK) < 0 ||
+     cfs_coffee_configure_compression("comp", 2 * COMPRESS_DATA_SIZE,
+                                      COMPRESS_BLOCK) == 0) {
+    FAIL(1);
+  }
+
+  /* Test 2: Appends of any size are accepted, and the data takes much
+     fewer bytes of flash. */
+  fd = cfs_open("comp", CFS_WRITE);
+  if(fd < 0) {
+    FAIL(2);
+  }
+  cfs_coffee_reset_stats();
+  for(offset = 0, n = 1; offset < COMPRESS_DATA_SIZE; offset += n, n += 37) {
+    if(n > COMPRESS_DATA_SIZE - offset) {
+      n = COMPRESS_DATA_SIZE - offset;
+    }
+    if(cfs_write(fd, compress_data + offset, n) != n) {
+      FAIL(2);
+    }
+  }
+#if COFFEE_IO_STATS
+  cfs_coffee_get_stats(&stats);
+  programmed = stats.ops[CFS_COFFEE_OP_WRITE].program_bytes;
+  if(stats.user_write_bytes != COMPRESS_DATA_SIZE ||
+     programmed > COMPRESS_DATA_SIZE / 2) {
+    FAIL(2);
+  }
+#endif
+
+  /* Test 3: Data that is not stored yet is read as well, but data
+     cannot be overwritten. */
+  if(cfs_seek(fd, -10, CFS_SEEK_END) != COMPRESS_DATA_SIZE - 10 ||
+     cfs_write(fd, compress_data, 10) >= 0 ||
+     cfs_seek(fd, 1, CFS_SEEK_END) >= 0) {
+    FAIL(3);
+  }
+  cfs_close(fd);
+  fd = cfs_open("comp", CFS_READ);
+  if(fd < 0 || dir_size("comp") != COMPRESS_DATA_SIZE) {
+    FAIL(3);
+  }
+
+  /* Test 4: Sequential reads return the data. */
+  for(offset = 0; offset < COMPRESS_DATA_SIZE; offset += n) {
+    n = cfs_read(fd, compress_buf + offset, 777);
+    if(n <= 0) {
+      FAIL(4);
+    }
+  }
+  if(cfs_read(fd, compress_buf, 1) != 0 ||
+     memcmp(compress_buf, compress_data, COMPRESS_DATA_SIZE) != 0) {
+    FAIL(4);
+  }
+
+  /* Test 5: Random reads decompress the blocks that they need. */
+  for(i = 0; i < 200; i++) {
+    offset = (cfs_offset_t)((i * 7919UL) % COMPRESS_DATA_SIZE);
+    size = COMPRESS_DATA_SIZE - offset < 1500 ? COMPRESS_DATA_SIZE - offset :
+           1500;
+    if(cfs_seek(fd, offset, CFS_SEEK_SET) != offset ||
+       cfs_read(fd, compress_buf, size) != size ||
+       memcmp(compress_buf, compress_data + offset, size) != 0) {
+      FAIL(5);
+    }
+  }
+  cfs_close(fd);
+
+  /* Test 6: Appends continue at the end after the file is opened again.
+     A reader that has the file open reads the partial block of the
+     writer, and stores it when it closes the file. */
+  size = COMPRESS_DATA_SIZE / 2 + 100;
+  fd = cfs_open("comp", CFS_WRITE | CFS_APPEND);
+  if(fd < 0 || cfs_seek(fd, 0, CFS_SEEK_CUR) != COMPRESS_DATA_SIZE ||
+     cfs_write(fd, compress_data, size) != size) {
+    FAIL(6);
+  }
+  i = cfs_open("comp", CFS_READ);
+  cfs_close(fd);
+  fd = i;
+  if(fd < 0 ||
+     cfs_seek(fd, COMPRESS_DATA_SIZE + size - 1000, CFS_SEEK_SET) < 0 ||
+     cfs_read(fd, compress_buf, 2000) != 1000 ||
+     memcmp(compress_buf, compress_data + size - 1000, 1000) != 0) {
+    FAIL(6);
+  }
+  cfs_close(fd);
+  fd = -1;
+  if(dir_size("comp") != COMPRESS_DATA_SIZE + size) {
+    FAIL(6);
+  }
+
+  /* Test 7: The file is full when its index is. */
+  n = (2 * COMPRESS_DATA_SIZE - COMPRESS_DATA_SIZE - size) / COMPRESS_BLOCK *
+      COMPRESS_BLOCK;
+  fd = cfs_open("comp", CFS_WRITE | CFS_APPEND);
+  if(fd < 0 || cfs_write(fd, compress_data, COMPRESS_DATA_SIZE) != n ||
+     cfs_write(fd, compress_data, 1) >= 0) {
+    FAIL(7);
+  }
+  cfs_close(fd);
+  fd = cfs_open("comp", CFS_READ);
+  if(fd < 0 || cfs_seek(fd, COMPRESS_DATA_SIZE - 100, CFS_SEEK_SET) < 0 ||
+     cfs_read(fd, compress_buf, 200) != 200 ||
+     memcmp(compress_buf, compress_data + COMPRESS_DATA_SIZE - 100, 100) != 0 ||
+     memcmp(compress_buf + 100, compress_data, 100) != 0) {
+    FAIL(7);
+  }
+
+#if COFFEE_IO_STATS
+  printf("Compression: %lu bytes programmed for %lu bytes\n",
+         programmed, (unsigned long)COMPRESS_DATA_SIZE);
+#endif
+  error = 0;
+end:
+  cfs_close(fd);
+  cfs_remove("comp");
+  return error;
+}
+#endif /* COFFEE_COMPRESSED_FILES */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_VOLUMES > 1
+/* A device in RAM for a second volume. */
+#define RAM_SECTORS 4
+static unsigned char ram_flash[RAM_SECTORS * COFFEE_SECTOR_SIZE];
+
+static void
+ram_read(void *arg, void *buf, cfs_offset_t size, cfs_offset_t offset)
+{
+  memcpy(buf, (unsigned char *)arg + offset, size);
+}
+
+static void
+ram_write(void *arg, const void *buf, cfs_offset_t size, cfs_offset_t offset)
+{
+  memcpy((unsigned char *)arg + offset, buf, size);
+}
+
+/* Sectors are numbered in the sector size of the attached volume. */
+static unsigned long ram_sector_size = COFFEE_SECTOR_SIZE;
+
+static void
+ram_erase(void *arg, unsigned sector)
+{
+  memset((unsigned char *)arg + sector * ram_sector_size, 0,
+         ram_sector_size);
+}
+
+static int
+coffee_test_volumes(void)
+{
+  static const struct cfs_coffee_flash ram = {
+    ram_read, ram_write, ram_erase, NULL, ram_flash
+  };
+  struct cfs_coffee_geometry geometry;
+  struct cfs_coffee_volume *vol;
+  unsigned char buf[1000];
+  int error;
+  int fd, vfd;
+  int i;
+
+  fd = vfd = -1;
+  vol = NULL;
+  memset(&geometry, 0, sizeof(geometry));
+  memset(ram_flash, 0xaa, COFFEE_SECTOR_SIZE);
+
+  /* Test 1: Storage areas that do not fit the tables are rejected. */
+  geometry.start = COFFEE_PAGE_SIZE;
+  geometry.size = COFFEE_SECTOR_SIZE;
+  if(cfs_coffee_attach(&ram, &geometry) != NULL) {
+    FAIL(1);
+  }
+  geometry.start = 0;
+  geometry.size = COFFEE_SIZE + COFFEE_SECTOR_SIZE;
+  if(cfs_coffee_attach(&ram, &geometry) != NULL) {
+    FAIL(1);
+  }
+
+  /* Test 2: A volume in the last sectors of the device can be formatted
+     without touching the first sector. */
+  geometry.start = COFFEE_SECTOR_SIZE;
+  geometry.size = (RAM_SECTORS - 1) * COFFEE_SECTOR_SIZE;
+  vol = cfs_coffee_attach(&ram, &geometry);
+  if(vol == NULL || vol == cfs_coffee_default_volume() ||
+     cfs_coffee_vol_format(vol) != 0 ||
+     ram_flash[0] != 0xaa || ram_flash[COFFEE_SECTOR_SIZE - 1] != 0xaa) {
+    FAIL(2);
+  }
+
+  /* Test 3: Files with the same name on two volumes are independent. */
+  cfs_remove("volume");
+  fd = cfs_open("volume", CFS_WRITE);
+  vfd = cfs_coffee_vol_open(vol, "volume", CFS_WRITE);
+  if(fd < 0 || vfd < 0) {
+    FAIL(3);
+  }
+  memset(buf, 'd', sizeof(buf));
+  if(cfs_write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+    FAIL(3);
+  }
+  memset(buf, 'v', sizeof(buf));
+  if(cfs_coffee_vol_write(vol, vfd, buf, sizeof(buf) / 2) !=
+     sizeof(buf) / 2) {
+    FAIL(3);
+  }
+  cfs_close(fd);
+  cfs_coffee_vol_close(vol, vfd);
+  fd = vfd = -1;
+
+  fd = cfs_open("volume", CFS_READ);
+  if(fd < 0 || cfs_read(fd, buf, sizeof(buf)) != sizeof(buf) ||
+     buf[0] != 'd' || buf[sizeof(buf) - 1] != 'd') {
+    FAIL(4);
+  }
+  vfd = cfs_coffee_vol_open(vol, "volume", CFS_READ);
+  if(vfd < 0 ||
+     cfs_coffee_vol_read(vol, vfd, buf, sizeof(buf)) != sizeof(buf) / 2 ||
+     buf[0] != 'v' || buf[sizeof(buf) / 2 - 1] != 'v') {
+    FAIL(4);
+  }
+  cfs_close(fd);
+  cfs_coffee_vol_close(vol, vfd);
+  fd = vfd = -1;
+
+  /* Test 5: The volume is limited to its storage area, and its garbage
+     collector reclaims space by itself. */
+  if(cfs_coffee_vol_reserve(vol, "big", 3L * COFFEE_SECTOR_SIZE) == 0) {
+    FAIL(5);
+  }
+  for(i = 0; i < 20; i++) {
+    if(cfs_coffee_vol_reserve(vol, "churn", COFFEE_SECTOR_SIZE / 2) != 0 ||
+       cfs_coffee_vol_remove(vol, "churn") != 0) {
+      FAIL(5);
+    }
+  }
+  if(cfs_coffee_vol_verify_sector_table(vol) != 0 || ram_flash[0] != 0xaa) {
+    FAIL(5);
+  }
+
+  /* Test 6: Volumes with open files and the default volume are not
+     detached. */
+  vfd = cfs_coffee_vol_open(vol, "volume", CFS_READ);
+  if(vfd < 0 || cfs_coffee_detach(vol) != -1 ||
+     cfs_coffee_vol_read(vol, vfd, buf, 1) != 1 ||
+     cfs_coffee_detach(cfs_coffee_default_volume()) != -1) {
+    FAIL(6);
+  }
+  cfs_coffee_vol_close(vol, vfd);
+  vfd = -1;
+
+  /* Test 7: The files remain after the volume is attached again. */
+  if(cfs_coffee_detach(vol) != 0) {
+    FAIL(7);
+  }
+  vol = cfs_coffee_attach(&ram, &geometry);
+  vfd = vol == NULL ? -1 : cfs_coffee_vol_open(vol, "volume", CFS_READ);
+  if(vfd < 0 ||
+     cfs_coffee_vol_read(vol, vfd, buf, sizeof(buf)) != sizeof(buf) / 2 ||
+     buf[0] != 'v') {
+    FAIL(7);
+  }
+
+  error = 0;
+end:
+  if(vol != NULL) {
+    cfs_coffee_vol_close(vol, vfd);
+    cfs_coffee_detach(vol);
+  }
+  cfs_close(fd);
+  cfs_remove("volume");
+  return error;
+}
+#endif /* COFFEE_VOLUMES > 1 */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_VOLUMES > 1 && COFFEE_HEADER_CACHE_SIZE
+/* Check whether a listing of a volume shows a file. */
+static int
+vol_lists(struct cfs_coffee_volume *vol, const char *name)
+{
+  struct cfs_dir dir;
+  struct cfs_dirent dirent;
+  int found;
+
+  found = 0;
+  if(cfs_coffee_vol_opendir(vol, &dir, "/") == 0) {
+    while(cfs_coffee_vol_readdir(vol, &dir, &dirent) == 0) {
+      found |= strcmp(dirent.name, name) == 0;
+    }
+    cfs_closedir(&dir);
+  }
+  return found;
+}
+/*---------------------------------------------------------------------------*/
+/*
+ * The headers of a freshly formatted volume in RAM are cached by
+ * listings, so that the pages that are read from the flash are known.
+ */
+static int
+coffee_test_cache_invalidation(void)
+{
+  static const struct cfs_coffee_flash ram = {
+    ram_read, ram_write, ram_erase, NULL, ram_flash
+  };
+  struct cfs_coffee_geometry geometry;
+  struct cfs_coffee_cache_stats stats;
+  struct cfs_coffee_volume *vol;
+  int error;
+  int fd;
+
+  fd = -1;
+  memset(&geometry, 0, sizeof(geometry));
+  geometry.size = RAM_SECTORS * COFFEE_SECTOR_SIZE;
+  vol = cfs_coffee_attach(&ram, &geometry);
+  if(vol == NULL || cfs_coffee_vol_format(vol) != 0) {
+    FAIL(1);
+  }
+
+  /* Test 1: A file that fills the first sector is listed from the
+     cache. */
+  if(cfs_coffee_vol_reserve(vol, "cached",
+                            COFFEE_SECTOR_SIZE - COFFEE_PAGE_SIZE) != 0 ||
+     !vol_lists(vol, "cached")) {
+    FAIL(1);
+  }
+  cfs_coffee_vol_reset_cache_stats(vol);
+  vol_lists(vol, "cached");
+  cfs_coffee_vol_get_cache_stats(vol, &stats);
+  if(stats.misses != 0 || stats.hits == 0) {
+    FAIL(1);
+  }
+
+  /* Test 2: A rewritten header replaces the cached one. */
+  if(cfs_coffee_vol_remove(vol, "cached") != 0 || vol_lists(vol, "cached")) {
+    FAIL(2);
+  }
+  fd = cfs_coffee_vol_open(vol, "cached", CFS_READ);
+  if(fd >= 0) {
+    FAIL(2);
+  }
+
+#if COFFEE_SECTOR_TABLE
+  /* Test 3: The header of an erased sector is read from the flash
+     again, and shows the sector as free. */
+  if(cfs_coffee_vol_gc_step(vol, 1) != 1) {
+    FAIL(3);
+  }
+  cfs_coffee_vol_reset_cache_stats(vol);
+  vol_lists(vol, "cached");
+  cfs_coffee_vol_get_cache_stats(vol, &stats);
+  if(stats.misses != 1 || cfs_coffee_vol_verify_sector_table(vol) != 0) {
+    FAIL(3);
+  }
+#endif
+
+  /*
+   * Test 4: The walk of the mount reads the headers from the flash, and
+   * the lookups of a missing file that follow read none of them.
+   */
+  cfs_coffee_vol_reset_cache_stats(vol);
+  if(cfs_coffee_vol_mount(vol, NULL) != 0) {
+    FAIL(4);
+  }
+  cfs_coffee_vol_get_cache_stats(vol, &stats);
+  if(stats.misses == 0) {
+    FAIL(4);
+  }
+  cfs_coffee_vol_reset_cache_stats(vol);
+  if(cfs_coffee_vol_open(vol, "missing", CFS_READ) >= 0 ||
+     cfs_coffee_vol_open(vol, "missing", CFS_READ) >= 0) {
+    FAIL(4);
+  }
+  cfs_coffee_vol_get_cache_stats(vol, &stats);
+  if(stats.misses != 0) {
+    FAIL(4);
+  }
+
+  error = 0;
+end:
+  if(vol != NULL) {
+    cfs_coffee_vol_close(vol, fd);
+    cfs_coffee_detach(vol);
+  }
+  return error;
+}
+#endif /* COFFEE_VOLUMES > 1 && COFFEE_HEADER_CACHE_SIZE */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_VOLUMES > 1 && COFFEE_EOF_RECORDS
+/*
+ * The storage of a volume whose file was not closed is attached again
+ * as a second volume, which sees it as after a power loss.
+ */
+static int
+coffee_test_unclosed_end(void)
+{
+  static const struct cfs_coffee_flash ram = {
+    ram_read, ram_write, ram_erase, NULL, ram_flash
+  };
+  struct cfs_coffee_geometry geometry;
+  struct cfs_coffee_volume *vol, *rebooted;
+  unsigned char buf[3 * COFFEE_PAGE_SIZE];
+  int error;
+  int fd, rfd;
+
+  fd = rfd = -1;
+  rebooted = NULL;
+  memset(&geometry, 0, sizeof(geometry));
+  geometry.size = RAM_SECTORS * COFFEE_SECTOR_SIZE;
+  vol = cfs_coffee_attach(&ram, &geometry);
+  if(vol == NULL || cfs_coffee_vol_format(vol) != 0) {
+    FAIL(1);
+  }
+
+  /* Test 1: Write a file and record its end. */
+  memset(buf, 'a', 100);
+  fd = cfs_coffee_vol_open(vol, "unclosed", CFS_WRITE);
+  if(fd < 0 || cfs_coffee_vol_write(vol, fd, buf, 100) != 100) {
+    FAIL(1);
+  }
+  cfs_coffee_vol_close(vol, fd);
+
+  /*
+   * Test 2: Append more zeros than the check of the recorded end reads,
+   * and data after them, and leave the file open.
+   */
+  memset(buf, 0, sizeof(buf));
+  fd = cfs_coffee_vol_open(vol, "unclosed", CFS_WRITE | CFS_APPEND);
+  if(fd < 0 || cfs_coffee_vol_write(vol, fd, buf, sizeof(buf)) !=
+     sizeof(buf)) {
+    FAIL(2);
+  }
+  memset(buf, 'b', 100);
+  if(cfs_coffee_vol_write(vol, fd, buf, 100) != 100) {
+    FAIL(2);
+  }
+
+  /* Test 3: The data is found after the power loss. */
+  rebooted = cfs_coffee_attach(&ram, &geometry);
+  rfd = rebooted == NULL ? -1 :
+    cfs_coffee_vol_open(rebooted, "unclosed", CFS_READ);
+  if(rfd < 0 ||
+     cfs_coffee_vol_seek(rebooted, rfd, 0, CFS_SEEK_END) !=
+     100 + sizeof(buf) + 100) {
+    FAIL(3);
+  }
+  cfs_coffee_vol_seek(rebooted, rfd, -100, CFS_SEEK_END);
+  if(cfs_coffee_vol_read(rebooted, rfd, buf, sizeof(buf)) != 100 ||
+     buf[0] != 'b' || buf[99] != 'b') {
+    FAIL(3);
+  }
+  cfs_coffee_vol_close(rebooted, rfd);
+  rfd = -1;
+  cfs_coffee_detach(rebooted);
+  rebooted = NULL;
+
+  /* Test 4: The end recorded at the close is trusted again. */
+  cfs_coffee_vol_close(vol, fd);
+  fd = -1;
+  rebooted = cfs_coffee_attach(&ram, &geometry);
+  rfd = rebooted == NULL ? -1 :
+    cfs_coffee_vol_open(rebooted, "unclosed", CFS_READ);
+  if(rfd < 0 ||
+     cfs_coffee_vol_seek(rebooted, rfd, 0, CFS_SEEK_END) !=
+     100 + sizeof(buf) + 100) {
+    FAIL(4);
+  }
+
+  error = 0;
+end:
+  if(rebooted != NULL) {
+    cfs_coffee_vol_close(rebooted, rfd);
+    cfs_coffee_detach(rebooted);
+  }
+  if(vol != NULL) {
+    cfs_coffee_vol_close(vol, fd);
+    cfs_coffee_detach(vol);
+  }
+  return error;
+}
+#endif /* COFFEE_VOLUMES > 1 && COFFEE_EOF_RECORDS */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_VOLUMES > 1 && COFFEE_RUNTIME_GEOMETRY
+static int
+coffee_test_geometry(void)
+{
+  static const struct cfs_coffee_flash ram = {
+    ram_read, ram_write, ram_erase, NULL, ram_flash
+  };
+  static const cfs_offset_t layouts[][2] = {
+    { 256, 4096 }, { 512, 4096 }, { 512, 65536 }, { 4096, 65536 }
+  };
+  struct cfs_coffee_geometry geometry, mounted;
+  struct cfs_coffee_volume *vol;
+  unsigned char buf[1000];
+  int error;
+  int fd;
+  int i, j, k;
+
+  fd = -1;
+  vol = NULL;
+
+  /* Test 1: Layouts outside the limits are rejected. */
+  memset(&geometry, 0, sizeof(geometry));
+  geometry.size = sizeof(ram_flash);
+  geometry.page_size = COFFEE_MAX_PAGE_SIZE * 2;
+  geometry.sector_size = COFFEE_MAX_PAGE_SIZE * 2;
+  if(cfs_coffee_attach(&ram, &geometry) != NULL) {
+    FAIL(1);
+  }
+  geometry.page_size = 256;
+  geometry.sector_size = COFFEE_MIN_SECTOR_SIZE / 2;
+  if(cfs_coffee_attach(&ram, &geometry) != NULL) {
+    FAIL(1);
+  }
+  geometry.page_size = 768;
+  geometry.sector_size = 4096;
+  if(cfs_coffee_attach(&ram, &geometry) != NULL) {
+    FAIL(1);
+  }
+
+  for(i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+    /* Test 2: A formatted volume holds files and collects garbage. */
+    geometry.page_size = layouts[i][0];
+    geometry.sector_size = layouts[i][1];
+    ram_sector_size = geometry.sector_size;
+    vol = cfs_coffee_attach(&ram, &geometry);
+    if(vol == NULL || cfs_coffee_vol_format(vol) != 0) {
+      FAIL(2);
+    }
+    fd = cfs_coffee_vol_open(vol, "geometry", CFS_WRITE);
+    for(j = 0; j < 20; j++) {
+      memset(buf, j + 1, sizeof(buf));
+      if(fd < 0 ||
+         cfs_coffee_vol_write(vol, fd, buf, sizeof(buf)) != sizeof(buf)) {
+        FAIL(2);
+      }
+    }
+    /* Overwrite the middle of the file through its log. */
+    memset(buf, 0xee, 100);
+    if(cfs_coffee_vol_seek(vol, fd, 5050, CFS_SEEK_SET) != 5050 ||
+       cfs_coffee_vol_write(vol, fd, buf, 100) != 100) {
+      FAIL(2);
+    }
+    cfs_coffee_vol_close(vol, fd);
+    fd = -1;
+    for(j = 0; j < 40; j++) {
+      if(cfs_coffee_vol_reserve(vol, "churn", sizeof(ram_flash) / 4) != 0 ||
+         cfs_coffee_vol_remove(vol, "churn") != 0) {
+        FAIL(2);
+      }
+    }
+    if(cfs_coffee_vol_verify_sector_table(vol) != 0) {
+      FAIL(2);
+    }
+    cfs_coffee_detach(vol);
+
+    /* Test 3: The layout is read from the superblock. */
+    mounted.start = 0;
+    mounted.size = sizeof(ram_flash);
+    mounted.page_size = mounted.sector_size = 0;
+    vol = cfs_coffee_attach(&ram, &mounted);
+    if(vol == NULL) {
+      FAIL(3);
+    }
+    cfs_coffee_vol_get_geometry(vol, &mounted);
+    if(mounted.page_size != geometry.page_size ||
+       mounted.sector_size != geometry.sector_size) {
+      FAIL(3);
+    }
+
+    /* Test 4: The file reads back. */
+    fd = cfs_coffee_vol_open(vol, "geometry", CFS_READ);
+    for(j = 0; j < 20; j++) {
+      if(fd < 0 ||
+         cfs_coffee_vol_read(vol, fd, buf, sizeof(buf)) != sizeof(buf)) {
+        FAIL(4);
+      }
+      for(k = 0; k < sizeof(buf); k++) {
+        if(buf[k] != (j * 1000 + k >= 5050 && j * 1000 + k < 5150 ?
+                      0xee : j + 1)) {
+          FAIL(4);
+        }
+      }
+    }
+    cfs_coffee_vol_close(vol, fd);
+    fd = -1;
+    cfs_coffee_detach(vol);
+    vol = NULL;
+  }
+
+  error = 0;
+end:
+  if(vol != NULL) {
+    cfs_coffee_vol_close(vol, fd);
+    cfs_coffee_detach(vol);
+  }
+  ram_sector_size = COFFEE_SECTOR_SIZE;
+  return error;
+}
+#endif /* COFFEE_VOLUMES > 1 && COFFEE_RUNTIME_GEOMETRY */
+/*---------------------------------------------------------------------------*/
+#if COFFEE_THREADS
+/*
+ * Many threads share the default volume. The writers merge their logs
+ * into new files, which need a free slot in the file cache while the
+ * other files are open.
+ */
+#define THREAD_READERS     4
+#define THREAD_WRITERS     2
+#define THREAD_FILES       (COFFEE_MAX_OPEN_FILES - THREAD_WRITERS - 1)
+#define THREAD_FILE_SIZE   16384
+#define THREAD_RECORD_SIZE 64
+#define THREAD_READS       10000
+#define THREAD_WRITES      1500
+
+static int thread_writers_left;
+static unsigned char
+thread_model[THREAD_WRITERS][THREAD_FILE_SIZE / 4];
+
+static unsigned char
+thread_byte(int file, cfs_offset_t offset)
+{
+  return (unsigned char)(file * 31 + offset * 7 + 1);
+}
+
+static unsigned
+thread_random(unsigned *state)
+{
+  *state = *state * 1103515245 + 12345;
+  return *state >> 16;
+}
+
+static void
+thread_name(char *name, char kind, int n)
+{
+  sprintf(name, "thr-%c%d", kind, n);
+}
+
+/* Open a file, waiting while the descriptors or the file cache are
+   taken by the other threads. */
+static int
+thread_open(const char *name, int flags)
+{
+  int fd;
+  int tries;
+
+  for(tries = 0; tries < 100000; tries++) {
+    fd = cfs_open(name, flags);
+    if(fd >= 0) {
+      return fd;
+    }
+    sched_yield();
+  }
+  return -1;
+}
+
+/* Read the unchanging files, and check that the records of the written
+   files are never seen half-written. */
+static void *
+thread_reader(void *arg)
+{
+  unsigned char buf[512];
+  char name[16];
+  unsigned state;
+  cfs_offset_t offset;
+  int file, fd, i, j;
+
+  state = (unsigned)(uintptr_t)arg;
+  for(i = 0; i < THREAD_READS; i++) {
+    file = thread_random(&state) % (THREAD_FILES + THREAD_WRITERS);
+    if(file < THREAD_FILES) {
+      thread_name(name, 'r', file);
+      offset = thread_random(&state) % (THREAD_FILE_SIZE - sizeof(buf));
+      fd = thread_open(name, CFS_READ);
+      if(fd < 0 || cfs_seek(fd, offset, CFS_SEEK_SET) != offset ||
+         cfs_read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+        cfs_close(fd);
+        return (void *)1;
+      }
+      for(j = 0; j < sizeof(buf); j++) {
+        if(buf[j] != thread_byte(file, offset + j)) {
+          cfs_close(fd);
+          return (void *)2;
+        }
+      }
+    } else {
+      thread_name(name, 'w', file - THREAD_FILES);
+      offset = thread_random(&state) % (sizeof(thread_model[0]) /
+                                        THREAD_RECORD_SIZE);
+      offset *= THREAD_RECORD_SIZE;
+      fd = thread_open(name, CFS_READ);
+      if(fd < 0 || cfs_seek(fd, offset, CFS_SEEK_SET) != offset ||
+         cfs_read(fd, buf, THREAD_RECORD_SIZE) != THREAD_RECORD_SIZE) {
+        cfs_close(fd);
+        return (void *)3;
+      }
+      for(j = 1; j < THREAD_RECORD_SIZE; j++) {
+        if(buf[j] != buf[0]) {
+          cfs_close(fd);
+          return (void *)4;
+        }
+      }
+    }
+    cfs_close(fd);
+  }
+  return NULL;
+}
+
+/* Overwrite random records of a file of one's own, keeping a copy of
+   the expected contents. */
+static void *
+thread_writer(void *arg)
+{
+  unsigned char buf[THREAD_RECORD_SIZE];
+  char name[16];
+  unsigned state;
+  cfs_offset_t offset;
+  int writer, fd, i;
+
+  writer = (int)(uintptr_t)arg;
+  state = writer;
+  thread_name(name, 'w', writer);
+  for(i = 0; i < THREAD_WRITES; i++) {
+    offset = thread_random(&state) % (sizeof(thread_model[0]) /
+                                      THREAD_RECORD_SIZE);
+    offset *= THREAD_RECORD_SIZE;
+    memset(buf, i % 255 + 1, sizeof(buf));
+    fd = thread_open(name, CFS_READ | CFS_WRITE);
+    if(fd < 0 || cfs_seek(fd, offset, CFS_SEEK_SET) != offset ||
+       cfs_write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+      cfs_close(fd);
+      __atomic_fetch_sub(&thread_writers_left, 1, __ATOMIC_SEQ_CST);
+      return (void *)5;
+    }
+    cfs_close(fd);
+    memcpy(&thread_model[writer][offset], buf, sizeof(buf));
+  }
+  __atomic_fetch_sub(&thread_writers_left, 1, __ATOMIC_SEQ_CST);
+  return NULL;
+}
+
+/* Collect garbage in the background until the writers are done. */
+static void *
+thread_collector(void *arg)
+{
+  struct cfs_dir dir;
+  struct cfs_dirent record;
+
+  while(__atomic_load_n(&thread_writers_left, __ATOMIC_SEQ_CST) > 0) {
+    cfs_coffee_gc_step(1);
+    cfs_coffee_refill_pool(2);
+    if(cfs_opendir(&dir, "/") == 0) {
+      while(cfs_readdir(&dir, &record) == 0);
+      cfs_closedir(&dir);
+    }
+  }
+  return NULL;
+}
+
+static int
+coffee_test_threads(void)
+{
+  pthread_t threads[THREAD_READERS + THREAD_WRITERS + 1];
+  unsigned char buf[THREAD_FILE_SIZE / 4];
+  char name[16];
+  void *result;
+  int error;
+  int fd;
+  int i, j;
+
+  fd = -1;
+
+  /* Test 1: Create the files. */
+  for(i = 0; i < THREAD_FILES; i++) {
+    thread_name(name, 'r', i);
+    cfs_remove(name);
+    fd = cfs_open(name, CFS_WRITE);
+    if(fd < 0) {
+      FAIL(1);
+    }
+    for(j = 0; j < THREAD_FILE_SIZE; j++) {
+      buf[j % sizeof(buf)] = thread_byte(i, j);
+      if(j % sizeof(buf) == sizeof(buf) - 1 &&
+         cfs_write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+        FAIL(1);
+      }
+    }
+    cfs_close(fd);
+  }
+  memset(thread_model, 0xff, sizeof(thread_model));
+  for(i = 0; i < THREAD_WRITERS; i++) {
+    thread_name(name, 'w', i);
+    cfs_remove(name);
+    fd = cfs_open(name, CFS_WRITE);
+    if(fd < 0 || cfs_write(fd, thread_model[i], sizeof(thread_model[i])) !=
+       sizeof(thread_model[i])) {
+      FAIL(1);
+    }
+    cfs_close(fd);
+  }
+  fd = -1;
+
+  /* Test 2: Readers, writers and the collector run at the same time
+     without errors. */
+  thread_writers_left = THREAD_WRITERS;
+  for(i = 0; i < THREAD_READERS; i++) {
+    pthread_create(&threads[i], NULL, thread_reader, (void *)(uintptr_t)(i + 1));
+  }
+  for(i = 0; i < THREAD_WRITERS; i++) {
+    pthread_create(&threads[THREAD_READERS + i], NULL, thread_writer,
+                   (void *)(uintptr_t)i);
+  }
+  pthread_create(&threads[THREAD_READERS + THREAD_WRITERS], NULL,
+                 thread_collector, NULL);
+  error = 0;
+  for(i = 0; i < THREAD_READERS + THREAD_WRITERS + 1; i++) {
+    pthread_join(threads[i], &result);
+    if(result != NULL && error == 0) {
+      error = 2;
+    }
+  }
+  if(error != 0) {
+    FAIL(error);
+  }
+
+  /* Test 3: The files hold what was written to them. */
+  for(i = 0; i < THREAD_FILES; i++) {
+    thread_name(name, 'r', i);
+    fd = cfs_open(name, CFS_READ);
+    if(fd < 0) {
+      FAIL(3);
+    }
+    for(j = 0; j < THREAD_FILE_SIZE; j++) {
+      if(j % sizeof(buf) == 0 &&
+         cfs_read(fd, buf, sizeof(buf)) != sizeof(buf)) {
+        FAIL(3);
+      }
+      if(buf[j % sizeof(buf)] != thread_byte(i, j)) {
+        FAIL(3);
+      }
+    }
+    cfs_close(fd);
+  }
+  for(i = 0; i < THREAD_WRITERS; i++) {
+    thread_name(name, 'w', i);
+    fd = cfs_open(name, CFS_READ);
+    if(fd < 0 || cfs_read(fd, buf, sizeof(buf)) != sizeof(buf) ||
+       memcmp(buf, thread_model[i], sizeof(buf)) != 0) {
+      FAIL(4);
+    }
+    cfs_close(fd);
+  }
+  fd = -1;
+
+  /* Test 5: The collector kept the sector table intact. */
+  if(cfs_coffee_verify_sector_table() != 0) {
+    FAIL(5);
+  }
+
+  error = 0;
+end:
+  cfs_close(fd);
+  for(i = 0; i < THREAD_FILES; i++) {
+    thread_name(name, 'r', i);
+    cfs_remove(name);
+  }
+  for(i = 0; i < THREAD_WRITERS; i++) {
+    thread_name(name, 'w', i);
+    cfs_remove(name);
+  }
+  return error;
+}
+#endif /* COFFEE_THREADS */
+/*---------------------------------------------------------------------------*/
 static void
 print_result(const char *test_name, int result)
 {
@@ -383,6 +2576,93 @@ void test_coffee(void)                         /* MODIFICATION FOR AALTO-2 */
   result = coffee_test_gc();
   print_result("Garbage collection", result);
 
+  result = coffee_test_gc_extent_head();
+  print_result("Obsolete extent head", result);
+
+  result = coffee_test_sector_table();
+  print_result("Sector table", result);
+
+  result = coffee_test_gc_step();
+  print_result("Garbage collection steps", result);
+
+  result = coffee_test_erase_pool();
+  print_result("Erase pool", result);
+
+  result = coffee_test_wear();
+  print_result("Wear", result);
+
+  result = coffee_test_flash_timing();
+  print_result("Flash timing", result);
+
+#if COFFEE_IO_STATS
+  result = coffee_test_io_stats();
+  print_result("I/O accounting", result);
+#endif
+
+  result = coffee_test_many_files();
+  print_result("Many files", result);
+
+  result = coffee_test_cache();
+  print_result("Header cache", result);
+
+  result = coffee_test_file_end();
+  print_result("File end", result);
+
+#if COFFEE_NAME_INDEX_SIZE && COFFEE_IO_STATS
+  result = coffee_test_name_index();
+  print_result("Name index overflow", result);
+#endif
+
+  result = coffee_test_log_regions();
+  print_result("Log regions", result);
+
+  result = coffee_test_log_overwrite();
+  print_result("Log overwrite", result);
+
+  result = coffee_test_merge();
+  print_result("Log merge", result);
+
+  result = coffee_test_mount();
+  print_result("Mount", result);
+
+  result = coffee_test_extent_chain();
+  print_result("Extent chain", result);
+
+#if COFFEE_RING_FILES
+  result = coffee_test_ring();
+  print_result("Ring file", result);
+#endif
+
+#if COFFEE_COMPRESSED_FILES
+  result = coffee_test_compression();
+  print_result("Compression", result);
+#endif
+
+#if COFFEE_VOLUMES > 1
+  result = coffee_test_volumes();
+  print_result("Volumes", result);
+#endif
+
+#if COFFEE_VOLUMES > 1 && COFFEE_HEADER_CACHE_SIZE
+  result = coffee_test_cache_invalidation();
+  print_result("Header cache invalidation", result);
+#endif
+
+#if COFFEE_VOLUMES > 1 && COFFEE_EOF_RECORDS
+  result = coffee_test_unclosed_end();
+  print_result("Unclosed file end", result);
+#endif
+
+#if COFFEE_VOLUMES > 1 && COFFEE_RUNTIME_GEOMETRY
+  result = coffee_test_geometry();
+  print_result("Geometry", result);
+#endif
+
+#if COFFEE_THREADS
+  result = coffee_test_threads();
+  print_result("Threads", result);
+#endif
+
   printf("Coffee test finished. Duration: %d milliseconds\n", /* MODIFICATION FOR AALTO-2 */
          (int)(xTaskGetTickCount() - start));
 